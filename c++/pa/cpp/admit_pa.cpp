@@ -0,0 +1,380 @@
+#include "kv_concurrent_manager.hpp"
+#include "pa_tool_util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Request threads admit and finish sequences while one engine thread steps every live
+// sequence through reserve_for_decode, build_batch_metadata and commit_tokens. Runs the
+// same workload against KVBlockManager behind one scheduler mutex and against
+// ConcurrentKVBlockManager, and reports admit/finish call latency and the engine's
+// per-step bookkeeping time.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct AdmitOptions {
+    int threads = 4;        // request threads
+    int live = 16;          // sequences each request thread keeps running
+    double rate = 2000.0;   // admits per second per request thread
+    int prompt_len = 128;   // mean, uniform in [len/2, 3*len/2]
+    int block_size = 16;
+    int num_blocks = 65536;
+    int cache_blocks = 32;
+    double duration_s = 2.0;
+    int compute_us = 50;  // engine work per step outside the scheduler, spun
+    std::string mode = "both";
+    std::string csv_path;
+};
+
+struct AdmitResult {
+    std::string mode;
+    int64_t admits = 0;
+    int64_t admit_failures = 0;
+    int64_t steps = 0;
+    int64_t decode_tokens = 0;
+    std::vector<double> admit_us;
+    std::vector<double> finish_us;
+    std::vector<double> step_us;
+};
+
+void print_usage(const char* argv0) {
+    std::cout << "usage: " << argv0 << " [options]\n"
+              << "  --threads 4          request threads admitting and finishing\n"
+              << "  --live 16            running sequences per request thread\n"
+              << "  --rate 2000          admits per second per request thread\n"
+              << "  --prompt 128         mean prompt length reserved on admit\n"
+              << "  --block 16           block size\n"
+              << "  --blocks 65536       pool blocks\n"
+              << "  --cache 32           per-thread block cache of the concurrent manager\n"
+              << "  --duration 2         seconds per mode\n"
+              << "  --compute-us 50      engine work per step outside the scheduler\n"
+              << "  --mode both          mutex, staged or both\n"
+              << "  --csv out.csv        also write the results as CSV ('-' for stdout)\n";
+}
+
+AdmitOptions parse_args(int argc, char** argv) {
+    AdmitOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--threads") {
+            opt.threads = std::stoi(value);
+        } else if (arg == "--live") {
+            opt.live = std::stoi(value);
+        } else if (arg == "--rate") {
+            opt.rate = std::stod(value);
+        } else if (arg == "--prompt") {
+            opt.prompt_len = std::stoi(value);
+        } else if (arg == "--block") {
+            opt.block_size = std::stoi(value);
+        } else if (arg == "--blocks") {
+            opt.num_blocks = std::stoi(value);
+        } else if (arg == "--cache") {
+            opt.cache_blocks = std::stoi(value);
+        } else if (arg == "--duration") {
+            opt.duration_s = std::stod(value);
+        } else if (arg == "--compute-us") {
+            opt.compute_us = std::stoi(value);
+        } else if (arg == "--mode") {
+            if (value != "both" && value != "mutex" && value != "staged") {
+                throw std::runtime_error("mode must be mutex, staged or both: " + value);
+            }
+            opt.mode = value;
+        } else if (arg == "--csv") {
+            opt.csv_path = value;
+        } else {
+            throw std::runtime_error("unknown option " + arg);
+        }
+    }
+    if (opt.threads < 1 || opt.live < 1 || opt.rate <= 0.0 || opt.prompt_len < 2 || opt.duration_s <= 0.0) {
+        throw std::runtime_error("threads, live, rate, prompt and duration must be positive");
+    }
+    return opt;
+}
+
+// Deterministic per sequence, so the engine knows what an admit reserved.
+int prompt_len_of(int seq_id, int mean) {
+    uint32_t h = static_cast<uint32_t>(seq_id) * 2654435761u;
+    h ^= h >> 15;
+    return mean / 2 + static_cast<int>(h % static_cast<uint32_t>(mean + 1));
+}
+
+double us_since(Clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - t).count();
+}
+
+void spin_for_us(int us) {
+    auto end = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < end) {
+    }
+}
+
+// One request thread's loop; `admit` and `finish` wrap the manager under test.
+template <typename Admit, typename Finish>
+void request_loop(
+    int thread, const AdmitOptions& opt, const std::atomic<bool>& stop, AdmitResult& result, std::mutex& result_mutex,
+    Admit admit, Finish finish) {
+    std::vector<int> live;
+    std::vector<double> admit_us;
+    std::vector<double> finish_us;
+    int64_t admits = 0;
+    int64_t failures = 0;
+    int next = 0;
+    auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / opt.rate));
+    auto due = Clock::now();
+    while (!stop.load(std::memory_order_relaxed)) {
+        if (static_cast<int>(live.size()) >= opt.live) {
+            auto t = Clock::now();
+            finish(live.front());
+            finish_us.push_back(us_since(t));
+            live.erase(live.begin());
+        }
+        int seq_id = thread * 100000000 + next++;
+        auto t = Clock::now();
+        bool ok = admit(seq_id, prompt_len_of(seq_id, opt.prompt_len));
+        admit_us.push_back(us_since(t));
+        if (ok) {
+            live.push_back(seq_id);
+            ++admits;
+        } else {
+            ++failures;
+        }
+        due += interval;
+        std::this_thread::sleep_until(due);
+    }
+    for (int seq_id : live) {
+        finish(seq_id);
+    }
+    std::lock_guard<std::mutex> lock(result_mutex);
+    result.admits += admits;
+    result.admit_failures += failures;
+    result.admit_us.insert(result.admit_us.end(), admit_us.begin(), admit_us.end());
+    result.finish_us.insert(result.finish_us.end(), finish_us.begin(), finish_us.end());
+}
+
+// Running sequences of the engine, removable by id in O(1).
+struct RunningSet {
+    std::vector<int> ids;
+    std::vector<SequenceHandle> handles;
+    std::unordered_map<int, size_t> index;
+
+    void add(int seq_id, SequenceHandle h) {
+        index[seq_id] = ids.size();
+        ids.push_back(seq_id);
+        handles.push_back(h);
+    }
+
+    void remove(int seq_id) {
+        auto it = index.find(seq_id);
+        if (it == index.end()) {
+            return;
+        }
+        size_t i = it->second;
+        index.erase(it);
+        if (i + 1 != ids.size()) {
+            ids[i] = ids.back();
+            handles[i] = handles.back();
+            index[ids[i]] = i;
+        }
+        ids.pop_back();
+        handles.pop_back();
+    }
+};
+
+template <typename Manager>
+void decode_step(Manager& manager, RunningSet& running, std::vector<int>& ones, AdmitResult& result) {
+    for (const auto& h : running.handles) {
+        manager.reserve_for_decode(h);
+    }
+    ones.assign(running.handles.size(), 1);
+    BatchMetadata meta = manager.build_batch_metadata(running.handles, ones);
+    for (const auto& h : running.handles) {
+        manager.commit_tokens(h, 1);
+    }
+    result.decode_tokens += static_cast<int64_t>(meta.past_lens.size());
+}
+
+// Baseline: KVBlockManager is unsynchronized, so request threads and the engine step
+// share one scheduler mutex.
+AdmitResult run_mutex(const AdmitOptions& opt) {
+    AdmitResult result;
+    result.mode = "mutex";
+    KVBlockManager manager(opt.num_blocks, opt.block_size);
+    std::mutex scheduler;
+    std::vector<int> admitted;
+    std::vector<int> finished;
+    std::atomic<bool> stop{false};
+    std::mutex result_mutex;
+
+    auto admit = [&](int seq_id, int prompt_len) {
+        std::lock_guard<std::mutex> lock(scheduler);
+        if (manager.num_free_blocks() < (prompt_len + opt.block_size - 1) / opt.block_size) {
+            return false;
+        }
+        manager.reserve_for_prefill(manager.add_sequence(seq_id), prompt_len);
+        admitted.push_back(seq_id);
+        return true;
+    };
+    auto finish = [&](int seq_id) {
+        std::lock_guard<std::mutex> lock(scheduler);
+        manager.finish_sequence(seq_id);
+        finished.push_back(seq_id);
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < opt.threads; ++t) {
+        threads.emplace_back([&, t] { request_loop(t, opt, stop, result, result_mutex, admit, finish); });
+    }
+    RunningSet running;
+    std::vector<int> ones;
+    auto end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(opt.duration_s));
+    while (Clock::now() < end) {
+        auto t = Clock::now();
+        {
+            std::lock_guard<std::mutex> lock(scheduler);
+            for (int seq_id : admitted) {
+                if (manager.has_sequence(seq_id)) {
+                    auto h = manager.handle(seq_id);
+                    int prompt_len = prompt_len_of(seq_id, opt.prompt_len);
+                    manager.reserve_for_prefill(h, prompt_len);
+                    manager.commit_tokens(h, prompt_len);
+                    running.add(seq_id, h);
+                }
+            }
+            for (int seq_id : finished) {
+                running.remove(seq_id);
+            }
+            admitted.clear();
+            finished.clear();
+            decode_step(manager, running, ones, result);
+        }
+        result.step_us.push_back(us_since(t));
+        ++result.steps;
+        spin_for_us(opt.compute_us);
+    }
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return result;
+}
+
+AdmitResult run_staged(const AdmitOptions& opt) {
+    AdmitResult result;
+    result.mode = "staged";
+    ConcurrentKVOptions options;
+    options.cache_blocks = opt.cache_blocks;
+    ConcurrentKVBlockManager manager(opt.num_blocks, opt.block_size, options);
+    std::atomic<bool> stop{false};
+    std::mutex result_mutex;
+
+    auto admit = [&](int seq_id, int prompt_len) { return manager.admit_sequence(seq_id, prompt_len); };
+    auto finish = [&](int seq_id) { manager.finish_sequence(seq_id); };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < opt.threads; ++t) {
+        threads.emplace_back([&, t] { request_loop(t, opt, stop, result, result_mutex, admit, finish); });
+    }
+    RunningSet running;
+    std::vector<int> ones;
+    auto end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(opt.duration_s));
+    while (Clock::now() < end) {
+        auto t = Clock::now();
+        StagedChanges changes = manager.apply_staged();
+        for (int seq_id : changes.admitted) {
+            if (manager.has_sequence(seq_id)) {
+                auto h = manager.handle(seq_id);
+                int prompt_len = prompt_len_of(seq_id, opt.prompt_len);
+                manager.reserve_for_prefill(h, prompt_len);
+                manager.commit_tokens(h, prompt_len);
+                running.add(seq_id, h);
+            }
+        }
+        for (int seq_id : changes.finished) {
+            running.remove(seq_id);
+        }
+        decode_step(manager, running, ones, result);
+        result.step_us.push_back(us_since(t));
+        ++result.steps;
+        spin_for_us(opt.compute_us);
+    }
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    // Everything was finished; the last finishes are still staged.
+    manager.apply_staged();
+    if (manager.num_sequences() != 0 || manager.num_free_blocks() != opt.num_blocks) {
+        throw std::runtime_error("concurrent manager leaked sequences or blocks");
+    }
+    return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    AdmitOptions opt;
+    try {
+        opt = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<AdmitResult> results;
+    if (opt.mode != "staged") {
+        results.push_back(run_mutex(opt));
+    }
+    if (opt.mode != "mutex") {
+        results.push_back(run_staged(opt));
+    }
+
+    std::ostringstream csv;
+    csv << "mode,threads,live,rate,admits,admit_failures,steps,decode_tokens,admit_p50_us,admit_p99_us,"
+           "finish_p50_us,finish_p99_us,step_p50_us,step_p99_us,step_max_us\n";
+    for (const auto& r : results) {
+        std::cout << std::fixed << std::setprecision(2) << std::setw(6) << r.mode << " | admits " << r.admits
+                  << " (failed " << r.admit_failures << ") | admit us p50/p99 " << percentile(r.admit_us, 50) << "/"
+                  << percentile(r.admit_us, 99) << " | finish us p50/p99 " << percentile(r.finish_us, 50) << "/"
+                  << percentile(r.finish_us, 99) << " | step us p50/p99/max " << percentile(r.step_us, 50) << "/"
+                  << percentile(r.step_us, 99) << "/" << percentile(r.step_us, 100) << " | steps " << r.steps
+                  << " (" << r.decode_tokens << " tokens)\n";
+        csv << std::fixed << std::setprecision(3) << r.mode << ',' << opt.threads << ',' << opt.live << ',' << opt.rate
+            << ',' << r.admits << ',' << r.admit_failures << ',' << r.steps << ',' << r.decode_tokens << ','
+            << percentile(r.admit_us, 50) << ',' << percentile(r.admit_us, 99) << ',' << percentile(r.finish_us, 50)
+            << ',' << percentile(r.finish_us, 99) << ',' << percentile(r.step_us, 50) << ','
+            << percentile(r.step_us, 99) << ',' << percentile(r.step_us, 100) << "\n";
+    }
+    if (!opt.csv_path.empty()) {
+        if (opt.csv_path == "-") {
+            std::cout << csv.str();
+        } else {
+            std::ofstream out(opt.csv_path);
+            out << csv.str();
+        }
+    }
+    return 0;
+}
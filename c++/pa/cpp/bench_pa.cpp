@@ -0,0 +1,747 @@
+#include "pa_sampler.hpp"
+#include "pa_tool_util.hpp"
+#include "standalone_pa.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct HeadConfig {
+    int num_heads = 4;
+    int head_size = 16;
+};
+
+struct BenchOptions {
+    std::vector<int> batch_sizes = {1, 4};
+    std::vector<int> prompt_lens = {32, 128};
+    std::vector<int> decode_lens = {16};
+    std::vector<int> block_sizes = {16};
+    std::vector<HeadConfig> head_configs = {{4, 16}};
+    std::vector<bool> int8_caches = {false, true};
+    std::vector<KVPoolLayout> kv_layouts = {KVPoolLayout::BlockMajor};
+    std::vector<KVKeyLayout> key_layouts = {KVKeyLayout::Auto};
+    std::vector<int> tp_shards = {1};
+    AllReduceAlgorithm all_reduce = AllReduceAlgorithm::Ring;
+    PipelineOptions pipeline;
+    MlpOptions mlp;
+    AttentionScheduleOptions schedule;
+    int ragged = 1;
+    int vocab_size = 0;
+    SamplingOptions sampling;
+    int sample_threads = 1;
+    bool sort_sampler = false;
+    int num_layers = 2;
+    KVPoolOptions pool;
+    NumaOptions numa;
+    RopeOptions rope;
+    int stream_sink = 0;
+    int stream_window = 0;
+    HeavyHitterOptions heavy_hitters;
+    SparseAttentionOptions sparse;
+    int warmup = 1;
+    int reps = 5;
+    std::string csv_path;
+};
+
+struct BenchCase {
+    int batch = 0;
+    int prompt_len = 0;
+    int decode_len = 0;
+    int block_size = 0;
+    HeadConfig heads;
+    bool use_int8_cache = false;
+    KVPoolLayout kv_layout = KVPoolLayout::BlockMajor;
+    KVKeyLayout key_layout = KVKeyLayout::Auto;
+    int tp_shards = 1;
+};
+
+struct BenchResult {
+    std::vector<double> ttft_ms;
+    std::vector<double> tpot_ms;
+    std::vector<double> decode_tokens_per_s;
+    std::vector<double> e2e_tokens_per_s;
+    std::vector<double> pool_setup_ms;
+    std::vector<double> block_copy_us;
+    size_t peak_kv_bytes = 0;
+    KVPoolStats pool_stats;
+    TensorParallelStats tp_stats;  // summed over the measured runs
+    PipelineStats pipeline_stats;
+    std::string attention_kernel;
+    KVKeyLayout key_layout = KVKeyLayout::Auto;  // as resolved by the arena
+    std::string quant_kernel;
+    int mlp_intermediate = 0;
+    std::string eltwise_kernel;
+    SamplingStats sampling_stats;  // summed over the measured runs
+};
+
+std::vector<int> parse_int_list(const std::string& s) {
+    std::vector<int> values;
+    for (const auto& part : split(s, ',')) {
+        values.push_back(std::stoi(part));
+    }
+    return values;
+}
+
+std::vector<HeadConfig> parse_head_list(const std::string& s) {
+    std::vector<HeadConfig> values;
+    for (const auto& part : split(s, ',')) {
+        auto dims = split(part, 'x');
+        if (dims.size() != 2) {
+            throw std::runtime_error("head config must look like <num_heads>x<head_size>: " + part);
+        }
+        values.push_back({std::stoi(dims[0]), std::stoi(dims[1])});
+    }
+    return values;
+}
+
+std::vector<bool> parse_cache_list(const std::string& s) {
+    std::vector<bool> values;
+    for (const auto& part : split(s, ',')) {
+        if (part == "fp32") {
+            values.push_back(false);
+        } else if (part == "int8") {
+            values.push_back(true);
+        } else {
+            throw std::runtime_error("cache precision must be fp32 or int8: " + part);
+        }
+    }
+    return values;
+}
+
+std::vector<KVPoolLayout> parse_layout_list(const std::string& s) {
+    std::vector<KVPoolLayout> values;
+    for (const auto& part : split(s, ',')) {
+        values.push_back(parse_kv_pool_layout(part));
+    }
+    return values;
+}
+
+std::vector<KVKeyLayout> parse_key_layout_list(const std::string& s) {
+    std::vector<KVKeyLayout> values;
+    for (const auto& part : split(s, ',')) {
+        values.push_back(parse_kv_key_layout(part));
+    }
+    return values;
+}
+
+void print_usage(const char* argv0) {
+    std::cout
+        << "usage: " << argv0 << " [options]\n"
+        << "  --batch 1,4          batch sizes\n"
+        << "  --prompt 32,128      prompt lengths\n"
+        << "  --decode 16          decode lengths\n"
+        << "  --block 16           block sizes\n"
+        << "  --heads 4x16,8x32    <num_heads>x<head_size> configs\n"
+        << "  --cache fp32,int8    KV cache precisions\n"
+        << "  --layers 2           number of layers\n"
+        << "  --kv-layout block    KV arena layouts: block (block-major), layer (layer-major)\n"
+        << "  --k-layout auto      K layouts within a block: auto, slot ([slot][dim]), dim ([dim][slot])\n"
+        << "  --hugepage none      KV pool backing: none, thp or hugetlb\n"
+        << "  --prefault 0         prefault the KV pool at startup (0/1)\n"
+        << "  --numa off           off, auto (sysfs topology) or <n> emulated nodes\n"
+        << "  --rope off           off, or <base>[:<scaling>] rotary embedding on Q/K\n"
+        << "  --stream 0:0         <sink>:<window> attention-sink streaming (0:0 = off)\n"
+        << "  --heavy off          <budget>:<recent>[:tokens|blocks] heavy-hitter KV retention\n"
+        << "  --sparse off         <top_k>[:<recent>] blocks per head for query-aware sparse decode\n"
+        << "  --tp 1               tensor-parallel shard counts (heads split across threads)\n"
+        << "  --all-reduce ring    all-reduce of the sharded output projection: ring or tree\n"
+        << "  --pipeline off       <stages>[:<micro_batches>] layer pipeline over micro-batches\n"
+        << "  --mlp off            off, on, or <intermediate> RMSNorm + SwiGLU MLP block per layer\n"
+        << "  --attn-threads 1     threads prefill/decode attention work items run on\n"
+        << "  --q-tile 64          query rows per prefill attention work item\n"
+        << "  --ragged 1           <r>: the first sequence keeps the prompt, the rest get prompt/r\n"
+        << "  --vocab 0            LM head + sampler over this many tokens after every step (0 = off)\n"
+        << "  --sample 1:0:1:1     <temperature>[:<top_k>[:<top_p>[:<repetition_penalty>]]]\n"
+        << "  --sampler fast       fast (threshold scans) or sort (full-vocabulary sort reference)\n"
+        << "  --sample-threads 1   threads the sequences of a batch are sampled on\n"
+        << "  --warmup 1           warmup runs per case\n"
+        << "  --reps 5             measured runs per case\n"
+        << "  --csv out.csv        also write results as CSV ('-' for stdout)\n";
+}
+
+BenchOptions parse_args(int argc, char** argv) {
+    BenchOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--batch") {
+            opt.batch_sizes = parse_int_list(value);
+        } else if (arg == "--prompt") {
+            opt.prompt_lens = parse_int_list(value);
+        } else if (arg == "--decode") {
+            opt.decode_lens = parse_int_list(value);
+        } else if (arg == "--block") {
+            opt.block_sizes = parse_int_list(value);
+        } else if (arg == "--heads") {
+            opt.head_configs = parse_head_list(value);
+        } else if (arg == "--cache") {
+            opt.int8_caches = parse_cache_list(value);
+        } else if (arg == "--kv-layout") {
+            opt.kv_layouts = parse_layout_list(value);
+        } else if (arg == "--k-layout") {
+            opt.key_layouts = parse_key_layout_list(value);
+        } else if (arg == "--layers") {
+            opt.num_layers = std::stoi(value);
+        } else if (arg == "--hugepage") {
+            opt.pool.huge_pages = parse_huge_page_mode(value);
+        } else if (arg == "--prefault") {
+            opt.pool.prefault = std::stoi(value) != 0;
+        } else if (arg == "--numa") {
+            opt.numa.enabled = value != "off";
+            opt.numa.emulate_nodes = (value == "off" || value == "auto") ? 0 : std::stoi(value);
+        } else if (arg == "--rope") {
+            opt.rope.enabled = value != "off";
+            if (opt.rope.enabled) {
+                auto parts = split(value, ':');
+                opt.rope.base = std::stof(parts.at(0));
+                opt.rope.scaling = parts.size() > 1 ? std::stof(parts[1]) : 1.0f;
+            }
+        } else if (arg == "--stream") {
+            auto parts = split(value, ':');
+            if (parts.size() != 2) {
+                throw std::runtime_error("--stream must look like <sink>:<window>");
+            }
+            opt.stream_sink = std::stoi(parts[0]);
+            opt.stream_window = std::stoi(parts[1]);
+        } else if (arg == "--heavy") {
+            opt.heavy_hitters = HeavyHitterOptions{};
+            if (value != "off") {
+                auto parts = split(value, ':');
+                if (parts.size() < 2 || parts.size() > 3 || (parts.size() == 3 && parts[2] != "tokens" && parts[2] != "blocks")) {
+                    throw std::runtime_error("--heavy must look like <budget>:<recent>[:tokens|blocks]");
+                }
+                opt.heavy_hitters.budget_tokens = std::stoi(parts[0]);
+                opt.heavy_hitters.recent_tokens = std::stoi(parts[1]);
+                opt.heavy_hitters.evict_tokens = parts.size() < 3 || parts[2] == "tokens";
+            }
+        } else if (arg == "--sparse") {
+            opt.sparse = SparseAttentionOptions{};
+            opt.sparse.enabled = value != "off";
+            if (opt.sparse.enabled) {
+                auto parts = split(value, ':');
+                opt.sparse.top_k_blocks = std::stoi(parts.at(0));
+                opt.sparse.recent_blocks = parts.size() > 1 ? std::stoi(parts[1]) : 1;
+            }
+        } else if (arg == "--tp") {
+            opt.tp_shards = parse_int_list(value);
+        } else if (arg == "--all-reduce") {
+            opt.all_reduce = parse_all_reduce_algorithm(value);
+        } else if (arg == "--pipeline") {
+            opt.pipeline = PipelineOptions{};
+            if (value != "off") {
+                auto parts = split(value, ':');
+                opt.pipeline.stages = std::stoi(parts.at(0));
+                opt.pipeline.micro_batches = parts.size() > 1 ? std::stoi(parts[1]) : 0;
+            }
+        } else if (arg == "--mlp") {
+            opt.mlp = MlpOptions{};
+            opt.mlp.enabled = value != "off";
+            opt.mlp.intermediate_size = (value == "off" || value == "on") ? 0 : std::stoi(value);
+        } else if (arg == "--attn-threads") {
+            opt.schedule.threads = std::stoi(value);
+        } else if (arg == "--q-tile") {
+            opt.schedule.q_tile = std::stoi(value);
+        } else if (arg == "--ragged") {
+            opt.ragged = std::max(1, std::stoi(value));
+        } else if (arg == "--vocab") {
+            opt.vocab_size = std::stoi(value);
+        } else if (arg == "--sample") {
+            auto parts = split(value, ':');
+            opt.sampling = SamplingOptions{};
+            opt.sampling.temperature = std::stof(parts.at(0));
+            opt.sampling.top_k = parts.size() > 1 ? std::stoi(parts[1]) : 0;
+            opt.sampling.top_p = parts.size() > 2 ? std::stof(parts[2]) : 1.0f;
+            opt.sampling.repetition_penalty = parts.size() > 3 ? std::stof(parts[3]) : 1.0f;
+        } else if (arg == "--sampler") {
+            if (value != "fast" && value != "sort") {
+                throw std::runtime_error("--sampler must be fast or sort");
+            }
+            opt.sort_sampler = value == "sort";
+        } else if (arg == "--sample-threads") {
+            opt.sample_threads = std::stoi(value);
+        } else if (arg == "--warmup") {
+            opt.warmup = std::stoi(value);
+        } else if (arg == "--reps") {
+            opt.reps = std::stoi(value);
+        } else if (arg == "--csv") {
+            opt.csv_path = value;
+        } else {
+            throw std::runtime_error("unknown option " + arg);
+        }
+    }
+    // Checked here as well as by the runtime, so a sweep fails before its first case.
+    if (opt.pipeline.stages > 1) {
+        bool sharded = std::any_of(opt.tp_shards.begin(), opt.tp_shards.end(), [](int s) { return s > 1; });
+        if (sharded || opt.numa.enabled) {
+            throw std::runtime_error("--pipeline cannot be combined with --tp or --numa");
+        }
+    }
+    return opt;
+}
+
+double elapsed_ms(Clock::time_point t0, Clock::time_point t1) {
+    return std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
+
+// What a sampler without partial selection does: sort the whole vocabulary, then apply
+// top-k / top-p to the sorted softmax. Single-threaded and without the repetition penalty.
+int sort_sample(
+    const LMHead& head,
+    const float* hidden,
+    const SamplingOptions& options,
+    std::mt19937& rng,
+    std::vector<float>& logits,
+    std::vector<int>& order) {
+    int n = head.vocab_size();
+    head.logits(hidden, logits.data());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return logits[a] > logits[b]; });
+    if (options.temperature <= 0.0f) {
+        return order[0];
+    }
+    int k = options.top_k > 0 ? std::min(options.top_k, n) : n;
+    float max_logit = logits[order[0]];
+    double total = 0.0;
+    std::vector<double> p(k);
+    for (int i = 0; i < k; ++i) {
+        p[i] = std::exp((logits[order[i]] - max_logit) / options.temperature);
+        total += p[i];
+    }
+    double acc = 0.0;
+    for (int i = 0; i < k; ++i) {
+        acc += p[i];
+        if (acc >= options.top_p * total) {
+            k = i + 1;
+            break;
+        }
+    }
+    double u = std::uniform_real_distribution<double>(0.0, acc)(rng);
+    acc = 0.0;
+    for (int i = 0; i < k; ++i) {
+        acc += p[i];
+        if (u < acc) {
+            return order[i];
+        }
+    }
+    return order[k - 1];
+}
+
+// One token per row of `hidden`, through the sampling head or the sort reference.
+std::vector<int> sample_tokens(
+    const BenchOptions& opt,
+    SamplingHead& head,
+    const std::vector<int>& seq_ids,
+    const ToyLLMRuntime::Tensor2& hidden,
+    std::mt19937& rng) {
+    if (!opt.sort_sampler) {
+        return head.sample(seq_ids, hidden, opt.sampling);
+    }
+    std::vector<float> logits(head.vocab_size());
+    std::vector<int> order(head.vocab_size());
+    std::vector<int> tokens;
+    for (const auto& row : hidden) {
+        tokens.push_back(sort_sample(head.lm_head(), row.data(), opt.sampling, rng, logits, order));
+    }
+    return tokens;
+}
+
+// With a sampling head, every step ends with the LM head and a sampled token per
+// sequence, and the token's embedding is the next decode input.
+void run_once(const BenchCase& c, const BenchOptions& opt, uint32_t seed, SamplingHead* head, BenchResult* result) {
+    int hidden_size = c.heads.num_heads * c.heads.head_size;
+    int blocks_per_seq = (c.prompt_len + c.decode_len + c.block_size - 1) / c.block_size;
+    // One spare block is the destination of the block-copy measurement.
+    int num_blocks = c.batch * blocks_per_seq + 1;
+    RuntimeOptions runtime_options;
+    runtime_options.pool = opt.pool;
+    runtime_options.pool.layout = c.kv_layout;
+    runtime_options.pool.key_layout = c.key_layout;
+    runtime_options.numa = opt.numa;
+    runtime_options.rope = opt.rope;
+    runtime_options.sparse = opt.sparse;
+    runtime_options.tp.shards = c.tp_shards;
+    runtime_options.tp.all_reduce = opt.all_reduce;
+    runtime_options.pipeline = opt.pipeline;
+    runtime_options.mlp = opt.mlp;
+    runtime_options.schedule = opt.schedule;
+
+    auto p0 = Clock::now();
+    ToyLLMRuntime runtime(
+        opt.num_layers, hidden_size, c.heads.num_heads, c.heads.head_size, num_blocks, c.block_size, c.use_int8_cache,
+        runtime_options);
+    double pool_setup_ms = elapsed_ms(p0, Clock::now());
+
+    std::vector<int> seq_ids;
+    for (int b = 0; b < c.batch; ++b) {
+        seq_ids.push_back(b);
+        runtime.add_sequence(b);
+        if (opt.stream_window > 0) {
+            runtime.enable_streaming(b, opt.stream_sink, opt.stream_window);
+        }
+        if (opt.heavy_hitters.budget_tokens > 0) {
+            runtime.enable_heavy_hitters(b, opt.heavy_hitters);
+        }
+        if (head) {
+            head->add_sequence(b);
+        }
+    }
+    std::mt19937 sort_rng(seed);
+    if (head) {
+        head->reset_stats();
+    }
+    std::vector<int> q_lens(c.batch, std::max(1, c.prompt_len / opt.ragged));
+    q_lens[0] = c.prompt_len;
+    int prompt_tokens = 0;
+    for (int len : q_lens) {
+        prompt_tokens += len;
+    }
+    auto x_prefill = make_random_tensor2(prompt_tokens, hidden_size, seed);
+
+    auto t0 = Clock::now();
+    auto hidden = runtime.prefill(seq_ids, x_prefill, q_lens);
+    // Feed the last prompt position of every sequence back as the first decode input.
+    ToyLLMRuntime::Tensor2 x_decode;
+    for (int b = 0, end = 0; b < c.batch; ++b) {
+        end += q_lens[b];
+        x_decode.push_back(hidden[end - 1]);
+    }
+    if (head) {
+        x_decode = head->embed(sample_tokens(opt, *head, seq_ids, x_decode, sort_rng));
+    }
+    auto t1 = Clock::now();
+    double ttft = elapsed_ms(t0, t1);
+
+    std::vector<double> step_ms;
+    auto d0 = Clock::now();
+    for (int step = 0; step < c.decode_len; ++step) {
+        auto s0 = Clock::now();
+        x_decode = runtime.decode(seq_ids, x_decode);
+        if (head) {
+            x_decode = head->embed(sample_tokens(opt, *head, seq_ids, x_decode, sort_rng));
+        }
+        step_ms.push_back(elapsed_ms(s0, Clock::now()));
+    }
+    double decode_ms = elapsed_ms(d0, Clock::now());
+
+    // Copy-on-write / swap cost: every live block copied once across all layers, into
+    // a block nobody holds. A full pool skips the measurement.
+    auto& arena = runtime.kv_arena();
+    const auto& manager = runtime.manager();
+    std::vector<int> live_blocks;
+    for (int seq_id : seq_ids) {
+        auto blocks = manager.logical_blocks(seq_id);
+        int committed = (manager.past_len(seq_id) + c.block_size - 1) / c.block_size;
+        live_blocks.insert(live_blocks.end(), blocks.begin(), blocks.begin() + committed);
+    }
+    std::sort(live_blocks.begin(), live_blocks.end());
+    live_blocks.erase(std::unique(live_blocks.begin(), live_blocks.end()), live_blocks.end());
+    auto free_blocks = manager.free_blocks();
+    double copy_us = 0.0;
+    if (!free_blocks.empty() && !live_blocks.empty()) {
+        auto c0 = Clock::now();
+        for (int block : live_blocks) {
+            arena.copy_block(block, free_blocks.front());
+        }
+        copy_us = 1000.0 * elapsed_ms(c0, Clock::now()) / live_blocks.size();
+    }
+
+    if (!result) {
+        return;
+    }
+    result->ttft_ms.push_back(ttft);
+    result->tpot_ms.insert(result->tpot_ms.end(), step_ms.begin(), step_ms.end());
+    if (c.decode_len > 0) {
+        result->decode_tokens_per_s.push_back(1000.0 * c.batch * c.decode_len / decode_ms);
+    }
+    double total_tokens = static_cast<double>(prompt_tokens) + static_cast<double>(c.batch) * c.decode_len;
+    result->e2e_tokens_per_s.push_back(1000.0 * total_tokens / (ttft + decode_ms));
+    result->pool_setup_ms.push_back(pool_setup_ms);
+    result->block_copy_us.push_back(copy_us);
+    result->peak_kv_bytes = std::max(result->peak_kv_bytes, runtime.peak_kv_bytes());
+    result->pool_stats = runtime.kv_pool_stats();
+    auto tp_stats = runtime.tensor_parallel_stats();
+    result->tp_stats.reductions += tp_stats.reductions;
+    result->tp_stats.compute_seconds += tp_stats.compute_seconds;
+    result->tp_stats.skew_seconds += tp_stats.skew_seconds;
+    result->tp_stats.reduce_seconds += tp_stats.reduce_seconds;
+    auto pipeline_stats = runtime.pipeline_stats();
+    result->pipeline_stats.steps += pipeline_stats.steps;
+    result->pipeline_stats.micro_batches += pipeline_stats.micro_batches;
+    result->pipeline_stats.wall_seconds += pipeline_stats.wall_seconds;
+    result->pipeline_stats.busy_seconds += pipeline_stats.busy_seconds;
+    result->attention_kernel = runtime.attention_kernel_name();
+    result->key_layout = runtime.kv_arena().key_layout();
+    result->quant_kernel = runtime.quant_kernel_isa();
+    result->mlp_intermediate = runtime.mlp_intermediate_size();
+    result->eltwise_kernel = runtime.eltwise_kernel_isa();
+    if (head) {
+        auto sampling_stats = head->stats();
+        result->sampling_stats.tokens += sampling_stats.tokens;
+        result->sampling_stats.lm_head_seconds += sampling_stats.lm_head_seconds;
+        result->sampling_stats.sample_seconds += sampling_stats.sample_seconds;
+    }
+}
+
+std::string rope_label(const RopeOptions& rope) {
+    if (!rope.enabled) {
+        return "off";
+    }
+    std::ostringstream os;
+    os << rope.base << ':' << rope.scaling;
+    return os.str();
+}
+
+std::string sparse_label(const SparseAttentionOptions& sparse) {
+    if (!sparse.enabled) {
+        return "off";
+    }
+    return std::to_string(sparse.top_k_blocks) + ':' + std::to_string(sparse.recent_blocks);
+}
+
+std::string heavy_hitter_label(const HeavyHitterOptions& options) {
+    if (options.budget_tokens == 0) {
+        return "off";
+    }
+    return std::to_string(options.budget_tokens) + ':' + std::to_string(options.recent_tokens) + ':' +
+           (options.evict_tokens ? "tokens" : "blocks");
+}
+
+// Shares of the sharded layer time spent waiting for the slowest shard and reducing.
+double tp_percent(const TensorParallelStats& stats, double seconds) {
+    double total = stats.compute_seconds + stats.skew_seconds + stats.reduce_seconds;
+    return total > 0.0 ? 100.0 * seconds / total : 0.0;
+}
+
+std::string pipeline_label(const PipelineOptions& pipeline) {
+    if (pipeline.stages <= 1) {
+        return "off";
+    }
+    return std::to_string(pipeline.stages) + ':' + std::to_string(pipeline.micro_batches);
+}
+
+std::string sampler_label(const BenchOptions& opt) {
+    if (opt.vocab_size <= 0) {
+        return "off";
+    }
+    if (opt.sort_sampler) {
+        return "sort";
+    }
+    std::ostringstream os;
+    os << opt.sampling.temperature << ':' << opt.sampling.top_k << ':' << opt.sampling.top_p << ':'
+       << opt.sampling.repetition_penalty;
+    return os.str();
+}
+
+// The sort reference bypasses the sampling head, so it records no split.
+double per_token_us(const SamplingStats& stats, double seconds) {
+    return stats.tokens > 0 ? 1e6 * seconds / static_cast<double>(stats.tokens) : 0.0;
+}
+
+std::string csv_header() {
+    return "batch,prompt_len,decode_len,block_size,num_heads,head_size,cache,kv_layout,k_layout,layers,reps,"
+           "hugepage,prefault,numa,rope,stream,heavy,sparse,tp,all_reduce,pipeline,mlp,attn_threads,q_tile,ragged,vocab,sampler,ttft_p50_ms,ttft_p90_ms,ttft_p99_ms,"
+           "tpot_p50_ms,tpot_p90_ms,tpot_p99_ms,"
+           "decode_tok_s_p50,e2e_tok_s_p50,peak_kv_bytes,"
+           "pool_setup_p50_ms,pool_mapped_bytes,pool_huge_bytes,block_copy_p50_us,attention_kernel,quant_kernel,tp_skew_pct,tp_reduce_pct,pipeline_bubble_pct,lm_head_us_per_tok,sample_us_per_tok";
+}
+
+std::string csv_row(const BenchCase& c, const BenchOptions& opt, const BenchResult& r) {
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(4)
+       << c.batch << ',' << c.prompt_len << ',' << c.decode_len << ',' << c.block_size << ','
+       << c.heads.num_heads << ',' << c.heads.head_size << ',' << (c.use_int8_cache ? "int8" : "fp32") << ','
+       << kv_pool_layout_name(c.kv_layout) << ',' << kv_key_layout_name(r.key_layout) << ',' << opt.num_layers << ',' << opt.reps << ','
+       << huge_page_mode_name(r.pool_stats.backing) << ',' << (opt.pool.prefault ? 1 : 0) << ','
+       << (opt.numa.enabled ? (opt.numa.emulate_nodes > 0 ? std::to_string(opt.numa.emulate_nodes) : "auto") : "off") << ','
+       << rope_label(opt.rope) << ','
+       << opt.stream_sink << ':' << opt.stream_window << ','
+       << heavy_hitter_label(opt.heavy_hitters) << ','
+       << sparse_label(opt.sparse) << ','
+       << c.tp_shards << ',' << all_reduce_algorithm_name(opt.all_reduce) << ','
+       << pipeline_label(opt.pipeline) << ','
+       << (r.mlp_intermediate > 0 ? std::to_string(r.mlp_intermediate) : "off") << ','
+       << opt.schedule.threads << ',' << opt.schedule.q_tile << ',' << opt.ragged << ','
+       << opt.vocab_size << ',' << sampler_label(opt) << ','
+       << percentile(r.ttft_ms, 50) << ',' << percentile(r.ttft_ms, 90) << ',' << percentile(r.ttft_ms, 99) << ','
+       << percentile(r.tpot_ms, 50) << ',' << percentile(r.tpot_ms, 90) << ',' << percentile(r.tpot_ms, 99) << ','
+       << percentile(r.decode_tokens_per_s, 50) << ',' << percentile(r.e2e_tokens_per_s, 50) << ','
+       << r.peak_kv_bytes << ','
+       << percentile(r.pool_setup_ms, 50) << ',' << r.pool_stats.mapped_bytes << ',' << r.pool_stats.huge_page_bytes << ','
+       << percentile(r.block_copy_us, 50) << ',' << r.attention_kernel << ',' << r.quant_kernel << ','
+       << tp_percent(r.tp_stats, r.tp_stats.skew_seconds) << ',' << tp_percent(r.tp_stats, r.tp_stats.reduce_seconds)
+       << ',' << 100.0 * r.pipeline_stats.bubble_fraction(opt.pipeline.stages)
+       << ',' << per_token_us(r.sampling_stats, r.sampling_stats.lm_head_seconds)
+       << ',' << per_token_us(r.sampling_stats, r.sampling_stats.sample_seconds);
+    return os.str();
+}
+
+void print_result(const BenchCase& c, const BenchOptions& opt, const BenchResult& r) {
+    std::cout << std::fixed << std::setprecision(3)
+              << "batch=" << std::setw(3) << c.batch
+              << " prompt=" << std::setw(5) << c.prompt_len
+              << " decode=" << std::setw(4) << c.decode_len
+              << " block=" << std::setw(3) << c.block_size
+              << " heads=" << c.heads.num_heads << "x" << c.heads.head_size
+              << " cache=" << (c.use_int8_cache ? "int8" : "fp32")
+              << " layout=" << kv_pool_layout_name(c.kv_layout)
+              << " k=" << kv_key_layout_name(r.key_layout)
+              << " kernel=" << r.attention_kernel
+              << " quant=" << r.quant_kernel
+              << " | ttft p50/p90/p99 = " << percentile(r.ttft_ms, 50) << "/" << percentile(r.ttft_ms, 90) << "/"
+              << percentile(r.ttft_ms, 99) << " ms"
+              << " | tpot p50/p90/p99 = " << percentile(r.tpot_ms, 50) << "/" << percentile(r.tpot_ms, 90) << "/"
+              << percentile(r.tpot_ms, 99) << " ms"
+              << " | decode " << std::setprecision(1) << percentile(r.decode_tokens_per_s, 50) << " tok/s"
+              << " | peak kv " << std::setprecision(2) << r.peak_kv_bytes / 1024.0 / 1024.0 << " MiB"
+              << " | pool " << huge_page_mode_name(r.pool_stats.backing) << " huge "
+              << r.pool_stats.huge_page_bytes / 1024.0 / 1024.0 << "/" << r.pool_stats.mapped_bytes / 1024.0 / 1024.0
+              << " MiB"
+              << " | block copy " << percentile(r.block_copy_us, 50) << " us";
+    if (r.pool_stats.numa_bind_failures > 0) {
+        std::cout << " | numa bind failed for " << r.pool_stats.numa_bind_failures << " ranges";
+    }
+    if (c.tp_shards > 1) {
+        std::cout << std::setprecision(1) << " | tp " << c.tp_shards << " " << all_reduce_algorithm_name(opt.all_reduce)
+                  << " skew " << tp_percent(r.tp_stats, r.tp_stats.skew_seconds) << "% reduce "
+                  << tp_percent(r.tp_stats, r.tp_stats.reduce_seconds) << "%";
+    }
+    if (opt.pipeline.stages > 1) {
+        std::cout << std::setprecision(1) << " | pipeline " << opt.pipeline.stages << " stages, "
+                  << static_cast<double>(r.pipeline_stats.micro_batches) / std::max<int64_t>(1, r.pipeline_stats.steps)
+                  << " micro-batches/step, bubble " << 100.0 * r.pipeline_stats.bubble_fraction(opt.pipeline.stages)
+                  << "%";
+    }
+    if (r.mlp_intermediate > 0) {
+        std::cout << " | mlp " << r.mlp_intermediate << " silu " << r.eltwise_kernel;
+    }
+    if (opt.schedule.threads > 1 || opt.ragged > 1) {
+        std::cout << " | attention " << opt.schedule.threads << " threads, q tile " << opt.schedule.q_tile;
+        if (opt.ragged > 1) {
+            std::cout << ", ragged 1/" << opt.ragged;
+        }
+    }
+    if (opt.vocab_size > 0 && opt.sort_sampler) {
+        std::cout << " | vocab " << opt.vocab_size << " sort sampler";
+    } else if (opt.vocab_size > 0) {
+        std::cout << std::setprecision(1) << " | vocab " << opt.vocab_size << " lm head "
+                  << per_token_us(r.sampling_stats, r.sampling_stats.lm_head_seconds) << " us/tok, sample "
+                  << per_token_us(r.sampling_stats, r.sampling_stats.sample_seconds) << " us/tok";
+    }
+    std::cout << "\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    BenchOptions opt;
+    try {
+        opt = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<BenchCase> cases;
+    for (int batch : opt.batch_sizes) {
+        for (int prompt_len : opt.prompt_lens) {
+            for (int decode_len : opt.decode_lens) {
+                for (int block_size : opt.block_sizes) {
+                    for (const auto& heads : opt.head_configs) {
+                        for (bool use_int8_cache : opt.int8_caches) {
+                            for (KVPoolLayout layout : opt.kv_layouts) {
+                                for (KVKeyLayout key_layout : opt.key_layouts) {
+                                    for (int tp_shards : opt.tp_shards) {
+                                        cases.push_back(
+                                            {batch, prompt_len, decode_len, block_size, heads, use_int8_cache, layout,
+                                             key_layout, tp_shards});
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << "=== paged attention runtime benchmark ===\n"
+              << "cases=" << cases.size() << " layers=" << opt.num_layers << " warmup=" << opt.warmup
+              << " reps=" << opt.reps << " hugepage=" << huge_page_mode_name(opt.pool.huge_pages)
+              << " prefault=" << (opt.pool.prefault ? 1 : 0);
+    if (opt.numa.enabled) {
+        NumaPlacement placement(opt.numa);
+        std::cout << " numa_nodes=" << placement.num_nodes() << (placement.topology().emulated() ? " (emulated)" : "")
+                  << " bind=" << (placement.bind_memory() ? 1 : 0);
+    }
+    std::cout << "\n";
+
+    std::vector<std::string> rows;
+    try {
+        for (const auto& c : cases) {
+            // Built once per case: a vocabulary-sized table is slow to draw.
+            std::unique_ptr<SamplingHead> head;
+            if (opt.vocab_size > 0) {
+                SamplingHeadOptions head_options;
+                head_options.vocab_size = opt.vocab_size;
+                head_options.threads = opt.sample_threads;
+                head.reset(new SamplingHead(c.heads.num_heads * c.heads.head_size, head_options));
+            }
+            // Fixed seeds keep every run of the sweep on identical inputs.
+            for (int i = 0; i < opt.warmup; ++i) {
+                run_once(c, opt, 7u, head.get(), nullptr);
+            }
+            BenchResult result;
+            for (int i = 0; i < opt.reps; ++i) {
+                run_once(c, opt, 7u, head.get(), &result);
+            }
+            print_result(c, opt, result);
+            rows.push_back(csv_row(c, opt, result));
+        }
+    } catch (const std::exception& e) {
+        // The runtime rejects option combinations the parser cannot see, e.g. a head
+        // count that --tp does not divide.
+        std::cerr << e.what() << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (opt.csv_path == "-") {
+        std::cout << csv_header() << "\n";
+        for (const auto& row : rows) {
+            std::cout << row << "\n";
+        }
+    } else if (!opt.csv_path.empty()) {
+        std::ofstream csv(opt.csv_path);
+        if (!csv) {
+            std::cerr << "failed to open " << opt.csv_path << "\n";
+            return 1;
+        }
+        csv << csv_header() << "\n";
+        for (const auto& row : rows) {
+            csv << row << "\n";
+        }
+        std::cout << "csv written to " << opt.csv_path << "\n";
+    }
+    return 0;
+}
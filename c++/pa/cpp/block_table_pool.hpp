@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// A sequence's block table: a span of BlockTablePool storage.
+struct BlockTableRef {
+    int begin = 0;
+    int capacity = 0;
+    int size = 0;
+};
+
+// Block tables of every sequence in one int array. Each table owns one chunk whose
+// capacity is a power-of-two size class; when it fills up the table moves to a chunk
+// of the next class and the old chunk goes back to its class's free list. Tables are
+// therefore contiguous (a batch's block indices are gathered with one memcpy per
+// sequence) and steady-state scheduling allocates nothing.
+//
+// Refs hold offsets, not pointers, so growing the storage never invalidates them.
+class BlockTablePool {
+public:
+    static constexpr int kMinCapacity = 8;
+
+    const int* data(const BlockTableRef& ref) const {
+        return m_storage.data() + ref.begin;
+    }
+
+    int* data(BlockTableRef& ref) {
+        return m_storage.data() + ref.begin;
+    }
+
+    int at(const BlockTableRef& ref, int i) const {
+        return m_storage[ref.begin + i];
+    }
+
+    void set(BlockTableRef& ref, int i, int block) {
+        m_storage[ref.begin + i] = block;
+    }
+
+    void push_back(BlockTableRef& ref, int block) {
+        if (ref.size == ref.capacity) {
+            grow(ref, ref.size + 1);
+        }
+        m_storage[ref.begin + ref.size] = block;
+        ref.size += 1;
+    }
+
+    // Removes entries [first, first + count), keeping the order of the rest.
+    void erase(BlockTableRef& ref, int first, int count) {
+        int* p = data(ref);
+        std::memmove(p + first, p + first + count, sizeof(int) * (ref.size - first - count));
+        ref.size -= count;
+    }
+
+    void assign(BlockTableRef& dst, const BlockTableRef& src) {
+        if (dst.capacity < src.size) {
+            release(dst);
+            dst = allocate(src.size);
+        }
+        std::memcpy(data(dst), data(src), sizeof(int) * src.size);
+        dst.size = src.size;
+    }
+
+    void release(BlockTableRef& ref) {
+        if (ref.capacity > 0) {
+            m_free_chunks[size_class(ref.capacity)].push_back(ref.begin);
+        }
+        ref = BlockTableRef{};
+    }
+
+    // Int slots reserved so far, live or free. Never shrinks.
+    size_t storage_size() const {
+        return m_storage.size();
+    }
+
+private:
+    std::vector<int> m_storage;
+    std::vector<std::vector<int>> m_free_chunks;  // chunk offsets per size class
+
+    static int size_class(int capacity) {
+        int cls = 0;
+        while ((kMinCapacity << cls) < capacity) {
+            ++cls;
+        }
+        return cls;
+    }
+
+    BlockTableRef allocate(int min_capacity) {
+        int cls = size_class(min_capacity);
+        if (static_cast<int>(m_free_chunks.size()) <= cls) {
+            m_free_chunks.resize(cls + 1);
+        }
+        BlockTableRef ref;
+        ref.capacity = kMinCapacity << cls;
+        if (!m_free_chunks[cls].empty()) {
+            ref.begin = m_free_chunks[cls].back();
+            m_free_chunks[cls].pop_back();
+        } else {
+            ref.begin = static_cast<int>(m_storage.size());
+            m_storage.resize(m_storage.size() + ref.capacity);
+        }
+        return ref;
+    }
+
+    void grow(BlockTableRef& ref, int min_capacity) {
+        BlockTableRef bigger = allocate(std::max(min_capacity, ref.capacity * 2));
+        std::memcpy(data(bigger), data(ref), sizeof(int) * ref.size);
+        bigger.size = ref.size;
+        release(ref);
+        ref = bigger;
+    }
+};
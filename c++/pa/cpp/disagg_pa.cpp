@@ -0,0 +1,398 @@
+#include "kv_transfer.hpp"
+#include "pa_tool_util.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Disaggregated prefill and decode on one host. A prefill process runs every prompt
+// and streams each sequence's KV layer by layer to a decode process over a Unix domain
+// socket (kv_transfer.hpp); the decode process adopts the blocks and decodes, polling
+// the socket between steps. `--role colocated` runs the same workload in one process
+// that interleaves prefills with the decode steps, which is what disaggregation avoids:
+// there, every prompt stalls all running decodes for the length of its prefill.
+//
+// The decode side reports the gaps between consecutive decode steps and checks every
+// final output against a private runtime that ran the request alone.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Tensor2 = ToyLLMRuntime::Tensor2;
+
+struct DisaggOptions {
+    std::string role = "both";  // both, prefill, decode, colocated
+    std::string socket_path = "/tmp/pa_disagg.sock";
+    int requests = 32;
+    int prompt_len = 512;
+    int decode_steps = 32;
+    int max_batch = 16;
+    int num_layers = 4;
+    int num_heads = 4;
+    int head_size = 16;
+    int block_size = 16;
+    bool use_int8_cache = false;
+    bool verify = true;
+    uint32_t seed = 1;
+};
+
+void print_usage(const char* argv0) {
+    std::cout << "usage: " << argv0 << " [options]\n"
+              << "  --role both             both (fork a prefill process), prefill, decode or colocated\n"
+              << "  --socket /tmp/pa_disagg.sock  Unix domain socket path\n"
+              << "  --requests 32           number of requests\n"
+              << "  --prompt 512            mean prompt length (uniform in [len/2, 3*len/2])\n"
+              << "  --decode 32             decode steps per request\n"
+              << "  --max-batch 16          sequences decoding at once\n"
+              << "  --layers 4              number of layers\n"
+              << "  --heads 4x16            <num_heads>x<head_size>\n"
+              << "  --block 16              block size\n"
+              << "  --cache fp32            KV cache precision: fp32 or int8\n"
+              << "  --verify 1              check outputs against private runs (0 to skip)\n"
+              << "  --seed 1                workload seed\n";
+}
+
+DisaggOptions parse_args(int argc, char** argv) {
+    DisaggOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--role") {
+            if (value != "both" && value != "prefill" && value != "decode" && value != "colocated") {
+                throw std::runtime_error("role must be both, prefill, decode or colocated: " + value);
+            }
+            opt.role = value;
+        } else if (arg == "--socket") {
+            opt.socket_path = value;
+        } else if (arg == "--requests") {
+            opt.requests = std::stoi(value);
+        } else if (arg == "--prompt") {
+            opt.prompt_len = std::stoi(value);
+        } else if (arg == "--decode") {
+            opt.decode_steps = std::stoi(value);
+        } else if (arg == "--max-batch") {
+            opt.max_batch = std::stoi(value);
+        } else if (arg == "--layers") {
+            opt.num_layers = std::stoi(value);
+        } else if (arg == "--heads") {
+            auto dims = split(value, 'x');
+            if (dims.size() != 2) {
+                throw std::runtime_error("head config must look like <num_heads>x<head_size>: " + value);
+            }
+            opt.num_heads = std::stoi(dims[0]);
+            opt.head_size = std::stoi(dims[1]);
+        } else if (arg == "--block") {
+            opt.block_size = std::stoi(value);
+        } else if (arg == "--cache") {
+            if (value != "fp32" && value != "int8") {
+                throw std::runtime_error("cache precision must be fp32 or int8: " + value);
+            }
+            opt.use_int8_cache = value == "int8";
+        } else if (arg == "--verify") {
+            opt.verify = std::stoi(value) != 0;
+        } else if (arg == "--seed") {
+            opt.seed = static_cast<uint32_t>(std::stoul(value));
+        } else {
+            throw std::runtime_error("unknown option " + arg);
+        }
+    }
+    if (opt.requests < 1 || opt.prompt_len < 1 || opt.decode_steps < 1 || opt.max_batch < 1) {
+        throw std::runtime_error("requests, prompt, decode and max-batch must be positive");
+    }
+    return opt;
+}
+
+int hidden_size(const DisaggOptions& opt) {
+    return opt.num_heads * opt.head_size;
+}
+
+// Both processes derive the same prompt lengths from the seed.
+std::vector<int> prompt_lengths(const DisaggOptions& opt) {
+    std::mt19937 gen(opt.seed);
+    std::uniform_int_distribution<int> dist(std::max(1, opt.prompt_len / 2), opt.prompt_len + opt.prompt_len / 2);
+    std::vector<int> lens(opt.requests);
+    for (auto& len : lens) {
+        len = dist(gen);
+    }
+    return lens;
+}
+
+Tensor2 prompt(const DisaggOptions& opt, int request, int len) {
+    return make_random_tensor2(len, hidden_size(opt), opt.seed * 7919u + static_cast<uint32_t>(request));
+}
+
+// Room for every request at full length: the prefill side may run arbitrarily far ahead.
+std::unique_ptr<ToyLLMRuntime> make_runtime(const DisaggOptions& opt, const std::vector<int>& lens) {
+    int blocks = 0;
+    for (int len : lens) {
+        blocks += (len + opt.decode_steps + opt.block_size - 1) / opt.block_size;
+    }
+    return std::unique_ptr<ToyLLMRuntime>(new ToyLLMRuntime(
+        opt.num_layers, hidden_size(opt), opt.num_heads, opt.head_size, blocks, opt.block_size, opt.use_int8_cache));
+}
+
+double ms_between(Clock::time_point a, Clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+int run_prefill(const DisaggOptions& opt) {
+    auto lens = prompt_lengths(opt);
+    auto runtime = make_runtime(opt, lens);
+    int fd = kv_transfer_connect(opt.socket_path, 10000);
+    auto start = Clock::now();
+    KVTransferStats stats;
+    {
+        KVTransferSender sender(*runtime, fd);
+        for (int r = 0; r < opt.requests; ++r) {
+            runtime->add_sequence(r);
+            sender.stream(r, static_cast<uint64_t>(r), lens[r]);
+            auto out = runtime->prefill({r}, prompt(opt, r, lens[r]), {lens[r]}, sender.layer_callback());
+            sender.finish(r, out.back());
+            for (int id : sender.sent()) {
+                runtime->finish_sequence(id);
+            }
+        }
+        sender.flush();
+        for (int id : sender.sent()) {
+            runtime->finish_sequence(id);
+        }
+        stats = sender.stats();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    ::shutdown(fd, SHUT_WR);
+    ::close(fd);
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(2) << "prefill: " << opt.requests << " prompts in " << seconds << " s, sent "
+         << stats.bytes / 1e6 << " MB in " << stats.layer_groups << " layer groups (" << stats.bytes / 1e6 / seconds
+         << " MB/s)\n";
+    std::cout << line.str() << std::flush;
+    return 0;
+}
+
+struct Running {
+    int seq_id = -1;
+    int steps = 0;
+    std::vector<float> row;
+};
+
+struct DecodeReport {
+    std::vector<double> step_gaps_ms;
+    std::vector<std::vector<float>> final_rows;
+    double seconds = 0.0;
+    int64_t decoded = 0;
+};
+
+// One decode step over up to max_batch running sequences; finished ones leave.
+void decode_step(ToyLLMRuntime& runtime, const DisaggOptions& opt, std::vector<Running>& running, DecodeReport& report) {
+    std::vector<int> ids;
+    Tensor2 x;
+    for (const auto& r : running) {
+        ids.push_back(r.seq_id);
+        x.push_back(r.row);
+    }
+    auto out = runtime.decode(ids, x);
+    report.decoded += static_cast<int64_t>(ids.size());
+    std::vector<Running> still;
+    for (size_t i = 0; i < running.size(); ++i) {
+        running[i].row = out[i];
+        running[i].steps += 1;
+        if (running[i].steps == opt.decode_steps) {
+            report.final_rows[running[i].seq_id] = out[i];
+            runtime.finish_sequence(running[i].seq_id);
+        } else {
+            still.push_back(std::move(running[i]));
+        }
+    }
+    running.swap(still);
+}
+
+DecodeReport run_decode(const DisaggOptions& opt, int listen_fd) {
+    auto lens = prompt_lengths(opt);
+    auto runtime = make_runtime(opt, lens);
+    int fd = kv_transfer_accept(listen_fd);
+    KVTransferReceiver receiver(*runtime, fd);
+    DecodeReport report;
+    report.final_rows.resize(opt.requests);
+    std::deque<ReceivedSequence> ready;
+    std::vector<Running> running;
+    std::vector<ReceivedSequence> arrived;
+    bool open = true;
+    int finished = 0;
+    auto start = Clock::now();
+    Clock::time_point last_step;
+    bool stepping = false;
+    while (finished < opt.requests) {
+        arrived.clear();
+        open = open && receiver.poll(arrived);
+        for (auto& a : arrived) {
+            ready.push_back(std::move(a));
+        }
+        while (!ready.empty() && static_cast<int>(running.size()) < opt.max_batch) {
+            running.push_back({ready.front().seq_id, 0, std::move(ready.front().last_hidden)});
+            ready.pop_front();
+        }
+        if (running.empty()) {
+            if (!open) {
+                throw std::runtime_error("prefill side closed before sending every request");
+            }
+            stepping = false;  // idle time is not a decode stall
+            receiver.wait(100);
+            continue;
+        }
+        size_t before = running.size();
+        decode_step(*runtime, opt, running, report);
+        finished += static_cast<int>(before - running.size());
+        auto now = Clock::now();
+        if (stepping) {
+            report.step_gaps_ms.push_back(ms_between(last_step, now));
+        }
+        last_step = now;
+        stepping = true;
+    }
+    report.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << std::fixed << std::setprecision(2) << "decode: received " << receiver.stats().sequences
+              << " sequences, " << receiver.stats().bytes / 1e6 << " MB\n";
+    ::close(fd);
+    return report;
+}
+
+// Prefill and decode in one loop: each iteration admits at most one prompt, then steps.
+DecodeReport run_colocated(const DisaggOptions& opt) {
+    auto lens = prompt_lengths(opt);
+    auto runtime = make_runtime(opt, lens);
+    DecodeReport report;
+    report.final_rows.resize(opt.requests);
+    std::vector<Running> running;
+    int next = 0;
+    int finished = 0;
+    auto start = Clock::now();
+    Clock::time_point last_step;
+    bool stepping = false;
+    while (finished < opt.requests) {
+        if (next < opt.requests && static_cast<int>(running.size()) < opt.max_batch) {
+            runtime->add_sequence(next);
+            auto out = runtime->prefill({next}, prompt(opt, next, lens[next]), {lens[next]});
+            running.push_back({next, 0, out.back()});
+            ++next;
+        }
+        size_t before = running.size();
+        decode_step(*runtime, opt, running, report);
+        finished += static_cast<int>(before - running.size());
+        auto now = Clock::now();
+        if (stepping) {
+            report.step_gaps_ms.push_back(ms_between(last_step, now));
+        }
+        last_step = now;
+        stepping = true;
+    }
+    report.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return report;
+}
+
+// Largest difference between the reported final rows and each request run alone.
+float verify(const DisaggOptions& opt, const DecodeReport& report) {
+    auto lens = prompt_lengths(opt);
+    float worst = 0.0f;
+    for (int r = 0; r < opt.requests; ++r) {
+        ToyLLMRuntime runtime(
+            opt.num_layers, hidden_size(opt), opt.num_heads, opt.head_size,
+            (lens[r] + opt.decode_steps + opt.block_size - 1) / opt.block_size, opt.block_size, opt.use_int8_cache);
+        runtime.add_sequence(0);
+        auto row = runtime.prefill({0}, prompt(opt, r, lens[r]), {lens[r]}).back();
+        for (int step = 0; step < opt.decode_steps; ++step) {
+            row = runtime.decode({0}, {row}).back();
+        }
+        for (size_t j = 0; j < row.size(); ++j) {
+            worst = std::max(worst, std::fabs(row[j] - report.final_rows[r][j]));
+        }
+    }
+    return worst;
+}
+
+// Returns false when verification found a mismatch.
+bool print_report(const DisaggOptions& opt, const std::string& mode, const DecodeReport& report) {
+    std::cout << std::fixed << std::setprecision(2) << mode << ": " << opt.requests << " requests x " << opt.decode_steps
+              << " tokens in " << report.seconds << " s (" << report.decoded / report.seconds << " tokens/s)"
+              << " | decode step gap ms p50/p99/max " << percentile(report.step_gaps_ms, 50) << "/"
+              << percentile(report.step_gaps_ms, 99) << "/" << percentile(report.step_gaps_ms, 100) << "\n";
+    if (!opt.verify) {
+        return true;
+    }
+    float diff = verify(opt, report);
+    std::cout << "max |diff| vs requests run alone: " << diff << "\n";
+    return diff == 0.0f;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    DisaggOptions opt;
+    try {
+        opt = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        if (opt.role == "colocated") {
+            return print_report(opt, "colocated", run_colocated(opt)) ? 0 : 1;
+        }
+        if (opt.role == "prefill") {
+            return run_prefill(opt);
+        }
+        // Listen before forking so the prefill process can connect at once.
+        int listen_fd = kv_transfer_listen(opt.socket_path);
+        pid_t child = -1;
+        if (opt.role == "both") {
+            child = fork();
+            if (child < 0) {
+                throw std::runtime_error("fork failed");
+            }
+            if (child == 0) {
+                ::close(listen_fd);
+                int status = 1;
+                try {
+                    status = run_prefill(opt);
+                } catch (const std::exception& e) {
+                    std::cerr << "prefill: " << e.what() << "\n";
+                }
+                _exit(status);
+            }
+        }
+        auto report = run_decode(opt, listen_fd);
+        ::close(listen_fd);
+        ::unlink(opt.socket_path.c_str());
+        int status = 0;
+        if (child > 0) {
+            waitpid(child, &status, 0);
+        }
+        bool ok = print_report(opt, "disaggregated", report);
+        return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include "kv_pool_allocator.hpp"
+#include "numa_topology.hpp"
+#include "pa_attention_kernels.hpp"
+#include "pa_sparse_attention.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// One mapping for the K/V cache of every layer. The unit of the arena is the
+// (layer, block) region:
+//
+//   [K: head][slot][dim] [V: head][slot][dim] [K scales: head][slot] [V scales: head][slot]
+//   [K min: head][dim] [K max: head][dim]
+//
+// with the scale arrays present only for the int8 cache, the fp32 key summaries only
+// with key_summaries (see pa_sparse_attention.hpp), and every sub-array padded to a
+// cache line. With KVKeyLayout::DimMajor each head's K is [dim][slot] instead; the
+// region size does not change. Regions are ordered [block][layer] (KVPoolLayout::BlockMajor) or
+// [layer][block] (LayerMajor). Block-major keeps a block's KV for all layers in one
+// contiguous range, so block copies, snapshot writes and restores are one memcpy.
+//
+// A region is also the on-disk unit of a snapshot (see kv_snapshot.hpp).
+struct KVLayerView {
+    char* base = nullptr;     // region of block 0 for this layer
+    size_t block_stride = 0;  // bytes between the regions of block b and b + 1
+    size_t v_offset = 0;      // byte offsets of the sub-arrays inside a region
+    size_t k_scale_offset = 0;
+    size_t v_scale_offset = 0;
+    size_t key_min_offset = 0;  // 0 without key summaries
+    size_t key_max_offset = 0;
+};
+
+class KVCacheArena {
+public:
+    static constexpr size_t kAlign = 64;
+
+    KVCacheArena(
+        int num_layers,
+        int num_blocks,
+        int num_heads,
+        int head_size,
+        int block_size,
+        bool use_int8_cache,
+        const KVPoolOptions& options = {},
+        const NumaPlacement* placement = nullptr,
+        bool key_summaries = false)
+        : m_num_layers(num_layers),
+          m_num_blocks(num_blocks),
+          m_num_heads(num_heads),
+          m_head_size(head_size),
+          m_block_size(block_size),
+          m_use_int8_cache(use_int8_cache),
+          m_layout(options.layout),
+          m_key_layout(resolve_key_layout(options.key_layout, use_int8_cache, head_size, block_size)) {
+        m_kv_bytes = kv_bytes(num_heads, head_size, block_size, use_int8_cache);
+        m_scale_bytes = scale_bytes(num_heads, block_size, use_int8_cache);
+        m_summary_bytes = summary_bytes(num_heads, head_size, key_summaries);
+        m_layer_block_bytes = 2 * m_kv_bytes + 2 * m_scale_bytes + 2 * m_summary_bytes;
+
+        // Prefault and lock only after the node ranges are bound, otherwise first touch decides.
+        KVPoolOptions map_options = options;
+        map_options.prefault = false;
+        map_options.lock = false;
+        m_mapping = KVPoolMapping(m_layer_block_bytes * num_layers * num_blocks, map_options);
+        if (placement && placement->bind_memory()) {
+            bind_blocks_to_nodes(*placement);
+        }
+        if (options.prefault) {
+            m_mapping.prefault(options.prefault_threads);
+        }
+        if (options.lock) {
+            m_mapping.lock();
+        }
+    }
+
+    KVCacheArena(const KVCacheArena&) = delete;
+    KVCacheArena& operator=(const KVCacheArena&) = delete;
+
+    // Size of one (layer, block) region for this configuration, before any arena exists.
+    static size_t layer_block_bytes_for(int num_heads, int head_size, int block_size, bool use_int8_cache, bool key_summaries) {
+        return 2 * kv_bytes(num_heads, head_size, block_size, use_int8_cache) +
+               2 * scale_bytes(num_heads, block_size, use_int8_cache) + 2 * summary_bytes(num_heads, head_size, key_summaries);
+    }
+
+    int num_layers() const {
+        return m_num_layers;
+    }
+
+    int num_blocks() const {
+        return m_num_blocks;
+    }
+
+    int num_heads() const {
+        return m_num_heads;
+    }
+
+    int head_size() const {
+        return m_head_size;
+    }
+
+    int block_size() const {
+        return m_block_size;
+    }
+
+    bool use_int8_cache() const {
+        return m_use_int8_cache;
+    }
+
+    bool key_summaries() const {
+        return m_summary_bytes > 0;
+    }
+
+    KVPoolLayout layout() const {
+        return m_layout;
+    }
+
+    // Never Auto: resolved for this CPU when the arena is built.
+    KVKeyLayout key_layout() const {
+        return m_key_layout;
+    }
+
+    size_t layer_block_bytes() const {
+        return m_layer_block_bytes;
+    }
+
+    // Bytes one block id pins across all layers.
+    size_t block_bytes() const {
+        return m_layer_block_bytes * m_num_layers;
+    }
+
+    char* layer_block(int layer, int block) {
+        return base() + region_offset(layer, block);
+    }
+
+    const char* layer_block(int layer, int block) const {
+        return base() + region_offset(layer, block);
+    }
+
+    KVLayerView layer_view(int layer) {
+        KVLayerView view;
+        view.base = layer_block(layer, 0);
+        view.block_stride = m_layout == KVPoolLayout::BlockMajor ? block_bytes() : m_layer_block_bytes;
+        view.v_offset = m_kv_bytes;
+        view.k_scale_offset = 2 * m_kv_bytes;
+        view.v_scale_offset = 2 * m_kv_bytes + m_scale_bytes;
+        if (m_summary_bytes > 0) {
+            view.key_min_offset = 2 * m_kv_bytes + 2 * m_scale_bytes;
+            view.key_max_offset = view.key_min_offset + m_summary_bytes;
+        }
+        return view;
+    }
+
+    void copy_block(int src_block, int dst_block) {
+        if (m_layout == KVPoolLayout::BlockMajor) {
+            std::memcpy(layer_block(0, dst_block), layer_block(0, src_block), block_bytes());
+            return;
+        }
+        for (int l = 0; l < m_num_layers; ++l) {
+            std::memcpy(layer_block(l, dst_block), layer_block(l, src_block), m_layer_block_bytes);
+        }
+    }
+
+    // Copies the K/V of one token slot (block * block_size + offset), every layer and
+    // head, scales included. The destination's key summary is widened by the source
+    // block's, so it stays a bound.
+    void copy_slot(int src_slot, int dst_slot) {
+        const size_t elem = m_use_int8_cache ? sizeof(int8_t) : sizeof(float);
+        const size_t row_bytes = m_head_size * elem;
+        const int src_offset = src_slot % m_block_size;
+        const int dst_offset = dst_slot % m_block_size;
+        for (int l = 0; l < m_num_layers; ++l) {
+            const char* src = layer_block(l, src_slot / m_block_size);
+            char* dst = layer_block(l, dst_slot / m_block_size);
+            for (int h = 0; h < m_num_heads; ++h) {
+                const size_t src_row = static_cast<size_t>(h) * m_block_size + src_offset;
+                const size_t dst_row = static_cast<size_t>(h) * m_block_size + dst_offset;
+                if (m_key_layout == KVKeyLayout::DimMajor) {
+                    const size_t head = static_cast<size_t>(h) * m_head_size * m_block_size;
+                    for (int d = 0; d < m_head_size; ++d) {
+                        const size_t at = head + static_cast<size_t>(d) * m_block_size;
+                        std::memcpy(dst + (at + dst_offset) * elem, src + (at + src_offset) * elem, elem);
+                    }
+                } else {
+                    std::memcpy(dst + dst_row * row_bytes, src + src_row * row_bytes, row_bytes);
+                }
+                std::memcpy(dst + m_kv_bytes + dst_row * row_bytes, src + m_kv_bytes + src_row * row_bytes, row_bytes);
+                if (m_use_int8_cache) {
+                    for (size_t scales = 2 * m_kv_bytes; scales < 2 * m_kv_bytes + 2 * m_scale_bytes; scales += m_scale_bytes) {
+                        std::memcpy(dst + scales + dst_row * sizeof(float), src + scales + src_row * sizeof(float), sizeof(float));
+                    }
+                }
+                if (m_summary_bytes > 0) {
+                    const size_t summary = 2 * m_kv_bytes + 2 * m_scale_bytes + h * m_head_size * sizeof(float);
+                    key_summary_merge(
+                        reinterpret_cast<float*>(dst + summary),
+                        reinterpret_cast<float*>(dst + summary + m_summary_bytes),
+                        reinterpret_cast<const float*>(src + summary),
+                        reinterpret_cast<const float*>(src + summary + m_summary_bytes),
+                        m_head_size);
+                }
+            }
+        }
+    }
+
+    // Image of one block across all layers, layer by layer (block_bytes() long).
+    void export_block(int block, char* dst) const {
+        if (m_layout == KVPoolLayout::BlockMajor) {
+            std::memcpy(dst, layer_block(0, block), block_bytes());
+            return;
+        }
+        for (int l = 0; l < m_num_layers; ++l) {
+            std::memcpy(dst + l * m_layer_block_bytes, layer_block(l, block), m_layer_block_bytes);
+        }
+    }
+
+    void import_block(int block, const char* src) {
+        if (m_layout == KVPoolLayout::BlockMajor) {
+            std::memcpy(layer_block(0, block), src, block_bytes());
+            return;
+        }
+        for (int l = 0; l < m_num_layers; ++l) {
+            std::memcpy(layer_block(l, block), src + l * m_layer_block_bytes, m_layer_block_bytes);
+        }
+    }
+
+    // The block's export image in place, or nullptr when the layout scatters it.
+    const char* contiguous_block(int block) const {
+        return m_layout == KVPoolLayout::BlockMajor ? layer_block(0, block) : nullptr;
+    }
+
+    // Returns the pages of blocks [first, first + count) to the kernel (all layers).
+    // Only whole pages are released, so with blocks smaller than a page the range
+    // should be the free tail of a node's block range rather than scattered blocks.
+    size_t release_blocks(int first, int count) {
+        if (count <= 0) {
+            return 0;
+        }
+        if (m_layout == KVPoolLayout::BlockMajor) {
+            return m_mapping.release(region_offset(0, first), count * block_bytes());
+        }
+        size_t released = 0;
+        for (int l = 0; l < m_num_layers; ++l) {
+            released += m_mapping.release(region_offset(l, first), count * m_layer_block_bytes);
+        }
+        return released;
+    }
+
+    KVPoolStats stats() const {
+        KVPoolStats s = m_mapping.stats();
+        s.numa_bind_failures = m_numa_bind_failures;
+        return s;
+    }
+
+private:
+    int m_num_layers;
+    int m_num_blocks;
+    int m_num_heads;
+    int m_head_size;
+    int m_block_size;
+    bool m_use_int8_cache;
+    KVPoolLayout m_layout;
+    KVKeyLayout m_key_layout;
+    size_t m_kv_bytes = 0;
+    size_t m_scale_bytes = 0;
+    size_t m_summary_bytes = 0;
+    size_t m_layer_block_bytes = 0;
+    KVPoolMapping m_mapping;
+    int m_numa_bind_failures = 0;
+
+    static size_t round_up(size_t x, size_t align) {
+        return (x + align - 1) / align * align;
+    }
+
+    static size_t kv_bytes(int num_heads, int head_size, int block_size, bool use_int8_cache) {
+        size_t elem = use_int8_cache ? sizeof(int8_t) : sizeof(float);
+        return round_up(static_cast<size_t>(num_heads) * block_size * head_size * elem, kAlign);
+    }
+
+    static size_t scale_bytes(int num_heads, int block_size, bool use_int8_cache) {
+        return use_int8_cache ? round_up(static_cast<size_t>(num_heads) * block_size * sizeof(float), kAlign) : 0;
+    }
+
+    static size_t summary_bytes(int num_heads, int head_size, bool key_summaries) {
+        return key_summaries ? round_up(static_cast<size_t>(num_heads) * head_size * sizeof(float), kAlign) : 0;
+    }
+
+    char* base() const {
+        return static_cast<char*>(m_mapping.data());
+    }
+
+    size_t region_offset(int layer, int block) const {
+        size_t index = m_layout == KVPoolLayout::BlockMajor
+                           ? static_cast<size_t>(block) * m_num_layers + layer
+                           : static_cast<size_t>(layer) * m_num_blocks + block;
+        return index * m_layer_block_bytes;
+    }
+
+    // Binds each node's block range (same split as KVBlockManager) to that node: one
+    // range per node block-major, one per node and layer layer-major. Ranges the kernel
+    // refuses are counted in stats() rather than failing the arena.
+    void bind_blocks_to_nodes(const NumaPlacement& placement) {
+        int num_nodes = placement.num_nodes();
+        for (int n = 0; n < num_nodes; ++n) {
+            int first = numa_block_begin(n, m_num_blocks, num_nodes);
+            int count = numa_block_begin(n + 1, m_num_blocks, num_nodes) - first;
+            int node_id = placement.topology().node(n).id;
+            if (count == 0) {
+                continue;
+            }
+            if (m_layout == KVPoolLayout::BlockMajor) {
+                m_numa_bind_failures += bind_memory_to_node(layer_block(0, first), count * block_bytes(), node_id) ? 0 : 1;
+                continue;
+            }
+            for (int l = 0; l < m_num_layers; ++l) {
+                m_numa_bind_failures += bind_memory_to_node(layer_block(l, first), count * m_layer_block_bytes, node_id) ? 0 : 1;
+            }
+        }
+    }
+};
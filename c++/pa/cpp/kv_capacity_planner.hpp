@@ -0,0 +1,216 @@
+#pragma once
+
+#include "kv_cache_arena.hpp"
+#include "kv_pool_allocator.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// Sizes the KV pool from a byte budget instead of a hand-tuned block count. The
+// planner uses the same region formula as KVCacheArena, so a plan's pool is exactly
+// what the runtime maps, page rounding included.
+struct KVModelConfig {
+    int num_layers = 0;
+    int num_kv_heads = 0;
+    int head_size = 0;
+    int block_size = 16;
+    bool use_int8_cache = false;
+    bool key_summaries = false;  // sparse decode adds per-block key min/max
+};
+
+struct KVCapacityPlan {
+    size_t budget_bytes = 0;
+    size_t block_bytes = 0;   // one block id across all layers
+    int num_blocks = 0;
+    size_t pool_bytes = 0;    // num_blocks * block_bytes
+    size_t mapped_bytes = 0;  // pool_bytes rounded up to the backing page size, <= budget
+    // The caller's pool options with prefault set, so the whole pool is committed while
+    // the runtime is built rather than on the first prefill that reaches it.
+    KVPoolOptions pool_options;
+};
+
+// How many sequences of a length distribution fit in a pool at once. A sequence holds
+// ceil(length / block_size) blocks at its full length, which is what the serving engine
+// reserves on admission.
+struct KVConcurrencyEstimate {
+    double mean_blocks = 0.0;    // per sequence
+    double stddev_blocks = 0.0;
+    int longest_blocks = 0;
+    int worst_case = 0;     // every sequence at the longest length
+    int expected = 0;       // pool / mean: fits on average, overflows about half the time
+    int at_confidence = 0;  // the summed demand fits with the requested probability
+};
+
+// MemAvailable from /proc/meminfo, 0 if it cannot be read.
+inline size_t host_available_bytes() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+        if (line.compare(0, 13, "MemAvailable:") == 0) {
+            std::istringstream is(line.substr(13));
+            size_t kb = 0;
+            is >> kb;
+            return kb * 1024;
+        }
+    }
+    return 0;
+}
+
+// Bytes in "<n>", "<n>K", "<n>M", "<n>G" (binary units), or "<p>%" of MemAvailable.
+inline size_t parse_byte_budget(const std::string& text) {
+    size_t used = 0;
+    double value = 0.0;
+    try {
+        value = std::stod(text, &used);
+    } catch (const std::exception&) {
+        throw std::runtime_error("byte budget must look like 512M, 8G or 40%: " + text);
+    }
+    std::string unit = text.substr(used);
+    double scale = 1.0;
+    if (unit == "%") {
+        size_t available = host_available_bytes();
+        if (available == 0) {
+            throw std::runtime_error("cannot read MemAvailable for a percentage budget");
+        }
+        scale = static_cast<double>(available) / 100.0;
+    } else if (unit == "K" || unit == "k") {
+        scale = 1024.0;
+    } else if (unit == "M" || unit == "m") {
+        scale = 1024.0 * 1024.0;
+    } else if (unit == "G" || unit == "g") {
+        scale = 1024.0 * 1024.0 * 1024.0;
+    } else if (!unit.empty()) {
+        throw std::runtime_error("byte budget must look like 512M, 8G or 40%: " + text);
+    }
+    if (value <= 0.0) {
+        throw std::runtime_error("byte budget must be positive: " + text);
+    }
+    return static_cast<size_t>(value * scale);
+}
+
+class KVCapacityPlanner {
+public:
+    explicit KVCapacityPlanner(const KVModelConfig& model)
+        : m_model(model) {
+        if (model.num_layers < 1 || model.num_kv_heads < 1 || model.head_size < 1 || model.block_size < 1) {
+            throw std::runtime_error("KV model config needs positive layers, kv heads, head size and block size");
+        }
+        m_block_bytes = KVCacheArena::layer_block_bytes_for(
+                            model.num_kv_heads, model.head_size, model.block_size, model.use_int8_cache,
+                            model.key_summaries) *
+                        static_cast<size_t>(model.num_layers);
+    }
+
+    const KVModelConfig& model() const {
+        return m_model;
+    }
+
+    size_t block_bytes() const {
+        return m_block_bytes;
+    }
+
+    // Largest pool whose mapping fits in `budget_bytes`. The mapping is rounded up to
+    // the page size of `pool_options.huge_pages` (2 MiB for THP and hugetlbfs), so
+    // the budget is rounded down to it first.
+    KVCapacityPlan plan(size_t budget_bytes, const KVPoolOptions& pool_options = {}) const {
+        const size_t page = pool_options.huge_pages == HugePageMode::None
+                                ? static_cast<size_t>(sysconf(_SC_PAGESIZE))
+                                : KVPoolMapping::kHugePageSize;
+        KVCapacityPlan p;
+        p.budget_bytes = budget_bytes;
+        p.block_bytes = m_block_bytes;
+        p.num_blocks = static_cast<int>(std::min<size_t>(budget_bytes / page * page / m_block_bytes, INT32_MAX));
+        if (p.num_blocks < 1) {
+            throw std::runtime_error(
+                "KV budget of " + std::to_string(budget_bytes) + " bytes holds no block of " +
+                std::to_string(m_block_bytes) + " bytes");
+        }
+        p.pool_bytes = static_cast<size_t>(p.num_blocks) * m_block_bytes;
+        p.mapped_bytes = (p.pool_bytes + page - 1) / page * page;
+        p.pool_options = pool_options;
+        p.pool_options.prefault = true;
+        return p;
+    }
+
+    // `lengths` are samples of whole sequence lengths (prompt plus generated tokens).
+    // The confidence bound treats sequences as independent draws and uses the normal
+    // approximation of their summed block demand, never going below the worst case.
+    KVConcurrencyEstimate max_concurrent_sequences(
+        int num_blocks, const std::vector<int>& lengths, double confidence = 0.99) const {
+        if (lengths.empty()) {
+            throw std::runtime_error("length distribution is empty");
+        }
+        if (confidence <= 0.0 || confidence >= 1.0) {
+            throw std::runtime_error("confidence must be in (0, 1)");
+        }
+        KVConcurrencyEstimate e;
+        double sum = 0.0;
+        double sum_sq = 0.0;
+        for (int length : lengths) {
+            int blocks = (std::max(length, 1) + m_model.block_size - 1) / m_model.block_size;
+            e.longest_blocks = std::max(e.longest_blocks, blocks);
+            sum += blocks;
+            sum_sq += static_cast<double>(blocks) * blocks;
+        }
+        const double n = static_cast<double>(lengths.size());
+        e.mean_blocks = sum / n;
+        e.stddev_blocks = std::sqrt(std::max(0.0, sum_sq / n - e.mean_blocks * e.mean_blocks));
+        e.worst_case = num_blocks / e.longest_blocks;
+        e.expected = static_cast<int>(num_blocks / e.mean_blocks);
+
+        // k * mean + z * sqrt(k) * stddev <= num_blocks, a quadratic in sqrt(k).
+        const double z = normal_quantile(confidence);
+        const double zs = z * e.stddev_blocks;
+        const double root = (-zs + std::sqrt(zs * zs + 4.0 * e.mean_blocks * num_blocks)) / (2.0 * e.mean_blocks);
+        e.at_confidence = std::min(e.expected, std::max(e.worst_case, static_cast<int>(root * root)));
+        return e;
+    }
+
+    // Smallest pool that holds `sequences` draws of `lengths` with the given confidence,
+    // e.g. to check a budget against a target batch size.
+    int blocks_for_sequences(int sequences, const std::vector<int>& lengths, double confidence = 0.99) const {
+        int lo = 0;
+        int hi = 1;
+        while (max_concurrent_sequences(hi, lengths, confidence).at_confidence < sequences) {
+            lo = hi;
+            hi *= 2;
+        }
+        while (hi - lo > 1) {
+            int mid = lo + (hi - lo) / 2;
+            if (max_concurrent_sequences(mid, lengths, confidence).at_confidence >= sequences) {
+                hi = mid;
+            } else {
+                lo = mid;
+            }
+        }
+        return hi;
+    }
+
+private:
+    KVModelConfig m_model;
+    size_t m_block_bytes = 0;
+
+    // Inverse standard normal CDF by bisection; only called once per estimate.
+    static double normal_quantile(double p) {
+        double lo = -10.0;
+        double hi = 10.0;
+        for (int i = 0; i < 100; ++i) {
+            double mid = 0.5 * (lo + hi);
+            if (0.5 * std::erfc(-mid / std::sqrt(2.0)) < p) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return 0.5 * (lo + hi);
+    }
+};
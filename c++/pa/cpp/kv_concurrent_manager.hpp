@@ -0,0 +1,358 @@
+#pragma once
+
+#include "kv_free_stack.hpp"
+#include "standalone_pa.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// KVBlockManager for a scheduler whose request threads admit and finish sequences
+// while the engine thread steps, without a lock around either side.
+//
+// Blocks: free ids sit in a global TaggedFreeStack (kv_free_stack.hpp, as in
+// kv_shared_pool.hpp), fronted by a small cache per thread. Allocating and
+// releasing touch only the calling thread's cache until it runs empty or overflows,
+// then move half a cache of ids with one CAS per pop or one per spill. A cache's mutex
+// is only ever contended when the global stack is dry and another thread drains it.
+// Ref counts are atomic, so any thread may drop a reference.
+//
+// Sequences: the SequenceTable it shares with KVBlockManager belongs to the engine
+// thread, as do the block tables in it. Admit,
+// fork and finish calls from other threads are pushed onto a lock-free stack and
+// applied by apply_staged() at the next step boundary, so no table changes under a
+// running step and a finished sequence's blocks are not handed out while that step
+// may still read them. An admit can reserve blocks for its first tokens from the
+// caller's cache, so the engine's prefill allocates nothing.
+//
+// Streaming, heavy hitters, compaction, NUMA placement and shared pools stay with
+// KVBlockManager.
+struct ConcurrentKVOptions {
+    int cache_blocks = 32;  // per-thread cache size; refills and spills move half of it
+};
+
+// What one apply_staged() changed, each in staging order.
+struct StagedChanges {
+    std::vector<int> admitted;
+    std::vector<int> forked;  // child ids
+    std::vector<int> finished;
+    std::vector<int> rejected;  // duplicate or unknown ids; their reserved blocks were returned
+};
+
+class ConcurrentKVBlockManager : public SequenceTable {
+public:
+    ConcurrentKVBlockManager(int num_blocks, int block_size, const ConcurrentKVOptions& options = {})
+        : SequenceTable(block_size),
+          m_num_blocks(num_blocks),
+          m_cache_blocks(std::max(2, options.cache_blocks)),
+          m_free_next(new std::atomic<int32_t>[num_blocks]),
+          m_ref_counts(new std::atomic<int32_t>[num_blocks]),
+          m_num_free(num_blocks),
+          m_instance(s_next_instance.fetch_add(1)) {
+        if (num_blocks < 1 || block_size < 1) {
+            throw std::runtime_error("concurrent KV manager needs blocks and a positive block size");
+        }
+        for (int b = 0; b < num_blocks; ++b) {
+            m_ref_counts[b].store(0, std::memory_order_relaxed);
+        }
+        m_free_stack.reset(num_blocks);
+    }
+
+    ~ConcurrentKVBlockManager() {
+        StagedOp* op = m_staged.exchange(nullptr);
+        while (op) {
+            StagedOp* next = op->next;
+            delete op;
+            op = next;
+        }
+    }
+
+    ConcurrentKVBlockManager(const ConcurrentKVBlockManager&) = delete;
+    ConcurrentKVBlockManager& operator=(const ConcurrentKVBlockManager&) = delete;
+
+    // Any thread. Takes the blocks for `reserve_tokens` now and stages the sequence for
+    // the next apply_staged(). Returns false, staging nothing, if the pool cannot
+    // supply them.
+    bool admit_sequence(int seq_id, int reserve_tokens = 0) {
+        std::unique_ptr<StagedOp> op(new StagedOp{StagedKind::Admit, seq_id, -1, {}, nullptr});
+        BlockCache& cache = local_cache();
+        int count = div_up(std::max(0, reserve_tokens), m_block_size);
+        op->blocks.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            int block = allocate_block(cache);
+            if (block < 0) {
+                for (int taken : op->blocks) {
+                    release_block(cache, taken);
+                }
+                return false;
+            }
+            op->blocks.push_back(block);
+        }
+        stage(op.release());
+        return true;
+    }
+
+    // Any thread. The child shares the parent's committed blocks as of the boundary.
+    void fork_sequence(int parent_seq_id, int child_seq_id) {
+        stage(new StagedOp{StagedKind::Fork, child_seq_id, parent_seq_id, {}, nullptr});
+    }
+
+    // Any thread. The blocks are released at the next boundary.
+    void finish_sequence(int seq_id) {
+        stage(new StagedOp{StagedKind::Finish, seq_id, -1, {}, nullptr});
+    }
+
+    // Engine thread, between steps: applies everything staged so far in call order.
+    StagedChanges apply_staged() {
+        StagedOp* op = m_staged.exchange(nullptr, std::memory_order_acquire);
+        StagedOp* ordered = nullptr;
+        while (op) {
+            StagedOp* next = op->next;
+            op->next = ordered;
+            ordered = op;
+            op = next;
+        }
+        StagedChanges changes;
+        BlockCache& cache = local_cache();
+        while (ordered) {
+            std::unique_ptr<StagedOp> current(ordered);
+            ordered = current->next;
+            apply(*current, cache, changes);
+        }
+        return changes;
+    }
+
+    // The rest is the engine thread's, like the matching KVBlockManager calls; the slot
+    // table queries and build_batch_metadata come from SequenceTable.
+    std::vector<BlockCopyPlan> reserve_for_prefill(SequenceHandle h, int q_len) {
+        auto& seq = state(h);
+        BlockCache& cache = local_cache();
+        std::vector<BlockCopyPlan> plans;
+        int block = partial_tail_block(seq, q_len);
+        if (block >= 0 && block_ref_count(block) > 1) {
+            int new_block = checked_allocate(cache);
+            m_block_tables.set(seq.logical_blocks, (seq.past_len - 1) / m_block_size, new_block);
+            release_block(cache, block);
+            plans.push_back({block, new_block});
+        }
+        for (int i = blocks_to_append(seq, q_len); i > 0; --i) {
+            m_block_tables.push_back(seq.logical_blocks, checked_allocate(cache));
+        }
+        return plans;
+    }
+
+    std::vector<BlockCopyPlan> reserve_for_decode(SequenceHandle h) {
+        return reserve_for_prefill(h, 1);
+    }
+
+    void commit_tokens(SequenceHandle h, int num_tokens) {
+        state(h).past_len += num_tokens;
+    }
+
+    int blocks_needed(SequenceHandle h, int q_len) const {
+        const auto& seq = state(h);
+        int tail_block = partial_tail_block(seq, q_len);
+        return blocks_to_append(seq, q_len) + (tail_block >= 0 && block_ref_count(tail_block) > 1 ? 1 : 0);
+    }
+
+    // Any thread. Blocks held by no sequence or staged admit, cached ones included.
+    int num_free_blocks() const {
+        return m_num_free.load(std::memory_order_relaxed);
+    }
+
+    int num_used_blocks() const {
+        return m_num_blocks - num_free_blocks();
+    }
+
+    int block_ref_count(int block) const {
+        return m_ref_counts[block].load(std::memory_order_acquire);
+    }
+
+    int num_blocks() const {
+        return m_num_blocks;
+    }
+
+private:
+    enum class StagedKind { Admit, Fork, Finish };
+
+    struct StagedOp {
+        StagedKind kind;
+        int seq_id;
+        int parent_seq_id;
+        std::vector<int> blocks;  // reserved by an admit
+        StagedOp* next;
+    };
+
+    struct alignas(64) BlockCache {
+        std::mutex mutex;
+        std::vector<int> blocks;
+    };
+
+    static inline std::atomic<uint64_t> s_next_instance{1};
+
+    int m_num_blocks;
+    int m_cache_blocks;
+    alignas(64) std::atomic<uint64_t> m_free_head{0};  // TaggedFreeStack head
+    std::unique_ptr<std::atomic<int32_t>[]> m_free_next;
+    TaggedFreeStack m_free_stack{&m_free_head, m_free_next.get()};
+    std::unique_ptr<std::atomic<int32_t>[]> m_ref_counts;
+    alignas(64) std::atomic<int> m_num_free;
+    alignas(64) std::atomic<StagedOp*> m_staged{nullptr};
+    const uint64_t m_instance;  // keys the thread-local cache lookup; never reused
+    std::mutex m_caches_mutex;  // registration, and draining on a dry pool
+    std::vector<std::unique_ptr<BlockCache>> m_caches;
+
+    void stage(StagedOp* op) {
+        op->next = m_staged.load(std::memory_order_relaxed);
+        while (!m_staged.compare_exchange_weak(op->next, op, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Threads register a cache with each manager they use on first use. A thread that
+    // exits leaves its cache behind; a dry pool drains it like any other.
+    BlockCache& local_cache() {
+        thread_local std::vector<std::pair<uint64_t, BlockCache*>> t_caches;
+        for (const auto& entry : t_caches) {
+            if (entry.first == m_instance) {
+                return *entry.second;
+            }
+        }
+        std::lock_guard<std::mutex> lock(m_caches_mutex);
+        m_caches.push_back(std::unique_ptr<BlockCache>(new BlockCache));
+        t_caches.push_back({m_instance, m_caches.back().get()});
+        return *m_caches.back();
+    }
+
+    // A fresh block with one reference, -1 if the global stack and every cache are empty.
+    int allocate_block(BlockCache& cache) {
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            for (int i = cache.blocks.empty() ? 0 : m_cache_blocks; i < m_cache_blocks / 2; ++i) {
+                int block = m_free_stack.pop();
+                if (block < 0) {
+                    break;
+                }
+                cache.blocks.push_back(block);
+            }
+            if (!cache.blocks.empty()) {
+                return take_from(cache);
+            }
+        }
+        // Without holding our own cache, so two drainers never wait on each other.
+        std::vector<int> drained;
+        {
+            std::lock_guard<std::mutex> registry(m_caches_mutex);
+            for (auto& other : m_caches) {
+                std::lock_guard<std::mutex> lock(other->mutex);
+                drained.insert(drained.end(), other->blocks.begin(), other->blocks.end());
+                other->blocks.clear();
+            }
+        }
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        cache.blocks.insert(cache.blocks.end(), drained.begin(), drained.end());
+        return cache.blocks.empty() ? -1 : take_from(cache);
+    }
+
+    int take_from(BlockCache& cache) {
+        int block = cache.blocks.back();
+        cache.blocks.pop_back();
+        m_ref_counts[block].store(1, std::memory_order_relaxed);
+        m_num_free.fetch_sub(1, std::memory_order_relaxed);
+        return block;
+    }
+
+    int checked_allocate(BlockCache& cache) {
+        int block = allocate_block(cache);
+        if (block < 0) {
+            throw std::runtime_error("out of KV blocks");
+        }
+        return block;
+    }
+
+    void add_ref(int block) {
+        m_ref_counts[block].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release_block(BlockCache& cache, int block) {
+        int32_t previous = m_ref_counts[block].fetch_sub(1, std::memory_order_acq_rel);
+        if (previous <= 0) {
+            m_ref_counts[block].fetch_add(1, std::memory_order_relaxed);
+            throw std::runtime_error("block already free");
+        }
+        if (previous > 1) {
+            return;
+        }
+        m_num_free.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        cache.blocks.push_back(block);
+        int size = static_cast<int>(cache.blocks.size());
+        if (size > m_cache_blocks) {
+            int keep = m_cache_blocks / 2;
+            m_free_stack.push(cache.blocks.data() + keep, size - keep);
+            cache.blocks.resize(keep);
+        }
+    }
+
+    void release_table(BlockCache& cache, BlockTableRef& table) {
+        const int* blocks = m_block_tables.data(table);
+        for (int i = 0; i < table.size; ++i) {
+            release_block(cache, blocks[i]);
+        }
+        table.size = 0;
+    }
+
+    void apply(StagedOp& op, BlockCache& cache, StagedChanges& changes) {
+        switch (op.kind) {
+        case StagedKind::Admit: {
+            if (has_sequence(op.seq_id)) {
+                for (int block : op.blocks) {
+                    release_block(cache, block);
+                }
+                changes.rejected.push_back(op.seq_id);
+                return;
+            }
+            auto& seq = m_slots[allocate_slot(op.seq_id).slot];
+            for (int block : op.blocks) {
+                m_block_tables.push_back(seq.logical_blocks, block);
+            }
+            changes.admitted.push_back(op.seq_id);
+            return;
+        }
+        case StagedKind::Fork: {
+            if (has_sequence(op.seq_id) || !has_sequence(op.parent_seq_id)) {
+                changes.rejected.push_back(op.seq_id);
+                return;
+            }
+            int parent_slot = m_seq_slots.at(op.parent_seq_id);
+            auto& child = m_slots[allocate_slot(op.seq_id).slot];
+            // allocate_slot may grow m_slots, so take the parent only now. Blocks the
+            // parent reserved past its length stay its own.
+            const auto& parent = m_slots[parent_slot];
+            child.past_len = parent.past_len;
+            for (int i = 0; i < div_up(parent.past_len, m_block_size); ++i) {
+                int block = m_block_tables.at(parent.logical_blocks, i);
+                m_block_tables.push_back(child.logical_blocks, block);
+                add_ref(block);
+            }
+            changes.forked.push_back(op.seq_id);
+            return;
+        }
+        case StagedKind::Finish: {
+            auto it = m_seq_slots.find(op.seq_id);
+            if (it == m_seq_slots.end()) {
+                changes.rejected.push_back(op.seq_id);
+                return;
+            }
+            release_table(cache, m_slots[it->second].logical_blocks);
+            release_slot(it->second);
+            changes.finished.push_back(op.seq_id);
+            return;
+        }
+        }
+    }
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free stack of free block ids (Treiber), used by KVSharedPool and
+// ConcurrentKVBlockManager. The links are one atomic per block, next[b] = the block
+// below b or -1, and the head packs (tag << 32) | (block + 1), 0 = empty. The tag
+// changes on every successful CAS, so a head that was popped and pushed back between a
+// reader's load and its CAS (ABA) fails the CAS instead of installing a stale link.
+//
+// The stack only points at the head and links; whoever owns them decides where they
+// live, e.g. in a shared-memory segment, which needs them lock-free and address-free.
+class TaggedFreeStack {
+public:
+    TaggedFreeStack() = default;
+    TaggedFreeStack(std::atomic<uint64_t>* head, std::atomic<int32_t>* next) : m_head(head), m_next(next) {}
+
+    // Links blocks [0, num_blocks) so they pop in ascending id order. Not thread safe.
+    void reset(int num_blocks) {
+        for (int b = 0; b < num_blocks; ++b) {
+            m_next[b].store(b + 1 < num_blocks ? b + 1 : -1, std::memory_order_relaxed);
+        }
+        m_head->store(num_blocks > 0 ? 1 : 0, std::memory_order_release);
+    }
+
+    // The top block, -1 if empty.
+    int pop() {
+        uint64_t head = m_head->load(std::memory_order_acquire);
+        while (true) {
+            uint32_t top = static_cast<uint32_t>(head);
+            if (top == 0) {
+                return -1;
+            }
+            int block = static_cast<int>(top - 1);
+            // May read a link another thread is rewriting; the tag then fails the CAS.
+            int32_t next = m_next[block].load(std::memory_order_relaxed);
+            if (m_head->compare_exchange_weak(
+                    head, next_tag(head) | static_cast<uint32_t>(next + 1), std::memory_order_acquire,
+                    std::memory_order_acquire)) {
+                return block;
+            }
+        }
+    }
+
+    // Pushes blocks[0, count) as one chain, blocks[0] on top.
+    void push(const int* blocks, int count) {
+        for (int i = 0; i + 1 < count; ++i) {
+            m_next[blocks[i]].store(blocks[i + 1], std::memory_order_relaxed);
+        }
+        uint64_t head = m_head->load(std::memory_order_relaxed);
+        do {
+            m_next[blocks[count - 1]].store(static_cast<int32_t>(static_cast<uint32_t>(head)) - 1, std::memory_order_relaxed);
+        } while (!m_head->compare_exchange_weak(
+            head, next_tag(head) | static_cast<uint32_t>(blocks[0] + 1), std::memory_order_release,
+            std::memory_order_relaxed));
+    }
+
+    void push(int block) {
+        push(&block, 1);
+    }
+
+private:
+    std::atomic<uint64_t>* m_head = nullptr;
+    std::atomic<int32_t>* m_next = nullptr;
+
+    static uint64_t next_tag(uint64_t head) {
+        return ((head >> 32) + 1) << 32;
+    }
+};
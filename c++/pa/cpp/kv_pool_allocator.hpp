@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Backing store for the large KV pools. Same idea as c++/hugepage/test_hugepage.c:
+// one anonymous mapping per pool, optionally backed by 2 MiB pages so random block
+// access does not pay a TLB miss per 4 KiB page.
+enum class HugePageMode {
+    None,     // plain 4 KiB pages
+    THP,      // 2 MiB aligned mapping + madvise(MADV_HUGEPAGE)
+    HugeTLB,  // MAP_HUGETLB from the hugetlbfs pool, falls back to THP if it is empty
+};
+
+// How the per-(layer, block) regions of the KV arena are ordered, see kv_cache_arena.hpp.
+enum class KVPoolLayout {
+    BlockMajor,  // [block][layer]: one block id is one contiguous range across all layers
+    LayerMajor,  // [layer][block]: each layer's pool is contiguous
+};
+
+// Order of the K elements of one head inside a block region. V is always slot-major.
+enum class KVKeyLayout {
+    Auto,       // whichever the attention kernels of this CPU prefer (resolve_key_layout)
+    SlotMajor,  // [head][slot][dim]: one key row per slot, scored with a dot product each
+    DimMajor,   // [head][dim][slot]: q[d] scales a row of block_size keys, no reduction
+};
+
+struct KVPoolOptions {
+    HugePageMode huge_pages = HugePageMode::None;
+    KVPoolLayout layout = KVPoolLayout::BlockMajor;
+    KVKeyLayout key_layout = KVKeyLayout::Auto;
+    bool prefault = false;
+    int prefault_threads = 0;  // 0 = std::thread::hardware_concurrency()
+    // mlock the pool once mapped (and prefaulted) so it is never swapped out; fails if
+    // RLIMIT_MEMLOCK is below the pool size.
+    bool lock = false;
+    // Maps [shared_offset, shared_offset + bytes) of this file MAP_SHARED instead of
+    // anonymous memory, e.g. a KVSharedPool segment (see kv_shared_pool.hpp).
+    int shared_fd = -1;
+    size_t shared_offset = 0;
+};
+
+struct KVPoolStats {
+    size_t mapped_bytes = 0;
+    size_t resident_bytes = 0;
+    size_t huge_page_bytes = 0;
+    size_t locked_bytes = 0;
+    HugePageMode backing = HugePageMode::None;
+    int numa_bind_failures = 0;  // block ranges mbind() refused; they stay first-touch
+};
+
+inline const char* huge_page_mode_name(HugePageMode mode) {
+    switch (mode) {
+    case HugePageMode::THP:
+        return "thp";
+    case HugePageMode::HugeTLB:
+        return "hugetlb";
+    default:
+        return "none";
+    }
+}
+
+inline HugePageMode parse_huge_page_mode(const std::string& name) {
+    if (name == "none") {
+        return HugePageMode::None;
+    }
+    if (name == "thp") {
+        return HugePageMode::THP;
+    }
+    if (name == "hugetlb") {
+        return HugePageMode::HugeTLB;
+    }
+    throw std::runtime_error("huge page mode must be none, thp or hugetlb: " + name);
+}
+
+inline const char* kv_pool_layout_name(KVPoolLayout layout) {
+    return layout == KVPoolLayout::LayerMajor ? "layer" : "block";
+}
+
+inline KVPoolLayout parse_kv_pool_layout(const std::string& name) {
+    if (name == "block") {
+        return KVPoolLayout::BlockMajor;
+    }
+    if (name == "layer") {
+        return KVPoolLayout::LayerMajor;
+    }
+    throw std::runtime_error("KV layout must be block or layer: " + name);
+}
+
+inline const char* kv_key_layout_name(KVKeyLayout layout) {
+    switch (layout) {
+    case KVKeyLayout::SlotMajor:
+        return "slot";
+    case KVKeyLayout::DimMajor:
+        return "dim";
+    default:
+        return "auto";
+    }
+}
+
+inline KVKeyLayout parse_kv_key_layout(const std::string& name) {
+    if (name == "auto") {
+        return KVKeyLayout::Auto;
+    }
+    if (name == "slot") {
+        return KVKeyLayout::SlotMajor;
+    }
+    if (name == "dim") {
+        return KVKeyLayout::DimMajor;
+    }
+    throw std::runtime_error("K layout must be auto, slot or dim: " + name);
+}
+
+class KVPoolMapping {
+public:
+    static constexpr size_t kHugePageSize = 2u << 20;
+
+    KVPoolMapping() = default;
+
+    KVPoolMapping(size_t bytes, const KVPoolOptions& options) {
+        if (bytes == 0) {
+            return;
+        }
+        if (options.shared_fd >= 0) {
+            map_shared(bytes, options);
+        } else if (options.huge_pages == HugePageMode::HugeTLB) {
+            m_size = round_up(bytes, kHugePageSize);
+            void* p = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                m_base = p;
+                m_backing = HugePageMode::HugeTLB;
+            }
+        }
+        if (!m_base) {
+            map_anonymous(bytes, options.huge_pages != HugePageMode::None);
+        }
+        if (options.prefault) {
+            prefault(options.prefault_threads);
+        }
+        if (options.lock) {
+            lock();
+        }
+    }
+
+    ~KVPoolMapping() {
+        reset();
+    }
+
+    KVPoolMapping(const KVPoolMapping&) = delete;
+    KVPoolMapping& operator=(const KVPoolMapping&) = delete;
+
+    KVPoolMapping(KVPoolMapping&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    KVPoolMapping& operator=(KVPoolMapping&& other) noexcept {
+        if (this != &other) {
+            reset();
+            m_base = other.m_base;
+            m_size = other.m_size;
+            m_backing = other.m_backing;
+            m_shared = other.m_shared;
+            other.m_base = nullptr;
+            other.m_size = 0;
+        }
+        return *this;
+    }
+
+    void* data() const {
+        return m_base;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    // Touches one byte per 4 KiB page from `num_threads` threads so page faults (and
+    // THP collapse) happen at startup instead of inside the first prefill. A shared
+    // mapping may already hold another process's KV, so its pages are only read.
+    void prefault(int num_threads) {
+        if (!m_base) {
+            return;
+        }
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t num_pages = m_size / page;
+        if (num_threads <= 0) {
+            num_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        }
+        num_threads = static_cast<int>(std::min<size_t>(num_threads, std::max<size_t>(1, num_pages)));
+
+        auto touch = [&](size_t begin, size_t end) {
+            volatile char* p = static_cast<char*>(m_base);
+            for (size_t i = begin; i < end; ++i) {
+                if (m_shared) {
+                    (void)p[i * page];
+                } else {
+                    p[i * page] = 0;
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        size_t chunk = (num_pages + num_threads - 1) / num_threads;
+        for (int t = 1; t < num_threads; ++t) {
+            size_t begin = std::min(num_pages, t * chunk);
+            size_t end = std::min(num_pages, begin + chunk);
+            workers.emplace_back(touch, begin, end);
+        }
+        touch(0, std::min(num_pages, chunk));
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    // Pins every page of the mapping, faulting in any that are not resident yet.
+    void lock() {
+        if (m_base && ::mlock(m_base, m_size) != 0) {
+            throw std::runtime_error(
+                "mlock failed for " + std::to_string(m_size) + " byte KV pool (check ulimit -l)");
+        }
+    }
+
+    // Gives the pages fully inside [offset, offset + bytes) back to the kernel with
+    // MADV_DONTNEED; they read as zero and are faulted in again on the next touch.
+    // Partial pages at either end are kept. Returns the bytes released. A shared
+    // mapping is left alone: the pages belong to every process attached to it.
+    size_t release(size_t offset, size_t bytes) {
+        if (!m_base || bytes == 0 || m_shared) {
+            return 0;
+        }
+        const size_t page = m_backing == HugePageMode::HugeTLB ? kHugePageSize : static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t begin = round_up(offset, page);
+        size_t end = std::min(m_size, offset + bytes) / page * page;
+        if (end <= begin) {
+            return 0;
+        }
+        if (::madvise(static_cast<char*>(m_base) + begin, end - begin, MADV_DONTNEED) != 0) {
+            return 0;
+        }
+        return end - begin;
+    }
+
+    // Residency and huge-page coverage as reported by the kernel, not what was
+    // requested: THP may be disabled system-wide or only partially collapsed, and
+    // untouched pages count as 0.
+    KVPoolStats stats() const {
+        KVPoolStats s;
+        s.mapped_bytes = m_size;
+        s.backing = m_backing;
+        if (!m_base) {
+            return s;
+        }
+        uintptr_t begin = reinterpret_cast<uintptr_t>(m_base);
+        s.locked_bytes = smaps_bytes(begin, begin + m_size, "Locked:");
+        if (m_backing == HugePageMode::HugeTLB) {
+            s.resident_bytes = m_size;
+            s.huge_page_bytes = m_size;
+            return s;
+        }
+        s.resident_bytes = smaps_bytes(begin, begin + m_size, "Rss:");
+        s.huge_page_bytes = smaps_bytes(begin, begin + m_size, m_shared ? "ShmemPmdMapped:" : "AnonHugePages:");
+        return s;
+    }
+
+    bool shared() const {
+        return m_shared;
+    }
+
+private:
+    void* m_base = nullptr;
+    size_t m_size = 0;
+    HugePageMode m_backing = HugePageMode::None;
+    bool m_shared = false;
+
+    static size_t round_up(size_t x, size_t align) {
+        return (x + align - 1) / align * align;
+    }
+
+    void map_anonymous(size_t bytes, bool want_thp) {
+        if (!want_thp) {
+            m_size = round_up(bytes, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+            void* p = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::runtime_error("mmap failed for KV pool");
+            }
+            m_base = p;
+            return;
+        }
+
+        // Over-map by one huge page and trim both ends so the pool starts on a 2 MiB
+        // boundary; otherwise the first and last partial huge pages stay 4 KiB.
+        m_size = round_up(bytes, kHugePageSize);
+        size_t raw_size = m_size + kHugePageSize;
+        void* raw = ::mmap(nullptr, raw_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            throw std::runtime_error("mmap failed for KV pool");
+        }
+        uintptr_t raw_begin = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = round_up(raw_begin, kHugePageSize);
+        if (aligned > raw_begin) {
+            ::munmap(raw, aligned - raw_begin);
+        }
+        uintptr_t tail = aligned + m_size;
+        uintptr_t raw_end = raw_begin + raw_size;
+        if (raw_end > tail) {
+            ::munmap(reinterpret_cast<void*>(tail), raw_end - tail);
+        }
+        m_base = reinterpret_cast<void*>(aligned);
+        if (::madvise(m_base, m_size, MADV_HUGEPAGE) == 0) {
+            m_backing = HugePageMode::THP;
+        }
+    }
+
+    // The file range must already exist. hugetlb pages cannot back a shm file, so both
+    // huge page modes ask for THP, which shmem gives when shmem_enabled allows it.
+    void map_shared(size_t bytes, const KVPoolOptions& options) {
+        m_size = round_up(bytes, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+        void* p = ::mmap(
+            nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, options.shared_fd, static_cast<off_t>(options.shared_offset));
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("mmap failed for shared KV pool");
+        }
+        m_base = p;
+        m_shared = true;
+        if (options.huge_pages != HugePageMode::None && ::madvise(m_base, m_size, MADV_HUGEPAGE) == 0) {
+            m_backing = HugePageMode::THP;
+        }
+    }
+
+    void reset() {
+        if (m_base) {
+            ::munmap(m_base, m_size);
+            m_base = nullptr;
+            m_size = 0;
+        }
+    }
+
+    // Sum of one "<field> <n> kB" line over the smaps entries overlapping [begin, end).
+    static size_t smaps_bytes(uintptr_t begin, uintptr_t end, const std::string& field) {
+        std::ifstream smaps("/proc/self/smaps");
+        std::string line;
+        bool in_range = false;
+        size_t kb = 0;
+        while (std::getline(smaps, line)) {
+            unsigned long long lo = 0;
+            unsigned long long hi = 0;
+            if (std::sscanf(line.c_str(), "%llx-%llx ", &lo, &hi) == 2 && line.find(':') > line.find(' ')) {
+                in_range = lo < end && hi > begin;
+                continue;
+            }
+            if (!in_range) {
+                continue;
+            }
+            if (line.compare(0, field.size(), field) == 0) {
+                std::istringstream is(line.substr(field.size()));
+                size_t v = 0;
+                is >> v;
+                kb += v;
+            }
+        }
+        return kb * 1024;
+    }
+};
@@ -0,0 +1,429 @@
+#pragma once
+
+#include "kv_free_stack.hpp"
+#include "kv_pool_allocator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// KV pool shared by the runtime processes of one host. One POSIX shared-memory segment
+// holds the block allocator state and the KV arena:
+//
+//   [header] [free-list links: block] [ref counts: block] [directory entries]
+//   [directory block lists: entry][max_published_blocks] ... [KV arena, 2 MiB aligned]
+//
+// Every process maps the same segment, so a block id means the same KV everywhere and
+// the ref counts count holders across processes. Everything a process updates
+// concurrently is a lock-free atomic in the segment (which needs atomics that are
+// lock-free and therefore address-free): the free list is a TaggedFreeStack
+// (kv_free_stack.hpp) over links in the segment, and ref counts are fetch_add/fetch_sub.
+//
+// Sequences cross processes through the directory: publish() stores a sequence's block
+// table under a caller-chosen key and holds one reference per block, attach() gives
+// another process its own references to the same blocks (a shared prefix) and take()
+// moves the directory's references to the caller (a hand-off). Nothing is copied; the
+// usual copy-on-write gives the first writer of a shared partial block its own copy.
+// A block with one reference has exactly one holder, which is why that writer can
+// skip the copy: nobody else can gain a reference to it.
+//
+// The directory is guarded by a spin lock in the segment. A process that dies keeps
+// its references forever; recovering them is out of scope.
+struct KVSharedPoolOptions {
+    std::string name;                // shm_open name, e.g. "/pa_kv"; empty = private pool
+    int max_published = 64;          // directory entries
+    int max_published_blocks = 256;  // blocks per published sequence
+    bool unlink_on_close = false;    // remove the name when this process closes the pool
+};
+
+// Shape of the segment; a process attaching with a different one is refused.
+struct KVSharedPoolGeometry {
+    uint32_t num_blocks = 0;
+    uint32_t block_size = 0;
+    uint32_t num_layers = 0;
+    uint32_t layout = 0;
+    uint64_t layer_block_bytes = 0;
+    uint32_t max_published = 0;
+    uint32_t max_published_blocks = 0;
+    uint32_t key_layout = 0;
+
+    bool operator==(const KVSharedPoolGeometry& other) const {
+        return num_blocks == other.num_blocks && block_size == other.block_size && num_layers == other.num_layers &&
+               layout == other.layout && layer_block_bytes == other.layer_block_bytes &&
+               max_published == other.max_published && max_published_blocks == other.max_published_blocks &&
+               key_layout == other.key_layout;
+    }
+};
+
+class KVSharedPool {
+public:
+    static constexpr uint64_t kMagic = 0x4c4f4f50564b4150ull;  // "PAKVPOOL"
+    static constexpr uint32_t kVersion = 2;
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared atomics must be lock-free");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock-free");
+
+    // Creates the segment or attaches to the one another process created. Creation is
+    // decided by O_EXCL; an attaching process waits until the creator marks it ready.
+    KVSharedPool(const KVSharedPoolOptions& options, const KVSharedPoolGeometry& geometry)
+        : m_name(options.name), m_unlink_on_close(options.unlink_on_close) {
+        if (m_name.empty()) {
+            throw std::runtime_error("shared KV pool needs a name");
+        }
+        if (geometry.max_published <= 0 || geometry.max_published_blocks <= 0) {
+            throw std::runtime_error("shared KV pool needs a non-empty directory");
+        }
+        compute_offsets(geometry);
+        m_fd = ::shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        m_creator = m_fd >= 0;
+        if (!m_creator) {
+            if (errno != EEXIST) {
+                throw std::runtime_error("shm_open failed for " + m_name + ": " + std::strerror(errno));
+            }
+            m_fd = ::shm_open(m_name.c_str(), O_RDWR, 0600);
+            if (m_fd < 0) {
+                throw std::runtime_error("shm_open failed for " + m_name + ": " + std::strerror(errno));
+            }
+        }
+        try {
+            if (m_creator) {
+                create(geometry);
+            } else {
+                attach(geometry);
+            }
+        } catch (...) {
+            m_unlink_on_close = m_unlink_on_close || m_creator;
+            close_segment();
+            throw;
+        }
+    }
+
+    ~KVSharedPool() {
+        if (m_header) {
+            m_header->attached.fetch_sub(1);
+        }
+        close_segment();
+    }
+
+    KVSharedPool(const KVSharedPool&) = delete;
+    KVSharedPool& operator=(const KVSharedPool&) = delete;
+
+    const std::string& name() const {
+        return m_name;
+    }
+
+    bool creator() const {
+        return m_creator;
+    }
+
+    int num_blocks() const {
+        return static_cast<int>(m_header->geometry.num_blocks);
+    }
+
+    int num_free_blocks() const {
+        return m_header->num_free.load(std::memory_order_relaxed);
+    }
+
+    int num_attached() const {
+        return m_header->attached.load(std::memory_order_relaxed);
+    }
+
+    // Options that map the KV arena from this segment.
+    KVPoolOptions kv_pool_options(const KVPoolOptions& base) const {
+        KVPoolOptions options = base;
+        options.shared_fd = m_fd;
+        options.shared_offset = m_kv_offset;
+        return options;
+    }
+
+    // A fresh block with one reference, -1 if the pool is empty.
+    int allocate() {
+        int block = m_free_stack.pop();
+        if (block < 0) {
+            return -1;
+        }
+        m_header->num_free.fetch_sub(1, std::memory_order_relaxed);
+        m_ref_counts[block].store(1, std::memory_order_relaxed);
+        return block;
+    }
+
+    void add_ref(int block) {
+        m_ref_counts[block].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Drops one reference; returns true if that freed the block.
+    bool release(int block) {
+        int32_t previous = m_ref_counts[block].fetch_sub(1, std::memory_order_acq_rel);
+        if (previous <= 0) {
+            m_ref_counts[block].fetch_add(1, std::memory_order_relaxed);
+            throw std::runtime_error("block already free");
+        }
+        if (previous > 1) {
+            return false;
+        }
+        m_free_stack.push(block);
+        m_header->num_free.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    int ref_count(int block) const {
+        return m_ref_counts[block].load(std::memory_order_acquire);
+    }
+
+    // Stores the table under `key`, holding one reference per block until unpublish()
+    // or take(). Returns false if the key is taken or the directory is full.
+    bool publish(uint64_t key, int past_len, const std::vector<int>& blocks) {
+        if (static_cast<int>(blocks.size()) > static_cast<int>(m_header->geometry.max_published_blocks)) {
+            throw std::runtime_error("sequence too long to publish");
+        }
+        DirectoryLock lock(m_header->directory_lock);
+        if (find_entry(key) >= 0) {
+            return false;
+        }
+        for (int e = 0; e < max_published(); ++e) {
+            auto& entry = m_entries[e];
+            if (entry.in_use) {
+                continue;
+            }
+            for (int block : blocks) {
+                add_ref(block);
+            }
+            std::copy(blocks.begin(), blocks.end(), entry_blocks(e));
+            entry.key = key;
+            entry.past_len = past_len;
+            entry.num_blocks = static_cast<int32_t>(blocks.size());
+            entry.in_use = 1;
+            return true;
+        }
+        return false;
+    }
+
+    // Adds a reference to every block of the entry for the caller. Returns false if
+    // nothing is published under `key`.
+    bool attach(uint64_t key, int& past_len, std::vector<int>& blocks) {
+        DirectoryLock lock(m_header->directory_lock);
+        int e = find_entry(key);
+        if (e < 0) {
+            return false;
+        }
+        read_entry(e, past_len, blocks);
+        for (int block : blocks) {
+            add_ref(block);
+        }
+        return true;
+    }
+
+    // Removes the entry and hands its references to the caller.
+    bool take(uint64_t key, int& past_len, std::vector<int>& blocks) {
+        DirectoryLock lock(m_header->directory_lock);
+        int e = find_entry(key);
+        if (e < 0) {
+            return false;
+        }
+        read_entry(e, past_len, blocks);
+        m_entries[e].in_use = 0;
+        return true;
+    }
+
+    bool unpublish(uint64_t key) {
+        int past_len = 0;
+        std::vector<int> blocks;
+        if (!take(key, past_len, blocks)) {
+            return false;
+        }
+        for (int block : blocks) {
+            release(block);
+        }
+        return true;
+    }
+
+private:
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        std::atomic<uint32_t> ready;
+        KVSharedPoolGeometry geometry;
+        std::atomic<int32_t> attached;
+        std::atomic<int32_t> num_free;
+        std::atomic<uint32_t> directory_lock;
+        alignas(64) std::atomic<uint64_t> free_head;  // TaggedFreeStack head
+    };
+
+    struct DirectoryEntry {
+        uint64_t key;
+        int32_t past_len;
+        int32_t num_blocks;
+        int32_t in_use;
+    };
+
+    class DirectoryLock {
+    public:
+        explicit DirectoryLock(std::atomic<uint32_t>& word) : m_word(word) {
+            while (m_word.exchange(1, std::memory_order_acquire) != 0) {
+                std::this_thread::yield();
+            }
+        }
+
+        ~DirectoryLock() {
+            m_word.store(0, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<uint32_t>& m_word;
+    };
+
+    std::string m_name;
+    bool m_unlink_on_close = false;
+    bool m_creator = false;
+    int m_fd = -1;
+    void* m_state = nullptr;
+    size_t m_state_bytes = 0;
+    size_t m_links_offset = 0;
+    size_t m_refs_offset = 0;
+    size_t m_entries_offset = 0;
+    size_t m_entry_blocks_offset = 0;
+    size_t m_kv_offset = 0;
+    size_t m_kv_bytes = 0;
+
+    Header* m_header = nullptr;
+    std::atomic<int32_t>* m_free_next = nullptr;
+    std::atomic<int32_t>* m_ref_counts = nullptr;
+    DirectoryEntry* m_entries = nullptr;
+    TaggedFreeStack m_free_stack;
+
+    static size_t round_up(size_t x, size_t align) {
+        return (x + align - 1) / align * align;
+    }
+
+    // The KV arena starts on a huge page boundary so a THP-backed shmem mapping of it
+    // can use 2 MiB pages from its first block.
+    void compute_offsets(const KVSharedPoolGeometry& g) {
+        m_links_offset = round_up(sizeof(Header), 64);
+        m_refs_offset = round_up(m_links_offset + g.num_blocks * sizeof(std::atomic<int32_t>), 64);
+        m_entries_offset = round_up(m_refs_offset + g.num_blocks * sizeof(std::atomic<int32_t>), 64);
+        m_entry_blocks_offset = round_up(m_entries_offset + g.max_published * sizeof(DirectoryEntry), 64);
+        m_state_bytes = m_entry_blocks_offset + static_cast<size_t>(g.max_published) * g.max_published_blocks * sizeof(int32_t);
+        m_kv_offset = round_up(m_state_bytes, KVPoolMapping::kHugePageSize);
+        m_kv_bytes = static_cast<size_t>(g.layer_block_bytes) * g.num_layers * g.num_blocks;
+    }
+
+    void map_state() {
+        m_state = ::mmap(nullptr, m_state_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (m_state == MAP_FAILED) {
+            m_state = nullptr;
+            throw std::runtime_error("mmap failed for shared KV pool " + m_name);
+        }
+        char* base = static_cast<char*>(m_state);
+        m_header = reinterpret_cast<Header*>(base);
+        m_free_next = reinterpret_cast<std::atomic<int32_t>*>(base + m_links_offset);
+        m_ref_counts = reinterpret_cast<std::atomic<int32_t>*>(base + m_refs_offset);
+        m_entries = reinterpret_cast<DirectoryEntry*>(base + m_entries_offset);
+        m_free_stack = TaggedFreeStack(&m_header->free_head, m_free_next);
+    }
+
+    void create(const KVSharedPoolGeometry& geometry) {
+        if (::ftruncate(m_fd, static_cast<off_t>(m_kv_offset + m_kv_bytes)) != 0) {
+            throw std::runtime_error("ftruncate failed for shared KV pool " + m_name + ": " + std::strerror(errno));
+        }
+        map_state();
+        // The file is zero-filled; the atomics only need constructing.
+        new (m_header) Header{};
+        m_header->magic = kMagic;
+        m_header->version = kVersion;
+        m_header->geometry = geometry;
+        for (uint32_t b = 0; b < geometry.num_blocks; ++b) {
+            new (&m_ref_counts[b]) std::atomic<int32_t>(0);
+            new (&m_free_next[b]) std::atomic<int32_t>(-1);
+        }
+        // Popped in ascending id order, like the private allocator.
+        m_free_stack.reset(static_cast<int>(geometry.num_blocks));
+        m_header->num_free.store(static_cast<int32_t>(geometry.num_blocks));
+        m_header->attached.store(1);
+        m_header->ready.store(1, std::memory_order_release);
+    }
+
+    void attach(const KVSharedPoolGeometry& geometry) {
+        // The creator may not have sized the file yet.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        struct stat st {};
+        while (true) {
+            if (::fstat(m_fd, &st) != 0) {
+                throw std::runtime_error("fstat failed for shared KV pool " + m_name);
+            }
+            if (st.st_size > 0) {
+                break;
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                throw std::runtime_error("shared KV pool " + m_name + " was never initialized");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (static_cast<size_t>(st.st_size) != m_kv_offset + m_kv_bytes) {
+            throw std::runtime_error("shared KV pool " + m_name + " has a different size");
+        }
+        map_state();
+        while (m_header->ready.load(std::memory_order_acquire) == 0) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                throw std::runtime_error("shared KV pool " + m_name + " was never initialized");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (m_header->magic != kMagic || m_header->version != kVersion || !(m_header->geometry == geometry)) {
+            throw std::runtime_error("shared KV pool " + m_name + " does not match runtime config");
+        }
+        m_header->attached.fetch_add(1);
+    }
+
+    void close_segment() {
+        if (m_state) {
+            ::munmap(m_state, m_state_bytes);
+            m_state = nullptr;
+            m_header = nullptr;
+        }
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        if (m_unlink_on_close) {
+            ::shm_unlink(m_name.c_str());
+        }
+    }
+
+    int max_published() const {
+        return static_cast<int>(m_header->geometry.max_published);
+    }
+
+    int32_t* entry_blocks(int e) {
+        return reinterpret_cast<int32_t*>(static_cast<char*>(m_state) + m_entry_blocks_offset) +
+               static_cast<size_t>(e) * m_header->geometry.max_published_blocks;
+    }
+
+    int find_entry(uint64_t key) const {
+        for (int e = 0; e < max_published(); ++e) {
+            if (m_entries[e].in_use && m_entries[e].key == key) {
+                return e;
+            }
+        }
+        return -1;
+    }
+
+    void read_entry(int e, int& past_len, std::vector<int>& blocks) {
+        const int32_t* table = entry_blocks(e);
+        past_len = m_entries[e].past_len;
+        blocks.assign(table, table + m_entries[e].num_blocks);
+    }
+};
@@ -0,0 +1,863 @@
+#include "pa_tool_util.hpp"
+#include "standalone_pa.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Replays a request trace against KVBlockManager alone: no model, no KV data. Every
+// scheduling step admits waiting requests (prefill), decodes one token for every running
+// request and preempts by recomputation when the pool runs dry, on a simulated clock
+// driven by a linear step-cost model.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct TraceRequest {
+    double arrival_s = 0.0;
+    int prompt_len = 0;
+    int output_len = 0;
+    int beams = 1;        // forked right after prefill; every beam decodes every step
+    int prefix_id = -1;   // requests with the same id share the first prefix_len tokens
+    int prefix_len = 0;
+};
+
+enum class PreemptPolicy { Newest, Oldest, Largest };
+
+struct SyntheticOptions {
+    int64_t num_requests = 0;
+    double rate = 10.0;  // Poisson arrivals per second
+    int prompt_min = 64;
+    int prompt_max = 1024;
+    int output_min = 16;
+    int output_max = 512;
+    int beams = 1;
+    double beam_prob = 0.0;
+    int prefix_groups = 0;
+    int prefix_len = 0;
+    uint32_t seed = 7;
+};
+
+struct SimOptions {
+    std::string trace_path;
+    std::string save_trace_path;
+    SyntheticOptions synthetic;
+    std::vector<int> block_sizes = {16};
+    std::vector<int> pool_blocks = {4096};
+    int max_running = 256;         // sequences (beams) decoding at once
+    int max_batched_tokens = 8192; // prefill + decode tokens per step
+    double watermark = 0.01;       // fraction of the pool admission keeps free
+    PreemptPolicy preempt = PreemptPolicy::Newest;
+    int prefix_cache = 0;          // cached prefixes kept resident (LRU), 0 = off
+    int stream_sink = 0;
+    int stream_window = 0;
+    double step_ms = 5.0;          // fixed cost of a step
+    double token_us = 20.0;        // plus this per token processed
+    int sample_every = 64;         // steps between fragmentation samples
+    int compact_every = 0;         // steps between compaction passes, 0 = off
+    CompactionOptions compaction;
+    bool build_metadata = false;   // also build the decode batch metadata every step
+    std::string csv_path;
+};
+
+struct SimCase {
+    int block_size = 0;
+    int num_blocks = 0;
+};
+
+struct SimResult {
+    int64_t finished = 0;
+    int64_t rejected = 0;
+    int64_t preemptions = 0;
+    int64_t steps = 0;
+    int64_t prefill_tokens = 0;
+    int64_t decode_tokens = 0;
+    int64_t prefix_lookups = 0;
+    int64_t prefix_hits = 0;
+    int64_t prefix_tokens_saved = 0;
+    int64_t manager_ops = 0;
+    double sim_s = 0.0;
+    double wall_s = 0.0;
+    double avg_utilization = 0.0;  // time-weighted used / total blocks
+    double peak_utilization = 0.0;
+    double avg_fragmentation = 0.0;  // empty slots in used blocks, sampled
+    double avg_high_water = 0.0;     // sampled highest used block id / total blocks
+    double avg_runs_per_seq = 0.0;   // sampled contiguous block runs per live sequence
+    double avg_running = 0.0;
+    KVAllocatorCounters counters;
+    std::vector<double> ttft_s;
+    std::vector<double> e2e_s;
+};
+
+std::vector<int> parse_int_list(const std::string& s) {
+    std::vector<int> values;
+    for (const auto& part : split(s, ',')) {
+        values.push_back(std::stoi(part));
+    }
+    return values;
+}
+
+std::pair<int, int> parse_range(const std::string& s) {
+    auto parts = split(s, ':');
+    if (parts.empty() || parts.size() > 2) {
+        throw std::runtime_error("range must look like <min>[:<max>]: " + s);
+    }
+    int lo = std::stoi(parts[0]);
+    int hi = parts.size() > 1 ? std::stoi(parts[1]) : lo;
+    if (lo < 1 || hi < lo) {
+        throw std::runtime_error("bad range " + s);
+    }
+    return {lo, hi};
+}
+
+PreemptPolicy parse_preempt_policy(const std::string& s) {
+    if (s == "newest") {
+        return PreemptPolicy::Newest;
+    }
+    if (s == "oldest") {
+        return PreemptPolicy::Oldest;
+    }
+    if (s == "largest") {
+        return PreemptPolicy::Largest;
+    }
+    throw std::runtime_error("preempt policy must be newest, oldest or largest: " + s);
+}
+
+const char* preempt_policy_name(PreemptPolicy policy) {
+    switch (policy) {
+    case PreemptPolicy::Newest:
+        return "newest";
+    case PreemptPolicy::Oldest:
+        return "oldest";
+    case PreemptPolicy::Largest:
+        return "largest";
+    }
+    return "?";
+}
+
+void print_usage(const char* argv0) {
+    std::cout
+        << "usage: " << argv0 << " [options]\n"
+        << "  --trace file         replay <arrival_s> <prompt> <output> [<beams> [<prefix_id> <prefix_len>]] lines\n"
+        << "  --synthetic 0        or generate this many requests instead\n"
+        << "  --rate 10            synthetic Poisson arrival rate (requests/s)\n"
+        << "  --prompt 64:1024     synthetic prompt length range\n"
+        << "  --output 16:512      synthetic output length range\n"
+        << "  --beams 1:0          synthetic <beams>:<probability> of a beam-search request\n"
+        << "  --prefix 0:0         synthetic <groups>:<tokens> shared system prompts\n"
+        << "  --seed 7             synthetic trace seed\n"
+        << "  --save-trace file    write the replayed trace in --trace format\n"
+        << "  --block 16           block sizes\n"
+        << "  --blocks 4096        KV pool sizes in blocks\n"
+        << "  --max-running 256    sequences decoding at once\n"
+        << "  --max-tokens 8192    tokens (prefill + decode) per step\n"
+        << "  --watermark 0.01     fraction of the pool admission leaves free\n"
+        << "  --preempt newest     victim on a dry pool: newest, oldest or largest\n"
+        << "  --prefix-cache 0     cached prefixes kept resident, LRU (0 = off)\n"
+        << "  --stream 0:0         <sink>:<window> attention-sink streaming (0:0 = off)\n"
+        << "  --step-ms 5          simulated fixed cost per step\n"
+        << "  --token-us 20        simulated cost per token in a step\n"
+        << "  --sample-every 64    steps between fragmentation samples\n"
+        << "  --compact 0          <steps>[:runs|tail[:<max_moves>[:<min_run_blocks>]]] compaction passes\n"
+        << "  --metadata 0         build the decode batch metadata every step (0/1)\n"
+        << "  --csv out.csv        also write results as CSV ('-' for stdout)\n";
+}
+
+SimOptions parse_args(int argc, char** argv) {
+    SimOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--trace") {
+            opt.trace_path = value;
+        } else if (arg == "--synthetic") {
+            opt.synthetic.num_requests = std::stoll(value);
+        } else if (arg == "--rate") {
+            opt.synthetic.rate = std::stod(value);
+        } else if (arg == "--prompt") {
+            std::tie(opt.synthetic.prompt_min, opt.synthetic.prompt_max) = parse_range(value);
+        } else if (arg == "--output") {
+            std::tie(opt.synthetic.output_min, opt.synthetic.output_max) = parse_range(value);
+        } else if (arg == "--beams") {
+            auto parts = split(value, ':');
+            opt.synthetic.beams = std::stoi(parts.at(0));
+            opt.synthetic.beam_prob = parts.size() > 1 ? std::stod(parts[1]) : 1.0;
+        } else if (arg == "--prefix") {
+            auto parts = split(value, ':');
+            if (parts.size() != 2) {
+                throw std::runtime_error("--prefix must look like <groups>:<tokens>");
+            }
+            opt.synthetic.prefix_groups = std::stoi(parts[0]);
+            opt.synthetic.prefix_len = std::stoi(parts[1]);
+        } else if (arg == "--seed") {
+            opt.synthetic.seed = static_cast<uint32_t>(std::stoul(value));
+        } else if (arg == "--save-trace") {
+            opt.save_trace_path = value;
+        } else if (arg == "--block") {
+            opt.block_sizes = parse_int_list(value);
+        } else if (arg == "--blocks") {
+            opt.pool_blocks = parse_int_list(value);
+        } else if (arg == "--max-running") {
+            opt.max_running = std::stoi(value);
+        } else if (arg == "--max-tokens") {
+            opt.max_batched_tokens = std::stoi(value);
+        } else if (arg == "--watermark") {
+            opt.watermark = std::stod(value);
+        } else if (arg == "--preempt") {
+            opt.preempt = parse_preempt_policy(value);
+        } else if (arg == "--prefix-cache") {
+            opt.prefix_cache = std::stoi(value);
+        } else if (arg == "--stream") {
+            auto parts = split(value, ':');
+            if (parts.size() != 2) {
+                throw std::runtime_error("--stream must look like <sink>:<window>");
+            }
+            opt.stream_sink = std::stoi(parts[0]);
+            opt.stream_window = std::stoi(parts[1]);
+        } else if (arg == "--step-ms") {
+            opt.step_ms = std::stod(value);
+        } else if (arg == "--token-us") {
+            opt.token_us = std::stod(value);
+        } else if (arg == "--sample-every") {
+            opt.sample_every = std::max(1, std::stoi(value));
+        } else if (arg == "--compact") {
+            auto parts = split(value, ':');
+            opt.compact_every = std::stoi(parts.at(0));
+            if (parts.size() > 1 && parts[1] != "runs" && parts[1] != "tail") {
+                throw std::runtime_error("--compact mode must be runs or tail: " + parts[1]);
+            }
+            opt.compaction.sequence_runs = parts.size() < 2 || parts[1] == "runs";
+            if (parts.size() > 2) {
+                opt.compaction.max_moves = std::stoi(parts[2]);
+            }
+            if (parts.size() > 3) {
+                opt.compaction.min_run_blocks = std::stoi(parts[3]);
+            }
+        } else if (arg == "--metadata") {
+            opt.build_metadata = std::stoi(value) != 0;
+        } else if (arg == "--csv") {
+            opt.csv_path = value;
+        } else {
+            throw std::runtime_error("unknown option " + arg);
+        }
+    }
+    if (opt.trace_path.empty() && opt.synthetic.num_requests <= 0) {
+        throw std::runtime_error("need --trace or --synthetic");
+    }
+    return opt;
+}
+
+std::vector<TraceRequest> load_trace(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("failed to open trace " + path);
+    }
+    std::vector<TraceRequest> trace;
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        ++line_no;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        TraceRequest r;
+        if (!(fields >> r.arrival_s >> r.prompt_len >> r.output_len)) {
+            throw std::runtime_error(path + ":" + std::to_string(line_no) + ": expected <arrival_s> <prompt> <output>");
+        }
+        fields >> r.beams >> r.prefix_id >> r.prefix_len;
+        r.beams = std::max(1, r.beams);
+        r.prefix_len = std::min(r.prefix_len, r.prompt_len);
+        if (r.prompt_len < 1 || r.output_len < 1) {
+            throw std::runtime_error(path + ":" + std::to_string(line_no) + ": lengths must be positive");
+        }
+        trace.push_back(r);
+    }
+    std::stable_sort(trace.begin(), trace.end(), [](const TraceRequest& a, const TraceRequest& b) {
+        return a.arrival_s < b.arrival_s;
+    });
+    return trace;
+}
+
+std::vector<TraceRequest> make_synthetic_trace(const SyntheticOptions& opt) {
+    std::mt19937_64 rng(opt.seed);
+    std::exponential_distribution<double> gap(opt.rate);
+    std::uniform_int_distribution<int> prompt(opt.prompt_min, opt.prompt_max);
+    std::uniform_int_distribution<int> output(opt.output_min, opt.output_max);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::uniform_int_distribution<int> group(0, std::max(0, opt.prefix_groups - 1));
+
+    std::vector<TraceRequest> trace(opt.num_requests);
+    double t = 0.0;
+    for (auto& r : trace) {
+        t += gap(rng);
+        r.arrival_s = t;
+        r.prompt_len = prompt(rng);
+        r.output_len = output(rng);
+        r.beams = coin(rng) < opt.beam_prob ? std::max(1, opt.beams) : 1;
+        if (opt.prefix_groups > 0 && opt.prefix_len > 0) {
+            // The shared system prompt comes in front of the sampled user prompt.
+            r.prefix_id = group(rng);
+            r.prefix_len = opt.prefix_len;
+            r.prompt_len += opt.prefix_len;
+        }
+    }
+    return trace;
+}
+
+void save_trace(const std::vector<TraceRequest>& trace, const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("failed to open " + path);
+    }
+    out << "# arrival_s prompt_len output_len beams prefix_id prefix_len\n";
+    out << std::setprecision(9);
+    for (const auto& r : trace) {
+        out << r.arrival_s << ' ' << r.prompt_len << ' ' << r.output_len << ' ' << r.beams << ' ' << r.prefix_id << ' '
+            << r.prefix_len << '\n';
+    }
+}
+
+int div_up(int x, int y) {
+    return (x + y - 1) / y;
+}
+
+class Simulator {
+public:
+    Simulator(const std::vector<TraceRequest>& trace, const SimOptions& opt, const SimCase& c)
+        : m_trace(trace),
+          m_opt(opt),
+          m_case(c),
+          m_manager(c.num_blocks, c.block_size),
+          m_watermark_blocks(static_cast<int>(opt.watermark * c.num_blocks)) {
+        m_result.ttft_s.assign(trace.size(), -1.0);
+        m_result.e2e_s.reserve(trace.size());
+        m_generated.assign(trace.size(), 0);
+    }
+
+    SimResult run() {
+        auto w0 = Clock::now();
+        double busy_s = 0.0;
+        double used_block_s = 0.0;
+        double running_s = 0.0;
+        double frag_sum = 0.0;
+        double high_water_sum = 0.0;
+        double runs_sum = 0.0;
+        int64_t frag_samples = 0;
+        size_t next_arrival = 0;
+
+        while (next_arrival < m_trace.size() || !m_waiting.empty() || !m_running.empty()) {
+            if (m_waiting.empty() && m_running.empty() && m_trace[next_arrival].arrival_s > m_now) {
+                m_now = m_trace[next_arrival].arrival_s;
+            }
+            while (next_arrival < m_trace.size() && m_trace[next_arrival].arrival_s <= m_now) {
+                m_waiting.push_back(static_cast<int>(next_arrival++));
+            }
+
+            m_step_tokens = 0;
+            m_step_first_tokens.clear();
+            decode_running();
+            admit_waiting();
+
+            double dt = (m_opt.step_ms + m_opt.token_us * m_step_tokens / 1000.0) / 1000.0;
+            m_now += dt;
+            busy_s += dt;
+            m_result.steps += 1;
+            for (int request : m_step_first_tokens) {
+                if (m_result.ttft_s[request] < 0.0) {
+                    m_result.ttft_s[request] = m_now - m_trace[request].arrival_s;
+                }
+            }
+            retire_finished();
+            if (m_opt.compact_every > 0 && m_result.steps % m_opt.compact_every == 0) {
+                m_manager.compact(m_opt.compaction);
+                m_result.manager_ops += 1;
+            }
+
+            double used = m_manager.num_used_blocks();
+            used_block_s += used * dt;
+            running_s += m_num_running_seqs * dt;
+            m_result.peak_utilization = std::max(m_result.peak_utilization, used / m_case.num_blocks);
+            if (m_result.steps % m_opt.sample_every == 0 && used > 0) {
+                auto usage = m_manager.usage_stats();
+                frag_sum += 1.0 - static_cast<double>(usage.filled_slots) / (static_cast<double>(usage.used_blocks) * m_case.block_size);
+                high_water_sum += static_cast<double>(usage.high_water) / m_case.num_blocks;
+                runs_sum += static_cast<double>(usage.block_runs) / std::max(1, m_manager.num_sequences());
+                frag_samples += 1;
+            }
+        }
+
+        m_result.wall_s = std::chrono::duration<double>(Clock::now() - w0).count();
+        m_result.sim_s = m_now;
+        m_result.avg_utilization = busy_s > 0.0 ? used_block_s / busy_s / m_case.num_blocks : 0.0;
+        m_result.avg_running = busy_s > 0.0 ? running_s / busy_s : 0.0;
+        m_result.avg_fragmentation = frag_samples > 0 ? frag_sum / frag_samples : 0.0;
+        m_result.avg_high_water = frag_samples > 0 ? high_water_sum / frag_samples : 0.0;
+        m_result.avg_runs_per_seq = frag_samples > 0 ? runs_sum / frag_samples : 0.0;
+        m_result.counters = m_manager.counters();
+        return std::move(m_result);
+    }
+
+private:
+    struct Running {
+        int request = -1;
+        int64_t admitted = 0;  // admission order, for the preemption policies
+        std::vector<int> seq_ids;
+        std::vector<SequenceHandle> handles;
+        bool preempted = false;
+    };
+
+    struct CachedPrefix {
+        int seq_id = -1;
+        std::list<int>::iterator lru;
+    };
+
+    const std::vector<TraceRequest>& m_trace;
+    const SimOptions& m_opt;
+    SimCase m_case;
+    KVBlockManager m_manager;
+    int m_watermark_blocks;
+    SimResult m_result;
+
+    double m_now = 0.0;
+    int m_next_seq_id = 0;
+    int64_t m_next_admission = 0;
+    int m_num_running_seqs = 0;
+    int64_t m_step_tokens = 0;
+    std::vector<int> m_step_first_tokens;
+    std::vector<int> m_generated;  // tokens sampled so far, survives preemption
+    std::deque<int> m_waiting;
+    std::vector<Running> m_running;
+    std::vector<SequenceHandle> m_meta_handles;
+    std::vector<int> m_meta_q_lens;
+
+    std::list<int> m_prefix_lru;  // most recently used first
+    std::unordered_map<int, CachedPrefix> m_prefix_cache;
+
+    // One token for every beam of every running request, oldest admission first.
+    void decode_running() {
+        if (m_opt.build_metadata) {
+            m_meta_handles.clear();
+        }
+        for (size_t i = 0; i < m_running.size(); ++i) {
+            Running& r = m_running[i];
+            if (r.preempted) {
+                continue;
+            }
+            int needed = 0;
+            for (const auto& h : r.handles) {
+                needed += m_manager.blocks_needed(h, 1);
+            }
+            m_result.manager_ops += static_cast<int64_t>(r.handles.size());
+            if (!make_room(needed, static_cast<int>(i))) {
+                continue;
+            }
+            for (const auto& h : r.handles) {
+                m_manager.reserve_for_decode(h);
+                m_manager.commit_tokens(h, 1);
+            }
+            m_result.manager_ops += 2 * static_cast<int64_t>(r.handles.size());
+            m_step_tokens += static_cast<int64_t>(r.handles.size());
+            m_result.decode_tokens += static_cast<int64_t>(r.handles.size());
+            m_generated[r.request] += 1;
+            if (m_opt.build_metadata) {
+                m_meta_handles.insert(m_meta_handles.end(), r.handles.begin(), r.handles.end());
+            }
+        }
+        if (m_opt.build_metadata && !m_meta_handles.empty()) {
+            // After the commits, so the tables cover past_len exactly.
+            m_meta_q_lens.assign(m_meta_handles.size(), 0);
+            auto meta = m_manager.build_batch_metadata(m_meta_handles, m_meta_q_lens);
+            m_result.manager_ops += 1;
+            (void)meta;
+        }
+    }
+
+    // Frees blocks until `needed` fit: cached prefixes first (LRU), then running
+    // requests chosen by the preemption policy. Returns false if `self` had to go.
+    bool make_room(int needed, int self) {
+        while (m_manager.num_free_blocks() < needed && evict_prefix()) {
+        }
+        while (m_manager.num_free_blocks() < needed) {
+            int victim = pick_victim(self);
+            if (victim < 0 || victim == self) {
+                preempt(self);
+                return false;
+            }
+            preempt(victim);
+        }
+        return true;
+    }
+
+    int pick_victim(int self) const {
+        int victim = -1;
+        for (int i = 0; i < static_cast<int>(m_running.size()); ++i) {
+            const Running& r = m_running[i];
+            if (r.preempted) {
+                continue;
+            }
+            if (victim < 0) {
+                victim = i;
+                continue;
+            }
+            const Running& v = m_running[victim];
+            bool better = false;
+            switch (m_opt.preempt) {
+            case PreemptPolicy::Newest:
+                better = r.admitted > v.admitted;
+                break;
+            case PreemptPolicy::Oldest:
+                better = i != self && (victim == self || r.admitted < v.admitted);
+                break;
+            case PreemptPolicy::Largest:
+                better = blocks_held(r) > blocks_held(v);
+                break;
+            }
+            if (better) {
+                victim = i;
+            }
+        }
+        return victim;
+    }
+
+    int blocks_held(const Running& r) const {
+        int blocks = 0;
+        for (const auto& h : r.handles) {
+            blocks += div_up(m_manager.past_len(h) + 1, m_case.block_size);
+        }
+        return blocks;
+    }
+
+    // Recompute-style preemption: drop the KV, requeue at the head of the line. A
+    // request that cannot fit even with the pool to itself is rejected instead.
+    void preempt(int index) {
+        Running& r = m_running[index];
+        release(r);
+        r.preempted = true;
+        bool alone = true;
+        for (const auto& other : m_running) {
+            alone = alone && (other.preempted || &other == &r);
+        }
+        if (alone) {
+            m_result.rejected += 1;
+            return;
+        }
+        m_result.preemptions += 1;
+        m_waiting.push_front(r.request);
+    }
+
+    void release(Running& r) {
+        for (int seq_id : r.seq_ids) {
+            m_manager.finish_sequence(seq_id);
+        }
+        m_result.manager_ops += static_cast<int64_t>(r.seq_ids.size());
+        m_num_running_seqs -= static_cast<int>(r.seq_ids.size());
+        r.seq_ids.clear();
+        r.handles.clear();
+    }
+
+    void admit_waiting() {
+        while (!m_waiting.empty()) {
+            int request = m_waiting.front();
+            const TraceRequest& t = m_trace[request];
+            // A preempted request recomputes its prompt plus what it had generated.
+            int context = t.prompt_len + m_generated[request];
+            int budget_left = m_opt.max_batched_tokens - static_cast<int>(m_step_tokens);
+            if (m_num_running_seqs + t.beams > m_opt.max_running && m_num_running_seqs > 0) {
+                break;
+            }
+            if (context > budget_left && m_step_tokens > 0) {
+                break;
+            }
+            int needed = div_up(context + 1, m_case.block_size) + (t.beams - 1);
+            if (uses_prefix_cache(t) && t.prefix_len % m_case.block_size != 0) {
+                // The fork copies the cached prefix's partly filled last block, on top of
+                // the prefix blocks a miss prefills into the cache.
+                needed += 1;
+            }
+            if (needed + m_watermark_blocks > m_case.num_blocks) {
+                // Never fits, even into an empty pool.
+                m_waiting.pop_front();
+                m_result.rejected += 1;
+                continue;
+            }
+            if (uses_prefix_cache(t) && m_prefix_cache.count(t.prefix_id)) {
+                // A hit shares the resident prefix blocks.
+                needed -= div_up(t.prefix_len, m_case.block_size);
+            }
+            while (m_manager.num_free_blocks() - needed < m_watermark_blocks && evict_prefix(t.prefix_id)) {
+            }
+            if (m_manager.num_free_blocks() - needed < m_watermark_blocks) {
+                break;
+            }
+            m_waiting.pop_front();
+            start(request, context);
+        }
+    }
+
+    void start(int request, int context) {
+        const TraceRequest& t = m_trace[request];
+        Running r;
+        r.request = request;
+        r.admitted = m_next_admission++;
+        int seq_id = m_next_seq_id++;
+        SequenceHandle h;
+        int cached = 0;
+        if (uses_prefix_cache(t)) {
+            int prefix_seq = lookup_prefix(t.prefix_id, t.prefix_len);
+            h = m_manager.fork_sequence(prefix_seq, seq_id);
+            cached = t.prefix_len;
+        } else {
+            h = m_manager.add_sequence(seq_id);
+        }
+        if (m_opt.stream_window > 0) {
+            m_manager.enable_streaming(seq_id, m_opt.stream_sink, m_opt.stream_window);
+        }
+        m_manager.reserve_for_prefill(h, context - cached);
+        m_manager.commit_tokens(h, context - cached);
+        m_result.manager_ops += 4;
+        m_step_tokens += context - cached;
+        m_result.prefill_tokens += context - cached;
+
+        r.seq_ids.push_back(seq_id);
+        r.handles.push_back(h);
+        for (int b = 1; b < t.beams; ++b) {
+            int child = m_next_seq_id++;
+            r.handles.push_back(m_manager.fork_sequence(seq_id, child));
+            r.seq_ids.push_back(child);
+            m_result.manager_ops += 1;
+        }
+        m_num_running_seqs += t.beams;
+        // Prefill samples the next token.
+        m_generated[request] += 1;
+        m_step_first_tokens.push_back(request);
+        m_running.push_back(std::move(r));
+    }
+
+    void retire_finished() {
+        size_t out = 0;
+        for (size_t i = 0; i < m_running.size(); ++i) {
+            Running& r = m_running[i];
+            if (!r.preempted && m_generated[r.request] >= m_trace[r.request].output_len) {
+                release(r);
+                m_result.finished += 1;
+                m_result.e2e_s.push_back(m_now - m_trace[r.request].arrival_s);
+                continue;
+            }
+            if (r.preempted) {
+                continue;
+            }
+            if (out != i) {
+                m_running[out] = std::move(r);
+            }
+            ++out;
+        }
+        m_running.resize(out);
+    }
+
+    bool uses_prefix_cache(const TraceRequest& t) const {
+        return t.prefix_id >= 0 && t.prefix_len > 0 && m_opt.prefix_cache > 0;
+    }
+
+    // Returns the resident sequence holding the prefix, prefilling it on a miss.
+    int lookup_prefix(int prefix_id, int prefix_len) {
+        m_result.prefix_lookups += 1;
+        auto it = m_prefix_cache.find(prefix_id);
+        if (it != m_prefix_cache.end()) {
+            m_result.prefix_hits += 1;
+            m_result.prefix_tokens_saved += prefix_len;
+            m_prefix_lru.splice(m_prefix_lru.begin(), m_prefix_lru, it->second.lru);
+            return it->second.seq_id;
+        }
+        while (static_cast<int>(m_prefix_cache.size()) >= m_opt.prefix_cache && evict_prefix(prefix_id)) {
+        }
+        int seq_id = m_next_seq_id++;
+        SequenceHandle h = m_manager.add_sequence(seq_id);
+        m_manager.reserve_for_prefill(h, prefix_len);
+        m_manager.commit_tokens(h, prefix_len);
+        m_result.manager_ops += 3;
+        m_step_tokens += prefix_len;
+        m_result.prefill_tokens += prefix_len;
+        m_prefix_lru.push_front(prefix_id);
+        m_prefix_cache[prefix_id] = {seq_id, m_prefix_lru.begin()};
+        return seq_id;
+    }
+
+    // Drops the least recently used cached prefix other than `keep`. Its blocks stay
+    // alive while running requests still share them.
+    bool evict_prefix(int keep = -1) {
+        for (auto it = m_prefix_lru.rbegin(); it != m_prefix_lru.rend(); ++it) {
+            if (*it == keep) {
+                continue;
+            }
+            auto entry = m_prefix_cache.find(*it);
+            m_manager.finish_sequence(entry->second.seq_id);
+            m_result.manager_ops += 1;
+            m_prefix_lru.erase(std::next(it).base());
+            m_prefix_cache.erase(entry);
+            return true;
+        }
+        return false;
+    }
+};
+
+std::string csv_header() {
+    return "requests,block_size,num_blocks,preempt,prefix_cache,stream,max_running,max_tokens,"
+           "finished,rejected,preemptions,steps,sim_s,avg_util,peak_util,avg_frag,avg_running,"
+           "prefix_hit_rate,prefill_tokens,decode_tokens,ttft_p50_s,ttft_p99_s,e2e_p50_s,e2e_p99_s,"
+           "block_allocs,block_frees,cow_copies,compact,compaction_moves,avg_high_water,avg_runs_per_seq,"
+           "manager_ops,wall_s,manager_ops_per_s";
+}
+
+std::vector<double> first_token_latencies(const SimResult& r) {
+    std::vector<double> values;
+    values.reserve(r.ttft_s.size());
+    for (double v : r.ttft_s) {
+        if (v >= 0.0) {
+            values.push_back(v);
+        }
+    }
+    return values;
+}
+
+double prefix_hit_rate(const SimResult& r) {
+    return r.prefix_lookups > 0 ? static_cast<double>(r.prefix_hits) / r.prefix_lookups : 0.0;
+}
+
+double ops_per_s(const SimResult& r) {
+    return r.wall_s > 0.0 ? (r.manager_ops + r.counters.block_allocations + r.counters.block_frees) / r.wall_s : 0.0;
+}
+
+std::string compact_label(const SimOptions& opt) {
+    if (opt.compact_every <= 0) {
+        return "off";
+    }
+    std::string label = std::to_string(opt.compact_every) + (opt.compaction.sequence_runs ? ":runs" : ":tail");
+    if (opt.compaction.max_moves != std::numeric_limits<int>::max() || opt.compaction.min_run_blocks != 2) {
+        label += ":" + std::to_string(opt.compaction.max_moves) + ":" + std::to_string(opt.compaction.min_run_blocks);
+    }
+    return label;
+}
+
+std::string csv_row(size_t num_requests, const SimCase& c, const SimOptions& opt, const SimResult& r) {
+    auto ttft = first_token_latencies(r);
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(4)
+       << num_requests << ',' << c.block_size << ',' << c.num_blocks << ',' << preempt_policy_name(opt.preempt) << ','
+       << opt.prefix_cache << ',' << opt.stream_sink << ':' << opt.stream_window << ',' << opt.max_running << ','
+       << opt.max_batched_tokens << ','
+       << r.finished << ',' << r.rejected << ',' << r.preemptions << ',' << r.steps << ',' << r.sim_s << ','
+       << r.avg_utilization << ',' << r.peak_utilization << ',' << r.avg_fragmentation << ',' << r.avg_running << ','
+       << prefix_hit_rate(r) << ',' << r.prefill_tokens << ',' << r.decode_tokens << ','
+       << percentile(ttft, 50) << ',' << percentile(ttft, 99) << ','
+       << percentile(r.e2e_s, 50) << ',' << percentile(r.e2e_s, 99) << ','
+       << r.counters.block_allocations << ',' << r.counters.block_frees << ',' << r.counters.cow_copies << ','
+       << compact_label(opt) << ',' << r.counters.compaction_moves << ',' << r.avg_high_water << ','
+       << r.avg_runs_per_seq << ','
+       << r.manager_ops << ',' << r.wall_s << ',' << ops_per_s(r);
+    return os.str();
+}
+
+void print_result(const SimCase& c, const SimResult& r) {
+    auto ttft = first_token_latencies(r);
+    std::cout << std::fixed << std::setprecision(3)
+              << "block=" << std::setw(3) << c.block_size
+              << " blocks=" << std::setw(7) << c.num_blocks
+              << " | done " << r.finished << " rejected " << r.rejected << " preempted " << r.preemptions
+              << " | util avg/peak " << r.avg_utilization << "/" << r.peak_utilization
+              << " frag " << r.avg_fragmentation
+              << " high water " << r.avg_high_water
+              << " runs/seq " << std::setprecision(2) << r.avg_runs_per_seq
+              << " moves " << r.counters.compaction_moves << std::setprecision(3)
+              << " running " << std::setprecision(1) << r.avg_running
+              << " | prefix hit " << std::setprecision(3) << prefix_hit_rate(r)
+              << " | ttft p50/p99 " << percentile(ttft, 50) << "/" << percentile(ttft, 99) << " s"
+              << " | e2e p50/p99 " << percentile(r.e2e_s, 50) << "/" << percentile(r.e2e_s, 99) << " s"
+              << " | sim " << std::setprecision(1) << r.sim_s << " s in " << std::setprecision(3) << r.wall_s << " s wall"
+              << " | " << std::setprecision(2) << ops_per_s(r) / 1e6 << " Mops/s\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    SimOptions opt;
+    std::vector<TraceRequest> trace;
+    try {
+        opt = parse_args(argc, argv);
+        trace = opt.trace_path.empty() ? make_synthetic_trace(opt.synthetic) : load_trace(opt.trace_path);
+        if (!opt.save_trace_path.empty()) {
+            save_trace(trace, opt.save_trace_path);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int64_t prompt_tokens = 0;
+    int64_t output_tokens = 0;
+    for (const auto& r : trace) {
+        prompt_tokens += r.prompt_len;
+        output_tokens += static_cast<int64_t>(r.output_len) * r.beams;
+    }
+    std::cout << "=== KV block manager trace simulator ===\n"
+              << "requests=" << trace.size() << " prompt_tokens=" << prompt_tokens << " output_tokens=" << output_tokens
+              << " span=" << std::fixed << std::setprecision(1) << (trace.empty() ? 0.0 : trace.back().arrival_s) << " s"
+              << " preempt=" << preempt_policy_name(opt.preempt) << " prefix_cache=" << opt.prefix_cache
+              << " max_running=" << opt.max_running << " max_tokens=" << opt.max_batched_tokens << "\n";
+
+    std::vector<std::string> rows;
+    try {
+        for (int block_size : opt.block_sizes) {
+            for (int num_blocks : opt.pool_blocks) {
+                SimCase c{block_size, num_blocks};
+                Simulator sim(trace, opt, c);
+                SimResult result = sim.run();
+                print_result(c, result);
+                rows.push_back(csv_row(trace.size(), c, opt, result));
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "simulation failed: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (opt.csv_path == "-") {
+        std::cout << csv_header() << "\n";
+        for (const auto& row : rows) {
+            std::cout << row << "\n";
+        }
+    } else if (!opt.csv_path.empty()) {
+        std::ofstream csv(opt.csv_path);
+        if (!csv) {
+            std::cerr << "failed to open " << opt.csv_path << "\n";
+            return 1;
+        }
+        csv << csv_header() << "\n";
+        for (const auto& row : rows) {
+            csv << row << "\n";
+        }
+        std::cout << "csv written to " << opt.csv_path << "\n";
+    }
+    return 0;
+}
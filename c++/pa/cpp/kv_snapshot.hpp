@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk layout of one sequence snapshot:
+//
+//   [KVSnapshotHeader][int32 block_table[num_logical_blocks]] ... pad to page ...
+//   [block 0: layer 0 bytes][block 0: layer 1 bytes] ... [block 1: layer 0 bytes] ...
+//
+// Block payloads are block-major so one logical block across every layer is a
+// single contiguous range, which is the unit the restore path pages back in.
+// Each layer payload is the KV arena's (layer, block) region as is (fp32 K/V, or
+// int8 K/V followed by the K/V scales), so nothing is re-quantized on restore and
+// a block-major arena saves and restores a block with one copy.
+struct KVSnapshotHeader {
+    char magic[8] = {'P', 'A', 'K', 'V', 'S', 'N', 'P', '1'};
+    uint32_t version = 2;
+    uint32_t num_layers = 0;
+    uint32_t num_heads = 0;
+    uint32_t head_size = 0;
+    uint32_t block_size = 0;
+    uint32_t use_int8_cache = 0;
+    uint32_t past_len = 0;
+    uint32_t num_logical_blocks = 0;
+    uint32_t key_layout = 0;  // KVKeyLayout of the K payload
+    uint32_t evicted_tokens = 0;  // RoPE positions of the KV start here
+    uint64_t layer_block_bytes = 0;
+    uint64_t data_offset = 0;
+};
+
+inline size_t snapshot_page_size() {
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+inline uint64_t snapshot_data_offset(uint32_t num_logical_blocks) {
+    uint64_t meta = sizeof(KVSnapshotHeader) + sizeof(int32_t) * static_cast<uint64_t>(num_logical_blocks);
+    uint64_t page = snapshot_page_size();
+    return (meta + page - 1) / page * page;
+}
+
+class KVSnapshotWriter {
+public:
+    KVSnapshotWriter(const std::string& path, const KVSnapshotHeader& header) : m_header(header) {
+        m_file = std::fopen(path.c_str(), "wb");
+        if (!m_file) {
+            throw std::runtime_error("failed to open snapshot for writing: " + path);
+        }
+        m_header.data_offset = snapshot_data_offset(m_header.num_logical_blocks);
+        write(&m_header, sizeof(m_header));
+    }
+
+    ~KVSnapshotWriter() {
+        if (m_file) {
+            std::fclose(m_file);
+        }
+    }
+
+    KVSnapshotWriter(const KVSnapshotWriter&) = delete;
+    KVSnapshotWriter& operator=(const KVSnapshotWriter&) = delete;
+
+    void write_block_table(const int32_t* blocks) {
+        write(blocks, sizeof(int32_t) * m_header.num_logical_blocks);
+        std::vector<char> pad(m_header.data_offset - sizeof(m_header) - sizeof(int32_t) * m_header.num_logical_blocks, 0);
+        write(pad.data(), pad.size());
+    }
+
+    void write_layer_block(const void* data) {
+        write(data, m_header.layer_block_bytes);
+    }
+
+    // All layers of one block, laid out as consecutive layer payloads.
+    void write_block(const void* data) {
+        write(data, m_header.layer_block_bytes * m_header.num_layers);
+    }
+
+    void close() {
+        if (std::fclose(m_file) != 0) {
+            m_file = nullptr;
+            throw std::runtime_error("failed to flush snapshot");
+        }
+        m_file = nullptr;
+    }
+
+private:
+    KVSnapshotHeader m_header;
+    std::FILE* m_file = nullptr;
+
+    void write(const void* data, size_t bytes) {
+        if (bytes && std::fwrite(data, 1, bytes, m_file) != bytes) {
+            throw std::runtime_error("short write while saving snapshot");
+        }
+    }
+};
+
+// Read-only private mapping of a snapshot file. Pages are only faulted in when a
+// block is actually copied back into the pool.
+class KVSnapshotMapping {
+public:
+    explicit KVSnapshotMapping(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("failed to open snapshot: " + path);
+        }
+        struct stat st {};
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(KVSnapshotHeader)) {
+            ::close(fd);
+            throw std::runtime_error("snapshot too small: " + path);
+        }
+        m_size = static_cast<size_t>(st.st_size);
+        m_base = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m_base == MAP_FAILED) {
+            m_base = nullptr;
+            throw std::runtime_error("failed to mmap snapshot: " + path);
+        }
+        std::memcpy(&m_header, m_base, sizeof(m_header));
+        if (std::memcmp(m_header.magic, KVSnapshotHeader{}.magic, sizeof(m_header.magic)) != 0 ||
+            m_header.version != KVSnapshotHeader{}.version) {
+            unmap();
+            throw std::runtime_error("not a KV snapshot: " + path);
+        }
+        uint64_t expected = m_header.data_offset +
+                            m_header.layer_block_bytes * m_header.num_layers * m_header.num_logical_blocks;
+        if (m_size < expected) {
+            unmap();
+            throw std::runtime_error("truncated KV snapshot: " + path);
+        }
+    }
+
+    ~KVSnapshotMapping() {
+        unmap();
+    }
+
+    KVSnapshotMapping(const KVSnapshotMapping&) = delete;
+    KVSnapshotMapping& operator=(const KVSnapshotMapping&) = delete;
+
+    const KVSnapshotHeader& header() const {
+        return m_header;
+    }
+
+    // Physical block id the i-th logical block had when the snapshot was taken.
+    int32_t saved_physical_block(uint32_t i) const {
+        int32_t block;
+        std::memcpy(&block, static_cast<const char*>(m_base) + sizeof(KVSnapshotHeader) + i * sizeof(int32_t), sizeof(block));
+        return block;
+    }
+
+    const char* layer_block(uint32_t logical_block, uint32_t layer) const {
+        uint64_t offset = m_header.data_offset +
+                          (static_cast<uint64_t>(logical_block) * m_header.num_layers + layer) * m_header.layer_block_bytes;
+        return static_cast<const char*>(m_base) + offset;
+    }
+
+private:
+    void* m_base = nullptr;
+    size_t m_size = 0;
+    KVSnapshotHeader m_header;
+
+    void unmap() {
+        if (m_base) {
+            ::munmap(m_base, m_size);
+            m_base = nullptr;
+        }
+    }
+};
+
+// A pool block whose contents still live in a snapshot mapping.
+struct PendingSnapshotBlock {
+    std::shared_ptr<const KVSnapshotMapping> mapping;
+    uint32_t logical_block = 0;
+};
@@ -0,0 +1,604 @@
+#pragma once
+
+#include "standalone_pa.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Moves prefilled sequences' KV from one runtime process to another over a stream
+// socket, for disaggregated prefill and decode. The stream is a series of frames
+//
+//   [KVTransferFrame{Begin}][KVTransferHeader][int32 block_table[num_blocks]]
+//   [KVTransferFrame{Layer, l}][block 0: layer l region][block 1: layer l region] ...
+//   [KVTransferFrame{End}][float last_hidden[hidden_size]]
+//
+// with one Begin, one Layer frame per layer in layer order and one End per sequence.
+// Frames of the sequences of one prefill batch interleave. A Layer frame is sent as soon
+// as the prefill has finished that layer, so sending layer l overlaps computing layer
+// l + 1. Regions are the arena's (layer, block) regions as is, as in a snapshot, and
+// the receiver reads them straight into fresh blocks of its own arena. The block table
+// is the sender's, for inspection only; the receiver maps logical block i to whatever
+// block it allocated.
+enum class KVTransferFrameKind : uint32_t { Begin = 1, Layer = 2, End = 3 };
+
+struct KVTransferFrame {
+    KVTransferFrameKind kind = KVTransferFrameKind::Begin;
+    uint32_t layer = 0;
+    uint64_t request_id = 0;
+};
+
+struct KVTransferHeader {
+    char magic[8] = {'P', 'A', 'K', 'V', 'X', 'F', 'R', '1'};
+    uint32_t version = 3;
+    uint32_t num_layers = 0;
+    uint32_t num_heads = 0;
+    uint32_t head_size = 0;
+    uint32_t block_size = 0;
+    uint32_t use_int8_cache = 0;
+    uint32_t hidden_size = 0;
+    uint32_t past_len = 0;
+    uint32_t num_blocks = 0;
+    uint32_t key_layout = 0;  // KVKeyLayout
+    uint32_t evicted_tokens = 0;  // RoPE positions of the KV start here
+    uint64_t layer_block_bytes = 0;
+    uint64_t request_id = 0;
+};
+
+struct KVTransferStats {
+    int64_t sequences = 0;
+    int64_t layer_groups = 0;
+    int64_t bytes = 0;
+};
+
+inline KVTransferHeader kv_transfer_header(const ToyLLMRuntime& runtime) {
+    const auto& arena = runtime.kv_arena();
+    KVTransferHeader header;
+    header.num_layers = static_cast<uint32_t>(arena.num_layers());
+    header.num_heads = static_cast<uint32_t>(arena.num_heads());
+    header.head_size = static_cast<uint32_t>(arena.head_size());
+    header.block_size = static_cast<uint32_t>(arena.block_size());
+    header.use_int8_cache = arena.use_int8_cache() ? 1u : 0u;
+    header.key_layout = static_cast<uint32_t>(arena.key_layout());
+    header.hidden_size = static_cast<uint32_t>(runtime.hidden_size());
+    header.layer_block_bytes = arena.layer_block_bytes();
+    return header;
+}
+
+inline sockaddr_un kv_transfer_address(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("socket path too long: " + path);
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+// Listening Unix domain socket at `path`, replacing a stale one.
+inline int kv_transfer_listen(const std::string& path) {
+    sockaddr_un addr = kv_transfer_address(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 4) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::runtime_error("cannot listen on " + path + ": " + std::strerror(err));
+    }
+    return fd;
+}
+
+inline int kv_transfer_accept(int listen_fd) {
+    int fd = ::accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("accept failed: ") + std::strerror(errno));
+    }
+    return fd;
+}
+
+// Retries until the listener is up or timeout_ms has passed.
+inline int kv_transfer_connect(const std::string& path, int timeout_ms) {
+    sockaddr_un addr = kv_transfer_address(path);
+    for (int waited = 0;; waited += 10) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+        }
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return fd;
+        }
+        int err = errno;
+        ::close(fd);
+        if (waited >= timeout_ms) {
+            throw std::runtime_error("cannot connect to " + path + ": " + std::strerror(err));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+// Prefill side. Streams are registered before the prefill that produces them and fed
+// by its layer callback; a writer thread puts the bytes on the socket in order while
+// the prefill thread moves on. The sender only reads the arena: the prefill thread
+// must keep a sequence alive until sent() reports it.
+//
+//   sender.stream(seq_id, request_id, past_len + q_len);
+//   auto out = runtime.prefill({seq_id}, x, {q_len}, sender.layer_callback());
+//   sender.finish(seq_id, out.back());
+//   for (int id : sender.sent()) runtime.finish_sequence(id);
+class KVTransferSender {
+public:
+    KVTransferSender(ToyLLMRuntime& runtime, int fd)
+        : m_runtime(runtime), m_fd(fd), m_header(kv_transfer_header(runtime)), m_thread([this] { writer_loop(); }) {}
+
+    ~KVTransferSender() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        m_thread.join();
+    }
+
+    KVTransferSender(const KVTransferSender&) = delete;
+    KVTransferSender& operator=(const KVTransferSender&) = delete;
+
+    // Sequences with streaming or heavy-hitter retention must not evict during the
+    // prefill, since layers are sent before retention runs. Tokens evicted earlier travel
+    // in the header, so the receiver keeps the RoPE positions of the retained keys.
+    void stream(int seq_id, uint64_t request_id, int kv_len) {
+        Stream s;
+        s.seq_id = seq_id;
+        s.header = m_header;
+        s.header.request_id = request_id;
+        s.header.past_len = static_cast<uint32_t>(kv_len);
+        m_open.push_back(std::move(s));
+    }
+
+    // Queues layer `layer` of every open stream; the first layer also fixes its block table.
+    void layer_done(int layer) {
+        std::vector<Job> jobs;
+        for (auto& s : m_open) {
+            if (layer == 0) {
+                auto blocks = m_runtime.manager().logical_blocks(s.seq_id);
+                int bs = static_cast<int>(m_header.block_size);
+                blocks.resize((s.header.past_len + bs - 1) / bs);
+                s.blocks.assign(blocks.begin(), blocks.end());
+                s.header.num_blocks = static_cast<uint32_t>(blocks.size());
+                s.header.evicted_tokens = static_cast<uint32_t>(m_runtime.manager().evicted_tokens(s.seq_id));
+                jobs.push_back(Job::start(s));
+            }
+            jobs.push_back(Job::layer_of(s, layer));
+        }
+        push(std::move(jobs));
+    }
+
+    ToyLLMRuntime::LayerDoneCallback layer_callback() {
+        return [this](int layer) { layer_done(layer); };
+    }
+
+    // Closes the stream with the prefill's output row for the sequence's last token.
+    void finish(int seq_id, const std::vector<float>& last_hidden) {
+        auto it = std::find_if(m_open.begin(), m_open.end(), [&](const Stream& s) { return s.seq_id == seq_id; });
+        if (it == m_open.end()) {
+            throw std::runtime_error("no open transfer for sequence " + std::to_string(seq_id));
+        }
+        if (last_hidden.size() != m_header.hidden_size) {
+            throw std::runtime_error("last hidden row has the wrong size");
+        }
+        Job job = Job::end(*it, last_hidden);
+        m_open.erase(it);
+        push({std::move(job)});
+    }
+
+    // Sequences whose bytes are all written since the last call; their blocks may be reused.
+    std::vector<int> sent() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<int> out;
+        out.swap(m_sent);
+        return out;
+    }
+
+    // Blocks until everything queued is written; rethrows a write error.
+    void flush() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] { return (m_jobs.empty() && !m_writing) || !m_error.empty(); });
+        if (!m_error.empty()) {
+            throw std::runtime_error(m_error);
+        }
+    }
+
+    KVTransferStats stats() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+private:
+    struct Stream {
+        int seq_id = -1;
+        KVTransferHeader header;
+        std::vector<int32_t> blocks;
+    };
+
+    // Each job carries what it needs, so the writer never touches the manager.
+    struct Job {
+        enum Kind { Start, Layer, End } kind = Start;
+        int seq_id = -1;
+        int layer = 0;
+        KVTransferHeader header;
+        std::vector<int32_t> blocks;
+        std::vector<float> last_hidden;
+
+        static Job start(const Stream& s) {
+            Job job;
+            job.kind = Start;
+            job.seq_id = s.seq_id;
+            job.header = s.header;
+            job.blocks = s.blocks;
+            return job;
+        }
+
+        static Job layer_of(const Stream& s, int layer) {
+            Job job;
+            job.kind = Layer;
+            job.seq_id = s.seq_id;
+            job.layer = layer;
+            job.header = s.header;
+            job.blocks = s.blocks;
+            return job;
+        }
+
+        static Job end(const Stream& s, const std::vector<float>& last_hidden) {
+            Job job;
+            job.kind = End;
+            job.seq_id = s.seq_id;
+            job.header = s.header;
+            job.last_hidden = last_hidden;
+            return job;
+        }
+    };
+
+    ToyLLMRuntime& m_runtime;
+    int m_fd;
+    KVTransferHeader m_header;
+    std::vector<Stream> m_open;  // prefill thread only
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Job> m_jobs;
+    std::vector<int> m_sent;
+    KVTransferStats m_stats;
+    std::string m_error;
+    bool m_writing = false;
+    bool m_stop = false;
+    std::thread m_thread;
+
+    void push(std::vector<Job> jobs) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error.empty()) {
+                throw std::runtime_error(m_error);
+            }
+            for (auto& job : jobs) {
+                m_jobs.push_back(std::move(job));
+            }
+        }
+        m_cv.notify_all();
+    }
+
+    void writer_loop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cv.wait(lock, [&] { return !m_jobs.empty() || m_stop; });
+            if (m_jobs.empty()) {
+                return;
+            }
+            Job job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_writing = true;
+            lock.unlock();
+            int64_t bytes = 0;
+            std::string error;
+            try {
+                bytes = write_job(job);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            lock.lock();
+            m_writing = false;
+            m_stats.bytes += bytes;
+            m_stats.layer_groups += job.kind == Job::Layer ? 1 : 0;
+            if (job.kind == Job::End) {
+                m_stats.sequences += 1;
+                m_sent.push_back(job.seq_id);
+            }
+            if (!error.empty() && m_error.empty()) {
+                m_error = error;
+                m_jobs.clear();
+            }
+            m_cv.notify_all();
+        }
+    }
+
+    int64_t write_job(const Job& job) {
+        KVTransferFrame frame;
+        frame.layer = static_cast<uint32_t>(job.layer);
+        frame.request_id = job.header.request_id;
+        std::vector<iovec> iov = {{&frame, sizeof(frame)}};
+        switch (job.kind) {
+        case Job::Start:
+            frame.kind = KVTransferFrameKind::Begin;
+            iov.push_back({const_cast<KVTransferHeader*>(&job.header), sizeof(job.header)});
+            iov.push_back({const_cast<int32_t*>(job.blocks.data()), job.blocks.size() * sizeof(int32_t)});
+            break;
+        case Job::Layer: {
+            frame.kind = KVTransferFrameKind::Layer;
+            const auto& arena = m_runtime.kv_arena();
+            for (int32_t block : job.blocks) {
+                iov.push_back({const_cast<char*>(arena.layer_block(job.layer, block)), arena.layer_block_bytes()});
+            }
+            break;
+        }
+        case Job::End:
+            frame.kind = KVTransferFrameKind::End;
+            iov.push_back({const_cast<float*>(job.last_hidden.data()), job.last_hidden.size() * sizeof(float)});
+            break;
+        }
+        return write_all(iov);
+    }
+
+    // Gathered sends in IOV_MAX-sized slices, resuming after short writes. MSG_NOSIGNAL
+    // turns a peer that closed early into EPIPE here instead of a process-killing SIGPIPE.
+    int64_t write_all(std::vector<iovec>& iov) {
+        int64_t total = 0;
+        size_t first = 0;
+        while (first < iov.size()) {
+            msghdr msg{};
+            msg.msg_iov = iov.data() + first;
+            msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+            ssize_t n = ::sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EPIPE) {
+                    throw std::runtime_error("KV transfer write failed: the decode side closed the connection");
+                }
+                throw std::runtime_error(std::string("KV transfer write failed: ") + std::strerror(errno));
+            }
+            total += n;
+            size_t left = static_cast<size_t>(n);
+            while (first < iov.size() && left >= iov[first].iov_len) {
+                left -= iov[first].iov_len;
+                ++first;
+            }
+            if (left > 0) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+            }
+        }
+        return total;
+    }
+};
+
+struct ReceivedSequence {
+    uint64_t request_id = 0;
+    int seq_id = -1;
+    int past_len = 0;
+    std::vector<float> last_hidden;
+};
+
+// Decode side. Never blocks: poll() reads whatever the socket holds and leaves the
+// rest for the next call, so a decode loop can call it between steps and a long
+// transfer never delays a step by more than one read. Blocks are allocated when a
+// sequence's Begin frame arrives (sequence id = request id) and filled in place; the
+// sequence is complete, and may be decoded, once poll() returns it.
+class KVTransferReceiver {
+public:
+    KVTransferReceiver(ToyLLMRuntime& runtime, int fd) : m_runtime(runtime), m_fd(fd), m_expected(kv_transfer_header(runtime)) {
+        int flags = ::fcntl(m_fd, F_GETFL, 0);
+        if (flags < 0 || ::fcntl(m_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+            throw std::runtime_error("cannot make the KV transfer socket non-blocking");
+        }
+        expect(State::Frame, &m_frame, sizeof(m_frame));
+    }
+
+    // Appends completed sequences to `done`; returns false once the sender has closed
+    // the connection.
+    bool poll(std::vector<ReceivedSequence>& done) {
+        while (!m_closed && fill()) {
+            advance(done);
+        }
+        return !m_closed;
+    }
+
+    // Waits up to timeout_ms for more bytes.
+    void wait(int timeout_ms) {
+        pollfd pfd{m_fd, POLLIN, 0};
+        ::poll(&pfd, 1, timeout_ms);
+    }
+
+    // Sequences whose Begin arrived but not their End yet.
+    int num_in_flight() const {
+        return static_cast<int>(m_in_flight.size());
+    }
+
+    const KVTransferStats& stats() const {
+        return m_stats;
+    }
+
+private:
+    enum class State { Frame, Header, Table, LayerData, Trailer };
+
+    struct Incoming {
+        ReceivedSequence sequence;
+        std::vector<int> blocks;
+        uint32_t next_layer = 0;
+    };
+
+    ToyLLMRuntime& m_runtime;
+    int m_fd;
+    KVTransferHeader m_expected;
+    KVTransferStats m_stats;
+    bool m_closed = false;
+
+    State m_state = State::Frame;
+    char* m_dst = nullptr;  // current read target
+    size_t m_need = 0;
+    size_t m_have = 0;
+
+    KVTransferFrame m_frame;
+    KVTransferHeader m_header;
+    std::vector<int32_t> m_source_table;
+    std::unordered_map<uint64_t, Incoming> m_in_flight;
+    Incoming* m_current = nullptr;
+    int m_block_index = 0;
+
+    void expect(State state, void* dst, size_t bytes) {
+        m_state = state;
+        m_dst = static_cast<char*>(dst);
+        m_need = bytes;
+        m_have = 0;
+    }
+
+    // Reads into the current target; true once it is complete.
+    bool fill() {
+        while (m_have < m_need) {
+            ssize_t n = ::read(m_fd, m_dst + m_have, m_need - m_have);
+            if (n > 0) {
+                m_have += static_cast<size_t>(n);
+                m_stats.bytes += n;
+                continue;
+            }
+            if (n == 0) {
+                m_closed = true;
+                if (m_have > 0 || m_state != State::Frame || !m_in_flight.empty()) {
+                    throw std::runtime_error("KV transfer connection closed mid-sequence");
+                }
+                return false;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            throw std::runtime_error(std::string("KV transfer read failed: ") + std::strerror(errno));
+        }
+        return true;
+    }
+
+    void advance(std::vector<ReceivedSequence>& done) {
+        switch (m_state) {
+        case State::Frame:
+            begin_frame();
+            break;
+        case State::Header:
+            m_source_table.resize(m_header.num_blocks);
+            expect(State::Table, m_source_table.data(), m_source_table.size() * sizeof(int32_t));
+            break;
+        case State::Table:
+            start_sequence();
+            expect(State::Frame, &m_frame, sizeof(m_frame));
+            break;
+        case State::LayerData:
+            ++m_block_index;
+            next_layer_block();
+            break;
+        case State::Trailer: {
+            auto it = m_in_flight.find(m_frame.request_id);
+            m_stats.sequences += 1;
+            done.push_back(std::move(it->second.sequence));
+            m_in_flight.erase(it);
+            expect(State::Frame, &m_frame, sizeof(m_frame));
+            break;
+        }
+        }
+    }
+
+    void begin_frame() {
+        if (m_frame.kind == KVTransferFrameKind::Begin) {
+            expect(State::Header, &m_header, sizeof(m_header));
+            return;
+        }
+        auto it = m_in_flight.find(m_frame.request_id);
+        if (it == m_in_flight.end()) {
+            throw std::runtime_error("KV transfer frame for an unknown request");
+        }
+        m_current = &it->second;
+        if (m_frame.kind == KVTransferFrameKind::Layer) {
+            if (m_frame.layer != m_current->next_layer || m_frame.layer >= m_expected.num_layers) {
+                throw std::runtime_error("KV transfer layers out of order");
+            }
+            m_block_index = 0;
+            next_layer_block();
+            return;
+        }
+        if (m_frame.kind != KVTransferFrameKind::End || m_current->next_layer != m_expected.num_layers) {
+            throw std::runtime_error("malformed KV transfer frame");
+        }
+        auto& hidden = m_current->sequence.last_hidden;
+        hidden.resize(m_expected.hidden_size);
+        expect(State::Trailer, hidden.data(), hidden.size() * sizeof(float));
+    }
+
+    void start_sequence() {
+        const auto& h = m_header;
+        if (std::memcmp(h.magic, m_expected.magic, sizeof(h.magic)) != 0 || h.version != m_expected.version) {
+            throw std::runtime_error("not a KV transfer stream");
+        }
+        if (h.num_layers != m_expected.num_layers || h.num_heads != m_expected.num_heads ||
+            h.head_size != m_expected.head_size || h.block_size != m_expected.block_size ||
+            h.use_int8_cache != m_expected.use_int8_cache || h.hidden_size != m_expected.hidden_size ||
+            h.key_layout != m_expected.key_layout || h.layer_block_bytes != m_expected.layer_block_bytes) {
+            throw std::runtime_error("KV transfer does not match runtime config");
+        }
+        int bs = static_cast<int>(h.block_size);
+        if (static_cast<int>(h.num_blocks) != (static_cast<int>(h.past_len) + bs - 1) / bs ||
+            h.request_id != m_frame.request_id || m_in_flight.count(h.request_id)) {
+            throw std::runtime_error("malformed KV transfer header");
+        }
+        Incoming incoming;
+        incoming.sequence.request_id = h.request_id;
+        incoming.sequence.seq_id = static_cast<int>(h.request_id);
+        incoming.sequence.past_len = static_cast<int>(h.past_len);
+        incoming.blocks = m_runtime.manager().adopt_sequence(
+            incoming.sequence.seq_id, incoming.sequence.past_len, -1, static_cast<int>(h.evicted_tokens));
+        m_in_flight.emplace(h.request_id, std::move(incoming));
+    }
+
+    // Points the next read at block m_block_index of the current layer, or finishes the
+    // layer group.
+    void next_layer_block() {
+        if (m_block_index < static_cast<int>(m_current->blocks.size())) {
+            auto& arena = m_runtime.kv_arena();
+            int block = m_current->blocks[m_block_index];
+            expect(State::LayerData, arena.layer_block(static_cast<int>(m_frame.layer), block), arena.layer_block_bytes());
+            return;
+        }
+        m_current->next_layer += 1;
+        m_stats.layer_groups += 1;
+        expect(State::Frame, &m_frame, sizeof(m_frame));
+    }
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "pa_thread_pool.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Node/CPU layout read straight from sysfs so no libnuma is needed:
+//   /sys/devices/system/node/online          e.g. "0-1"
+//   /sys/devices/system/node/node<N>/cpulist e.g. "0-27,56-83"
+struct NumaNode {
+    int id = 0;
+    std::vector<int> cpus;
+};
+
+inline std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> ids;
+    std::stringstream ss(text);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        auto dash = range.find('-');
+        int lo = std::stoi(range.substr(0, dash));
+        int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+        for (int i = lo; i <= hi; ++i) {
+            ids.push_back(i);
+        }
+    }
+    return ids;
+}
+
+inline std::string read_sysfs_line(const std::string& path) {
+    std::ifstream f(path);
+    std::string line;
+    std::getline(f, line);
+    return line;
+}
+
+class NumaTopology {
+public:
+    static NumaTopology detect() {
+        NumaTopology topo;
+        std::string online = read_sysfs_line("/sys/devices/system/node/online");
+        if (!online.empty()) {
+            for (int id : parse_cpu_list(online)) {
+                auto cpus = parse_cpu_list(read_sysfs_line("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"));
+                if (!cpus.empty()) {
+                    topo.m_nodes.push_back({id, cpus});
+                }
+            }
+        }
+        if (topo.m_nodes.empty()) {
+            NumaNode node;
+            int n = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+            for (int i = 0; i < n; ++i) {
+                node.cpus.push_back(i);
+            }
+            topo.m_nodes.push_back(node);
+        }
+        return topo;
+    }
+
+    // Splits the CPUs of a detected topology into `num_nodes` pretend nodes, for trying
+    // the placement logic on single-socket machines. Memory binding is disabled.
+    static NumaTopology emulate(int num_nodes) {
+        NumaTopology real = detect();
+        std::vector<int> cpus;
+        for (const auto& node : real.m_nodes) {
+            cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+        }
+        NumaTopology topo;
+        topo.m_emulated = true;
+        for (int n = 0; n < num_nodes; ++n) {
+            NumaNode node;
+            node.id = n;
+            size_t begin = cpus.size() * n / num_nodes;
+            size_t end = cpus.size() * (n + 1) / num_nodes;
+            if (begin == end) {
+                node.cpus.push_back(cpus[begin % cpus.size()]);
+            } else {
+                node.cpus.assign(cpus.begin() + begin, cpus.begin() + end);
+            }
+            topo.m_nodes.push_back(node);
+        }
+        return topo;
+    }
+
+    int num_nodes() const {
+        return static_cast<int>(m_nodes.size());
+    }
+
+    const NumaNode& node(int index) const {
+        return m_nodes[index];
+    }
+
+    bool emulated() const {
+        return m_emulated;
+    }
+
+private:
+    std::vector<NumaNode> m_nodes;
+    bool m_emulated = false;
+};
+
+// Node index (not sysfs id) that owns `block` when `num_blocks` are split into
+// `num_nodes` contiguous ranges. KVBlockManager and the executors must agree on this.
+inline int numa_block_begin(int node, int num_blocks, int num_nodes) {
+    return static_cast<int>(static_cast<int64_t>(num_blocks) * node / num_nodes);
+}
+
+inline int numa_block_node(int block, int num_blocks, int num_nodes) {
+    int node = num_nodes - 1;
+    while (node > 0 && block < numa_block_begin(node, num_blocks, num_nodes)) {
+        --node;
+    }
+    return node;
+}
+
+// mbind(2) through the raw syscall. The range is widened to page boundaries, so a
+// page straddling two nodes' block ranges goes to whichever range is bound last.
+inline bool bind_memory_to_node(void* addr, size_t bytes, int node_id) {
+    constexpr int kMpolBind = 2;
+    constexpr unsigned kMpolMfMove = 1u << 1;
+    if (!addr || bytes == 0 || node_id < 0 || node_id >= 64) {
+        return false;
+    }
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr) & ~(page - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + bytes + page - 1) & ~(page - 1);
+    unsigned long mask = 1ul << node_id;
+    long rc = syscall(SYS_mbind, begin, end - begin, kMpolBind, &mask, sizeof(mask) * 8, kMpolMfMove);
+    return rc == 0;
+}
+
+struct NumaOptions {
+    bool enabled = false;
+    int emulate_nodes = 0;     // > 0: pretend the machine has this many nodes (no binding)
+    int threads_per_node = 0;  // 0 = every CPU of the node
+    bool bind_memory = true;
+};
+
+// Topology plus one pinned worker pool per node, shared by every layer's executor.
+class NumaPlacement {
+public:
+    explicit NumaPlacement(const NumaOptions& options)
+        : m_topology(options.emulate_nodes > 0 ? NumaTopology::emulate(options.emulate_nodes) : NumaTopology::detect()),
+          m_bind_memory(options.bind_memory && !m_topology.emulated()) {
+        for (int n = 0; n < m_topology.num_nodes(); ++n) {
+            const auto& cpus = m_topology.node(n).cpus;
+            int threads = options.threads_per_node > 0 ? options.threads_per_node : static_cast<int>(cpus.size());
+            m_pools.emplace_back(new ThreadPool(threads, cpus));
+        }
+    }
+
+    const NumaTopology& topology() const {
+        return m_topology;
+    }
+
+    int num_nodes() const {
+        return m_topology.num_nodes();
+    }
+
+    bool bind_memory() const {
+        return m_bind_memory;
+    }
+
+    ThreadPool& pool(int node) const {
+        return *m_pools[node];
+    }
+
+private:
+    NumaTopology m_topology;
+    bool m_bind_memory;
+    std::vector<std::unique_ptr<ThreadPool>> m_pools;
+};
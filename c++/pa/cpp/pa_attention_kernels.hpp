@@ -0,0 +1,307 @@
+#pragma once
+
+#include "kv_pool_allocator.hpp"
+#include "pa_quant_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Single-head paged attention for one query row, reading K/V directly from the
+// block regions of the KV arena instead of gathering them into temporaries. V is
+// [head][slot][dim]; K is the same (KVKeyLayout::SlotMajor) or [head][dim][slot]
+// (DimMajor).
+//
+// Every kernel is one template body. HS / BS of 0 mean "take head_size /
+// block_size from the args"; any other value turns the QK and PV loops into fixed
+// trip counts the compiler can fully unroll, keeping the PV accumulator in registers.
+// The body is compiled once per ISA. Both K layouts sum in the same order, so they
+// are bit-identical where the compiler does not contract into FMAs (the baseline
+// build) and agree to the last bits where it does.
+struct AttentionHeadArgs {
+    const float* q = nullptr;   // [head_size]
+    float* out = nullptr;       // [head_size]
+    float* scores = nullptr;    // scratch, >= kv_len
+    const int* blocks = nullptr;  // physical block of each logical block
+    int kv_len = 0;
+    int head_size = 0;
+    int block_size = 0;
+    float scale = 1.0f;
+    float* mass = nullptr;  // optional, [kv_len]: each slot's softmax probability is added
+
+    // (block, head) starts blocks[i] * block_stride bytes past k_cache / v_cache,
+    // then head_offset elements in.
+    const char* k_cache = nullptr;
+    const char* v_cache = nullptr;
+    size_t block_stride = 0;
+    size_t head_offset = 0;
+
+    // int8 only: per-slot scales, same block stride, then scale_head_offset floats in.
+    const char* k_scales = nullptr;
+    const char* v_scales = nullptr;
+    size_t scale_head_offset = 0;
+};
+
+using AttentionHeadFn = void (*)(const AttentionHeadArgs&);
+
+// Eight independent partial sums vectorize without -ffast-math reassociation.
+template <int HS, typename T>
+inline float attention_dot(const float* q, const T* k, int head_size) {
+    const int hs = HS ? HS : head_size;
+    constexpr int kLanes = 8;
+    float lanes[kLanes] = {};
+    int d = 0;
+    for (; d + kLanes <= hs; d += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            lanes[j] += q[d + j] * static_cast<float>(k[d + j]);
+        }
+    }
+    float s = 0.0f;
+    for (; d < hs; ++d) {
+        s += q[d] * static_cast<float>(k[d]);
+    }
+    for (int j = 0; j < kLanes; ++j) {
+        s += lanes[j];
+    }
+    return s;
+}
+
+// Scores of slots [0, n) of one block from its [dim][slot] keys: every q[d] is
+// broadcast against a contiguous row of slots, so the slots are the vector lanes and
+// nothing is reduced across lanes. Each slot keeps the eight partial sums of
+// attention_dot, which makes its score bit-identical to the slot-major one.
+template <int HS, int BS, typename T>
+inline void attention_dot_transposed(const float* q, const T* k, int head_size, int block_size, int n, float* s) {
+    const int hs = HS ? HS : head_size;
+    const int bs = BS ? BS : block_size;
+    constexpr int kLanes = 8;
+    constexpr int kChunk = BS ? BS : 16;
+    for (int first = 0; first < n; first += kChunk) {
+        const int m = std::min(kChunk, n - first);
+        const T* kc = k + first;
+        float lanes[kLanes][kChunk] = {};
+        int d = 0;
+        for (; d + kLanes <= hs; d += kLanes) {
+#pragma GCC unroll 8
+            for (int j = 0; j < kLanes; ++j) {
+                const float qd = q[d + j];
+                const T* row = kc + static_cast<size_t>(d + j) * bs;
+                for (int o = 0; o < m; ++o) {
+                    lanes[j][o] += qd * static_cast<float>(row[o]);
+                }
+            }
+        }
+        for (int o = 0; o < m; ++o) {
+            float sum = 0.0f;
+            for (int t = d; t < hs; ++t) {
+                sum += q[t] * static_cast<float>(kc[static_cast<size_t>(t) * bs + o]);
+            }
+            for (int j = 0; j < kLanes; ++j) {
+                sum += lanes[j][o];
+            }
+            s[first + o] = sum;
+        }
+    }
+}
+
+template <int HS, typename T>
+inline void attention_axpy(float* acc, float p, const T* v, int head_size) {
+    const int hs = HS ? HS : head_size;
+    for (int d = 0; d < hs; ++d) {
+        acc[d] += p * static_cast<float>(v[d]);
+    }
+}
+
+template <typename T, int HS, int BS, KVKeyLayout KL>
+inline void attention_head_kernel(const AttentionHeadArgs& a) {
+    constexpr bool kQuantized = std::is_same<T, int8_t>::value;
+    const int hs = HS ? HS : a.head_size;
+    const int bs = BS ? BS : a.block_size;
+
+    // QK: scores for every context slot, block by block.
+    float max_s = -std::numeric_limits<float>::infinity();
+    for (int lb = 0, pos = 0; pos < a.kv_len; ++lb, pos += bs) {
+        const size_t block = static_cast<size_t>(a.blocks[lb]);
+        const T* kb = reinterpret_cast<const T*>(a.k_cache + block * a.block_stride) + a.head_offset;
+        const float* ks = kQuantized ? reinterpret_cast<const float*>(a.k_scales + block * a.block_stride) + a.scale_head_offset : nullptr;
+        float* sb = a.scores + pos;
+        auto score_block = [&](int n) {
+            if (KL == KVKeyLayout::DimMajor) {
+                attention_dot_transposed<HS, BS>(a.q, kb, hs, bs, n, sb);
+            } else {
+                for (int o = 0; o < n; ++o) {
+                    sb[o] = attention_dot<HS>(a.q, kb + static_cast<size_t>(o) * hs, hs);
+                }
+            }
+            for (int o = 0; o < n; ++o) {
+                float s = sb[o] * a.scale;
+                if (kQuantized) {
+                    s *= ks[o];
+                }
+                sb[o] = s;
+                max_s = std::max(max_s, s);
+            }
+        };
+        const int n = std::min(bs, a.kv_len - pos);
+        if (n == bs) {
+            score_block(bs);
+        } else {
+            score_block(n);
+        }
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < a.kv_len; ++i) {
+        a.scores[i] = std::exp(a.scores[i] - max_s);
+        sum += a.scores[i];
+    }
+    const float inv_sum = 1.0f / sum;
+
+    // PV: with a fixed HS the accumulator is a register-resident local array; the
+    // generic kernel accumulates straight into `out`.
+    float acc_fixed[HS ? HS : 1];
+    float* acc = HS ? acc_fixed : a.out;
+    std::fill(acc, acc + hs, 0.0f);
+    for (int lb = 0, pos = 0; pos < a.kv_len; ++lb, pos += bs) {
+        const size_t block = static_cast<size_t>(a.blocks[lb]);
+        const T* vb = reinterpret_cast<const T*>(a.v_cache + block * a.block_stride) + a.head_offset;
+        const float* vs = kQuantized ? reinterpret_cast<const float*>(a.v_scales + block * a.block_stride) + a.scale_head_offset : nullptr;
+        const float* pb = a.scores + pos;
+        float* mb = a.mass ? a.mass + pos : nullptr;
+        auto accumulate_slot = [&](int o) {
+            float p = pb[o] * inv_sum;
+            if (mb) {
+                mb[o] += p;
+            }
+            if (kQuantized) {
+                p *= vs[o];
+            }
+            attention_axpy<HS>(acc, p, vb + static_cast<size_t>(o) * hs, hs);
+        };
+        const int n = std::min(bs, a.kv_len - pos);
+        if (n == bs) {
+            for (int o = 0; o < bs; ++o) {
+                accumulate_slot(o);
+            }
+        } else {
+            for (int o = 0; o < n; ++o) {
+                accumulate_slot(o);
+            }
+        }
+    }
+    if (HS) {
+        std::copy(acc, acc + hs, a.out);
+    }
+}
+
+// The same body with the vector width of each ISA; flatten inlines the helpers and
+// lambdas so all of it is compiled for the target. The AVX2 and AVX-512 builds contract
+// multiply-adds into FMAs, so their outputs differ from the baseline build in the last
+// bits. Only x86 gets the ISA builds; elsewhere the baseline entries are the registry.
+#if defined(__x86_64__) || defined(__i386__)
+template <typename T, int HS, int BS, KVKeyLayout KL>
+__attribute__((target("avx512f"), flatten)) void attention_head_kernel_avx512f(const AttentionHeadArgs& a) {
+    attention_head_kernel<T, HS, BS, KL>(a);
+}
+
+template <typename T, int HS, int BS, KVKeyLayout KL>
+__attribute__((target("avx2,fma"), flatten)) void attention_head_kernel_avx2(const AttentionHeadArgs& a) {
+    attention_head_kernel<T, HS, BS, KL>(a);
+}
+#endif
+
+template <typename T, int HS, int BS, KVKeyLayout KL>
+__attribute__((flatten)) void attention_head_kernel_baseline(const AttentionHeadArgs& a) {
+    attention_head_kernel<T, HS, BS, KL>(a);
+}
+
+inline bool cpu_has_avx2_fma() {
+#if defined(__x86_64__) || defined(__i386__)
+    return cpu_has_avx2() && __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
+struct AttentionKernelEntry {
+    const char* isa;
+    bool (*supported)();
+    bool int8_cache;
+    KVKeyLayout key_layout;
+    int head_size;  // 0 = any
+    int block_size; // 0 = any
+    AttentionHeadFn fn;
+    const char* name;
+};
+
+#define PA_ATTN_KERNEL(ISA, SUPPORTED, T, HS, BS, KL)                          \
+    {#ISA, &SUPPORTED, std::is_same<T, int8_t>::value, KVKeyLayout::KL, HS, BS, \
+     &attention_head_kernel_##ISA<T, HS, BS, KVKeyLayout::KL>, #T "_hs" #HS "_bs" #BS "_" #KL "_" #ISA}
+
+#define PA_ATTN_KERNELS(ISA, SUPPORTED, KL)              \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, float, 64, 16, KL),   \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, float, 64, 32, KL),   \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, float, 128, 16, KL),  \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, float, 128, 32, KL),  \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, int8_t, 64, 16, KL),  \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, int8_t, 64, 32, KL),  \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, int8_t, 128, 16, KL), \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, int8_t, 128, 32, KL), \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, float, 0, 0, KL),     \
+    PA_ATTN_KERNEL(ISA, SUPPORTED, int8_t, 0, 0, KL)
+
+// Widest ISA first; within one, specializations for the common (head_size,
+// block_size) pairs, generic last. The baseline entries always match.
+inline const std::vector<AttentionKernelEntry>& attention_kernel_registry() {
+    static const std::vector<AttentionKernelEntry> registry = {
+#if defined(__x86_64__) || defined(__i386__)
+        PA_ATTN_KERNELS(avx512f, cpu_has_avx512f, SlotMajor),
+        PA_ATTN_KERNELS(avx512f, cpu_has_avx512f, DimMajor),
+        PA_ATTN_KERNELS(avx2, cpu_has_avx2_fma, SlotMajor),
+        PA_ATTN_KERNELS(avx2, cpu_has_avx2_fma, DimMajor),
+#endif
+        PA_ATTN_KERNELS(baseline, cpu_has_baseline, SlotMajor),
+        PA_ATTN_KERNELS(baseline, cpu_has_baseline, DimMajor),
+    };
+    return registry;
+}
+
+#undef PA_ATTN_KERNELS
+#undef PA_ATTN_KERNEL
+
+inline const AttentionKernelEntry& select_attention_kernel(
+    bool int8_cache, int head_size, int block_size, KVKeyLayout key_layout) {
+    for (const auto& entry : attention_kernel_registry()) {
+        if (entry.int8_cache != int8_cache || entry.key_layout != key_layout || !entry.supported()) {
+            continue;
+        }
+        bool hs_ok = entry.head_size == 0 || entry.head_size == head_size;
+        bool bs_ok = entry.block_size == 0 || entry.block_size == block_size;
+        if (hs_ok && bs_ok) {
+            return entry;
+        }
+    }
+    throw std::runtime_error(std::string("no attention kernel for K layout ") + kv_key_layout_name(key_layout));
+}
+
+// What KVKeyLayout::Auto stands for, from bench_pa sweeps of both layouts. The
+// dim-major QK keeps block_size slots per lane group in registers: int8 keys win on
+// every ISA (the widening happens once per slot row), fp32 keys only with AVX-512's 32
+// registers. The generic kernels walk a dim-major block in fixed chunks and lose, so
+// shapes without a specialization stay slot-major.
+inline KVKeyLayout resolve_key_layout(KVKeyLayout layout, bool int8_cache, int head_size, int block_size) {
+    if (layout != KVKeyLayout::Auto) {
+        return layout;
+    }
+    const auto& kernel = select_attention_kernel(int8_cache, head_size, block_size, KVKeyLayout::DimMajor);
+    if (kernel.head_size == 0) {
+        return KVKeyLayout::SlotMajor;
+    }
+    return int8_cache || cpu_has_avx512f() ? KVKeyLayout::DimMajor : KVKeyLayout::SlotMajor;
+}
@@ -0,0 +1,426 @@
+#pragma once
+
+#include "pa_quant_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Element-wise building blocks of the layer and the sampler: the projection inner loop,
+// RMSNorm, the SwiGLU activation, and the max / exp / threshold scans over logits. The
+// plain loops use the fixed 8-wide bodies of rope_rotate / attention_dot, which vectorize
+// at -O2 without -ffast-math. exp and index compaction do not auto-vectorize, so those
+// have explicit AVX-512 / AVX2 variants picked at run time like the int8 quantization
+// kernels, compiled on x86 only.
+
+// y += a * x
+inline void eltwise_axpy(float a, const float* __restrict x, float* __restrict y, int n) {
+    constexpr int kLanes = 8;
+    int i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            y[i + j] += a * x[i + j];
+        }
+    }
+    for (; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+// y += x
+inline void eltwise_add(const float* __restrict x, float* __restrict y, int n) {
+    constexpr int kLanes = 8;
+    int i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            y[i + j] += x[i + j];
+        }
+    }
+    for (; i < n; ++i) {
+        y[i] += x[i];
+    }
+}
+
+inline float eltwise_dot(const float* a, const float* b, int n) {
+    constexpr int kLanes = 8;
+    float lanes[kLanes] = {};
+    int i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            lanes[j] += a[i + j] * b[i + j];
+        }
+    }
+    float s = 0.0f;
+    for (; i < n; ++i) {
+        s += a[i] * b[i];
+    }
+    for (int j = 0; j < kLanes; ++j) {
+        s += lanes[j];
+    }
+    return s;
+}
+
+inline float eltwise_sum(const float* x, int n) {
+    constexpr int kLanes = 8;
+    float lanes[kLanes] = {};
+    int i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            lanes[j] += x[i + j];
+        }
+    }
+    float s = 0.0f;
+    for (; i < n; ++i) {
+        s += x[i];
+    }
+    for (int j = 0; j < kLanes; ++j) {
+        s += lanes[j];
+    }
+    return s;
+}
+
+// Sum of val[i] over the i with key[i] >= threshold. Loading both operands of the select
+// first lets GCC emit a compare and an and; the inline form `? val[i + j] : 0.0f` ran
+// several times slower.
+inline float eltwise_sum_ge(const float* key, const float* val, int n, float threshold) {
+    constexpr int kLanes = 8;
+    float lanes[kLanes] = {};
+    int i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            float v = val[i + j];
+            float zero = 0.0f;
+            lanes[j] += key[i + j] >= threshold ? v : zero;
+        }
+    }
+    float s = 0.0f;
+    for (; i < n; ++i) {
+        s += key[i] >= threshold ? val[i] : 0.0f;
+    }
+    for (int j = 0; j < kLanes; ++j) {
+        s += lanes[j];
+    }
+    return s;
+}
+
+// n >= 1. The a > b ? a : b form is what maxps computes, so the lanes vectorize.
+inline float eltwise_max(const float* x, int n) {
+    constexpr int kLanes = 8;
+    float m = x[0];
+    int i = 0;
+    if (n >= kLanes) {
+        float lanes[kLanes];
+        for (int j = 0; j < kLanes; ++j) {
+            lanes[j] = x[j];
+        }
+        for (i = kLanes; i + kLanes <= n; i += kLanes) {
+            for (int j = 0; j < kLanes; ++j) {
+                lanes[j] = lanes[j] > x[i + j] ? lanes[j] : x[i + j];
+            }
+        }
+        for (int j = 0; j < kLanes; ++j) {
+            m = m > lanes[j] ? m : lanes[j];
+        }
+    }
+    for (; i < n; ++i) {
+        m = m > x[i] ? m : x[i];
+    }
+    return m;
+}
+
+inline float eltwise_min(const float* x, int n) {
+    constexpr int kLanes = 8;
+    float m = x[0];
+    int i = 0;
+    if (n >= kLanes) {
+        float lanes[kLanes];
+        for (int j = 0; j < kLanes; ++j) {
+            lanes[j] = x[j];
+        }
+        for (i = kLanes; i + kLanes <= n; i += kLanes) {
+            for (int j = 0; j < kLanes; ++j) {
+                lanes[j] = lanes[j] < x[i + j] ? lanes[j] : x[i + j];
+            }
+        }
+        for (int j = 0; j < kLanes; ++j) {
+            m = m < lanes[j] ? m : lanes[j];
+        }
+    }
+    for (; i < n; ++i) {
+        m = m < x[i] ? m : x[i];
+    }
+    return m;
+}
+
+inline float eltwise_sum_squares(const float* x, int n) {
+    constexpr int kLanes = 8;
+    float lanes[kLanes] = {};
+    int i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            lanes[j] += x[i + j] * x[i + j];
+        }
+    }
+    float s = 0.0f;
+    for (; i < n; ++i) {
+        s += x[i] * x[i];
+    }
+    for (int j = 0; j < kLanes; ++j) {
+        s += lanes[j];
+    }
+    return s;
+}
+
+// RMSNorm(x)_i = x_i * inv_rms * weight_i. Callers fold the two factors into the read
+// of the next projection instead of writing the normalized row.
+inline float rms_norm_inv(const float* x, int n, float eps) {
+    return 1.0f / std::sqrt(eltwise_sum_squares(x, n) / static_cast<float>(n) + eps);
+}
+
+// exp(x) as 2^k * p(r) with x = k ln2 + r, the Cephes expf polynomial. The input is
+// clamped to [-87, 88], where 2^k stays a normal float. Every variant below evaluates
+// the same operations in the same order. Contraction into FMA is off for them (AVX-512
+// implies FMA), so all ISAs produce the same bits. That guarantee is GCC-only: other
+// compilers ignore the optimize pragma and may contract under their own defaults.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+namespace eltwise_exp_detail {
+constexpr float kLo = -87.0f;
+constexpr float kHi = 88.0f;
+constexpr float kLog2e = 1.44269504088896341f;
+constexpr float kLn2Hi = 0.693359375f;
+constexpr float kLn2Lo = -2.12194440e-4f;
+constexpr float kP0 = 1.9875691500e-4f;
+constexpr float kP1 = 1.3981999507e-3f;
+constexpr float kP2 = 8.3334519073e-3f;
+constexpr float kP3 = 4.1665795894e-2f;
+constexpr float kP4 = 1.6666665459e-1f;
+constexpr float kP5 = 5.0000001201e-1f;
+}  // namespace eltwise_exp_detail
+
+inline float eltwise_exp_scalar(float x) {
+    using namespace eltwise_exp_detail;
+    x = std::min(kHi, std::max(kLo, x));
+    float k = std::floor(x * kLog2e + 0.5f);
+    float r = x - k * kLn2Hi;
+    r = r - k * kLn2Lo;
+    float p = kP0;
+    p = p * r + kP1;
+    p = p * r + kP2;
+    p = p * r + kP3;
+    p = p * r + kP4;
+    p = p * r + kP5;
+    float y = p * (r * r);
+    y = y + r;
+    y = y + 1.0f;
+    int32_t bits = (static_cast<int32_t>(k) + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return y * scale;
+}
+
+// out = silu(gate) * up, silu(g) = g / (1 + exp(-g)). out may alias gate or up.
+using SiluMulFn = void (*)(const float* gate, const float* up, float* out, int n);
+
+inline void silu_mul_scalar(const float* gate, const float* up, float* out, int n) {
+    for (int i = 0; i < n; ++i) {
+        float g = gate[i];
+        out[i] = g / (1.0f + eltwise_exp_scalar(-g)) * up[i];
+    }
+}
+
+// out = exp((x - shift) * scale), the unnormalized softmax of logits at a temperature.
+using ExpScaledFn = void (*)(const float* x, float shift, float scale, float* out, int n);
+
+inline void exp_scaled_scalar(const float* x, float shift, float scale, float* out, int n) {
+    for (int i = 0; i < n; ++i) {
+        out[i] = eltwise_exp_scalar((x[i] - shift) * scale);
+    }
+}
+
+// Writes the indices i with x[i] >= threshold to idx, ascending, and returns how many.
+// idx must have room for n.
+using SelectGeFn = int (*)(const float* x, int n, float threshold, int32_t* idx);
+
+inline int select_ge_scalar(const float* x, int n, float threshold, int32_t* idx) {
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        idx[count] = i;
+        count += x[i] >= threshold ? 1 : 0;
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) inline __m256 eltwise_exp_avx2(__m256 x) {
+    using namespace eltwise_exp_detail;
+    x = _mm256_min_ps(_mm256_set1_ps(kHi), _mm256_max_ps(_mm256_set1_ps(kLo), x));
+    __m256 k = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(kLog2e)), _mm256_set1_ps(0.5f)));
+    __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(k, _mm256_set1_ps(kLn2Hi)));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(k, _mm256_set1_ps(kLn2Lo)));
+    __m256 p = _mm256_set1_ps(kP0);
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(kP1));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(kP2));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(kP3));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(kP4));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(kP5));
+    __m256 y = _mm256_mul_ps(p, _mm256_mul_ps(r, r));
+    y = _mm256_add_ps(y, r);
+    y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(k), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2"))) inline void silu_mul_avx2(const float* gate, const float* up, float* out, int n) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 g = _mm256_loadu_ps(gate + i);
+        __m256 e = eltwise_exp_avx2(_mm256_xor_ps(g, sign));
+        __m256 s = _mm256_div_ps(g, _mm256_add_ps(one, e));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(s, _mm256_loadu_ps(up + i)));
+    }
+    silu_mul_scalar(gate + i, up + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline void exp_scaled_avx2(const float* x, float shift, float scale, float* out, int n) {
+    const __m256 vshift = _mm256_set1_ps(shift);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 t = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), vshift), vscale);
+        _mm256_storeu_ps(out + i, eltwise_exp_avx2(t));
+    }
+    exp_scaled_scalar(x + i, shift, scale, out + i, n - i);
+}
+
+// Compare, movemask, then one store per set bit.
+__attribute__((target("avx2"))) inline int select_ge_avx2(const float* x, int n, float threshold, int32_t* idx) {
+    const __m256 t = _mm256_set1_ps(threshold);
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(x + i), t, _CMP_GE_OQ)));
+        while (mask) {
+            idx[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; ++i) {
+        if (x[i] >= threshold) {
+            idx[count++] = i;
+        }
+    }
+    return count;
+}
+
+// See pa_quant_kernels.hpp for why -Wuninitialized is silenced around AVX-512 code.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f"))) inline __m512 eltwise_exp_avx512(__m512 x) {
+    using namespace eltwise_exp_detail;
+    x = _mm512_min_ps(_mm512_set1_ps(kHi), _mm512_max_ps(_mm512_set1_ps(kLo), x));
+    __m512 k = _mm512_roundscale_ps(
+        _mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(kLog2e)), _mm512_set1_ps(0.5f)),
+        _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_sub_ps(x, _mm512_mul_ps(k, _mm512_set1_ps(kLn2Hi)));
+    r = _mm512_sub_ps(r, _mm512_mul_ps(k, _mm512_set1_ps(kLn2Lo)));
+    __m512 p = _mm512_set1_ps(kP0);
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(kP1));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(kP2));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(kP3));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(kP4));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(kP5));
+    __m512 y = _mm512_mul_ps(p, _mm512_mul_ps(r, r));
+    y = _mm512_add_ps(y, r);
+    y = _mm512_add_ps(y, _mm512_set1_ps(1.0f));
+    __m512i bits = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(k), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(bits));
+}
+
+// Masked tail as in quantize_row_int8_avx512; masked-off lanes compute on zeros.
+__attribute__((target("avx512f"))) inline void silu_mul_avx512(const float* gate, const float* up, float* out, int n) {
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512i sign = _mm512_set1_epi32(static_cast<int>(0x80000000u));
+    for (int i = 0; i < n; i += 16) {
+        const __mmask16 mask = n - i >= 16 ? static_cast<__mmask16>(0xFFFF)
+                                           : static_cast<__mmask16>((1u << (n - i)) - 1);
+        __m512 g = _mm512_maskz_loadu_ps(mask, gate + i);
+        __m512 neg = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(g), sign));
+        __m512 s = _mm512_div_ps(g, _mm512_add_ps(one, eltwise_exp_avx512(neg)));
+        _mm512_mask_storeu_ps(out + i, mask, _mm512_mul_ps(s, _mm512_maskz_loadu_ps(mask, up + i)));
+    }
+}
+
+__attribute__((target("avx512f"))) inline void exp_scaled_avx512(
+    const float* x, float shift, float scale, float* out, int n) {
+    const __m512 vshift = _mm512_set1_ps(shift);
+    const __m512 vscale = _mm512_set1_ps(scale);
+    for (int i = 0; i < n; i += 16) {
+        const __mmask16 mask = n - i >= 16 ? static_cast<__mmask16>(0xFFFF)
+                                           : static_cast<__mmask16>((1u << (n - i)) - 1);
+        __m512 t = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i), vshift), vscale);
+        _mm512_mask_storeu_ps(out + i, mask, eltwise_exp_avx512(t));
+    }
+}
+
+// The compare mask drives a compress-store of the lane indices, no per-bit loop.
+__attribute__((target("avx512f"))) inline int select_ge_avx512(const float* x, int n, float threshold, int32_t* idx) {
+    const __m512 t = _mm512_set1_ps(threshold);
+    const __m512i step = _mm512_set1_epi32(16);
+    __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    int count = 0;
+    for (int i = 0; i < n; i += 16) {
+        const __mmask16 valid = n - i >= 16 ? static_cast<__mmask16>(0xFFFF)
+                                            : static_cast<__mmask16>((1u << (n - i)) - 1);
+        __mmask16 hit = _mm512_mask_cmp_ps_mask(valid, _mm512_maskz_loadu_ps(valid, x + i), t, _CMP_GE_OQ);
+        _mm512_mask_compressstoreu_epi32(idx + count, hit, lanes);
+        count += __builtin_popcount(static_cast<unsigned>(hit));
+        lanes = _mm512_add_epi32(lanes, step);
+    }
+    return count;
+}
+#pragma GCC diagnostic pop
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+struct EltwiseKernelEntry {
+    const char* isa;
+    bool (*supported)();
+    SiluMulFn silu_mul;
+    ExpScaledFn exp_scaled;
+    SelectGeFn select_ge;
+};
+
+// Widest first; the scalar entry always matches.
+inline const std::vector<EltwiseKernelEntry>& eltwise_kernel_registry() {
+    static const std::vector<EltwiseKernelEntry> registry = {
+#if defined(__x86_64__) || defined(__i386__)
+        {"avx512", &cpu_has_avx512f, &silu_mul_avx512, &exp_scaled_avx512, &select_ge_avx512},
+        {"avx2", &cpu_has_avx2, &silu_mul_avx2, &exp_scaled_avx2, &select_ge_avx2},
+#endif
+        {"scalar", &cpu_has_baseline, &silu_mul_scalar, &exp_scaled_scalar, &select_ge_scalar},
+    };
+    return registry;
+}
+
+inline const EltwiseKernelEntry& select_eltwise_kernel() {
+    for (const auto& entry : eltwise_kernel_registry()) {
+        if (entry.supported()) {
+            return entry;
+        }
+    }
+    return eltwise_kernel_registry().back();
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "pa_thread_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Layer pipelining of one step. The layers are cut into `stages` contiguous ranges, each
+// run by its own thread, and the batch into micro-batches that flow through the stages
+// in order over bounded queues, so stage s works on micro-batch m while stage s + 1
+// works on m - 1.
+struct PipelineOptions {
+    int stages = 1;         // 1 = no pipelining
+    int micro_batches = 0;  // per step; 0 = one per stage. Capped at the batch size.
+    int queue_depth = 2;    // micro-batches a stage may run ahead of the next one
+    // Optional CPU set per stage's thread.
+    std::vector<std::vector<int>> stage_cpus;
+};
+
+// Summed over every pipelined step.
+struct PipelineStats {
+    int64_t steps = 0;
+    int64_t micro_batches = 0;
+    double wall_seconds = 0.0;
+    double busy_seconds = 0.0;  // summed over stages
+
+    // Share of stage time spent idle: 1 - busy / (stages * wall).
+    double bubble_fraction(int stages) const {
+        double capacity = stages * wall_seconds;
+        return capacity > 0.0 ? 1.0 - busy_seconds / capacity : 0.0;
+    }
+};
+
+// Blocking FIFO of bounded capacity. close() wakes every waiter: push then fails and
+// pop fails once the queue is empty.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : m_capacity(capacity < 1 ? 1 : capacity) {}
+
+    bool push(T value) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [this] { return m_closed || m_items.size() < m_capacity; });
+        if (m_closed) {
+            return false;
+        }
+        m_items.push_back(std::move(value));
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T& value) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this] { return m_closed || !m_items.empty(); });
+        if (m_items.empty()) {
+            return false;
+        }
+        value = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_full.notify_all();
+        m_not_empty.notify_all();
+    }
+
+    void reopen() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_items.clear();
+        m_closed = false;
+    }
+
+private:
+    size_t m_capacity;
+    std::deque<T> m_items;
+    std::mutex m_mutex;
+    std::condition_variable m_not_full;
+    std::condition_variable m_not_empty;
+    bool m_closed = false;
+};
+
+// Stage 0 runs on the calling thread, every later stage on a single-thread pool of its
+// own. The layer ranges are the caller's business; the pipeline only sequences calls.
+class LayerPipeline {
+public:
+    explicit LayerPipeline(const PipelineOptions& options) : m_options(options), m_busy(options.stages, 0.0) {
+        if (options.stages < 1) {
+            throw std::runtime_error("a pipeline needs at least one stage");
+        }
+        for (int s = 0; s < options.stages; ++s) {
+            m_queues.emplace_back(new BoundedQueue<int>(static_cast<size_t>(options.queue_depth)));
+            if (s > 0) {
+                std::vector<int> cpus = s < static_cast<int>(options.stage_cpus.size()) ? options.stage_cpus[s]
+                                                                                         : std::vector<int>{};
+                m_workers.emplace_back(new ThreadPool(1, cpus));
+            }
+        }
+        if (!options.stage_cpus.empty()) {
+            pin_current_thread(options.stage_cpus[0]);
+        }
+    }
+
+    int stages() const {
+        return m_options.stages;
+    }
+
+    // Micro-batches to cut a batch of `batch` sequences into.
+    int micro_batches_for(int batch) const {
+        int wanted = m_options.micro_batches > 0 ? m_options.micro_batches : stages();
+        return std::max(1, std::min(wanted, batch));
+    }
+
+    // Calls fn(stage, micro_batch) for every pair: each stage sees the micro-batches in
+    // order, and stage s + 1 sees micro-batch m only after stage s finished it. If a call
+    // throws, the queues are closed so every stage stops, and the first exception is
+    // rethrown here.
+    void run(int micro_batches, const std::function<void(int stage, int micro_batch)>& fn) {
+        auto start = Clock::now();
+        m_error = nullptr;
+        for (auto& queue : m_queues) {
+            queue->reopen();
+        }
+        for (int s = 1; s < stages(); ++s) {
+            m_workers[s - 1]->enqueue([this, &fn, s, micro_batches] { stage_loop(s, micro_batches, fn); });
+        }
+        stage_loop(0, micro_batches, fn);
+        for (auto& worker : m_workers) {
+            worker->wait_idle();
+        }
+        m_stats.steps += 1;
+        m_stats.micro_batches += micro_batches;
+        m_stats.wall_seconds += std::chrono::duration<double>(Clock::now() - start).count();
+        for (double& busy : m_busy) {
+            m_stats.busy_seconds += busy;
+            busy = 0.0;
+        }
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+    PipelineStats stats() const {
+        return m_stats;
+    }
+
+    void reset_stats() {
+        m_stats = {};
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    PipelineOptions m_options;
+    // m_queues[s] feeds stage s; stage 0 generates its own micro-batch sequence.
+    std::vector<std::unique_ptr<BoundedQueue<int>>> m_queues;
+    std::vector<std::unique_ptr<ThreadPool>> m_workers;
+    std::vector<double> m_busy;  // per stage, written only by that stage during run
+    PipelineStats m_stats;
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error;
+
+    void stage_loop(int stage, int micro_batches, const std::function<void(int, int)>& fn) {
+        for (int i = 0; i < micro_batches; ++i) {
+            int mb = i;
+            if (stage > 0 && !m_queues[stage]->pop(mb)) {
+                return;
+            }
+            auto t0 = Clock::now();
+            try {
+                fn(stage, mb);
+            } catch (...) {
+                fail(std::current_exception());
+                return;
+            }
+            m_busy[stage] += std::chrono::duration<double>(Clock::now() - t0).count();
+            if (stage + 1 < stages() && !m_queues[stage + 1]->push(mb)) {
+                return;
+            }
+        }
+    }
+
+    void fail(std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lock(m_error_mutex);
+            if (!m_error) {
+                m_error = error;
+            }
+        }
+        for (auto& queue : m_queues) {
+            queue->close();
+        }
+    }
+};
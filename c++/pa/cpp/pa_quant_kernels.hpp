@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Per-row symmetric int8 quantization written straight into the KV cache. The row
+// kernels follow asm/exp9_src_dynamic_quant (JitQuantizationKernel) with intrinsics
+// instead of Xbyak: |x| via andnot of the sign bit, vector max, horizontal max,
+// dscale = max / 127, multiply by 1 / dscale, convert and saturate-pack to int8.
+//
+// All variants use the same arithmetic (reciprocal multiply, round-half-even, clamp
+// to +-127), so the cache contents do not depend on which ISA was picked. The AVX
+// variants exist on x86 only; elsewhere the scalar kernel is the whole registry.
+using Int8QuantRowFn = float (*)(const float* x, int n, int8_t* dst);
+
+inline float int8_quant_scale(float max_abs) {
+    return max_abs < 1e-12f ? 1.0f : max_abs / 127.0f;
+}
+
+inline float quantize_row_int8_scalar(const float* x, int n, int8_t* dst) {
+    float max_abs = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        max_abs = std::max(max_abs, std::fabs(x[i]));
+    }
+    float scale = int8_quant_scale(max_abs);
+    float inv = 1.0f / scale;
+    for (int i = 0; i < n; ++i) {
+        float v = std::nearbyint(x[i] * inv);
+        dst[i] = static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, v)));
+    }
+    return scale;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) inline float quantize_row_int8_avx2(const float* x, int n, int8_t* dst) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 vmax = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_andnot_ps(sign, _mm256_loadu_ps(x + i)));
+    }
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1));
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, 0x4E));
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, 0xB1));
+    float max_abs = _mm_cvtss_f32(m);
+    for (int j = i; j < n; ++j) {
+        max_abs = std::max(max_abs, std::fabs(x[j]));
+    }
+
+    float scale = int8_quant_scale(max_abs);
+    float inv = 1.0f / scale;
+    const __m256 vinv = _mm256_set1_ps(inv);
+    const __m256i lo = _mm256_set1_epi32(-127);
+    const __m256i hi = _mm256_set1_epi32(127);
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(x + i), vinv));
+        q = _mm256_max_epi32(lo, _mm256_min_epi32(hi, q));
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi16(w, w));
+    }
+    for (; i < n; ++i) {
+        float v = std::nearbyint(x[i] * inv);
+        dst[i] = static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, v)));
+    }
+    return scale;
+}
+
+// The tail is handled with masked loads / stores, so there is no scalar remainder.
+// GCC 12 flags the _mm512_undefined_* placeholders inside the intrinsics as
+// uninitialized once they are inlined here; the warning is spurious.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f"))) inline float quantize_row_int8_avx512(const float* x, int n, int8_t* dst) {
+    const __m512i sign = _mm512_set1_epi32(0x80000000);
+    const int full = n & ~15;
+    const __mmask16 tail = static_cast<__mmask16>((1u << (n - full)) - 1);
+    __m512 vmax = _mm512_setzero_ps();
+    for (int i = 0; i < full; i += 16) {
+        __m512i v = _mm512_castps_si512(_mm512_loadu_ps(x + i));
+        vmax = _mm512_max_ps(vmax, _mm512_castsi512_ps(_mm512_andnot_si512(sign, v)));
+    }
+    if (tail) {
+        __m512i v = _mm512_castps_si512(_mm512_maskz_loadu_ps(tail, x + full));
+        vmax = _mm512_max_ps(vmax, _mm512_castsi512_ps(_mm512_andnot_si512(sign, v)));
+    }
+    float scale = int8_quant_scale(_mm512_reduce_max_ps(vmax));
+    const __m512 vinv = _mm512_set1_ps(1.0f / scale);
+    const __m512i lo = _mm512_set1_epi32(-127);
+    const __m512i hi = _mm512_set1_epi32(127);
+    for (int i = 0; i < full; i += 16) {
+        __m512i q = _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_loadu_ps(x + i), vinv));
+        q = _mm512_max_epi32(lo, _mm512_min_epi32(hi, q));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm512_cvtsepi32_epi8(q));
+    }
+    if (tail) {
+        __m512i q = _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_maskz_loadu_ps(tail, x + full), vinv));
+        q = _mm512_max_epi32(lo, _mm512_min_epi32(hi, q));
+        _mm512_mask_cvtsepi32_storeu_epi8(dst + full, tail, q);
+    }
+    return scale;
+}
+#pragma GCC diagnostic pop
+#endif
+
+inline bool cpu_has_avx512f() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx512f");
+#else
+    return false;
+#endif
+}
+
+inline bool cpu_has_avx2() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+inline bool cpu_has_baseline() {
+    return true;
+}
+
+struct Int8QuantKernelEntry {
+    const char* isa;
+    bool (*supported)();
+    Int8QuantRowFn row;
+};
+
+// Widest first; the scalar entry always matches.
+inline const std::vector<Int8QuantKernelEntry>& int8_quant_kernel_registry() {
+    static const std::vector<Int8QuantKernelEntry> registry = {
+#if defined(__x86_64__) || defined(__i386__)
+        {"avx512", &cpu_has_avx512f, &quantize_row_int8_avx512},
+        {"avx2", &cpu_has_avx2, &quantize_row_int8_avx2},
+#endif
+        {"scalar", &cpu_has_baseline, &quantize_row_int8_scalar},
+    };
+    return registry;
+}
+
+inline const Int8QuantKernelEntry& select_int8_quant_kernel() {
+    for (const auto& entry : int8_quant_kernel_registry()) {
+        if (entry.supported()) {
+            return entry;
+        }
+    }
+    return int8_quant_kernel_registry().back();
+}
+
+// Quantizes every (token, head) row of one step into its cache slot: the int8 row
+// goes to data_offset and the scale to scale_offset of the slot's block region, in
+// the [head][slot] order of the KV arena. A dim_major destination ([head][dim][slot],
+// see KVKeyLayout) is quantized into row_scratch first and then scattered with a
+// stride of block_size. Nothing is allocated.
+struct Int8ScatterArgs {
+    const float* const* rows = nullptr;  // [token * num_heads + head] -> head_size floats
+    const int* slots = nullptr;          // cache slot of each token
+    int num_tokens = 0;
+    int num_heads = 0;
+    int head_size = 0;
+    int block_size = 0;
+    char* cache = nullptr;  // region of block 0 for this layer
+    size_t block_stride = 0;
+    size_t data_offset = 0;
+    size_t scale_offset = 0;
+    bool dim_major = false;
+    int8_t* row_scratch = nullptr;  // [head_size], dim_major only
+};
+
+inline void quantize_scatter_int8(const Int8QuantKernelEntry& kernel, const Int8ScatterArgs& a) {
+    for (int t = 0; t < a.num_tokens; ++t) {
+        const int block = a.slots[t] / a.block_size;
+        const int offset = a.slots[t] % a.block_size;
+        char* region = a.cache + static_cast<size_t>(block) * a.block_stride;
+        int8_t* data = reinterpret_cast<int8_t*>(region + a.data_offset);
+        float* scales = reinterpret_cast<float*>(region + a.scale_offset);
+        for (int h = 0; h < a.num_heads; ++h) {
+            const size_t slot = static_cast<size_t>(h) * a.block_size + offset;
+            const float* row = a.rows[static_cast<size_t>(t) * a.num_heads + h];
+            if (!a.dim_major) {
+                scales[slot] = kernel.row(row, a.head_size, data + slot * a.head_size);
+                continue;
+            }
+            scales[slot] = kernel.row(row, a.head_size, a.row_scratch);
+            int8_t* head = data + static_cast<size_t>(h) * a.block_size * a.head_size + offset;
+            for (int d = 0; d < a.head_size; ++d) {
+                head[static_cast<size_t>(d) * a.block_size] = a.row_scratch[d];
+            }
+        }
+    }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Rotary position embedding in the "rotate half" form: dim i is rotated together with
+// dim i + head_size / 2 by angle position * base^(-2i / head_size). Both halves are
+// contiguous, so the rotation is plain element-wise vector arithmetic.
+struct RopeOptions {
+    bool enabled = false;
+    float base = 10000.0f;
+    float scaling = 1.0f;  // linear position interpolation: angles use position / scaling
+    int table_positions = 8192;  // cos/sin rows kept; later positions are computed per call
+};
+
+inline void rope_rotate(
+    const float* __restrict x,
+    float* __restrict out,
+    const float* __restrict cos,
+    const float* __restrict sin,
+    int half) {
+    const float* x_hi = x + half;
+    float* out_hi = out + half;
+    // Fixed 8-wide bodies get SLP-vectorized at -O2; the tail is scalar.
+    constexpr int kLanes = 8;
+    int i = 0;
+    for (; i + kLanes <= half; i += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            out[i + j] = x[i + j] * cos[i + j] - x_hi[i + j] * sin[i + j];
+        }
+        for (int j = 0; j < kLanes; ++j) {
+            out_hi[i + j] = x_hi[i + j] * cos[i + j] + x[i + j] * sin[i + j];
+        }
+    }
+    for (; i < half; ++i) {
+        out[i] = x[i] * cos[i] - x_hi[i] * sin[i];
+        out_hi[i] = x_hi[i] * cos[i] + x[i] * sin[i];
+    }
+}
+
+// cos/sin of every (position, frequency) pair, one row of head_size / 2 per position.
+// Rows are appended as longer sequences show up, up to options.table_positions; readers
+// only use rows that were reserved before the step started. Positions past the table
+// (long streams count evicted tokens too) compute their angles in rotate instead, so
+// memory stays bounded however long a sequence runs.
+class RopeTable {
+public:
+    RopeTable(int head_size, const RopeOptions& options) : m_half(head_size / 2), m_options(options) {
+        if (head_size % 2 != 0) {
+            throw std::runtime_error("RoPE needs an even head size, got " + std::to_string(head_size));
+        }
+        if (options.scaling <= 0.0f) {
+            throw std::runtime_error("RoPE scaling must be positive");
+        }
+        if (options.table_positions < 0) {
+            throw std::runtime_error("RoPE table size must not be negative");
+        }
+        m_inv_freq.resize(m_half);
+        for (int i = 0; i < m_half; ++i) {
+            m_inv_freq[i] = std::pow(static_cast<double>(options.base), -2.0 * i / head_size);
+        }
+    }
+
+    const RopeOptions& options() const {
+        return m_options;
+    }
+
+    int num_positions() const {
+        return m_num_positions;
+    }
+
+    void reserve(int num_positions) {
+        num_positions = std::min(num_positions, m_options.table_positions);
+        if (num_positions <= m_num_positions) {
+            return;
+        }
+        m_cos.resize(static_cast<size_t>(num_positions) * m_half);
+        m_sin.resize(static_cast<size_t>(num_positions) * m_half);
+        for (int p = m_num_positions; p < num_positions; ++p) {
+            double pos = p / static_cast<double>(m_options.scaling);
+            for (int i = 0; i < m_half; ++i) {
+                double angle = pos * m_inv_freq[i];
+                m_cos[static_cast<size_t>(p) * m_half + i] = static_cast<float>(std::cos(angle));
+                m_sin[static_cast<size_t>(p) * m_half + i] = static_cast<float>(std::sin(angle));
+            }
+        }
+        m_num_positions = num_positions;
+    }
+
+    // out must not alias x.
+    void rotate(const float* x, float* out, int position) const {
+        if (position < m_num_positions) {
+            size_t row = static_cast<size_t>(position) * m_half;
+            rope_rotate(x, out, m_cos.data() + row, m_sin.data() + row, m_half);
+            return;
+        }
+        // Same angles and rounding as a table row, one pair at a time.
+        double pos = position / static_cast<double>(m_options.scaling);
+        const float* x_hi = x + m_half;
+        float* out_hi = out + m_half;
+        for (int i = 0; i < m_half; ++i) {
+            double angle = pos * m_inv_freq[i];
+            float c = static_cast<float>(std::cos(angle));
+            float s = static_cast<float>(std::sin(angle));
+            out[i] = x[i] * c - x_hi[i] * s;
+            out_hi[i] = x_hi[i] * c + x[i] * s;
+        }
+    }
+
+private:
+    int m_half;
+    RopeOptions m_options;
+    int m_num_positions = 0;
+    std::vector<double> m_inv_freq;
+    std::vector<float> m_cos;
+    std::vector<float> m_sin;
+};
@@ -0,0 +1,500 @@
+#pragma once
+
+#include "pa_eltwise.hpp"
+#include "pa_thread_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Token selection on top of the runtime's hidden states: an LM head projects a row to
+// vocabulary logits and a sampler draws the next token from them. Nothing here sorts.
+// Candidates are found with threshold scans below the max logit, top-k is an nth_element
+// over them, and the top-p cut a bisection of a logit threshold over masked sums of the
+// candidates' probabilities. Drawing only needs the kept set, not its order.
+struct SamplingOptions {
+    float temperature = 1.0f;         // <= 0: greedy
+    int top_k = 0;                    // 0 = off
+    float top_p = 1.0f;               // 1 = off
+    float repetition_penalty = 1.0f;  // 1 = off; > 1 discourages tokens the sequence has seen
+};
+
+struct SamplingHeadOptions {
+    int vocab_size = 0;
+    int threads = 1;  // sequences of a batch are sampled in parallel over these
+    uint32_t seed = 4321;
+    std::vector<int> cpus;  // optional CPU set of the workers
+};
+
+// Summed over the workers of every sample() call.
+struct SamplingStats {
+    int64_t tokens = 0;
+    double lm_head_seconds = 0.0;
+    double sample_seconds = 0.0;  // penalty, scans, candidate ordering and the draw
+};
+
+// Output projection tied to the token embedding: row t of the [vocab][hidden] weight is
+// both token t's embedding and its logit weights.
+class LMHead {
+public:
+    LMHead(int hidden_size, int vocab_size, uint32_t seed)
+        : m_hidden_size(hidden_size),
+          m_vocab_size(vocab_size),
+          m_weight(static_cast<size_t>(hidden_size) * vocab_size) {
+        if (hidden_size < 1 || vocab_size < 1) {
+            throw std::runtime_error("an LM head needs hidden_size and vocab_size >= 1");
+        }
+        // Uniform with the variance of N(0, 1 / hidden): a 150k x hidden table is drawn
+        // several times faster than with normal_distribution.
+        std::mt19937 gen(seed);
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        float bound = std::sqrt(3.0f / static_cast<float>(hidden_size));
+        for (float& w : m_weight) {
+            w = bound * dist(gen);
+        }
+    }
+
+    int hidden_size() const {
+        return m_hidden_size;
+    }
+
+    int vocab_size() const {
+        return m_vocab_size;
+    }
+
+    void logits(const float* hidden, float* out) const {
+        logits(&hidden, 1, &out);
+    }
+
+    // Several rows per pass over the weight, which is read from memory once per pass.
+    void logits(const float* const* hidden, int rows, float* const* out) const {
+        for (int t = 0; t < m_vocab_size; ++t) {
+            const float* w = embedding(t);
+            for (int r = 0; r < rows; ++r) {
+                out[r][t] = eltwise_dot(hidden[r], w, m_hidden_size);
+            }
+        }
+    }
+
+    const float* embedding(int token) const {
+        return m_weight.data() + static_cast<size_t>(token) * m_hidden_size;
+    }
+
+private:
+    int m_hidden_size;
+    int m_vocab_size;
+    std::vector<float> m_weight;
+};
+
+// Draws one token from a logits row. Holds vocabulary-sized scratch, so one sampler per
+// worker thread.
+class TokenSampler {
+public:
+    explicit TokenSampler(int vocab_size)
+        : m_kernel(select_eltwise_kernel()),
+          m_probs(vocab_size),
+          m_candidate_probs(vocab_size),
+          m_candidate_logits(vocab_size),
+          m_kept_probs(vocab_size),
+          m_candidates(vocab_size),
+          m_narrower(vocab_size),
+          m_boundary_pos(vocab_size) {}
+
+    // `logits` is modified in place. `seen` lists the distinct tokens the repetition
+    // penalty applies to (positive logits are divided by it, negative ones multiplied).
+    int sample(
+        float* logits,
+        int n,
+        const SamplingOptions& options,
+        const std::vector<int>& seen,
+        std::mt19937& rng) {
+        if (options.repetition_penalty != 1.0f) {
+            for (int token : seen) {
+                float l = logits[token];
+                logits[token] = l > 0.0f ? l / options.repetition_penalty : l * options.repetition_penalty;
+            }
+        }
+        const float max_logit = eltwise_max(logits, n);
+        if (options.temperature <= 0.0f || options.top_k == 1) {
+            // Lowest index among equal maxima.
+            m_kernel.select_ge(logits, n, max_logit, m_candidates.data());
+            return m_candidates[0];
+        }
+        const float inv_t = 1.0f / options.temperature;
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        if (options.top_k > 0 && options.top_k < n) {
+            const int k = options.top_k;
+            int count = collect_top_k(logits, n, max_logit, options.temperature, k);
+            std::nth_element(m_candidates.begin(), m_candidates.begin() + (k - 1), m_candidates.begin() + count,
+                             ByLogit{logits});
+            // Top-k renormalizes over the k candidates; top-p then cuts within them.
+            float* p = m_probs.data();
+            for (int i = 0; i < k; ++i) {
+                p[i] = logits[m_candidates[i]];
+            }
+            m_kernel.exp_scaled(p, max_logit, inv_t, p, k);
+            if (options.top_p < 1.0f) {
+                int kept = nucleus(logits, p, k, options.top_p * eltwise_sum(p, k));
+                return draw(m_kept_probs.data(), kept, uniform(rng));
+            }
+            return draw(p, k, uniform(rng));
+        }
+
+        float* p = m_probs.data();
+        m_kernel.exp_scaled(logits, max_logit, inv_t, p, n);
+        float total = eltwise_sum(p, n);
+        if (options.top_p >= 1.0f) {
+            // Plain temperature sampling: one walk over the whole distribution.
+            double u = uniform(rng) * total;
+            double acc = 0.0;
+            for (int t = 0; t < n; ++t) {
+                acc += p[t];
+                if (u < acc) {
+                    return t;
+                }
+            }
+            return static_cast<int>(std::max_element(p, p + n) - p);
+        }
+        // Top-p alone: widen the threshold until the candidates hold the nucleus mass.
+        const float target = options.top_p * total;
+        float* cp = m_candidate_probs.data();
+        int count = 0;
+        for (float gap = kFirstGap;; gap *= 2.0f) {
+            count = m_kernel.select_ge(logits, n, threshold(max_logit, gap, options.temperature), m_candidates.data());
+            for (int i = 0; i < count; ++i) {
+                cp[i] = p[m_candidates[i]];
+            }
+            if (count == n || eltwise_sum(cp, count) >= target) {
+                break;
+            }
+        }
+        int kept = nucleus(logits, cp, count, target);
+        return draw(m_kept_probs.data(), kept, uniform(rng));
+    }
+
+    const char* isa() const {
+        return m_kernel.isa;
+    }
+
+private:
+    // Threshold scans start this many temperature-scaled nats below the max and double
+    // the gap each time; past the last one everything is a candidate. A top-k scan that
+    // finds more than kOverselect * k candidates halves the gap while k remain.
+    static constexpr float kFirstGap = 2.0f;
+    static constexpr float kLastGap = 64.0f;
+    static constexpr float kMinGap = 1.0f / 64.0f;
+    static constexpr int kOverselect = 8;
+    // Bisection steps of the top-p threshold; the rest of the logit range is sorted.
+    static constexpr int kNucleusSteps = 12;
+
+    const EltwiseKernelEntry& m_kernel;
+    std::vector<float> m_probs;
+    std::vector<float> m_candidate_probs;
+    std::vector<float> m_candidate_logits;
+    std::vector<float> m_kept_probs;
+    std::vector<int32_t> m_candidates;
+    std::vector<int32_t> m_narrower;
+    std::vector<int32_t> m_boundary_pos;
+    std::vector<std::pair<float, int32_t>> m_boundary;
+
+    static float threshold(float max_logit, float gap, float temperature) {
+        return gap <= kLastGap ? max_logit - gap * temperature : -std::numeric_limits<float>::infinity();
+    }
+
+    // Fills m_candidates with at least k tokens (k < n), all within some gap of the max,
+    // and returns how many.
+    int collect_top_k(const float* logits, int n, float max_logit, float temperature, int k) {
+        float gap = kFirstGap;
+        int count = m_kernel.select_ge(logits, n, threshold(max_logit, gap, temperature), m_candidates.data());
+        while (count < k) {
+            gap *= 2.0f;
+            count = m_kernel.select_ge(logits, n, threshold(max_logit, gap, temperature), m_candidates.data());
+        }
+        // A flat distribution puts much of the vocabulary inside the first gap.
+        while (count > kOverselect * k && gap > kMinGap) {
+            gap *= 0.5f;
+            int narrower = m_kernel.select_ge(logits, n, threshold(max_logit, gap, temperature), m_narrower.data());
+            if (narrower < k) {
+                break;
+            }
+            m_candidates.swap(m_narrower);
+            count = narrower;
+        }
+        return count;
+    }
+
+    // Descending logit, ties by ascending token id, so the order never depends on the scan.
+    struct ByLogit {
+        const float* logits;
+
+        bool operator()(int32_t a, int32_t b) const {
+            return logits[a] > logits[b] || (logits[a] == logits[b] && a < b);
+        }
+    };
+
+    // The nucleus of the first n candidates, whose probabilities are p: the fewest
+    // highest-logit tokens holding `mass`. Moves its tokens to the front of m_candidates
+    // and their probabilities to m_kept_probs, and returns how many.
+    //
+    // A logit threshold is bisected so that the tokens at or above `hi` hold less than
+    // `mass` and those at or above `lo` at least that, one masked-sum scan per step.
+    // The tokens above `hi` are kept with one select_ge scan; only the few in
+    // [lo, hi) are ordered to place the cut.
+    int nucleus(const float* logits, const float* p, int n, float mass) {
+        float* cl = m_candidate_logits.data();
+        for (int i = 0; i < n; ++i) {
+            cl[i] = logits[m_candidates[i]];
+        }
+        float hi = eltwise_max(cl, n);
+        float lo = eltwise_min(cl, n);
+        int32_t* kept_ids = m_narrower.data();
+        float* kept_p = m_kept_probs.data();
+        int kept = 0;
+        if (eltwise_sum_ge(cl, p, n, hi) >= mass) {
+            lo = hi;  // the cut falls among the tokens tied at the max
+        } else {
+            for (int step = 0; step < kNucleusSteps; ++step) {
+                float mid = lo + (hi - lo) * 0.5f;
+                if (mid <= lo || mid >= hi) {
+                    break;
+                }
+                (eltwise_sum_ge(cl, p, n, mid) >= mass ? lo : hi) = mid;
+            }
+            kept = m_kernel.select_ge(cl, n, hi, kept_ids);
+            for (int j = 0; j < kept; ++j) {
+                kept_p[j] = p[kept_ids[j]];
+                kept_ids[j] = m_candidates[kept_ids[j]];
+            }
+        }
+        // Branch-free: about half the candidates pass the first test, unpredictably.
+        int32_t* pos = m_boundary_pos.data();
+        int in_range = 0;
+        const bool tied = lo == hi;
+        for (int i = 0; i < n; ++i) {
+            pos[in_range] = i;
+            in_range += (cl[i] >= lo) & (tied | (cl[i] < hi));
+        }
+        std::vector<std::pair<float, int32_t>>& boundary = m_boundary;
+        boundary.clear();
+        for (int j = 0; j < in_range; ++j) {
+            boundary.emplace_back(p[pos[j]], m_candidates[pos[j]]);
+        }
+        ByLogit by_logit{logits};
+        std::sort(boundary.begin(), boundary.end(), [&](const auto& a, const auto& b) {
+            return by_logit(a.second, b.second);
+        });
+        float acc = eltwise_sum(kept_p, kept);
+        for (const auto& entry : boundary) {
+            if (kept > 0 && acc >= mass) {
+                break;
+            }
+            kept_ids[kept] = entry.second;
+            kept_p[kept++] = entry.first;
+            acc += entry.first;
+        }
+        m_candidates.swap(m_narrower);
+        return kept;
+    }
+
+    int draw(const float* p, int n, double u) const {
+        double total = 0.0;
+        for (int i = 0; i < n; ++i) {
+            total += p[i];
+        }
+        double target = u * total;
+        double acc = 0.0;
+        for (int i = 0; i < n; ++i) {
+            acc += p[i];
+            if (target < acc) {
+                return m_candidates[i];
+            }
+        }
+        return m_candidates[n - 1];
+    }
+};
+
+// LM head plus per-sequence sampling state. sample() turns one hidden row per sequence
+// into one token per sequence; embed() turns tokens back into the next decode input.
+// The sequences of a batch are split over the workers, each with its own logits buffers
+// and sampler, so no state is shared between them. A worker projects up to
+// kRowsPerPass of its sequences per pass over the LM head.
+class SamplingHead {
+public:
+    using Tensor2 = std::vector<std::vector<float>>;
+
+    SamplingHead(int hidden_size, const SamplingHeadOptions& options)
+        : m_options(options), m_head(hidden_size, options.vocab_size, options.seed) {
+        int threads = std::max(1, options.threads);
+        for (int w = 0; w < threads; ++w) {
+            m_workers.push_back(Worker{
+                std::vector<float>(static_cast<size_t>(kRowsPerPass) * options.vocab_size),
+                TokenSampler(options.vocab_size),
+                {}});
+        }
+        if (threads > 1) {
+            m_pool.reset(new ThreadPool(threads, options.cpus));
+        }
+    }
+
+    int vocab_size() const {
+        return m_head.vocab_size();
+    }
+
+    const LMHead& lm_head() const {
+        return m_head;
+    }
+
+    // The prompt's tokens count as seen for the repetition penalty.
+    void add_sequence(int seq_id, const std::vector<int>& prompt_tokens = {}) {
+        auto& state = m_sequences[seq_id];
+        state = SequenceState{};
+        state.seen_mask.assign(m_head.vocab_size(), false);
+        state.rng.seed(m_options.seed ^ (0x9E3779B9u * static_cast<uint32_t>(seq_id + 1)));
+        for (int token : prompt_tokens) {
+            mark_seen(state, token);
+        }
+    }
+
+    // The child continues the parent's history with its own random stream.
+    void fork_sequence(int parent_seq_id, int child_seq_id) {
+        SequenceState child = state(parent_seq_id);
+        child.rng.seed(m_options.seed ^ (0x9E3779B9u * static_cast<uint32_t>(child_seq_id + 1)));
+        m_sequences[child_seq_id] = std::move(child);
+    }
+
+    void finish_sequence(int seq_id) {
+        m_sequences.erase(seq_id);
+    }
+
+    // Row i of `hidden` belongs to seq_ids[i]. The drawn tokens join each sequence's
+    // history.
+    std::vector<int> sample(const std::vector<int>& seq_ids, const Tensor2& hidden, const SamplingOptions& options) {
+        if (hidden.size() != seq_ids.size()) {
+            throw std::runtime_error("sample needs one hidden row per sequence");
+        }
+        std::vector<SequenceState*> states;
+        for (int seq_id : seq_ids) {
+            states.push_back(&state(seq_id));
+        }
+        std::vector<int> tokens(seq_ids.size());
+        const int workers = std::min(static_cast<int>(m_workers.size()), static_cast<int>(seq_ids.size()));
+        const int vocab = m_head.vocab_size();
+        auto work = [&](int w) {
+            Worker& worker = m_workers[w];
+            std::vector<size_t> mine;
+            for (size_t i = static_cast<size_t>(w); i < seq_ids.size(); i += static_cast<size_t>(workers)) {
+                mine.push_back(i);
+            }
+            for (size_t first = 0; first < mine.size(); first += kRowsPerPass) {
+                const int rows = static_cast<int>(std::min<size_t>(kRowsPerPass, mine.size() - first));
+                const float* in[kRowsPerPass];
+                float* out[kRowsPerPass];
+                for (int r = 0; r < rows; ++r) {
+                    in[r] = hidden[mine[first + r]].data();
+                    out[r] = worker.logits.data() + static_cast<size_t>(r) * vocab;
+                }
+                auto t0 = Clock::now();
+                m_head.logits(in, rows, out);
+                auto t1 = Clock::now();
+                for (int r = 0; r < rows; ++r) {
+                    size_t i = mine[first + r];
+                    tokens[i] = worker.sampler.sample(out[r], vocab, options, states[i]->seen, states[i]->rng);
+                    mark_seen(*states[i], tokens[i]);
+                }
+                worker.stats.lm_head_seconds += seconds(t0, t1);
+                worker.stats.sample_seconds += seconds(t1, Clock::now());
+                worker.stats.tokens += rows;
+            }
+        };
+        if (workers <= 1) {
+            work(0);
+        } else {
+            m_pool->parallel_for(workers, work);
+        }
+        return tokens;
+    }
+
+    Tensor2 embed(const std::vector<int>& tokens) const {
+        Tensor2 x;
+        for (int token : tokens) {
+            const float* e = m_head.embedding(token);
+            x.emplace_back(e, e + m_head.hidden_size());
+        }
+        return x;
+    }
+
+    SamplingStats stats() const {
+        SamplingStats total;
+        for (const auto& worker : m_workers) {
+            total.tokens += worker.stats.tokens;
+            total.lm_head_seconds += worker.stats.lm_head_seconds;
+            total.sample_seconds += worker.stats.sample_seconds;
+        }
+        return total;
+    }
+
+    void reset_stats() {
+        for (auto& worker : m_workers) {
+            worker.stats = {};
+        }
+    }
+
+    const char* kernel_isa() const {
+        return m_workers.front().sampler.isa();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr int kRowsPerPass = 4;
+
+    struct SequenceState {
+        std::vector<int> seen;  // distinct, in first-seen order
+        std::vector<bool> seen_mask;
+        std::mt19937 rng;
+    };
+
+    struct Worker {
+        std::vector<float> logits;
+        TokenSampler sampler;
+        SamplingStats stats;
+    };
+
+    SamplingHeadOptions m_options;
+    LMHead m_head;
+    std::vector<Worker> m_workers;
+    std::unique_ptr<ThreadPool> m_pool;
+    std::unordered_map<int, SequenceState> m_sequences;
+
+    static double seconds(Clock::time_point a, Clock::time_point b) {
+        return std::chrono::duration<double>(b - a).count();
+    }
+
+    SequenceState& state(int seq_id) {
+        auto it = m_sequences.find(seq_id);
+        if (it == m_sequences.end()) {
+            throw std::runtime_error("sampling head does not know sequence " + std::to_string(seq_id));
+        }
+        return it->second;
+    }
+
+    void mark_seen(SequenceState& state, int token) {
+        if (token < 0 || token >= m_head.vocab_size()) {
+            throw std::runtime_error("token out of vocabulary range: " + std::to_string(token));
+        }
+        if (!state.seen_mask[token]) {
+            state.seen_mask[token] = true;
+            state.seen.push_back(token);
+        }
+    }
+};
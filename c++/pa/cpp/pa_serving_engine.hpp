@@ -0,0 +1,440 @@
+#pragma once
+
+#include "standalone_pa.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Request front end for ToyLLMRuntime, shaped like a serving engine: callers submit a
+// prompt (one hidden row per prompt token) and get a RequestHandle that streams one
+// hidden row per generated token. The last prefill row is the first output and every
+// output is fed back as the next decode input.
+//
+// One engine thread owns the runtime. Each iteration it drains new submissions, drops
+// cancelled requests, admits waiting ones FCFS into one batched prefill, runs one
+// decode step over everything running, and hands the rows to the handles. submit()
+// never takes a lock: requests are pushed onto a lock-free stack that the engine
+// empties with one exchange and reverses into arrival order.
+
+enum class RequestStatus { Queued, Running, Completed, Cancelled, Failed };
+
+inline const char* request_status_name(RequestStatus status) {
+    switch (status) {
+    case RequestStatus::Queued:
+        return "queued";
+    case RequestStatus::Running:
+        return "running";
+    case RequestStatus::Completed:
+        return "completed";
+    case RequestStatus::Cancelled:
+        return "cancelled";
+    case RequestStatus::Failed:
+        return "failed";
+    }
+    return "unknown";
+}
+
+struct GenerationRequest {
+    std::vector<std::vector<float>> prompt;  // [prompt_len][hidden_size]
+    int max_new_tokens = 16;
+};
+
+struct RequestTimings {
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point admitted;  // prefill started
+    std::chrono::steady_clock::time_point first_output;
+    std::chrono::steady_clock::time_point finished;
+};
+
+struct ServingOptions {
+    int max_batch = 32;             // requests running at once
+    int max_prefill_tokens = 2048;  // prompt tokens per prefill step (one prompt always fits)
+};
+
+struct ServingStats {
+    int64_t prefill_steps = 0;
+    int64_t decode_steps = 0;
+    int64_t prefill_tokens = 0;
+    int64_t decode_tokens = 0;
+};
+
+// Shared between the engine and the handle; the mutex guards everything but the
+// request itself, which only the engine reads after submission.
+struct ServingRequestState {
+    GenerationRequest request;
+    std::atomic<bool> cancel_requested{false};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::vector<float>> pending_outputs;  // produced, not yet taken by next()
+    int num_outputs = 0;
+    RequestStatus status = RequestStatus::Queued;
+    std::string error;
+    RequestTimings timings;
+
+    bool ended() const {
+        return status == RequestStatus::Completed || status == RequestStatus::Cancelled ||
+               status == RequestStatus::Failed;
+    }
+};
+
+class RequestHandle {
+public:
+    RequestHandle() = default;
+    explicit RequestHandle(std::shared_ptr<ServingRequestState> state) : m_state(std::move(state)) {}
+
+    // Blocks for the next output row; false once the request ended and every row was taken.
+    bool next(std::vector<float>& row) {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        m_state->cv.wait(lock, [&] { return !m_state->pending_outputs.empty() || m_state->ended(); });
+        if (m_state->pending_outputs.empty()) {
+            return false;
+        }
+        row = std::move(m_state->pending_outputs.front());
+        m_state->pending_outputs.pop_front();
+        return true;
+    }
+
+    // Blocks until the request completed, was cancelled or failed.
+    RequestStatus wait() {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        m_state->cv.wait(lock, [&] { return m_state->ended(); });
+        return m_state->status;
+    }
+
+    // Takes effect at the engine's next iteration; outputs already produced stay readable.
+    void cancel() {
+        m_state->cancel_requested.store(true);
+    }
+
+    RequestStatus status() const {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->status;
+    }
+
+    int num_outputs() const {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->num_outputs;
+    }
+
+    RequestTimings timings() const {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->timings;
+    }
+
+    std::string error() const {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->error;
+    }
+
+private:
+    std::shared_ptr<ServingRequestState> m_state;
+};
+
+class ServingEngine {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // The engine thread is the only user of `runtime` until the engine is destroyed.
+    explicit ServingEngine(ToyLLMRuntime& runtime, const ServingOptions& options = {})
+        : m_runtime(runtime), m_options(options) {
+        if (options.max_batch < 1 || options.max_prefill_tokens < 1) {
+            throw std::runtime_error("serving needs max_batch >= 1 and max_prefill_tokens >= 1");
+        }
+        m_thread = std::thread([this] { engine_loop(); });
+    }
+
+    // Requests still queued or running end as cancelled.
+    ~ServingEngine() {
+        m_stop.store(true);
+        wake_engine();
+        m_thread.join();
+    }
+
+    ServingEngine(const ServingEngine&) = delete;
+    ServingEngine& operator=(const ServingEngine&) = delete;
+
+    // Thread-safe and lock-free apart from allocating the request state.
+    RequestHandle submit(GenerationRequest request) {
+        if (request.prompt.empty() || request.max_new_tokens < 1) {
+            throw std::runtime_error("a request needs a prompt and max_new_tokens >= 1");
+        }
+        for (const auto& row : request.prompt) {
+            if (static_cast<int>(row.size()) != m_runtime.hidden_size()) {
+                throw std::runtime_error("prompt rows must have hidden_size elements");
+            }
+        }
+        auto state = std::make_shared<ServingRequestState>();
+        state->request = std::move(request);
+        state->timings.submitted = Clock::now();
+        auto* node = new SubmitNode{state, m_submitted.load(std::memory_order_relaxed)};
+        while (!m_submitted.compare_exchange_weak(node->next, node)) {
+        }
+        if (m_sleeping.load()) {
+            wake_engine();
+        }
+        return RequestHandle(std::move(state));
+    }
+
+    ServingStats stats() const {
+        ServingStats s;
+        s.prefill_steps = m_prefill_steps.load();
+        s.decode_steps = m_decode_steps.load();
+        s.prefill_tokens = m_prefill_tokens.load();
+        s.decode_tokens = m_decode_tokens.load();
+        return s;
+    }
+
+private:
+    struct SubmitNode {
+        std::shared_ptr<ServingRequestState> state;
+        SubmitNode* next;
+    };
+
+    struct ActiveRequest {
+        std::shared_ptr<ServingRequestState> state;
+        int seq_id = -1;
+        int reserved_blocks = 0;
+        int generated = 0;
+        std::vector<float> last_output;
+    };
+
+    ToyLLMRuntime& m_runtime;
+    ServingOptions m_options;
+    std::thread m_thread;
+
+    std::atomic<SubmitNode*> m_submitted{nullptr};
+    std::atomic<bool> m_stop{false};
+    std::atomic<bool> m_sleeping{false};
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake_cv;
+
+    std::atomic<int64_t> m_prefill_steps{0};
+    std::atomic<int64_t> m_decode_steps{0};
+    std::atomic<int64_t> m_prefill_tokens{0};
+    std::atomic<int64_t> m_decode_tokens{0};
+
+    // Engine thread only.
+    std::deque<std::shared_ptr<ServingRequestState>> m_waiting;
+    std::vector<ActiveRequest> m_running;
+    int m_next_seq_id = 0;
+    int m_reserved_blocks = 0;
+
+    void wake_engine() {
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+        m_wake_cv.notify_one();
+    }
+
+    void engine_loop() {
+        while (!m_stop.load()) {
+            drain_submissions();
+            drop_cancelled();
+            try {
+                admit_and_prefill();
+                decode_step();
+            } catch (const std::exception& e) {
+                fail_running(e.what());
+            }
+            if (m_waiting.empty() && m_running.empty()) {
+                sleep_until_submitted();
+            }
+        }
+        drain_submissions();
+        for (auto& state : m_waiting) {
+            end_request(*state, RequestStatus::Cancelled);
+        }
+        m_waiting.clear();
+        for (auto& active : m_running) {
+            release(active);
+            end_request(*active.state, RequestStatus::Cancelled);
+        }
+        m_running.clear();
+    }
+
+    // submit() pushes before it reads m_sleeping and the engine publishes m_sleeping
+    // before it reads the stack, so one of them always sees the other.
+    void sleep_until_submitted() {
+        std::unique_lock<std::mutex> lock(m_wake_mutex);
+        m_sleeping.store(true);
+        m_wake_cv.wait(lock, [this] { return m_stop.load() || m_submitted.load() != nullptr; });
+        m_sleeping.store(false);
+    }
+
+    void drain_submissions() {
+        SubmitNode* node = m_submitted.exchange(nullptr, std::memory_order_acquire);
+        std::vector<std::shared_ptr<ServingRequestState>> batch;
+        while (node) {
+            batch.push_back(std::move(node->state));
+            SubmitNode* next = node->next;
+            delete node;
+            node = next;
+        }
+        // The stack is newest first.
+        m_waiting.insert(m_waiting.end(), batch.rbegin(), batch.rend());
+    }
+
+    void drop_cancelled() {
+        for (auto it = m_waiting.begin(); it != m_waiting.end();) {
+            if ((*it)->cancel_requested.load()) {
+                end_request(**it, RequestStatus::Cancelled);
+                it = m_waiting.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto it = m_running.begin(); it != m_running.end();) {
+            if (it->state->cancel_requested.load()) {
+                release(*it);
+                end_request(*it->state, RequestStatus::Cancelled);
+                it = m_running.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // KV is reserved for the whole request up front, so running requests never have
+    // to be preempted.
+    int blocks_for(const GenerationRequest& request) const {
+        int block_size = m_runtime.manager().block_size();
+        int tokens = static_cast<int>(request.prompt.size()) + request.max_new_tokens;
+        return (tokens + block_size - 1) / block_size;
+    }
+
+    void admit_and_prefill() {
+        std::vector<int> seq_ids;
+        std::vector<int> q_lens;
+        ToyLLMRuntime::Tensor2 x;
+        size_t first_new = m_running.size();
+        int tokens = 0;
+        const int pool_blocks = m_runtime.manager().num_blocks();
+        while (!m_waiting.empty() && static_cast<int>(m_running.size()) < m_options.max_batch) {
+            auto state = m_waiting.front();
+            int need = blocks_for(state->request);
+            int prompt_len = static_cast<int>(state->request.prompt.size());
+            if (need > pool_blocks) {
+                m_waiting.pop_front();
+                end_request(*state, RequestStatus::Failed, "request needs more KV blocks than the pool holds");
+                continue;
+            }
+            if (m_reserved_blocks + need > pool_blocks || (!seq_ids.empty() && tokens + prompt_len > m_options.max_prefill_tokens)) {
+                break;
+            }
+            m_waiting.pop_front();
+            ActiveRequest active;
+            active.state = state;
+            active.seq_id = m_next_seq_id++;
+            active.reserved_blocks = need;
+            m_runtime.add_sequence(active.seq_id);
+            m_reserved_blocks += need;
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->status = RequestStatus::Running;
+                state->timings.admitted = Clock::now();
+            }
+            seq_ids.push_back(active.seq_id);
+            q_lens.push_back(prompt_len);
+            x.insert(x.end(), state->request.prompt.begin(), state->request.prompt.end());
+            tokens += prompt_len;
+            m_running.push_back(std::move(active));
+        }
+        if (seq_ids.empty()) {
+            return;
+        }
+
+        auto hidden = m_runtime.prefill(seq_ids, x, q_lens);
+        m_prefill_steps += 1;
+        m_prefill_tokens += tokens;
+        int row = 0;
+        for (size_t i = first_new; i < m_running.size(); ++i) {
+            row += q_lens[i - first_new];
+            emit(m_running[i], std::move(hidden[row - 1]));
+        }
+        retire_finished();
+    }
+
+    void decode_step() {
+        if (m_running.empty()) {
+            return;
+        }
+        std::vector<int> seq_ids;
+        ToyLLMRuntime::Tensor2 x;
+        for (const auto& active : m_running) {
+            seq_ids.push_back(active.seq_id);
+            x.push_back(active.last_output);
+        }
+        auto hidden = m_runtime.decode(seq_ids, x);
+        m_decode_steps += 1;
+        m_decode_tokens += static_cast<int64_t>(seq_ids.size());
+        for (size_t i = 0; i < m_running.size(); ++i) {
+            emit(m_running[i], std::move(hidden[i]));
+        }
+        retire_finished();
+    }
+
+    void emit(ActiveRequest& active, std::vector<float> row) {
+        active.generated += 1;
+        active.last_output = row;
+        auto& state = *active.state;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.num_outputs == 0) {
+                state.timings.first_output = Clock::now();
+            }
+            state.num_outputs += 1;
+            state.pending_outputs.push_back(std::move(row));
+        }
+        state.cv.notify_all();
+    }
+
+    void retire_finished() {
+        for (auto it = m_running.begin(); it != m_running.end();) {
+            if (it->generated >= it->state->request.max_new_tokens) {
+                release(*it);
+                end_request(*it->state, RequestStatus::Completed);
+                it = m_running.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void release(ActiveRequest& active) {
+        if (m_runtime.manager().has_sequence(active.seq_id)) {
+            m_runtime.finish_sequence(active.seq_id);
+        }
+        m_reserved_blocks -= active.reserved_blocks;
+    }
+
+    // A failed step leaves the running sequences in an unknown state, so they all fail.
+    void fail_running(const std::string& error) {
+        for (auto& active : m_running) {
+            try {
+                release(active);
+            } catch (const std::exception&) {
+            }
+            end_request(*active.state, RequestStatus::Failed, error);
+        }
+        m_running.clear();
+    }
+
+    static void end_request(ServingRequestState& state, RequestStatus status, const std::string& error = {}) {
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.status = status;
+            state.error = error;
+            state.timings.finished = Clock::now();
+        }
+        state.cv.notify_all();
+    }
+};
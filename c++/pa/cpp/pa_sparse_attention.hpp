@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Query-aware block selection for decode (Quest). Every block keeps, per head, the
+// channel-wise min and max of the keys written to it. For a query q the largest score
+// any key of the block can reach is bounded by
+//
+//   sum_d max(q_d * min_d, q_d * max_d)
+//
+// so decode scores all blocks from their summaries (2 * head_size floats instead of
+// block_size keys), attends exactly over the top_k_blocks best ones plus the newest
+// recent_blocks, and leaves the rest of the cache unread.
+struct SparseAttentionOptions {
+    bool enabled = false;
+    int top_k_blocks = 16;  // per head, picked by the summary bound
+    int recent_blocks = 1;  // newest blocks, tail included, always attended
+};
+
+// Widens a summary by one key; the block's first key resets it.
+inline void key_summary_update(float* kmin, float* kmax, const float* k, int head_size, bool first) {
+    if (first) {
+        std::copy(k, k + head_size, kmin);
+        std::copy(k, k + head_size, kmax);
+        return;
+    }
+    for (int d = 0; d < head_size; ++d) {
+        kmin[d] = std::min(kmin[d], k[d]);
+        kmax[d] = std::max(kmax[d], k[d]);
+    }
+}
+
+// Widens dst by src, e.g. when a key of src's block is copied into dst's block.
+inline void key_summary_merge(float* dst_min, float* dst_max, const float* src_min, const float* src_max, int head_size) {
+    for (int d = 0; d < head_size; ++d) {
+        dst_min[d] = std::min(dst_min[d], src_min[d]);
+        dst_max[d] = std::max(dst_max[d], src_max[d]);
+    }
+}
+
+// Eight independent partial sums vectorize without -ffast-math reassociation.
+inline float key_summary_bound(const float* q, const float* kmin, const float* kmax, int head_size) {
+    constexpr int kLanes = 8;
+    float lanes[kLanes] = {};
+    int d = 0;
+    for (; d + kLanes <= head_size; d += kLanes) {
+        for (int j = 0; j < kLanes; ++j) {
+            lanes[j] += std::max(q[d + j] * kmin[d + j], q[d + j] * kmax[d + j]);
+        }
+    }
+    float s = 0.0f;
+    for (; d < head_size; ++d) {
+        s += std::max(q[d] * kmin[d], q[d] * kmax[d]);
+    }
+    for (int j = 0; j < kLanes; ++j) {
+        s += lanes[j];
+    }
+    return s;
+}
+
+// Block list for one (query, head): the top_k logical blocks by bound among those
+// before the recent window, in logical order, then the recent window. `bound(lb)`
+// scores logical block lb. Returns the number of context slots the list covers;
+// only the last block may be partial.
+template <typename Bound>
+int select_sparse_blocks(
+    const int* blocks,
+    int kv_len,
+    int block_size,
+    const SparseAttentionOptions& options,
+    const Bound& bound,
+    std::vector<std::pair<float, int>>& scratch,
+    std::vector<int>& selected) {
+    const int num_blocks = (kv_len + block_size - 1) / block_size;
+    const int recent_begin = std::max(0, num_blocks - options.recent_blocks);
+    selected.clear();
+    scratch.clear();
+    for (int lb = 0; lb < recent_begin; ++lb) {
+        scratch.push_back({-bound(lb), lb});
+    }
+    int k = std::min(options.top_k_blocks, recent_begin);
+    if (k < recent_begin) {
+        std::nth_element(scratch.begin(), scratch.begin() + k, scratch.end());
+        std::sort(scratch.begin(), scratch.begin() + k, [](const auto& a, const auto& b) { return a.second < b.second; });
+    }
+    for (int i = 0; i < k; ++i) {
+        selected.push_back(blocks[scratch[i].second]);
+    }
+    for (int lb = recent_begin; lb < num_blocks; ++lb) {
+        selected.push_back(blocks[lb]);
+    }
+    return k * block_size + (kv_len - recent_begin * block_size);
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "pa_thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tensor parallelism inside one process. A layer's heads are split into `shards`
+// contiguous ranges; each shard owns its heads' slices of the Q/K/V/O weights and its
+// heads' part of every KV block, and runs on its own worker. The output projection of
+// a shard is a partial sum over its heads, so each layer ends with an all-reduce of
+// the shards' partial outputs.
+enum class AllReduceAlgorithm { Ring, Tree };
+
+inline const char* all_reduce_algorithm_name(AllReduceAlgorithm algorithm) {
+    return algorithm == AllReduceAlgorithm::Ring ? "ring" : "tree";
+}
+
+inline AllReduceAlgorithm parse_all_reduce_algorithm(const std::string& name) {
+    if (name == "ring") {
+        return AllReduceAlgorithm::Ring;
+    }
+    if (name == "tree") {
+        return AllReduceAlgorithm::Tree;
+    }
+    throw std::runtime_error("all-reduce must be ring or tree: " + name);
+}
+
+struct TensorParallelOptions {
+    int shards = 1;  // 1 = no tensor parallelism
+    AllReduceAlgorithm all_reduce = AllReduceAlgorithm::Ring;
+    // Optional CPU set per shard's worker, e.g. one socket each.
+    std::vector<std::vector<int>> shard_cpus;
+};
+
+// Seen from shard 0, summed over every sharded layer forward.
+struct TensorParallelStats {
+    int64_t reductions = 0;
+    double compute_seconds = 0.0;  // projections, attention, partial output projection
+    double skew_seconds = 0.0;     // waiting for the slowest shard's partial sums
+    double reduce_seconds = 0.0;   // the all-reduce itself
+};
+
+// Sense-reversing barrier. Spins briefly, then yields, so oversubscribed hosts still
+// make progress.
+class SpinBarrier {
+public:
+    explicit SpinBarrier(int count) : m_count(count) {}
+
+    void arrive_and_wait() {
+        uint32_t generation = m_generation.load(std::memory_order_acquire);
+        if (m_arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == m_count) {
+            m_arrived.store(0, std::memory_order_relaxed);
+            m_generation.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        for (int spins = 0; m_generation.load(std::memory_order_acquire) == generation; ++spins) {
+            if (spins >= 64) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    int m_count;
+    std::atomic<int> m_arrived{0};
+    std::atomic<uint32_t> m_generation{0};
+};
+
+// The shard workers plus the buffers of the all-reduce. Shard 0 runs on the calling
+// thread, every other shard on a single-thread pool of its own. One group serves every
+// layer of a runtime, one layer at a time.
+class TensorParallelGroup {
+public:
+    using Tensor2 = std::vector<std::vector<float>>;
+
+    explicit TensorParallelGroup(const TensorParallelOptions& options)
+        : m_options(options), m_barrier(options.shards), m_partials(options.shards) {
+        if (options.shards < 1) {
+            throw std::runtime_error("tensor parallelism needs at least one shard");
+        }
+        for (int s = 1; s < options.shards; ++s) {
+            std::vector<int> cpus = s < static_cast<int>(options.shard_cpus.size()) ? options.shard_cpus[s]
+                                                                                     : std::vector<int>{};
+            m_workers.emplace_back(new ThreadPool(1, cpus));
+        }
+        if (!options.shard_cpus.empty()) {
+            pin_current_thread(options.shard_cpus[0]);
+        }
+    }
+
+    int shards() const {
+        return m_options.shards;
+    }
+
+    AllReduceAlgorithm algorithm() const {
+        return m_options.all_reduce;
+    }
+
+    // Sizes every shard's partial-sum buffer for a rows x width output. Call before run.
+    void prepare(int rows, int width) {
+        m_width = width;
+        for (auto& partial : m_partials) {
+            partial.resize(static_cast<size_t>(rows) * width);
+        }
+    }
+
+    float* partial(int shard) {
+        return m_partials[shard].data();
+    }
+
+    // Runs fn(shard) for every shard at once and returns when all are done. Every shard's
+    // fn must call all_reduce the same number of times, or throw before the first on every
+    // shard alike (the checks of a step see the same batch everywhere); the first
+    // exception is rethrown here.
+    void run(const std::function<void(int shard)>& fn) {
+        m_error = nullptr;
+        auto guarded = [this, &fn](int shard) {
+            try {
+                fn(shard);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_error_mutex);
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+        };
+        for (int s = 1; s < shards(); ++s) {
+            m_workers[s - 1]->enqueue([&guarded, s] { guarded(s); });
+        }
+        m_started = Clock::now();
+        guarded(0);
+        for (auto& worker : m_workers) {
+            worker->wait_idle();
+        }
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+    // Called by every shard once its partial sums are complete; leaves the sum of all
+    // partials in `out` (rows x width, already sized). Once it returns, the partial
+    // buffers may be written again for the next reduction of the same run.
+    void all_reduce(int shard, Tensor2& out) {
+        auto arrived = Clock::now();
+        m_barrier.arrive_and_wait();
+        auto reducing = Clock::now();
+        if (m_options.all_reduce == AllReduceAlgorithm::Ring) {
+            ring_reduce(shard, out);
+        } else {
+            tree_reduce(shard, out);
+        }
+        m_barrier.arrive_and_wait();
+        if (shard == 0) {
+            m_stats.reductions += 1;
+            m_stats.compute_seconds += seconds(m_started, arrived);
+            m_stats.skew_seconds += seconds(arrived, reducing);
+            auto done = Clock::now();
+            m_stats.reduce_seconds += seconds(reducing, done);
+            m_started = done;
+        }
+    }
+
+    TensorParallelStats stats() const {
+        return m_stats;
+    }
+
+    void reset_stats() {
+        m_stats = {};
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    TensorParallelOptions m_options;
+    std::vector<std::unique_ptr<ThreadPool>> m_workers;
+    SpinBarrier m_barrier;
+    std::vector<std::vector<float>> m_partials;
+    int m_width = 0;
+    Clock::time_point m_started;
+    TensorParallelStats m_stats;
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error;
+
+    static double seconds(Clock::time_point a, Clock::time_point b) {
+        return std::chrono::duration<double>(b - a).count();
+    }
+
+    // [begin, end) of piece `i` when `total` elements are cut into `n` pieces.
+    static size_t piece_begin(size_t total, int n, int i) {
+        return total * static_cast<size_t>(i) / static_cast<size_t>(n);
+    }
+
+    static void add_range(float* dst, const float* src, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            dst[i] += src[i];
+        }
+    }
+
+    void gather_range(const float* src, size_t begin, size_t end, Tensor2& out) const {
+        size_t width = static_cast<size_t>(m_width);
+        while (begin < end) {
+            size_t row = begin / width;
+            size_t col = begin % width;
+            size_t n = std::min(end - begin, width - col);
+            std::copy(src + begin, src + begin + n, out[row].begin() + static_cast<std::ptrdiff_t>(col));
+            begin += n;
+        }
+    }
+
+    // Reduce-scatter around the ring: in step k shard s adds chunk (s - k - 1) of its left
+    // neighbour into its own buffer, so after n - 1 steps it holds the full sum of chunk
+    // (s + 1). The all-gather is a single copy of that chunk into the shared output.
+    void ring_reduce(int shard, Tensor2& out) {
+        const int n = shards();
+        const size_t total = m_partials[0].size();
+        const int left = (shard + n - 1) % n;
+        for (int k = 0; k < n - 1; ++k) {
+            int chunk = ((shard - k - 1) % n + n) % n;
+            add_range(partial(shard), partial(left), piece_begin(total, n, chunk), piece_begin(total, n, chunk + 1));
+            if (k + 1 < n - 1) {
+                m_barrier.arrive_and_wait();
+            }
+        }
+        int owned = (shard + 1) % n;
+        gather_range(partial(shard), piece_begin(total, n, owned), piece_begin(total, n, owned + 1), out);
+    }
+
+    // Binary tree towards shard 0: in the round of stride d, the partial of shard r + d
+    // is added into shard r for every r that is a multiple of 2d. All 2d shards of that
+    // subtree share the add, one slice each, so nobody idles while the tree narrows.
+    void tree_reduce(int shard, Tensor2& out) {
+        const int n = shards();
+        const size_t total = m_partials[0].size();
+        for (int stride = 1; stride < n; stride *= 2) {
+            int root = shard - shard % (2 * stride);
+            int member = shard - root;
+            if (root + stride < n) {
+                int members = std::min(2 * stride, n - root);
+                add_range(
+                    partial(root), partial(root + stride), piece_begin(total, members, member),
+                    piece_begin(total, members, member + 1));
+            }
+            m_barrier.arrive_and_wait();
+        }
+        gather_range(partial(0), piece_begin(total, n, shard), piece_begin(total, n, shard + 1), out);
+    }
+};
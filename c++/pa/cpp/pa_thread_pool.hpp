@@ -0,0 +1,133 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+inline bool pin_current_thread(const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Fixed set of workers sharing one FIFO. When `cpus` is given every worker is
+// restricted to that CPU set, which is how a pool is tied to one NUMA node.
+// A task that throws does not take its worker down: the first exception is kept
+// and rethrown to whoever waits for the pool next.
+class ThreadPool {
+public:
+    explicit ThreadPool(int num_threads, std::vector<int> cpus = {}) : m_cpus(std::move(cpus)) {
+        if (num_threads < 1) {
+            num_threads = 1;
+        }
+        for (int i = 0; i < num_threads; ++i) {
+            m_workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_task_cv.notify_all();
+        for (auto& w : m_workers) {
+            w.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return static_cast<int>(m_workers.size());
+    }
+
+    void enqueue(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+            ++m_pending;
+        }
+        m_task_cv.notify_one();
+    }
+
+    // Blocks until every queued task returned, then rethrows the first exception any
+    // of them threw since the last wait.
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle_cv.wait(lock, [this] { return m_pending == 0; });
+        if (m_error) {
+            std::exception_ptr error = m_error;
+            m_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Runs fn(i) for i in [0, n) on the pool and blocks until all calls returned; the
+    // first exception is rethrown here once the others have finished.
+    void parallel_for(int n, const std::function<void(int)>& fn) {
+        for (int i = 0; i < n; ++i) {
+            enqueue([&fn, i] { fn(i); });
+        }
+        wait_idle();
+    }
+
+private:
+    std::vector<int> m_cpus;
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_task_cv;
+    std::condition_variable m_idle_cv;
+    size_t m_pending = 0;
+    bool m_stop = false;
+    std::exception_ptr m_error;
+
+    void worker_loop() {
+        pin_current_thread(m_cpus);
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_task_cv.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                if (m_tasks.empty()) {
+                    return;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            std::exception_ptr error;
+            try {
+                task();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (error && !m_error) {
+                    m_error = error;
+                }
+                --m_pending;
+                if (m_pending == 0) {
+                    m_idle_cv.notify_all();
+                }
+            }
+        }
+    }
+};
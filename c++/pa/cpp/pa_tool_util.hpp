@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Small helpers shared by the command-line drivers (bench_pa, serve_pa, kv_sim, ...).
+
+// Splits on `sep`, dropping empty parts, so "a,,b," gives {"a", "b"}.
+inline std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> parts;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, sep)) {
+        if (!item.empty()) {
+            parts.push_back(item);
+        }
+    }
+    return parts;
+}
+
+// p-th percentile (0..100), linear interpolation between closest ranks; 0 when empty.
+// `values` is taken by copy and sorted.
+inline double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    double rank = p / 100.0 * static_cast<double>(values.size() - 1);
+    size_t lo = static_cast<size_t>(rank);
+    size_t hi = std::min(lo + 1, values.size() - 1);
+    double frac = rank - static_cast<double>(lo);
+    return values[lo] + (values[hi] - values[lo]) * frac;
+}
@@ -0,0 +1,308 @@
+#include "kv_capacity_planner.hpp"
+#include "pa_serving_engine.hpp"
+#include "pa_tool_util.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Open-loop load generator for ServingEngine: requests arrive as a Poisson process,
+// each is submitted at its arrival time whatever the engine is doing, and the per
+// request timings (queueing delay, TTFT, TPOT, end to end) are summarized at the end.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct ServeOptions {
+    int requests = 200;
+    double rate = 20.0;  // requests per second
+    int prompt_len = 64;
+    int output_len = 32;
+    double cancel_fraction = 0.0;
+    int num_layers = 2;
+    int num_heads = 4;
+    int head_size = 16;
+    int block_size = 16;
+    int num_blocks = 0;  // 0 = enough for max_batch requests of the longest length
+    std::string kv_budget;  // sizes the pool instead, see kv_capacity_planner.hpp
+    bool lock_kv = false;
+    bool use_int8_cache = false;
+    ServingOptions serving;
+    uint32_t seed = 1;
+    std::string csv_path;
+};
+
+struct Event {
+    double at_s = 0.0;
+    int request = 0;
+    bool cancel = false;
+    int cancel_after = 0;  // output tokens the request produces before it is cancelled
+
+    // A cancel never overtakes the submit it refers to.
+    bool operator>(const Event& other) const {
+        return at_s != other.at_s ? at_s > other.at_s : cancel && !other.cancel;
+    }
+};
+
+void print_usage(const char* argv0) {
+    std::cout
+        << "usage: " << argv0 << " [options]\n"
+        << "  --requests 200       number of requests\n"
+        << "  --rate 20            mean arrival rate (requests/s, Poisson)\n"
+        << "  --prompt 64          mean prompt length (uniform in [len/2, 3*len/2])\n"
+        << "  --output 32          mean output length (same spread)\n"
+        << "  --cancel 0           fraction of requests cancelled after a random number of output tokens\n"
+        << "  --max-batch 32       requests running at once\n"
+        << "  --max-prefill 2048   prompt tokens per prefill step\n"
+        << "  --layers 2           number of layers\n"
+        << "  --heads 4x16         <num_heads>x<head_size>\n"
+        << "  --block 16           block size\n"
+        << "  --blocks 0           KV pool blocks (0 = max-batch longest requests)\n"
+        << "  --kv-budget 256M     size the KV pool from bytes (K/M/G) or a % of MemAvailable\n"
+        << "  --kv-lock 0          1 = mlock the KV pool after reserving it\n"
+        << "  --cache fp32         KV cache precision: fp32 or int8\n"
+        << "  --seed 1             workload seed\n"
+        << "  --csv out.csv        also write the summary as CSV ('-' for stdout)\n";
+}
+
+ServeOptions parse_args(int argc, char** argv) {
+    ServeOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--requests") {
+            opt.requests = std::stoi(value);
+        } else if (arg == "--rate") {
+            opt.rate = std::stod(value);
+        } else if (arg == "--prompt") {
+            opt.prompt_len = std::stoi(value);
+        } else if (arg == "--output") {
+            opt.output_len = std::stoi(value);
+        } else if (arg == "--cancel") {
+            opt.cancel_fraction = std::stod(value);
+        } else if (arg == "--max-batch") {
+            opt.serving.max_batch = std::stoi(value);
+        } else if (arg == "--max-prefill") {
+            opt.serving.max_prefill_tokens = std::stoi(value);
+        } else if (arg == "--layers") {
+            opt.num_layers = std::stoi(value);
+        } else if (arg == "--heads") {
+            auto dims = split(value, 'x');
+            if (dims.size() != 2) {
+                throw std::runtime_error("head config must look like <num_heads>x<head_size>: " + value);
+            }
+            opt.num_heads = std::stoi(dims[0]);
+            opt.head_size = std::stoi(dims[1]);
+        } else if (arg == "--block") {
+            opt.block_size = std::stoi(value);
+        } else if (arg == "--blocks") {
+            opt.num_blocks = std::stoi(value);
+        } else if (arg == "--kv-budget") {
+            opt.kv_budget = value;
+        } else if (arg == "--kv-lock") {
+            opt.lock_kv = std::stoi(value) != 0;
+        } else if (arg == "--cache") {
+            if (value != "fp32" && value != "int8") {
+                throw std::runtime_error("cache precision must be fp32 or int8: " + value);
+            }
+            opt.use_int8_cache = value == "int8";
+        } else if (arg == "--seed") {
+            opt.seed = static_cast<uint32_t>(std::stoul(value));
+        } else if (arg == "--csv") {
+            opt.csv_path = value;
+        } else {
+            throw std::runtime_error("unknown option " + arg);
+        }
+    }
+    if (opt.requests < 1 || opt.rate <= 0.0 || opt.prompt_len < 1 || opt.output_len < 1) {
+        throw std::runtime_error("requests, rate, prompt and output must be positive");
+    }
+    if (!opt.kv_budget.empty() && opt.num_blocks > 0) {
+        throw std::runtime_error("--blocks and --kv-budget both size the KV pool, give one");
+    }
+    return opt;
+}
+
+double ms_between(Clock::time_point a, Clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+constexpr double kCancelPollSeconds = 0.0001;
+
+int spread(std::mt19937& gen, int mean) {
+    std::uniform_int_distribution<int> dist(std::max(1, mean / 2), std::max(1, mean + mean / 2));
+    return dist(gen);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    ServeOptions opt;
+    try {
+        opt = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // The workload is drawn up front so generating it never delays a submission.
+    std::mt19937 gen(opt.seed);
+    std::exponential_distribution<double> gap(opt.rate);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    std::vector<GenerationRequest> requests(opt.requests);
+    int hidden_size = opt.num_heads * opt.head_size;
+    double t = 0.0;
+    int longest = 0;
+    std::vector<int> lengths;
+    for (int i = 0; i < opt.requests; ++i) {
+        t += gap(gen);
+        int prompt_len = spread(gen, opt.prompt_len);
+        requests[i].max_new_tokens = spread(gen, opt.output_len);
+        requests[i].prompt = make_random_tensor2(prompt_len, hidden_size, opt.seed * 7919u + static_cast<uint32_t>(i));
+        longest = std::max(longest, prompt_len + requests[i].max_new_tokens);
+        lengths.push_back(prompt_len + requests[i].max_new_tokens);
+        events.push({t, i, false});
+        if (unit(gen) < opt.cancel_fraction) {
+            // Somewhere between queueing and the last token, counted in tokens so it does
+            // not depend on how fast the engine decodes.
+            events.push({t, i, true, static_cast<int>(unit(gen) * requests[i].max_new_tokens)});
+        }
+    }
+    int num_blocks = opt.num_blocks > 0
+                         ? opt.num_blocks
+                         : opt.serving.max_batch * ((longest + opt.block_size - 1) / opt.block_size);
+    RuntimeOptions runtime_options;
+    runtime_options.pool.lock = opt.lock_kv;
+    if (!opt.kv_budget.empty()) {
+        KVCapacityPlanner planner({opt.num_layers, opt.num_heads, opt.head_size, opt.block_size, opt.use_int8_cache});
+        auto plan = planner.plan(parse_byte_budget(opt.kv_budget), runtime_options.pool);
+        auto fit = planner.max_concurrent_sequences(plan.num_blocks, lengths);
+        num_blocks = plan.num_blocks;
+        runtime_options.pool = plan.pool_options;
+        std::cout << std::fixed << std::setprecision(1) << "kv budget " << plan.budget_bytes / 1048576.0 << " MiB -> "
+                  << plan.num_blocks << " blocks of " << plan.block_bytes / 1024.0 << " KiB ("
+                  << plan.mapped_bytes / 1048576.0 << " MiB mapped) | sequences worst/p99/mean " << fit.worst_case
+                  << "/" << fit.at_confidence << "/" << fit.expected << " vs max-batch " << opt.serving.max_batch
+                  << "\n";
+    }
+
+    ToyLLMRuntime runtime(
+        opt.num_layers, hidden_size, opt.num_heads, opt.head_size, num_blocks, opt.block_size, opt.use_int8_cache,
+        runtime_options);
+    std::vector<RequestHandle> handles(opt.requests);
+    Clock::time_point start;
+    Clock::time_point end;
+    ServingStats stats;
+    {
+        ServingEngine engine(runtime, opt.serving);
+        start = Clock::now();
+        while (!events.empty()) {
+            Event e = events.top();
+            events.pop();
+            auto at = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(e.at_s));
+            std::this_thread::sleep_until(start + at);
+            if (e.cancel) {
+                // Polled until the request produced its tokens; one that ended first is left alone.
+                auto& handle = handles[e.request];
+                auto status = handle.status();
+                if (status != RequestStatus::Queued && status != RequestStatus::Running) {
+                    continue;
+                }
+                if (handle.num_outputs() >= e.cancel_after) {
+                    handle.cancel();
+                } else {
+                    e.at_s = std::chrono::duration<double>(Clock::now() - start).count() + kCancelPollSeconds;
+                    events.push(e);
+                }
+            } else {
+                handles[e.request] = engine.submit(std::move(requests[e.request]));
+            }
+        }
+        for (auto& handle : handles) {
+            handle.wait();
+        }
+        end = Clock::now();
+        stats = engine.stats();
+    }
+
+    std::vector<double> queue_ms;
+    std::vector<double> ttft_ms;
+    std::vector<double> tpot_ms;
+    std::vector<double> e2e_ms;
+    int completed = 0;
+    int cancelled = 0;
+    int failed = 0;
+    int64_t outputs = 0;
+    for (auto& handle : handles) {
+        auto status = handle.status();
+        auto tm = handle.timings();
+        int n = handle.num_outputs();
+        outputs += n;
+        completed += status == RequestStatus::Completed ? 1 : 0;
+        cancelled += status == RequestStatus::Cancelled ? 1 : 0;
+        failed += status == RequestStatus::Failed ? 1 : 0;
+        if (status != RequestStatus::Completed) {
+            continue;
+        }
+        queue_ms.push_back(ms_between(tm.submitted, tm.admitted));
+        ttft_ms.push_back(ms_between(tm.submitted, tm.first_output));
+        if (n > 1) {
+            tpot_ms.push_back(ms_between(tm.first_output, tm.finished) / (n - 1));
+        }
+        e2e_ms.push_back(ms_between(tm.submitted, tm.finished));
+    }
+    double wall_s = std::chrono::duration<double>(end - start).count();
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "requests " << opt.requests << " at " << opt.rate << "/s over " << wall_s << " s"
+              << " | completed " << completed << " cancelled " << cancelled << " failed " << failed << "\n"
+              << "queue ms p50/p90/p99 " << percentile(queue_ms, 50) << "/" << percentile(queue_ms, 90) << "/"
+              << percentile(queue_ms, 99) << " | ttft ms " << percentile(ttft_ms, 50) << "/" << percentile(ttft_ms, 90)
+              << "/" << percentile(ttft_ms, 99) << " | tpot ms " << percentile(tpot_ms, 50) << "/"
+              << percentile(tpot_ms, 90) << "/" << percentile(tpot_ms, 99) << " | e2e ms " << percentile(e2e_ms, 50)
+              << "/" << percentile(e2e_ms, 90) << "/" << percentile(e2e_ms, 99) << "\n"
+              << "output tokens/s " << outputs / wall_s << " | prefill steps " << stats.prefill_steps << " ("
+              << stats.prefill_tokens << " tokens) decode steps " << stats.decode_steps << " (avg batch "
+              << (stats.decode_steps ? static_cast<double>(stats.decode_tokens) / stats.decode_steps : 0.0) << ")\n";
+
+    if (!opt.csv_path.empty()) {
+        std::ostringstream row;
+        row << std::fixed << std::setprecision(4) << opt.requests << ',' << opt.rate << ',' << opt.prompt_len << ','
+            << opt.output_len << ',' << opt.serving.max_batch << ',' << num_blocks << ',' << completed << ','
+            << cancelled << ',' << failed << ',' << wall_s << ',' << percentile(queue_ms, 50) << ','
+            << percentile(queue_ms, 99) << ',' << percentile(ttft_ms, 50) << ',' << percentile(ttft_ms, 99) << ','
+            << percentile(tpot_ms, 50) << ',' << percentile(tpot_ms, 99) << ',' << percentile(e2e_ms, 50) << ','
+            << percentile(e2e_ms, 99) << ',' << outputs / wall_s;
+        const char* header =
+            "requests,rate,prompt_len,output_len,max_batch,num_blocks,completed,cancelled,failed,wall_s,"
+            "queue_p50_ms,queue_p99_ms,ttft_p50_ms,ttft_p99_ms,tpot_p50_ms,tpot_p99_ms,e2e_p50_ms,e2e_p99_ms,"
+            "output_tok_s";
+        if (opt.csv_path == "-") {
+            std::cout << header << "\n" << row.str() << "\n";
+        } else {
+            std::ofstream csv(opt.csv_path);
+            csv << header << "\n" << row.str() << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,297 @@
+#include "pa_tool_util.hpp"
+#include "standalone_pa.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Several local processes on one shared KV pool (see kv_shared_pool.hpp). The parent
+// creates the pool, prefills a common prefix once and publishes it. Each worker is a
+// separate process that attaches to the pool by name and:
+//
+//   1. attaches the published prefix (no copy) and prefills its own suffix on top,
+//   2. decodes, feeding each output back as the next input,
+//   3. hands its sequence to the next worker and takes over the previous worker's,
+//   4. decodes that one further.
+//
+// Every output is checked against a private runtime that computes the same sequence
+// alone, and the parent finally checks that every block went back to the pool.
+
+namespace {
+
+using Tensor2 = ToyLLMRuntime::Tensor2;
+
+struct SharedOptions {
+    int workers = 4;
+    int prefix_len = 256;
+    int suffix_len = 24;
+    int decode_steps = 8;
+    int num_layers = 2;
+    int num_heads = 4;
+    int head_size = 16;
+    int block_size = 16;
+    bool use_int8_cache = false;
+    std::string name = "/pa_shared_kv";
+};
+
+constexpr uint64_t kPrefixKey = 1;
+constexpr uint64_t kHandoffKey = 1000;
+
+void print_usage(const char* argv0) {
+    std::cout << "usage: " << argv0 << " [options]\n"
+              << "  --workers 4         worker processes\n"
+              << "  --prefix 256        shared prefix tokens\n"
+              << "  --suffix 24         per-worker prompt tokens after the prefix\n"
+              << "  --decode 8          decode steps before and after the hand-off\n"
+              << "  --layers 2          number of layers\n"
+              << "  --heads 4x16        <num_heads>x<head_size>\n"
+              << "  --block 16          block size\n"
+              << "  --cache fp32        KV cache precision: fp32 or int8\n"
+              << "  --name /pa_shared_kv  shm name of the pool\n";
+}
+
+SharedOptions parse_args(int argc, char** argv) {
+    SharedOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--workers") {
+            opt.workers = std::stoi(value);
+        } else if (arg == "--prefix") {
+            opt.prefix_len = std::stoi(value);
+        } else if (arg == "--suffix") {
+            opt.suffix_len = std::stoi(value);
+        } else if (arg == "--decode") {
+            opt.decode_steps = std::stoi(value);
+        } else if (arg == "--layers") {
+            opt.num_layers = std::stoi(value);
+        } else if (arg == "--heads") {
+            auto dims = split(value, 'x');
+            if (dims.size() != 2) {
+                throw std::runtime_error("head config must look like <num_heads>x<head_size>: " + value);
+            }
+            opt.num_heads = std::stoi(dims[0]);
+            opt.head_size = std::stoi(dims[1]);
+        } else if (arg == "--block") {
+            opt.block_size = std::stoi(value);
+        } else if (arg == "--cache") {
+            if (value != "fp32" && value != "int8") {
+                throw std::runtime_error("cache precision must be fp32 or int8: " + value);
+            }
+            opt.use_int8_cache = value == "int8";
+        } else if (arg == "--name") {
+            opt.name = value;
+        } else {
+            throw std::runtime_error("unknown option " + arg);
+        }
+    }
+    if (opt.workers < 1 || opt.prefix_len < 1 || opt.suffix_len < 1 || opt.decode_steps < 1) {
+        throw std::runtime_error("workers, prefix, suffix and decode must be positive");
+    }
+    return opt;
+}
+
+int hidden_size(const SharedOptions& opt) {
+    return opt.num_heads * opt.head_size;
+}
+
+// Enough for the prefix plus two private sequences per worker, each grown by a
+// copy-on-write tail.
+int pool_blocks(const SharedOptions& opt) {
+    int bs = opt.block_size;
+    int seq_blocks = (opt.prefix_len + opt.suffix_len + 2 * opt.decode_steps + bs - 1) / bs + 1;
+    return (opt.prefix_len + bs - 1) / bs + 2 * opt.workers * seq_blocks;
+}
+
+std::unique_ptr<ToyLLMRuntime> make_runtime(const SharedOptions& opt, bool shared) {
+    RuntimeOptions options;
+    if (shared) {
+        options.shared.name = opt.name;
+        options.shared.max_published_blocks = pool_blocks(opt);
+    }
+    return std::unique_ptr<ToyLLMRuntime>(new ToyLLMRuntime(
+        opt.num_layers, hidden_size(opt), opt.num_heads, opt.head_size, pool_blocks(opt), opt.block_size,
+        opt.use_int8_cache, options));
+}
+
+Tensor2 prefix_input(const SharedOptions& opt) {
+    return make_random_tensor2(opt.prefix_len, hidden_size(opt), 1);
+}
+
+Tensor2 suffix_input(const SharedOptions& opt, int worker) {
+    return make_random_tensor2(opt.suffix_len, hidden_size(opt), 100 + static_cast<uint32_t>(worker));
+}
+
+Tensor2 handoff_input(const SharedOptions& opt, int worker, int step) {
+    return make_random_tensor2(1, hidden_size(opt), 10000 + static_cast<uint32_t>(worker * 1000 + step));
+}
+
+// Suffix prefill and decode of `worker`'s sequence; returns every output row.
+Tensor2 run_own(ToyLLMRuntime& runtime, const SharedOptions& opt, int seq_id, int worker) {
+    auto out = runtime.prefill({seq_id}, suffix_input(opt, worker), {opt.suffix_len});
+    Tensor2 rows = {out.back()};
+    for (int step = 0; step < opt.decode_steps; ++step) {
+        rows.push_back(runtime.decode({seq_id}, {rows.back()}).back());
+    }
+    return rows;
+}
+
+Tensor2 run_handoff(ToyLLMRuntime& runtime, const SharedOptions& opt, int seq_id, int from) {
+    Tensor2 rows;
+    for (int step = 0; step < opt.decode_steps; ++step) {
+        rows.push_back(runtime.decode({seq_id}, handoff_input(opt, from, step)).back());
+    }
+    return rows;
+}
+
+float max_abs_diff(const Tensor2& a, const Tensor2& b) {
+    float diff = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (size_t j = 0; j < a[i].size(); ++j) {
+            diff = std::max(diff, std::fabs(a[i][j] - b[i][j]));
+        }
+    }
+    return diff;
+}
+
+// The same sequence computed alone: prefix prefill, suffix prefill, decode, hand-off decode.
+std::pair<Tensor2, Tensor2> reference(const SharedOptions& opt, int worker) {
+    auto runtime = make_runtime(opt, false);
+    runtime->add_sequence(1);
+    runtime->prefill({1}, prefix_input(opt), {opt.prefix_len});
+    auto own = run_own(*runtime, opt, 1, worker);
+    auto handoff = run_handoff(*runtime, opt, 1, worker);
+    return {own, handoff};
+}
+
+int run_worker(const SharedOptions& opt, int worker) {
+    auto runtime = make_runtime(opt, true);
+    const int seq_id = 100 + worker;
+    int polls = 0;
+    while (!runtime->attach_published_sequence(seq_id, kPrefixKey)) {
+        if (++polls > 10000) {
+            throw std::runtime_error("prefix was never published");
+        }
+        usleep(1000);
+    }
+    const auto& blocks = runtime->manager().logical_blocks(seq_id);
+    int shared_blocks = 0;
+    for (int block : blocks) {
+        shared_blocks += runtime->manager().block_ref_count(block) > 1 ? 1 : 0;
+    }
+    auto own = run_own(*runtime, opt, seq_id, worker);
+
+    // Hand ours to the next worker, then take the previous worker's.
+    if (!runtime->publish_sequence(seq_id, kHandoffKey + worker)) {
+        throw std::runtime_error("hand-off publish failed");
+    }
+    runtime->finish_sequence(seq_id);
+    const int from = (worker + opt.workers - 1) % opt.workers;
+    const int taken_id = 200 + from;
+    polls = 0;
+    while (!runtime->attach_published_sequence(taken_id, kHandoffKey + from, true)) {
+        if (++polls > 100000) {
+            throw std::runtime_error("hand-off from worker " + std::to_string(from) + " never arrived");
+        }
+        usleep(1000);
+    }
+    auto handoff = run_handoff(*runtime, opt, taken_id, from);
+    runtime->finish_sequence(taken_id);
+
+    auto own_ref = reference(opt, worker);
+    auto from_ref = reference(opt, from);
+    float own_diff = max_abs_diff(own, own_ref.first);
+    float handoff_diff = max_abs_diff(handoff, from_ref.second);
+    std::ostringstream line;
+    line << "worker " << worker << " (pid " << getpid() << "): prefix blocks " << blocks.size() << ", shared "
+         << shared_blocks << " | own max|diff| " << own_diff << " | took worker " << from << "'s sequence, max|diff| "
+         << handoff_diff << "\n";
+    std::cout << line.str() << std::flush;
+    return own_diff == 0.0f && handoff_diff == 0.0f ? 0 : 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    SharedOptions opt;
+    try {
+        opt = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // A pool left behind by a killed run would otherwise be attached with stale refs.
+    shm_unlink(opt.name.c_str());
+    // Workers are forked before this process maps anything, so each one attaches to the
+    // pool by name like an unrelated process would.
+    std::vector<pid_t> pids;
+    for (int w = 0; w < opt.workers; ++w) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "fork failed\n";
+            return 1;
+        }
+        if (pid == 0) {
+            int status = 1;
+            try {
+                status = run_worker(opt, w);
+            } catch (const std::exception& e) {
+                std::cerr << "worker " << w << ": " << e.what() << "\n";
+            }
+            std::cout.flush();
+            _exit(status);
+        }
+        pids.push_back(pid);
+    }
+
+    int failures = 0;
+    try {
+        auto runtime = make_runtime(opt, true);
+        const auto* pool = runtime->shared_pool();
+        runtime->add_sequence(1);
+        runtime->prefill({1}, prefix_input(opt), {opt.prefix_len});
+        int prefix_blocks = static_cast<int>(runtime->manager().logical_blocks(1).size());
+        runtime->publish_sequence(1, kPrefixKey);
+        std::cout << "pool " << pool->name() << ": " << pool->num_blocks() << " blocks of "
+                  << runtime->kv_bytes_per_block() << " bytes, prefix " << opt.prefix_len << " tokens in "
+                  << prefix_blocks << " blocks published once for " << opt.workers << " workers\n"
+                  << std::flush;
+
+        for (pid_t pid : pids) {
+            int status = 0;
+            waitpid(pid, &status, 0);
+            failures += WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+        }
+        runtime->unpublish_sequence(kPrefixKey);
+        runtime->finish_sequence(1);
+        int leaked = pool->num_blocks() - pool->num_free_blocks();
+        std::cout << "workers failed " << failures << ", blocks still held " << leaked << ", attached processes "
+                  << pool->num_attached() << "\n";
+        failures += leaked != 0 ? 1 : 0;
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        failures += 1;
+    }
+    shm_unlink(opt.name.c_str());
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,2809 @@
+#pragma once
+
+#include "block_table_pool.hpp"
+#include "kv_cache_arena.hpp"
+#include "kv_pool_allocator.hpp"
+#include "kv_shared_pool.hpp"
+#include "kv_snapshot.hpp"
+#include "numa_topology.hpp"
+#include "pa_attention_kernels.hpp"
+#include "pa_eltwise.hpp"
+#include "pa_pipeline.hpp"
+#include "pa_quant_kernels.hpp"
+#include "pa_rope.hpp"
+#include "pa_sparse_attention.hpp"
+#include "pa_tensor_parallel.hpp"
+#include "pa_thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Heavy-hitter retention (H2O): once a sequence holds more than budget_tokens of KV,
+// the tokens that received the least attention so far are evicted.
+struct HeavyHitterOptions {
+    int budget_tokens = 0;     // 0 = off
+    int recent_tokens = 0;     // newest tokens, never evicted
+    bool evict_tokens = true;  // single tokens with the holes refilled; false: whole blocks
+};
+
+struct SequenceState {
+    int seq_id = -1;
+    BlockTableRef logical_blocks;  // in the SequenceTable's BlockTablePool
+    int past_len = 0;
+    int node = 0;
+    // Streaming (attention-sink) mode, off while window_tokens == 0. past_len is then
+    // the virtual length of sink + window; evicted_tokens counts what was dropped.
+    int sink_tokens = 0;
+    int window_tokens = 0;
+    int evicted_tokens = 0;
+    HeavyHitterOptions heavy_hitters;  // evicted_tokens counts these evictions too
+};
+
+// Dense slot of a live sequence. The generation changes whenever the slot is freed,
+// so a handle kept past finish_sequence is rejected instead of aliasing the slot's
+// next owner.
+struct SequenceHandle {
+    int slot = -1;
+    uint32_t generation = 0;
+};
+
+struct BatchMetadata {
+    std::vector<int> past_lens;
+    std::vector<int> subsequence_begins;
+    std::vector<int> block_indices;
+    std::vector<int> block_indices_begins;
+    std::vector<int> seq_nodes;
+    // Tokens each sequence evicted so far. RoPE positions are absolute (evicted plus
+    // logical), so keys rotated before an eviction keep matching later queries.
+    std::vector<int> evicted_tokens;
+};
+
+struct BlockCopyPlan {
+    int src_block = -1;
+    int dst_block = -1;
+};
+
+// Slots are block * block_size + offset.
+struct SlotCopyPlan {
+    int src_slot = -1;
+    int dst_slot = -1;
+};
+
+// KV copies of one heavy-hitter eviction, in order: copy-on-write of shared blocks that
+// receive a token, then the token moves that close the holes.
+struct EvictionPlan {
+    std::vector<BlockCopyPlan> block_copies;
+    std::vector<SlotCopyPlan> slot_moves;
+};
+
+// Occupancy of the pool at one instant. filled_slots counts the token slots holding
+// KV, each physical block once however many sequences share it.
+struct KVUsageStats {
+    int used_blocks = 0;
+    int shared_blocks = 0;
+    int64_t filled_slots = 0;
+    int block_runs = 0;   // ascending contiguous id runs over all live block tables
+    int high_water = 0;   // one past the highest used block id
+};
+
+// Running totals since construction; block_frees counts blocks returning to a free list.
+struct KVAllocatorCounters {
+    int64_t block_allocations = 0;
+    int64_t block_frees = 0;
+    int64_t cow_copies = 0;
+    int64_t compaction_moves = 0;
+};
+
+struct KVCompactionResult {
+    int moves = 0;
+    size_t released_bytes = 0;
+};
+
+// One compaction pass, see KVBlockManager::compact.
+struct CompactionOptions {
+    int max_moves = std::numeric_limits<int>::max();  // the rest is left to the next pass
+    bool sequence_runs = true;  // also lay every sequence out as one ascending run
+    int min_run_blocks = 2;     // shorter sequences are only packed, never rebuilt as runs
+};
+
+// Dense slot table of live sequences and their block tables, shared by KVBlockManager
+// and ConcurrentKVBlockManager (kv_concurrent_manager.hpp). The seq_id -> slot map is
+// only consulted by the id-based entry points. The per-step path (reserve,
+// build_batch_metadata, commit) also takes handles, which index the table directly.
+// Owning blocks and ref counts is left to the manager.
+class SequenceTable {
+public:
+    explicit SequenceTable(int block_size) : m_block_size(block_size) {}
+
+    SequenceHandle handle(int seq_id) const {
+        auto it = m_seq_slots.find(seq_id);
+        if (it == m_seq_slots.end()) {
+            throw std::runtime_error("sequence does not exist: " + std::to_string(seq_id));
+        }
+        return {it->second, m_slot_generations[it->second]};
+    }
+
+    std::vector<SequenceHandle> handles(const std::vector<int>& seq_ids) const {
+        std::vector<SequenceHandle> out;
+        out.reserve(seq_ids.size());
+        for (int seq_id : seq_ids) {
+            out.push_back(handle(seq_id));
+        }
+        return out;
+    }
+
+    bool is_valid(SequenceHandle h) const {
+        return h.slot >= 0 && h.slot < static_cast<int>(m_slots.size()) && m_slot_generations[h.slot] == h.generation &&
+               m_slots[h.slot].seq_id >= 0;
+    }
+
+    bool has_sequence(int seq_id) const {
+        return m_seq_slots.count(seq_id) != 0;
+    }
+
+    int num_sequences() const {
+        return static_cast<int>(m_seq_slots.size());
+    }
+
+    int past_len(SequenceHandle h) const {
+        return state(h).past_len;
+    }
+
+    int past_len(int seq_id) const {
+        return state(handle(seq_id)).past_len;
+    }
+
+    std::vector<int> logical_blocks(int seq_id) const {
+        return table_copy(state(handle(seq_id)).logical_blocks);
+    }
+
+    BatchMetadata build_batch_metadata(const std::vector<SequenceHandle>& handles, const std::vector<int>& q_lens) const {
+        if (handles.size() != q_lens.size()) {
+            throw std::runtime_error("seq_ids size mismatch with q_lens");
+        }
+
+        BatchMetadata meta;
+        meta.past_lens.reserve(handles.size());
+        meta.seq_nodes.reserve(handles.size());
+        meta.evicted_tokens.reserve(handles.size());
+        meta.subsequence_begins.reserve(handles.size() + 1);
+        meta.block_indices_begins.reserve(handles.size() + 1);
+        meta.subsequence_begins.push_back(0);
+        meta.block_indices_begins.push_back(0);
+
+        int token_acc = 0;
+        int block_acc = 0;
+        for (size_t i = 0; i < handles.size(); ++i) {
+            const auto& seq = state(handles[i]);
+            int total_blocks = div_up(seq.past_len + q_lens[i], m_block_size);
+            meta.past_lens.push_back(seq.past_len);
+            meta.seq_nodes.push_back(seq.node);
+            meta.evicted_tokens.push_back(seq.evicted_tokens);
+            token_acc += q_lens[i];
+            meta.subsequence_begins.push_back(token_acc);
+            block_acc += total_blocks;
+            meta.block_indices_begins.push_back(block_acc);
+        }
+
+        // Second pass: every table is contiguous in the pool, one copy per sequence.
+        meta.block_indices.resize(block_acc);
+        for (size_t i = 0; i < handles.size(); ++i) {
+            const auto& seq = state(handles[i]);
+            int begin = meta.block_indices_begins[i];
+            int count = meta.block_indices_begins[i + 1] - begin;
+            std::copy_n(m_block_tables.data(seq.logical_blocks), count, meta.block_indices.begin() + begin);
+        }
+        return meta;
+    }
+
+    BatchMetadata build_batch_metadata(const std::vector<int>& seq_ids, const std::vector<int>& q_lens) const {
+        return build_batch_metadata(handles(seq_ids), q_lens);
+    }
+
+    int block_size() const {
+        return m_block_size;
+    }
+
+protected:
+    int m_block_size;
+    std::vector<SequenceState> m_slots;
+    std::vector<uint32_t> m_slot_generations;
+    std::vector<int> m_free_slots;
+    std::unordered_map<int, int> m_seq_slots;
+    BlockTablePool m_block_tables;
+
+    static int div_up(int x, int y) {
+        return (x + y - 1) / y;
+    }
+
+    SequenceHandle allocate_slot(int seq_id) {
+        int slot;
+        if (!m_free_slots.empty()) {
+            slot = m_free_slots.back();
+            m_free_slots.pop_back();
+        } else {
+            slot = static_cast<int>(m_slots.size());
+            m_slots.emplace_back();
+            m_slot_generations.push_back(0);
+        }
+        m_slots[slot] = SequenceState{};
+        m_slots[slot].seq_id = seq_id;
+        m_seq_slots.emplace(seq_id, slot);
+        return {slot, m_slot_generations[slot]};
+    }
+
+    // Drops the sequence in `slot` once the manager released its block references.
+    void release_slot(int slot) {
+        auto& seq = m_slots[slot];
+        m_seq_slots.erase(seq.seq_id);
+        m_block_tables.release(seq.logical_blocks);
+        seq = SequenceState{};
+        m_slot_generations[slot] += 1;
+        m_free_slots.push_back(slot);
+    }
+
+    SequenceState& state(SequenceHandle h) {
+        if (!is_valid(h)) {
+            throw std::runtime_error("stale or invalid sequence handle");
+        }
+        return m_slots[h.slot];
+    }
+
+    const SequenceState& state(SequenceHandle h) const {
+        if (!is_valid(h)) {
+            throw std::runtime_error("stale or invalid sequence handle");
+        }
+        return m_slots[h.slot];
+    }
+
+    std::vector<int> table_copy(const BlockTableRef& table) const {
+        const int* blocks = m_block_tables.data(table);
+        return std::vector<int>(blocks, blocks + table.size);
+    }
+
+    // Blocks past the end of the table that appending q_len tokens needs.
+    int blocks_to_append(const SequenceState& seq, int q_len) const {
+        return std::max(0, div_up(seq.past_len + q_len, m_block_size) - seq.logical_blocks.size);
+    }
+
+    // The partially filled tail block that appending q_len > 0 tokens writes into, -1 if
+    // the tail is full. A manager copies it first when it is shared.
+    int partial_tail_block(const SequenceState& seq, int q_len) const {
+        if (q_len <= 0 || seq.past_len % m_block_size == 0) {
+            return -1;
+        }
+        return m_block_tables.at(seq.logical_blocks, (seq.past_len - 1) / m_block_size);
+    }
+};
+
+class KVBlockManager : public SequenceTable {
+public:
+    // With num_nodes > 1 the block ids are split into contiguous per-node ranges (see
+    // numa_block_begin) and every sequence allocates from its home node's range first.
+    //
+    // With a shared pool the free list and ref counts live in its segment instead and
+    // are shared with every other process attached to it; sequences stay private.
+    KVBlockManager(int num_blocks, int block_size, int num_nodes = 1, KVSharedPool* shared = nullptr)
+        : SequenceTable(block_size),
+          m_num_blocks(num_blocks),
+          m_num_nodes(num_nodes),
+          m_num_free_blocks(num_blocks),
+          m_node_free_blocks(num_nodes),
+          m_node_sequences(num_nodes, 0),
+          m_shared(shared) {
+        if (m_shared) {
+            if (num_nodes != 1 || m_shared->num_blocks() != num_blocks) {
+                throw std::runtime_error("a shared KV pool needs one node and the pool's block count");
+            }
+            return;
+        }
+        // Ascending ids are already a valid min-heap.
+        for (int i = 0; i < num_blocks; ++i) {
+            m_node_free_blocks[numa_block_node(i, num_blocks, num_nodes)].push_back(i);
+        }
+        m_block_ref_counts.assign(num_blocks, 0);
+    }
+
+    // node < 0 places the sequence on the node with the most free blocks per resident
+    // sequence, so a burst of admissions is spread before any of them allocates.
+    SequenceHandle add_sequence(int seq_id, int node = -1) {
+        if (m_seq_slots.count(seq_id)) {
+            throw std::runtime_error("sequence already exists");
+        }
+        if (node >= m_num_nodes) {
+            throw std::runtime_error("sequence node out of range");
+        }
+        node = node < 0 ? least_loaded_node() : node;
+        SequenceHandle handle = allocate_slot(seq_id);
+        m_slots[handle.slot].node = node;
+        m_node_sequences[node] += 1;
+        return handle;
+    }
+
+    SequenceHandle fork_sequence(int parent_seq_id, int child_seq_id) {
+        if (m_seq_slots.count(child_seq_id)) {
+            throw std::runtime_error("child sequence already exists");
+        }
+        int parent_slot = handle(parent_seq_id).slot;
+        SequenceHandle child_handle = allocate_slot(child_seq_id);
+        // allocate_slot may grow m_slots, so take references only now.
+        const auto& parent = m_slots[parent_slot];
+        auto& child = m_slots[child_handle.slot];
+        BlockTableRef child_blocks;
+        m_block_tables.assign(child_blocks, parent.logical_blocks);
+        child = parent;
+        child.seq_id = child_seq_id;
+        child.logical_blocks = child_blocks;
+        m_node_sequences[parent.node] += 1;
+        add_block_refs(child.logical_blocks);
+        return child_handle;
+    }
+
+    void beam_merge(int dst_seq_id, int src_seq_id) {
+        if (dst_seq_id == src_seq_id) {
+            return;
+        }
+        auto& dst = state(handle(dst_seq_id));
+        const auto& src = state(handle(src_seq_id));
+        release_block_refs(dst.logical_blocks);
+        m_block_tables.assign(dst.logical_blocks, src.logical_blocks);
+        dst.past_len = src.past_len;
+        m_node_sequences[dst.node] -= 1;
+        m_node_sequences[src.node] += 1;
+        dst.node = src.node;
+        dst.sink_tokens = src.sink_tokens;
+        dst.window_tokens = src.window_tokens;
+        dst.evicted_tokens = src.evicted_tokens;
+        dst.heavy_hitters = src.heavy_hitters;
+        add_block_refs(dst.logical_blocks);
+    }
+
+    void finish_sequence(int seq_id) {
+        auto it = m_seq_slots.find(seq_id);
+        if (it == m_seq_slots.end()) {
+            throw std::runtime_error("sequence does not exist");
+        }
+        auto& seq = m_slots[it->second];
+        m_node_sequences[seq.node] -= 1;
+        release_block_refs(seq.logical_blocks);
+        release_slot(it->second);
+    }
+
+    std::vector<BlockCopyPlan> reserve_for_prefill(SequenceHandle h, int q_len) {
+        auto& seq = state(h);
+        auto copy_plans = q_len > 0 ? ensure_writable_tail(seq) : std::vector<BlockCopyPlan>{};
+        ensure_capacity_for_append(seq, q_len);
+        if (seq.heavy_hitters.budget_tokens > 0) {
+            for (int i = seq.past_len; i < seq.past_len + q_len; ++i) {
+                int slot = slot_of(seq, i);
+                m_slot_mass[slot] = 0.0f;
+                m_slot_positions[slot] = seq.evicted_tokens + i;
+            }
+        }
+        return copy_plans;
+    }
+
+    std::vector<BlockCopyPlan> reserve_for_prefill(int seq_id, int q_len) {
+        return reserve_for_prefill(handle(seq_id), q_len);
+    }
+
+    std::vector<BlockCopyPlan> reserve_for_decode(SequenceHandle h) {
+        return reserve_for_prefill(h, 1);
+    }
+
+    std::vector<BlockCopyPlan> reserve_for_decode(int seq_id) {
+        return reserve_for_prefill(handle(seq_id), 1);
+    }
+
+    void commit_tokens(SequenceHandle h, int num_tokens) {
+        auto& seq = state(h);
+        seq.past_len += num_tokens;
+        if (seq.window_tokens > 0) {
+            evict_streaming_middle(seq);
+        }
+    }
+
+    void commit_tokens(int seq_id, int num_tokens) {
+        commit_tokens(handle(seq_id), num_tokens);
+    }
+
+    // StreamingLLM-style retention: keep the first `sink_tokens` and the most recent
+    // `window_tokens` (both rounded up to whole blocks) and release everything between
+    // them after each commit. The survivors are re-indexed as one contiguous virtual
+    // context, so KV memory and per-token attention cost stop growing with the stream.
+    void enable_streaming(int seq_id, int sink_tokens, int window_tokens) {
+        if (sink_tokens < 0 || window_tokens <= 0) {
+            throw std::runtime_error("streaming needs sink_tokens >= 0 and window_tokens > 0");
+        }
+        auto& seq = state(handle(seq_id));
+        if (seq.heavy_hitters.budget_tokens > 0) {
+            throw std::runtime_error("streaming and heavy-hitter retention are exclusive");
+        }
+        seq.sink_tokens = sink_tokens;
+        seq.window_tokens = window_tokens;
+        evict_streaming_middle(seq);
+    }
+
+    int evicted_tokens(int seq_id) const {
+        return state(handle(seq_id)).evicted_tokens;
+    }
+
+    // Heavy-hitter retention: every step adds the attention probability each cached
+    // token received (add_attention_mass) to a per-slot total, and evict_heavy_hitters
+    // then trims the sequence back to the budget by dropping the lowest totals outside
+    // the recent window. Tokens already cached start from zero.
+    //
+    // The totals are kept per physical slot next to a token's write position, so they
+    // follow the KV through copy-on-write, compaction and eviction moves, and beams
+    // sharing a block share its totals.
+    void enable_heavy_hitters(int seq_id, const HeavyHitterOptions& options) {
+        if (options.recent_tokens < 0 || options.recent_tokens >= options.budget_tokens) {
+            throw std::runtime_error("heavy hitters need budget_tokens > recent_tokens >= 0");
+        }
+        auto& seq = state(handle(seq_id));
+        if (seq.window_tokens > 0) {
+            throw std::runtime_error("streaming and heavy-hitter retention are exclusive");
+        }
+        if (m_slot_mass.empty()) {
+            m_slot_mass.assign(static_cast<size_t>(m_num_blocks) * m_block_size, 0.0f);
+            m_slot_positions.assign(m_slot_mass.size(), 0);
+        }
+        seq.heavy_hitters = options;
+        for (int i = 0; i < seq.past_len; ++i) {
+            int slot = slot_of(seq, i);
+            m_slot_mass[slot] = 0.0f;
+            m_slot_positions[slot] = seq.evicted_tokens + i;
+        }
+    }
+
+    bool tracks_attention_mass(SequenceHandle h) const {
+        return state(h).heavy_hitters.budget_tokens > 0;
+    }
+
+    // mass[i] is what logical position i received during the last step, i < kv_len.
+    void add_attention_mass(SequenceHandle h, const float* mass, int kv_len) {
+        const auto& seq = state(h);
+        if (seq.heavy_hitters.budget_tokens == 0) {
+            return;
+        }
+        for (int i = 0; i < kv_len; ++i) {
+            m_slot_mass[slot_of(seq, i)] += mass[i];
+        }
+    }
+
+    // Call after commit_tokens. Token mode drops the lowest-mass tokens and moves the
+    // newest survivors past the new length into the holes, so partially filled blocks are
+    // packed and the freed tail blocks released; the KV copies are returned. Block mode
+    // drops the lowest-mass full blocks and needs no copies. Either way logical order no
+    // longer follows write order, which attention does not depend on.
+    EvictionPlan evict_heavy_hitters(SequenceHandle h) {
+        auto& seq = state(h);
+        EvictionPlan plan;
+        const auto& options = seq.heavy_hitters;
+        int excess = seq.past_len - options.budget_tokens;
+        if (options.budget_tokens == 0 || excess <= 0) {
+            return plan;
+        }
+        int recent_begin = seq.evicted_tokens + seq.past_len - options.recent_tokens;
+        if (options.evict_tokens) {
+            evict_low_mass_tokens(seq, excess, recent_begin, plan);
+        } else {
+            evict_low_mass_blocks(seq, div_up(excess, m_block_size), recent_begin);
+        }
+        return plan;
+    }
+
+    // Accumulated attention mass of a cached token, by logical position.
+    float attention_mass(int seq_id, int pos) const {
+        return m_slot_mass[slot_of(state(handle(seq_id)), pos)];
+    }
+
+    // Re-creates a sequence that already holds `past_len` committed tokens, e.g. when
+    // resuming from a snapshot; `evicted_tokens` carries over the source's evictions so
+    // RoPE positions continue where they left off. The caller fills the returned fresh blocks.
+    std::vector<int> adopt_sequence(int seq_id, int past_len, int node = -1, int evicted_tokens = 0) {
+        auto& seq = state(add_sequence(seq_id, node));
+        ensure_capacity_for_append(seq, past_len);
+        seq.past_len = past_len;
+        seq.evicted_tokens = evicted_tokens;
+        return table_copy(seq.logical_blocks);
+    }
+
+    // Shared pool only: stores the committed blocks of `seq_id` in the pool's directory
+    // under `key` for other processes to attach or take (see kv_shared_pool.hpp).
+    // Returns false if the key is already published or the directory is full.
+    bool publish_sequence(int seq_id, uint64_t key) {
+        const auto& seq = state(handle(seq_id));
+        const int* blocks = m_block_tables.data(seq.logical_blocks);
+        std::vector<int> committed(blocks, blocks + div_up(seq.past_len, m_block_size));
+        return shared_pool().publish(key, seq.past_len, committed);
+    }
+
+    // Creates `seq_id` over the blocks published under `key`, sharing them with their
+    // other holders (take = false) or taking over the directory's references (take =
+    // true, a hand-off). Returns false if nothing is published under `key`.
+    bool attach_published_sequence(int seq_id, uint64_t key, bool take = false, int node = -1) {
+        if (m_seq_slots.count(seq_id)) {
+            throw std::runtime_error("sequence already exists");
+        }
+        auto& pool = shared_pool();
+        auto h = add_sequence(seq_id, node);
+        int past_len = 0;
+        std::vector<int> blocks;
+        if (!(take ? pool.take(key, past_len, blocks) : pool.attach(key, past_len, blocks))) {
+            finish_sequence(seq_id);
+            return false;
+        }
+        auto& seq = state(h);
+        for (int block : blocks) {
+            m_block_tables.push_back(seq.logical_blocks, block);
+        }
+        seq.past_len = past_len;
+        return true;
+    }
+
+    // Drops the directory's references; returns false if `key` is not published.
+    bool unpublish_sequence(uint64_t key) {
+        return shared_pool().unpublish(key);
+    }
+
+    bool has_shared_pool() const {
+        return m_shared != nullptr;
+    }
+
+    // Fresh blocks reserve_for_prefill(h, q_len) would allocate, including the
+    // copy-on-write of a shared tail. Lets a scheduler preempt before running dry.
+    int blocks_needed(SequenceHandle h, int q_len) const {
+        const auto& seq = state(h);
+        int tail_block = partial_tail_block(seq, q_len);
+        return blocks_to_append(seq, q_len) + (tail_block >= 0 && block_ref_count(tail_block) > 1 ? 1 : 0);
+    }
+
+    void dump_state(const std::vector<int>& seq_ids) const {
+        std::cout << "scheduler state:\n";
+        for (int seq_id : seq_ids) {
+            const auto& seq = state(handle(seq_id));
+            std::cout << "  seq=" << seq_id << " past_len=" << seq.past_len;
+            if (seq.window_tokens > 0 || seq.heavy_hitters.budget_tokens > 0) {
+                std::cout << " evicted=" << seq.evicted_tokens;
+            }
+            std::cout << " blocks=[";
+            for (int i = 0; i < seq.logical_blocks.size; ++i) {
+                if (i) {
+                    std::cout << ", ";
+                }
+                std::cout << m_block_tables.at(seq.logical_blocks, i);
+            }
+            std::cout << "]\n";
+        }
+        auto free_list = free_blocks();
+        std::cout << "  free_blocks_head=[";
+        for (size_t i = 0; i < std::min<size_t>(8, free_list.size()); ++i) {
+            if (i) {
+                std::cout << ", ";
+            }
+            std::cout << free_list[i];
+        }
+        std::cout << "]\n";
+        std::cout << "  block_ref_counts=[";
+        bool first = true;
+        for (int block = 0; block < m_num_blocks; ++block) {
+            int ref_count = block_ref_count(block);
+            if (ref_count == 0) {
+                continue;
+            }
+            if (!first) {
+                std::cout << ", ";
+            }
+            first = false;
+            std::cout << block << ":" << ref_count;
+        }
+        std::cout << "]\n";
+    }
+
+    // All free blocks in ascending id order, across nodes. Debug/inspection only.
+    std::vector<int> free_blocks() const {
+        std::vector<int> blocks;
+        if (m_shared) {
+            for (int block = 0; block < m_num_blocks; ++block) {
+                if (m_shared->ref_count(block) == 0) {
+                    blocks.push_back(block);
+                }
+            }
+            return blocks;
+        }
+        for (const auto& node_blocks : m_node_free_blocks) {
+            size_t begin = blocks.size();
+            blocks.insert(blocks.end(), node_blocks.begin(), node_blocks.end());
+            std::sort(blocks.begin() + begin, blocks.end());
+        }
+        return blocks;
+    }
+
+    int num_free_blocks(int node) const {
+        return m_shared ? m_shared->num_free_blocks() : static_cast<int>(m_node_free_blocks[node].size());
+    }
+
+    int num_free_blocks() const {
+        return m_shared ? m_shared->num_free_blocks() : m_num_free_blocks;
+    }
+
+    int num_nodes() const {
+        return m_num_nodes;
+    }
+
+    int sequence_node(int seq_id) const {
+        return state(handle(seq_id)).node;
+    }
+
+    int block_ref_count(int block) const {
+        return m_shared ? m_shared->ref_count(block) : m_block_ref_counts[block];
+    }
+
+    int num_blocks() const {
+        return m_num_blocks;
+    }
+
+    int num_used_blocks() const {
+        return m_num_blocks - num_free_blocks();
+    }
+
+    int peak_used_blocks() const {
+        return m_peak_used_blocks;
+    }
+
+    void reset_peak_used_blocks() {
+        m_peak_used_blocks = num_used_blocks();
+    }
+
+    // Walks every live block table: O(blocks in use), meant for periodic sampling.
+    KVUsageStats usage_stats() const {
+        KVUsageStats stats;
+        stats.used_blocks = num_used_blocks();
+        std::vector<int> fill(m_num_blocks, 0);
+        for (const auto& seq : m_slots) {
+            if (seq.seq_id < 0) {
+                continue;
+            }
+            const int* blocks = m_block_tables.data(seq.logical_blocks);
+            for (int i = 0; i < seq.logical_blocks.size; ++i) {
+                int tokens = std::min(m_block_size, std::max(0, seq.past_len - i * m_block_size));
+                fill[blocks[i]] = std::max(fill[blocks[i]], tokens);
+                stats.block_runs += (i == 0 || blocks[i] != blocks[i - 1] + 1) ? 1 : 0;
+            }
+        }
+        for (int block = 0; block < m_num_blocks; ++block) {
+            stats.filled_slots += fill[block];
+            stats.shared_blocks += block_ref_count(block) > 1 ? 1 : 0;
+            stats.high_water = block_ref_count(block) > 0 ? block + 1 : stats.high_water;
+        }
+        return stats;
+    }
+
+    // One past the highest used block id of the node's range (its first id if none is
+    // used). Everything from here to the end of the range is free.
+    int node_high_water(int node) const {
+        int begin = numa_block_begin(node, m_num_blocks, m_num_nodes);
+        int end = numa_block_begin(node + 1, m_num_blocks, m_num_nodes);
+        while (end > begin && block_ref_count(end - 1) == 0) {
+            --end;
+        }
+        return end;
+    }
+
+    // Relocates used blocks so each node's used blocks occupy the start of its id range
+    // and the rest of the range is one free tail. Blocks never leave their node.
+    //
+    // Without sequence_runs only the blocks past the packed range move, into its lowest
+    // holes. With it, every sequence of at least min_run_blocks blocks that is not one
+    // ascending run yet is rebuilt as one: a run that grew is extended in place, anything
+    // else goes to the lowest range that holds it whole. Sequences that are runs already
+    // never move, and a shared block goes with its first holder. Concurrent decodes
+    // interleave their blocks, so runs cost moves; max_moves bounds one pass.
+    //
+    // Returns the copies in the order they must be applied; each destination is free at
+    // the time of its copy. Block tables, ref counts and free lists already describe the
+    // final placement, so the copies have to happen before the next step reads the cache.
+    std::vector<BlockCopyPlan> compact(const CompactionOptions& options = {}) {
+        if (m_shared) {
+            throw std::runtime_error("blocks of a shared KV pool are held by other processes and cannot move");
+        }
+        std::vector<int> block_at(m_num_blocks, -1);  // position -> original block id
+        std::vector<int> position(m_num_blocks, -1);  // original block id -> position
+        for (int block = 0; block < m_num_blocks; ++block) {
+            if (m_block_ref_counts[block] > 0) {
+                block_at[block] = block;
+                position[block] = block;
+            }
+        }
+        std::vector<BlockCopyPlan> moves;
+        auto move = [&](int block, int dst) {
+            moves.push_back({position[block], dst});
+            block_at[position[block]] = -1;
+            block_at[dst] = block;
+            position[block] = dst;
+        };
+
+        for (int node = 0; node < m_num_nodes; ++node) {
+            int begin = numa_block_begin(node, m_num_blocks, m_num_nodes);
+            int end = numa_block_begin(node + 1, m_num_blocks, m_num_nodes);
+            if (m_node_free_blocks[node].empty()) {
+                continue;  // nothing to move into
+            }
+            // (target, block), ascending by target.
+            auto targets = compaction_targets(begin, end, options.sequence_runs, options.min_run_blocks);
+            std::vector<int> target_of(end - begin, -1);
+            for (const auto& t : targets) {
+                target_of[t.second - begin] = t.first;
+            }
+            // Every position in [begin, park) is in use.
+            int park = begin;
+            for (const auto& t : targets) {
+                int target = t.first;
+                int block = t.second;
+                if (position[block] == target) {
+                    continue;
+                }
+                int displaced = block_at[target];
+                if (static_cast<int>(moves.size()) + (displaced >= 0 ? 2 : 1) > options.max_moves) {
+                    break;
+                }
+                if (displaced >= 0) {
+                    // Its own target lies ahead (earlier ones are placed). Otherwise park it on
+                    // the lowest free id, which no later target can be.
+                    int own = target_of[displaced - begin];
+                    if (block_at[own] >= 0) {
+                        while (block_at[park] >= 0) {
+                            ++park;
+                        }
+                        own = park;
+                    }
+                    move(displaced, own);
+                }
+                int vacated = position[block];
+                move(block, target);
+                park = std::min(park, vacated);
+            }
+        }
+        if (moves.empty()) {
+            return moves;
+        }
+
+        for (auto& seq : m_slots) {
+            if (seq.seq_id < 0) {
+                continue;
+            }
+            int* blocks = m_block_tables.data(seq.logical_blocks);
+            for (int i = 0; i < seq.logical_blocks.size; ++i) {
+                blocks[i] = position[blocks[i]];
+            }
+        }
+        std::vector<int> ref_counts(m_num_blocks, 0);
+        for (int block = 0; block < m_num_blocks; ++block) {
+            if (position[block] >= 0) {
+                ref_counts[position[block]] = m_block_ref_counts[block];
+            }
+        }
+        m_block_ref_counts.swap(ref_counts);
+        if (!m_slot_mass.empty()) {
+            std::vector<float> mass(m_slot_mass.size(), 0.0f);
+            std::vector<int> positions(m_slot_positions.size(), 0);
+            for (int block = 0; block < m_num_blocks; ++block) {
+                if (position[block] >= 0) {
+                    size_t src = static_cast<size_t>(block) * m_block_size;
+                    size_t dst = static_cast<size_t>(position[block]) * m_block_size;
+                    std::copy_n(m_slot_mass.begin() + src, m_block_size, mass.begin() + dst);
+                    std::copy_n(m_slot_positions.begin() + src, m_block_size, positions.begin() + dst);
+                }
+            }
+            m_slot_mass.swap(mass);
+            m_slot_positions.swap(positions);
+        }
+        for (auto& free_list : m_node_free_blocks) {
+            free_list.clear();
+        }
+        for (int block = 0; block < m_num_blocks; ++block) {
+            if (block_at[block] < 0) {
+                m_node_free_blocks[numa_block_node(block, m_num_blocks, m_num_nodes)].push_back(block);
+            }
+        }
+        m_counters.compaction_moves += static_cast<int64_t>(moves.size());
+        return moves;
+    }
+
+    const KVAllocatorCounters& counters() const {
+        return m_counters;
+    }
+
+private:
+    int m_num_blocks;
+    int m_num_nodes;
+    int m_num_free_blocks;
+    int m_peak_used_blocks = 0;
+    KVAllocatorCounters m_counters;
+    std::vector<std::vector<int>> m_node_free_blocks;  // min-heaps of block ids
+    std::vector<int> m_node_sequences;
+    std::vector<int> m_block_ref_counts;  // empty with a shared pool
+    KVSharedPool* m_shared = nullptr;
+
+    // Per physical slot, allocated by the first enable_heavy_hitters: accumulated
+    // attention mass and the token's write position.
+    std::vector<float> m_slot_mass;
+    std::vector<int> m_slot_positions;
+
+    int slot_of(const SequenceState& seq, int pos) const {
+        return m_block_tables.at(seq.logical_blocks, pos / m_block_size) * m_block_size + pos % m_block_size;
+    }
+
+    void add_block_refs(const BlockTableRef& table) {
+        const int* blocks = m_block_tables.data(table);
+        for (int i = 0; i < table.size; ++i) {
+            if (m_shared) {
+                m_shared->add_ref(blocks[i]);
+            } else {
+                m_block_ref_counts[blocks[i]] += 1;
+            }
+        }
+    }
+
+    KVSharedPool& shared_pool() {
+        if (!m_shared) {
+            throw std::runtime_error("no shared KV pool");
+        }
+        return *m_shared;
+    }
+
+    // Final position of every used block of [begin, end), as (target, block) pairs
+    // ascending by target; the targets are exactly [begin, begin + used).
+    std::vector<std::pair<int, int>> compaction_targets(int begin, int end, bool sequence_runs, int min_run_blocks) const {
+        std::vector<std::pair<int, int>> targets;
+        int packed_end = begin;
+        for (int block = begin; block < end; ++block) {
+            packed_end += m_block_ref_counts[block] > 0 ? 1 : 0;
+        }
+        if (!sequence_runs) {
+            // Blocks past the packed range fill its holes, lowest first.
+            int hole = begin;
+            for (int block = begin; block < end; ++block) {
+                if (m_block_ref_counts[block] == 0) {
+                    continue;
+                }
+                if (block < packed_end) {
+                    targets.push_back({block, block});
+                    continue;
+                }
+                while (m_block_ref_counts[hole] > 0) {
+                    ++hole;
+                }
+                targets.push_back({hole++, block});
+            }
+            std::sort(targets.begin(), targets.end());
+            return targets;
+        }
+
+        // Each sequence's not yet claimed blocks of this range, in table order; sequences
+        // by first block.
+        std::vector<int> slots;
+        for (int slot = 0; slot < static_cast<int>(m_slots.size()); ++slot) {
+            if (m_slots[slot].seq_id >= 0 && m_slots[slot].logical_blocks.size > 0) {
+                slots.push_back(slot);
+            }
+        }
+        std::stable_sort(slots.begin(), slots.end(), [&](int a, int b) {
+            return m_block_tables.at(m_slots[a].logical_blocks, 0) < m_block_tables.at(m_slots[b].logical_blocks, 0);
+        });
+        std::vector<int> blocks;
+        std::vector<int> segment_begins = {0};
+        std::vector<char> claimed(end - begin, 0);
+        for (int slot : slots) {
+            const auto& table = m_slots[slot].logical_blocks;
+            const int* entries = m_block_tables.data(table);
+            for (int i = 0; i < table.size; ++i) {
+                int block = entries[i];
+                if (block >= begin && block < end && !claimed[block - begin]) {
+                    claimed[block - begin] = 1;
+                    blocks.push_back(block);
+                }
+            }
+            if (static_cast<int>(blocks.size()) > segment_begins.back()) {
+                segment_begins.push_back(static_cast<int>(blocks.size()));
+            }
+        }
+
+        std::vector<int> target(blocks.size(), -1);
+        std::vector<char> open(end - begin, 0);  // packed positions nobody has claimed yet
+        std::fill(open.begin(), open.begin() + (packed_end - begin), 1);
+        auto is_open = [&](int p) {
+            return p >= begin && p < packed_end && open[p - begin];
+        };
+        auto place = [&](int i, int p) {
+            target[i] = p;
+            open[p - begin] = 0;
+        };
+        // Length of the run of segment blocks starting at `first` that sit on consecutive
+        // open positions.
+        auto run_in_place = [&](int first, int count) {
+            int k = 0;
+            while (k < count && blocks[first + k] == blocks[first] + k && is_open(blocks[first + k])) {
+                ++k;
+            }
+            return k;
+        };
+
+        // Segments that already are one run inside the packed range stay put.
+        size_t num_segments = segment_begins.size() - 1;
+        for (size_t s = 0; s < num_segments; ++s) {
+            int first = segment_begins[s];
+            int count = segment_begins[s + 1] - first;
+            if (run_in_place(first, count) == count) {
+                for (int i = 0; i < count; ++i) {
+                    place(first + i, blocks[first + i]);
+                }
+            }
+        }
+
+        for (size_t s = 0; s < num_segments; ++s) {
+            int first = segment_begins[s];
+            int count = segment_begins[s + 1] - first;
+            if (target[first] >= 0 || count < min_run_blocks) {
+                continue;
+            }
+            // A run that grew is extended in place, anything else goes to the lowest open
+            // range that holds it whole. Blocks of shorter sequences there make way.
+            int start = -1;
+            int k = run_in_place(first, count);
+            if (k > 0) {
+                start = blocks[first];
+                for (int p = start + k; p < start + count && start >= 0; ++p) {
+                    start = is_open(p) ? start : -1;
+                }
+            }
+            for (int p = begin, len = 0; start < 0 && p < packed_end; ++p) {
+                len = is_open(p) ? len + 1 : 0;
+                start = len == count ? p - count + 1 : -1;
+            }
+            if (start >= 0) {
+                for (int i = 0; i < count; ++i) {
+                    place(first + i, start + i);
+                }
+            }
+        }
+        // Everything else keeps its blocks where it can; blocks past the packed range or
+        // displaced fill the remaining holes, lowest first.
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            if (target[i] < 0 && is_open(blocks[i])) {
+                place(static_cast<int>(i), blocks[i]);
+            }
+        }
+        int hole = begin;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            if (target[i] >= 0) {
+                continue;
+            }
+            while (!is_open(hole)) {
+                ++hole;
+            }
+            place(static_cast<int>(i), hole);
+        }
+
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            targets.push_back({target[i], blocks[i]});
+        }
+        std::sort(targets.begin(), targets.end());
+        return targets;
+    }
+
+    int least_loaded_node() const {
+        int best = 0;
+        for (int n = 1; n < m_num_nodes; ++n) {
+            // free[n] / (seqs[n] + 1) > free[best] / (seqs[best] + 1), without division
+            int64_t lhs = static_cast<int64_t>(m_node_free_blocks[n].size()) * (m_node_sequences[best] + 1);
+            int64_t rhs = static_cast<int64_t>(m_node_free_blocks[best].size()) * (m_node_sequences[n] + 1);
+            if (lhs > rhs) {
+                best = n;
+            }
+        }
+        return best;
+    }
+
+    int emptiest_node() const {
+        int best = 0;
+        for (int n = 1; n < m_num_nodes; ++n) {
+            if (m_node_free_blocks[n].size() > m_node_free_blocks[best].size()) {
+                best = n;
+            }
+        }
+        return best;
+    }
+
+    // Prefers the sequence's home node and spills to the emptiest other node rather than
+    // failing; a remote block is slower to read but cheaper than preempting the sequence.
+    int allocate_block(int node) {
+        if (m_shared) {
+            int block = m_shared->allocate();
+            if (block < 0) {
+                throw std::runtime_error("out of KV blocks");
+            }
+            m_counters.block_allocations += 1;
+            m_peak_used_blocks = std::max(m_peak_used_blocks, num_used_blocks());
+            return block;
+        }
+        if (m_node_free_blocks[node].empty()) {
+            node = emptiest_node();
+        }
+        auto& free_list = m_node_free_blocks[node];
+        if (free_list.empty()) {
+            throw std::runtime_error("out of KV blocks");
+        }
+        // Lowest id first, as a sorted list would give, in O(log n).
+        std::pop_heap(free_list.begin(), free_list.end(), std::greater<int>());
+        int block = free_list.back();
+        free_list.pop_back();
+        m_num_free_blocks -= 1;
+        m_counters.block_allocations += 1;
+        m_block_ref_counts[block] = 1;
+        m_peak_used_blocks = std::max(m_peak_used_blocks, num_used_blocks());
+        return block;
+    }
+
+    void release_block(int block) {
+        if (m_shared) {
+            m_counters.block_frees += m_shared->release(block) ? 1 : 0;
+            return;
+        }
+        if (m_block_ref_counts[block] <= 0) {
+            throw std::runtime_error("block already free");
+        }
+        m_block_ref_counts[block] -= 1;
+        if (m_block_ref_counts[block] == 0) {
+            auto& free_list = m_node_free_blocks[numa_block_node(block, m_num_blocks, m_num_nodes)];
+            free_list.push_back(block);
+            std::push_heap(free_list.begin(), free_list.end(), std::greater<int>());
+            m_num_free_blocks += 1;
+            m_counters.block_frees += 1;
+        }
+    }
+
+    // Drops the table's references; the table keeps its chunk for reuse.
+    void release_block_refs(BlockTableRef& table) {
+        const int* blocks = m_block_tables.data(table);
+        for (int i = 0; i < table.size; ++i) {
+            release_block(blocks[i]);
+        }
+        table.size = 0;
+    }
+
+    std::vector<BlockCopyPlan> ensure_writable_tail(SequenceState& seq) {
+        if (seq.past_len == 0) {
+            return {};
+        }
+        if (seq.past_len % m_block_size == 0) {
+            return {};
+        }
+
+        std::vector<BlockCopyPlan> plans;
+        copy_on_write(seq, (seq.past_len - 1) / m_block_size, plans);
+        return plans;
+    }
+
+    // Gives the sequence its own copy of logical block `index` if it is shared.
+    void copy_on_write(SequenceState& seq, int index, std::vector<BlockCopyPlan>& plans) {
+        int block = m_block_tables.at(seq.logical_blocks, index);
+        if (block_ref_count(block) <= 1) {
+            return;
+        }
+        int new_block = allocate_block(seq.node);
+        m_block_tables.set(seq.logical_blocks, index, new_block);
+        release_block(block);
+        m_counters.cow_copies += 1;
+        if (!m_slot_mass.empty()) {
+            size_t src = static_cast<size_t>(block) * m_block_size;
+            size_t dst = static_cast<size_t>(new_block) * m_block_size;
+            std::copy_n(m_slot_mass.begin() + src, m_block_size, m_slot_mass.begin() + dst);
+            std::copy_n(m_slot_positions.begin() + src, m_block_size, m_slot_positions.begin() + dst);
+        }
+        plans.push_back({block, new_block});
+    }
+
+    // Evicts up to `count` tokens written before recent_begin, lowest mass first (older
+    // first on ties). The newest survivors at or past the new length fill the holes, so
+    // only as many tokens move as were evicted below the new length.
+    void evict_low_mass_tokens(SequenceState& seq, int count, int recent_begin, EvictionPlan& plan) {
+        std::vector<std::pair<float, int>> candidates;  // (mass, logical position)
+        for (int i = 0; i < seq.past_len; ++i) {
+            int slot = slot_of(seq, i);
+            if (m_slot_positions[slot] < recent_begin) {
+                candidates.push_back({m_slot_mass[slot], i});
+            }
+        }
+        count = std::min(count, static_cast<int>(candidates.size()));
+        if (count == 0) {
+            return;
+        }
+        std::nth_element(candidates.begin(), candidates.begin() + (count - 1), candidates.end());
+        std::vector<char> evicted(seq.past_len, 0);
+        for (int k = 0; k < count; ++k) {
+            evicted[candidates[k].second] = 1;
+        }
+
+        int new_len = seq.past_len - count;
+        int src = seq.past_len - 1;
+        for (int dst = 0; dst < new_len; ++dst) {
+            if (!evicted[dst]) {
+                continue;
+            }
+            while (evicted[src]) {
+                --src;
+            }
+            copy_on_write(seq, dst / m_block_size, plan.block_copies);
+            int src_slot = slot_of(seq, src);
+            int dst_slot = slot_of(seq, dst);
+            m_slot_mass[dst_slot] = m_slot_mass[src_slot];
+            m_slot_positions[dst_slot] = m_slot_positions[src_slot];
+            plan.slot_moves.push_back({src_slot, dst_slot});
+            --src;
+        }
+
+        // The moves still read the released tail blocks; nothing is allocated before the
+        // caller applies them.
+        int keep_blocks = div_up(new_len, m_block_size);
+        for (int i = keep_blocks; i < seq.logical_blocks.size; ++i) {
+            release_block(m_block_tables.at(seq.logical_blocks, i));
+        }
+        m_block_tables.erase(seq.logical_blocks, keep_blocks, seq.logical_blocks.size - keep_blocks);
+        seq.past_len = new_len;
+        seq.evicted_tokens += count;
+    }
+
+    // Evicts up to `count` full blocks whose tokens were all written before recent_begin,
+    // lowest total mass first.
+    void evict_low_mass_blocks(SequenceState& seq, int count, int recent_begin) {
+        std::vector<std::pair<float, int>> candidates;  // (mass, logical block)
+        for (int b = 0; b < seq.past_len / m_block_size; ++b) {
+            size_t first = static_cast<size_t>(m_block_tables.at(seq.logical_blocks, b)) * m_block_size;
+            float mass = 0.0f;
+            bool recent = false;
+            for (int o = 0; o < m_block_size; ++o) {
+                mass += m_slot_mass[first + o];
+                recent = recent || m_slot_positions[first + o] >= recent_begin;
+            }
+            if (!recent) {
+                candidates.push_back({mass, b});
+            }
+        }
+        count = std::min(count, static_cast<int>(candidates.size()));
+        if (count == 0) {
+            return;
+        }
+        std::nth_element(candidates.begin(), candidates.begin() + (count - 1), candidates.end());
+        std::vector<int> victims;
+        for (int k = 0; k < count; ++k) {
+            victims.push_back(candidates[k].second);
+        }
+        std::sort(victims.rbegin(), victims.rend());
+        for (int b : victims) {
+            release_block(m_block_tables.at(seq.logical_blocks, b));
+            m_block_tables.erase(seq.logical_blocks, b, 1);
+        }
+        seq.past_len -= count * m_block_size;
+        seq.evicted_tokens += count * m_block_size;
+    }
+
+    // Drops whole blocks strictly between the sink blocks and the first block that
+    // still holds one of the last window_tokens tokens. The tail is never touched, so a
+    // partially filled block shared by beams keeps its copy-on-write semantics.
+    void evict_streaming_middle(SequenceState& seq) {
+        int sink_blocks = div_up(seq.sink_tokens, m_block_size);
+        int first_kept = std::max(0, seq.past_len - seq.window_tokens) / m_block_size;
+        int num_evict = first_kept - sink_blocks;
+        if (num_evict <= 0) {
+            return;
+        }
+        for (int i = sink_blocks; i < sink_blocks + num_evict; ++i) {
+            release_block(m_block_tables.at(seq.logical_blocks, i));
+        }
+        m_block_tables.erase(seq.logical_blocks, sink_blocks, num_evict);
+        seq.past_len -= num_evict * m_block_size;
+        seq.evicted_tokens += num_evict * m_block_size;
+    }
+
+    void ensure_capacity_for_append(SequenceState& seq, int append_tokens) {
+        int needed_tokens = seq.past_len + append_tokens;
+        int needed_blocks = div_up(needed_tokens, m_block_size);
+        while (seq.logical_blocks.size < needed_blocks) {
+            m_block_tables.push_back(seq.logical_blocks, allocate_block(seq.node));
+        }
+    }
+};
+
+class ExecutorPACommon {
+public:
+    explicit ExecutorPACommon(int block_size) : m_block_size(block_size) {}
+
+    std::vector<int> build_slot_mapping(const BatchMetadata& meta, const std::vector<int>& q_lens) const {
+        std::vector<int> slots;
+        for (size_t seq_idx = 0; seq_idx < q_lens.size(); ++seq_idx) {
+            int past_len = meta.past_lens[seq_idx];
+            int block_begin = meta.block_indices_begins[seq_idx];
+            int q_len = q_lens[seq_idx];
+
+            for (int j = 0; j < q_len; ++j) {
+                int logical_pos = past_len + j;
+                int logical_block = logical_pos / m_block_size;
+                int offset = logical_pos % m_block_size;
+                int physical_block = meta.block_indices[block_begin + logical_block];
+                slots.push_back(physical_block * m_block_size + offset);
+            }
+        }
+        return slots;
+    }
+
+    // Absolute position of every new token, in the same order as build_slot_mapping.
+    // These index the RoPE tables.
+    std::vector<int> build_position_ids(const BatchMetadata& meta, const std::vector<int>& q_lens) const {
+        std::vector<int> positions;
+        for (size_t seq_idx = 0; seq_idx < q_lens.size(); ++seq_idx) {
+            int first = position_offset(meta, static_cast<int>(seq_idx)) + meta.past_lens[seq_idx];
+            for (int j = 0; j < q_lens[seq_idx]; ++j) {
+                positions.push_back(first + j);
+            }
+        }
+        return positions;
+    }
+
+    // Absolute position of the sequence's logical position 0.
+    static int position_offset(const BatchMetadata& meta, int seq_idx) {
+        return meta.evicted_tokens.empty() ? 0 : meta.evicted_tokens[seq_idx];
+    }
+
+    // Physical block ids of one sequence's context, in logical order.
+    const int* context_blocks(const BatchMetadata& meta, int seq_idx) const {
+        return meta.block_indices.data() + meta.block_indices_begins[seq_idx];
+    }
+
+private:
+    int m_block_size;
+};
+
+// Softmax probability every context token received during one step, summed over
+// layers, heads and query rows. Sequence i owns [begins[i], begins[i + 1]) of `mass`,
+// indexed by logical position; an empty range means the sequence is not tracked.
+struct AttentionMass {
+    std::vector<float> mass;
+    std::vector<int> begins;
+
+    float* sequence(int seq_idx) {
+        return begins[seq_idx + 1] > begins[seq_idx] ? mass.data() + begins[seq_idx] : nullptr;
+    }
+};
+
+// Runs the attention work items of every layer (see PagedAttentionExecutor::run_items)
+// on one pool owned by the runtime. A NUMA placement brings its own node pools instead.
+struct AttentionScheduleOptions {
+    int threads = 1;        // 1 = on the calling thread
+    int q_tile = 64;        // prefill queries per work item
+    std::vector<int> cpus;  // optional affinity of the pool's workers
+};
+
+class PagedAttentionExecutor {
+public:
+    using Tensor2 = std::vector<std::vector<float>>;
+    using Tensor3 = std::vector<std::vector<std::vector<float>>>;
+
+    // The cache itself lives in the shared arena; the executor only addresses its layer.
+    // With a RoPE table, K is rotated on its way into the cache and Q right before
+    // attention; the table must cover every position of the step. Sparse decode needs
+    // an arena with key summaries. A tensor-parallel shard owns heads
+    // [head_begin, head_begin + num_heads) of every block; its Q/K/V carry only those.
+    // Attention work items run on `pool` when given (and no NUMA placement is), and a
+    // prefill item covers up to q_tile queries. K is written and read in the arena's
+    // key layout, with the widest kernel this CPU supports for it.
+    PagedAttentionExecutor(
+        int layer_id,
+        KVCacheArena& arena,
+        const NumaPlacement* placement = nullptr,
+        const RopeTable* rope = nullptr,
+        const SparseAttentionOptions& sparse = {},
+        int head_begin = 0,
+        int num_heads = -1,
+        ThreadPool* pool = nullptr,
+        int q_tile = 64)
+        : m_layer_id(layer_id),
+          m_head_begin(head_begin),
+          m_num_heads(num_heads < 0 ? arena.num_heads() - head_begin : num_heads),
+          m_head_size(arena.head_size()),
+          m_block_size(arena.block_size()),
+          m_use_int8_cache(arena.use_int8_cache()),
+          m_key_layout(arena.key_layout()),
+          m_common(arena.block_size()),
+          m_placement(placement),
+          m_attention_kernel(&select_attention_kernel(
+              arena.use_int8_cache(), arena.head_size(), arena.block_size(), arena.key_layout())),
+          m_quant_kernel(&select_int8_quant_kernel()),
+          m_rope(rope),
+          m_sparse(sparse),
+          m_cache(arena.layer_view(layer_id)),
+          m_pool(pool),
+          m_q_tile(std::max(1, q_tile)),
+          m_k_row(m_key_layout == KVKeyLayout::DimMajor ? arena.head_size() : 0),
+          m_k_row_int8(m_key_layout == KVKeyLayout::DimMajor && m_use_int8_cache ? arena.head_size() : 0) {
+        if (m_sparse.enabled && !arena.key_summaries()) {
+            throw std::runtime_error("sparse decode needs a KV arena with key summaries");
+        }
+        if (head_begin < 0 || m_num_heads < 1 || head_begin + m_num_heads > arena.num_heads()) {
+            throw std::runtime_error("executor head range is outside the arena's heads");
+        }
+    }
+
+    const char* attention_kernel_name() const {
+        return m_attention_kernel->name;
+    }
+
+    const char* quant_kernel_isa() const {
+        return m_use_int8_cache ? m_quant_kernel->isa : "none";
+    }
+
+    void write_kv(
+        const BatchMetadata& meta,
+        const std::vector<int>& q_lens,
+        const Tensor3& k_new,
+        const Tensor3& v_new) {
+        auto slots = m_common.build_slot_mapping(meta, q_lens);
+        std::vector<int> positions;
+        if (m_rope) {
+            positions = m_common.build_position_ids(meta, q_lens);
+        }
+        if (m_use_int8_cache) {
+            write_kv_int8(slots, positions, k_new, v_new);
+            return;
+        }
+        for (size_t token_idx = 0; token_idx < slots.size(); ++token_idx) {
+            int pos = m_rope ? positions[token_idx] : -1;
+            write_one_token(slots[token_idx], pos, k_new[token_idx], v_new[token_idx]);
+        }
+    }
+
+    // Ragged prefill over the packed token rows: every sequence is cut into work items of
+    // up to q_tile queries of one head (see run_items), each reading its queries from `q`
+    // and writing its rows of the returned tensor in place. With `mass`, the attention
+    // kernels also add each context token's probability to the sequence's range of it; a
+    // tracked sequence is then one item, so its range has a single writer.
+    Tensor3 prefill(
+        const BatchMetadata& meta,
+        const std::vector<int>& q_lens,
+        const Tensor3& q,
+        const Tensor3& k,
+        const Tensor3& v,
+        AttentionMass* mass = nullptr) {
+        write_kv(meta, q_lens, k, v);
+
+        Tensor3 outputs(q.size(), Tensor2(m_num_heads, std::vector<float>(m_head_size, 0.0f)));
+        m_items.clear();
+        for (int seq_idx = 0; seq_idx < static_cast<int>(q_lens.size()); ++seq_idx) {
+            int q_len = q_lens[seq_idx];
+            if (mass && mass->sequence(seq_idx)) {
+                add_item(meta, seq_idx, 0, q_len, 0, m_num_heads);
+                continue;
+            }
+            for (int first = 0; first < q_len; first += m_q_tile) {
+                for (int h = 0; h < m_num_heads; ++h) {
+                    add_item(meta, seq_idx, first, std::min(m_q_tile, q_len - first), h, h + 1);
+                }
+            }
+        }
+        run_items(meta, q, outputs, mass, false);
+        return outputs;
+    }
+
+    // With sparse decode enabled, sequences whose attention mass is not tracked attend
+    // only to the blocks select_sparse_blocks picks per head.
+    Tensor3 decode(
+        const BatchMetadata& meta,
+        const Tensor3& q,
+        const Tensor3& k,
+        const Tensor3& v,
+        AttentionMass* mass = nullptr) {
+        std::vector<int> q_lens(meta.past_lens.size(), 1);
+        write_kv(meta, q_lens, k, v);
+
+        Tensor3 outputs(q.size(), Tensor2(m_num_heads, std::vector<float>(m_head_size, 0.0f)));
+        m_items.clear();
+        for (int seq_idx = 0; seq_idx < static_cast<int>(q_lens.size()); ++seq_idx) {
+            add_item(meta, seq_idx, 0, 1, 0, m_num_heads);
+        }
+        run_items(meta, q, outputs, mass, m_sparse.enabled);
+        return outputs;
+    }
+
+private:
+    // Attention for queries [first, first + count) of one sequence, heads [head_lo,
+    // head_hi). cost counts the score entries the kernel computes.
+    struct AttentionItem {
+        int seq_idx = 0;
+        int first = 0;
+        int count = 0;
+        int head_lo = 0;
+        int head_hi = 0;
+        int64_t cost = 0;
+    };
+
+    // Per worker, reused across its items.
+    struct AttentionScratch {
+        std::vector<float> scores;
+        std::vector<float> q_rotated;
+        std::vector<std::pair<float, int>> block_bounds;
+        std::vector<int> selected_blocks;
+    };
+
+    int m_layer_id;
+    int m_head_begin;
+    int m_num_heads;
+    int m_head_size;
+    int m_block_size;
+    bool m_use_int8_cache;
+    KVKeyLayout m_key_layout;
+    ExecutorPACommon m_common;
+    const NumaPlacement* m_placement;
+    const AttentionKernelEntry* m_attention_kernel;
+    const Int8QuantKernelEntry* m_quant_kernel;
+    const RopeTable* m_rope;
+    SparseAttentionOptions m_sparse;
+    KVLayerView m_cache;
+    ThreadPool* m_pool;
+    int m_q_tile;
+    std::vector<AttentionItem> m_items;  // this step's work, reused across steps
+
+    // int8 write scratch, reused across steps: row pointers per (token, head) and the
+    // RoPE-rotated K rows.
+    std::vector<const float*> m_k_rows;
+    std::vector<const float*> m_v_rows;
+    std::vector<float> m_k_rotated;
+    // A dim-major K row on its way into the cache (RoPE-rotated, or quantized into
+    // m_k_row_int8), so it is scattered with a stride of block_size.
+    std::vector<float> m_k_row;
+    std::vector<int8_t> m_k_row_int8;
+
+    // `head` is relative to the executor's head range.
+    size_t slot_index(int head, int offset) const {
+        return static_cast<size_t>(m_head_begin + head) * m_block_size + offset;
+    }
+
+    void add_item(const BatchMetadata& meta, int seq_idx, int first, int count, int head_lo, int head_hi) {
+        // Query t of the sequence attends to past_len + t + 1 tokens.
+        int64_t kv_first = meta.past_lens[seq_idx] + first + 1;
+        int64_t cost = (count * kv_first + static_cast<int64_t>(count) * (count - 1) / 2) * (head_hi - head_lo);
+        m_items.push_back({seq_idx, first, count, head_lo, head_hi, cost});
+    }
+
+    // Runs m_items on the node pool holding each sequence's blocks under a NUMA placement,
+    // on the attention pool if there is one, inline otherwise. Items go out largest first
+    // from a shared counter, so the tiles of a long prompt start early and short prompts
+    // fill in around them instead of one worker owning the longest sequence. Every output
+    // row has exactly one writer and one kernel call, so the result does not depend on the
+    // schedule.
+    void run_items(const BatchMetadata& meta, const Tensor3& q, Tensor3& out, AttentionMass* mass, bool sparse) {
+        if (!m_placement && !m_pool) {
+            AttentionScratch scratch;
+            for (const auto& item : m_items) {
+                attend(item, meta, q, out, mass, sparse, scratch);
+            }
+            return;
+        }
+        std::stable_sort(m_items.begin(), m_items.end(), [](const AttentionItem& a, const AttentionItem& b) {
+            return a.cost > b.cost;
+        });
+        auto drain = [&](const std::vector<AttentionItem>& items, std::atomic<size_t>& next) {
+            AttentionScratch scratch;
+            for (size_t i = next.fetch_add(1); i < items.size(); i = next.fetch_add(1)) {
+                attend(items[i], meta, q, out, mass, sparse, scratch);
+            }
+        };
+        if (!m_placement) {
+            std::atomic<size_t> next{0};
+            int workers = std::min(m_pool->size(), static_cast<int>(m_items.size()));
+            m_pool->parallel_for(workers, [&](int) { drain(m_items, next); });
+            return;
+        }
+        int num_nodes = m_placement->num_nodes();
+        std::vector<std::vector<AttentionItem>> node_items(num_nodes);
+        for (const auto& item : m_items) {
+            node_items[meta.seq_nodes[item.seq_idx]].push_back(item);
+        }
+        std::vector<std::atomic<size_t>> next(num_nodes);
+        for (int n = 0; n < num_nodes; ++n) {
+            next[n].store(0);
+            ThreadPool& pool = m_placement->pool(n);
+            int workers = std::min(pool.size(), static_cast<int>(node_items[n].size()));
+            for (int w = 0; w < workers; ++w) {
+                pool.enqueue([&, n] { drain(node_items[n], next[n]); });
+            }
+        }
+        // Every node's items reference node_items, so all pools drain before a rethrow.
+        std::exception_ptr error;
+        for (int n = 0; n < num_nodes; ++n) {
+            try {
+                m_placement->pool(n).wait_idle();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // position < 0: no RoPE. K is rotated straight into the cache.
+    void write_one_token(int slot, int position, const Tensor2& k, const Tensor2& v) {
+        int block = slot / m_block_size;
+        int offset = slot % m_block_size;
+        char* region = m_cache.base + static_cast<size_t>(block) * m_cache.block_stride;
+
+        for (int h = 0; h < m_num_heads; ++h) {
+            float* v_dst = reinterpret_cast<float*>(region + m_cache.v_offset) + slot_index(h, offset) * m_head_size;
+            const float* k_row = k[h].data();
+            if (m_key_layout == KVKeyLayout::SlotMajor) {
+                float* k_dst = reinterpret_cast<float*>(region) + slot_index(h, offset) * m_head_size;
+                if (position >= 0) {
+                    m_rope->rotate(k_row, k_dst, position);
+                } else {
+                    std::copy(k[h].begin(), k[h].end(), k_dst);
+                }
+                k_row = k_dst;
+            } else {
+                if (position >= 0) {
+                    m_rope->rotate(k_row, m_k_row.data(), position);
+                    k_row = m_k_row.data();
+                }
+                // Transposed on the way in: dim d of this slot is [head][d][offset].
+                float* k_head = reinterpret_cast<float*>(region) + slot_index(h, 0) * m_head_size;
+                for (int d = 0; d < m_head_size; ++d) {
+                    k_head[static_cast<size_t>(d) * m_block_size + offset] = k_row[d];
+                }
+            }
+            std::copy(v[h].begin(), v[h].end(), v_dst);
+            if (m_cache.key_min_offset) {
+                update_key_summary(region, h, offset, k_row);
+            }
+        }
+    }
+
+    // The summary of a block restarts with its first slot.
+    void update_key_summary(char* region, int head, int offset, const float* k) {
+        size_t at = static_cast<size_t>(m_head_begin + head) * m_head_size;
+        float* kmin = reinterpret_cast<float*>(region + m_cache.key_min_offset) + at;
+        float* kmax = reinterpret_cast<float*>(region + m_cache.key_max_offset) + at;
+        key_summary_update(kmin, kmax, k, m_head_size, offset == 0);
+    }
+
+    // One quantize-and-scatter pass each for K and V over every new token of the step.
+    // With RoPE, K rows are rotated into scratch first so the scale covers the rotated row.
+    void write_kv_int8(
+        const std::vector<int>& slots,
+        const std::vector<int>& positions,
+        const Tensor3& k_new,
+        const Tensor3& v_new) {
+        size_t num_rows = slots.size() * m_num_heads;
+        m_k_rows.resize(num_rows);
+        m_v_rows.resize(num_rows);
+        if (m_rope) {
+            m_k_rotated.resize(num_rows * m_head_size);
+        }
+        for (size_t t = 0; t < slots.size(); ++t) {
+            for (int h = 0; h < m_num_heads; ++h) {
+                size_t row = t * m_num_heads + h;
+                m_v_rows[row] = v_new[t][h].data();
+                if (m_rope) {
+                    float* rotated = m_k_rotated.data() + row * m_head_size;
+                    m_rope->rotate(k_new[t][h].data(), rotated, positions[t]);
+                    m_k_rows[row] = rotated;
+                } else {
+                    m_k_rows[row] = k_new[t][h].data();
+                }
+            }
+        }
+
+        Int8ScatterArgs args;
+        args.slots = slots.data();
+        args.num_tokens = static_cast<int>(slots.size());
+        args.num_heads = m_num_heads;
+        args.head_size = m_head_size;
+        args.block_size = m_block_size;
+        args.cache = m_cache.base;
+        args.block_stride = m_cache.block_stride;
+
+        // The kernel numbers heads from 0, so the offsets start at the first head of the range.
+        const size_t head_slots = slot_index(0, 0);
+        args.rows = m_k_rows.data();
+        args.data_offset = head_slots * m_head_size;
+        args.scale_offset = m_cache.k_scale_offset + head_slots * sizeof(float);
+        if (m_key_layout == KVKeyLayout::DimMajor) {
+            args.dim_major = true;
+            args.row_scratch = m_k_row_int8.data();
+        }
+        quantize_scatter_int8(*m_quant_kernel, args);
+        args.dim_major = false;
+        if (m_cache.key_min_offset) {
+            // Summaries bound the fp32 keys, not the int8 ones: a dequantized key can sit
+            // up to half its row's scale outside them per dimension, so the score bound
+            // may fall short of the int8 score by sum |q_d| * scale / 2. Selection only
+            // ranks blocks by the bound, so that slack shifts ranks but breaks nothing.
+            for (size_t t = 0; t < slots.size(); ++t) {
+                char* region = m_cache.base + static_cast<size_t>(slots[t] / m_block_size) * m_cache.block_stride;
+                for (int h = 0; h < m_num_heads; ++h) {
+                    update_key_summary(region, h, slots[t] % m_block_size, m_k_rows[t * m_num_heads + h]);
+                }
+            }
+        }
+
+        args.rows = m_v_rows.data();
+        args.data_offset = m_cache.v_offset + head_slots * m_head_size;
+        args.scale_offset = m_cache.v_scale_offset + head_slots * sizeof(float);
+        quantize_scatter_int8(*m_quant_kernel, args);
+    }
+
+    void attend(
+        const AttentionItem& item,
+        const BatchMetadata& meta,
+        const Tensor3& q,
+        Tensor3& out,
+        AttentionMass* mass,
+        bool sparse,
+        AttentionScratch& scratch) const {
+        const int seq_idx = item.seq_idx;
+        const int token_start = meta.subsequence_begins[seq_idx];
+        const int q_len = meta.subsequence_begins[seq_idx + 1] - token_start;
+        const int past_len = meta.past_lens[seq_idx];
+        const int total_kv_len = past_len + q_len;
+        const int position_offset = ExecutorPACommon::position_offset(meta, seq_idx);
+        float* seq_mass = mass ? mass->sequence(seq_idx) : nullptr;
+        if (static_cast<int>(scratch.scores.size()) < total_kv_len) {
+            scratch.scores.resize(total_kv_len);
+        }
+        scratch.q_rotated.resize(m_rope ? m_head_size : 0);
+        // Mass is indexed by logical position, so tracked sequences stay dense.
+        const int* context_blocks = m_common.context_blocks(meta, seq_idx);
+        const int num_context_blocks = (total_kv_len + m_block_size - 1) / m_block_size;
+        sparse = sparse && !seq_mass && q_len == 1 &&
+                 num_context_blocks > m_sparse.top_k_blocks + m_sparse.recent_blocks;
+
+        AttentionHeadArgs args;
+        args.scores = scratch.scores.data();
+        args.blocks = context_blocks;
+        args.head_size = m_head_size;
+        args.block_size = m_block_size;
+        args.scale = 1.0f / std::sqrt(static_cast<float>(m_head_size));
+        args.mass = seq_mass;
+        args.k_cache = m_cache.base;
+        args.v_cache = m_cache.base + m_cache.v_offset;
+        args.block_stride = m_cache.block_stride;
+        if (m_use_int8_cache) {
+            args.k_scales = m_cache.base + m_cache.k_scale_offset;
+            args.v_scales = m_cache.base + m_cache.v_scale_offset;
+        }
+
+        for (int t = item.first; t < item.first + item.count; ++t) {
+            const auto& q_row = q[token_start + t];
+            auto& out_row = out[token_start + t];
+            for (int h = item.head_lo; h < item.head_hi; ++h) {
+                args.kv_len = past_len + t + 1;
+                args.blocks = context_blocks;
+                args.q = q_row[h].data();
+                if (m_rope) {
+                    // The query sits at the last position it may attend to.
+                    m_rope->rotate(args.q, scratch.q_rotated.data(), position_offset + args.kv_len - 1);
+                    args.q = scratch.q_rotated.data();
+                }
+                args.out = out_row[h].data();
+                args.head_offset = slot_index(h, 0) * m_head_size;
+                args.scale_head_offset = slot_index(h, 0);
+                if (sparse) {
+                    auto bound = [&](int lb) {
+                        const char* region = m_cache.base + static_cast<size_t>(context_blocks[lb]) * m_cache.block_stride;
+                        size_t head = static_cast<size_t>(m_head_begin + h) * m_head_size;
+                        return key_summary_bound(
+                            args.q,
+                            reinterpret_cast<const float*>(region + m_cache.key_min_offset) + head,
+                            reinterpret_cast<const float*>(region + m_cache.key_max_offset) + head,
+                            m_head_size);
+                    };
+                    args.kv_len = select_sparse_blocks(
+                        context_blocks, total_kv_len, m_block_size, m_sparse, bound, scratch.block_bounds,
+                        scratch.selected_blocks);
+                    args.blocks = scratch.selected_blocks.data();
+                }
+                m_attention_kernel->fn(args);
+            }
+        }
+    }
+};
+
+// Pre-norm transformer block: h = x + Attn(RMSNorm(x)), out = h + MLP(RMSNorm(h)) with a
+// SwiGLU MLP, Down(silu(Gate n) * Up n). Off, the layer is attention plus the output
+// projection alone, as before.
+struct MlpOptions {
+    bool enabled = false;
+    int intermediate_size = 0;  // 0 = 8/3 of hidden, rounded up to a multiple of 16
+    float rms_eps = 1e-6f;
+};
+
+inline int mlp_intermediate_size(const MlpOptions& options, int hidden_size) {
+    if (options.intermediate_size > 0) {
+        return options.intermediate_size;
+    }
+    return (8 * hidden_size / 3 + 15) / 16 * 16;
+}
+
+class ToyLayer {
+public:
+    using Tensor2 = std::vector<std::vector<float>>;
+    using Tensor3 = std::vector<std::vector<std::vector<float>>>;
+
+    // With a tensor-parallel group of more than one shard, the heads and their weight
+    // slices are split across the group's shards (see pa_tensor_parallel.hpp). The weights
+    // are drawn as for the unsharded layer, so both compute the same model. With the MLP
+    // on, so is its intermediate dimension, and every layer ends with a second all-reduce.
+    ToyLayer(
+        int layer_id,
+        int hidden_size,
+        KVCacheArena& arena,
+        uint32_t seed,
+        const NumaPlacement* placement = nullptr,
+        const RopeTable* rope = nullptr,
+        const SparseAttentionOptions& sparse = {},
+        TensorParallelGroup* tp = nullptr,
+        const MlpOptions& mlp = {},
+        ThreadPool* attention_pool = nullptr,
+        int q_tile = 64)
+        : m_layer_id(layer_id),
+          m_hidden_size(hidden_size),
+          m_num_heads(arena.num_heads()),
+          m_head_size(arena.head_size()),
+          m_mlp(mlp.enabled),
+          m_rms_eps(mlp.rms_eps),
+          m_intermediate(mlp.enabled ? ::mlp_intermediate_size(mlp, hidden_size) : 0),
+          m_silu_mul(select_eltwise_kernel().silu_mul),
+          m_tp(tp && tp->shards() > 1 ? tp : nullptr) {
+        if (!m_tp) {
+            m_pa.reset(new PagedAttentionExecutor(layer_id, arena, placement, rope, sparse, 0, -1, attention_pool, q_tile));
+        }
+        init_weights(seed);
+        if (m_tp) {
+            shard_weights(arena, rope, sparse, q_tile);
+        }
+    }
+
+    Tensor2 forward_prefill(
+        const Tensor2& x,
+        const BatchMetadata& meta,
+        const std::vector<int>& q_lens,
+        AttentionMass* mass = nullptr) {
+        if (m_tp) {
+            return forward_sharded(x, meta, &q_lens, mass);
+        }
+        auto norm = row_norm(x, m_attn_norm);
+        auto qkv = project_qkv(x, m_wq, m_wk, m_wv, m_num_heads, norm);
+        auto attn_out = m_pa->prefill(meta, q_lens, qkv.q, qkv.k, qkv.v, mass);
+        return finish(x, merge_heads(attn_out));
+    }
+
+    Tensor2 forward_decode(const Tensor2& x, const BatchMetadata& meta, AttentionMass* mass = nullptr) {
+        if (m_tp) {
+            return forward_sharded(x, meta, nullptr, mass);
+        }
+        auto norm = row_norm(x, m_attn_norm);
+        auto qkv = project_qkv(x, m_wq, m_wk, m_wv, m_num_heads, norm);
+        auto attn_out = m_pa->decode(meta, qkv.q, qkv.k, qkv.v, mass);
+        return finish(x, merge_heads(attn_out));
+    }
+
+    const char* attention_kernel_name() const {
+        return executor().attention_kernel_name();
+    }
+
+    const char* quant_kernel_isa() const {
+        return executor().quant_kernel_isa();
+    }
+
+    int mlp_intermediate_size() const {
+        return m_intermediate;
+    }
+
+private:
+    struct QKV {
+        Tensor3 q;
+        Tensor3 k;
+        Tensor3 v;
+    };
+
+    // RMSNorm of every input row, applied while a projection reads the row rather than
+    // written out: the projection's input i is x[i] * inv_rms[row] * weight[i].
+    struct RowNorm {
+        const float* weight = nullptr;
+        std::vector<float> inv_rms;
+    };
+
+    int m_layer_id;
+    int m_hidden_size;
+    int m_num_heads;
+    int m_head_size;
+    bool m_mlp;
+    float m_rms_eps;
+    int m_intermediate;
+    SiluMulFn m_silu_mul;
+
+    std::vector<std::vector<float>> m_wq;
+    std::vector<std::vector<float>> m_wk;
+    std::vector<std::vector<float>> m_wv;
+    std::vector<std::vector<float>> m_wo;
+
+    // MLP block. Row i of m_w_gate_up is [gate_i | up_i], both m_intermediate wide, so a
+    // single pass over the normalized input produces both halves side by side.
+    std::vector<float> m_attn_norm;
+    std::vector<float> m_mlp_norm;
+    std::vector<std::vector<float>> m_w_gate_up;
+    std::vector<std::vector<float>> m_w_down;
+
+    // Executor over all heads; only built when the layer is not sharded.
+    std::unique_ptr<PagedAttentionExecutor> m_pa;
+
+    // One tensor-parallel shard: a head range, the matching Q/K/V columns and O rows,
+    // and an executor over those heads of the KV cache. With the MLP on, also a range of
+    // the intermediate dimension: its gate and up columns and its down rows.
+    struct Shard {
+        int num_heads = 0;
+        std::vector<std::vector<float>> wq;
+        std::vector<std::vector<float>> wk;
+        std::vector<std::vector<float>> wv;
+        std::vector<std::vector<float>> wo;
+        PagedAttentionExecutor pa;
+        std::vector<std::vector<float>> w_gate_up;
+        std::vector<std::vector<float>> w_down;
+    };
+
+    TensorParallelGroup* m_tp;
+    std::vector<Shard> m_shards;
+
+    // Any executor of the layer; every shard selects the same kernels.
+    const PagedAttentionExecutor& executor() const {
+        return m_pa ? *m_pa : m_shards.front().pa;
+    }
+
+    void init_weights(uint32_t seed) {
+        std::mt19937 gen(seed);
+        std::normal_distribution<float> dist(0.0f, 1.0f / std::sqrt(static_cast<float>(m_hidden_size)));
+
+        int proj = m_num_heads * m_head_size;
+        m_wq.assign(m_hidden_size, std::vector<float>(proj));
+        m_wk.assign(m_hidden_size, std::vector<float>(proj));
+        m_wv.assign(m_hidden_size, std::vector<float>(proj));
+        m_wo.assign(proj, std::vector<float>(m_hidden_size));
+
+        for (int i = 0; i < m_hidden_size; ++i) {
+            for (int j = 0; j < proj; ++j) {
+                m_wq[i][j] = dist(gen);
+                m_wk[i][j] = dist(gen);
+                m_wv[i][j] = dist(gen);
+            }
+        }
+        for (int i = 0; i < proj; ++i) {
+            for (int j = 0; j < m_hidden_size; ++j) {
+                m_wo[i][j] = dist(gen);
+            }
+        }
+        if (m_mlp) {
+            init_mlp_weights(gen);
+        }
+    }
+
+    // Drawn after the attention weights, so those stay the same with the MLP on or off.
+    void init_mlp_weights(std::mt19937& gen) {
+        std::normal_distribution<float> norm_dist(1.0f, 0.1f);
+        std::normal_distribution<float> in_dist(0.0f, 1.0f / std::sqrt(static_cast<float>(m_hidden_size)));
+        std::normal_distribution<float> down_dist(0.0f, 1.0f / std::sqrt(static_cast<float>(m_intermediate)));
+
+        m_attn_norm.resize(m_hidden_size);
+        m_mlp_norm.resize(m_hidden_size);
+        for (int i = 0; i < m_hidden_size; ++i) {
+            m_attn_norm[i] = norm_dist(gen);
+            m_mlp_norm[i] = norm_dist(gen);
+        }
+        m_w_gate_up.assign(m_hidden_size, std::vector<float>(2 * m_intermediate));
+        m_w_down.assign(m_intermediate, std::vector<float>(m_hidden_size));
+        for (int i = 0; i < m_hidden_size; ++i) {
+            for (int j = 0; j < m_intermediate; ++j) {
+                m_w_gate_up[i][j] = in_dist(gen);
+                m_w_gate_up[i][m_intermediate + j] = in_dist(gen);
+            }
+        }
+        for (int i = 0; i < m_intermediate; ++i) {
+            for (int j = 0; j < m_hidden_size; ++j) {
+                m_w_down[i][j] = down_dist(gen);
+            }
+        }
+    }
+
+    // Slices the full weights into one Shard per member of the group, then drops them.
+    void shard_weights(KVCacheArena& arena, const RopeTable* rope, const SparseAttentionOptions& sparse, int q_tile) {
+        int shards = m_tp->shards();
+        if (m_num_heads % shards != 0) {
+            throw std::runtime_error(
+                "tensor parallelism needs num_heads divisible by the shard count: " + std::to_string(m_num_heads) +
+                " heads, " + std::to_string(shards) + " shards");
+        }
+        if (m_mlp && m_intermediate % shards != 0) {
+            throw std::runtime_error(
+                "tensor parallelism needs the MLP intermediate size divisible by the shard count: " +
+                std::to_string(m_intermediate) + ", " + std::to_string(shards) + " shards");
+        }
+        int heads = m_num_heads / shards;
+        int width = heads * m_head_size;
+        int inter = m_intermediate / shards;
+        for (int s = 0; s < shards; ++s) {
+            int col = s * width;
+            auto columns = [&](const std::vector<std::vector<float>>& w) {
+                std::vector<std::vector<float>> slice(m_hidden_size);
+                for (int i = 0; i < m_hidden_size; ++i) {
+                    slice[i].assign(w[i].begin() + col, w[i].begin() + col + width);
+                }
+                return slice;
+            };
+            m_shards.push_back(Shard{
+                heads,
+                columns(m_wq),
+                columns(m_wk),
+                columns(m_wv),
+                std::vector<std::vector<float>>(m_wo.begin() + col, m_wo.begin() + col + width),
+                PagedAttentionExecutor(m_layer_id, arena, nullptr, rope, sparse, s * heads, heads, nullptr, q_tile),
+                {},
+                {}});
+            if (m_mlp) {
+                Shard& shard = m_shards.back();
+                int begin = s * inter;
+                shard.w_gate_up.resize(m_hidden_size);
+                for (int i = 0; i < m_hidden_size; ++i) {
+                    const auto& row = m_w_gate_up[i];
+                    shard.w_gate_up[i].assign(row.begin() + begin, row.begin() + begin + inter);
+                    shard.w_gate_up[i].insert(
+                        shard.w_gate_up[i].end(), row.begin() + m_intermediate + begin,
+                        row.begin() + m_intermediate + begin + inter);
+                }
+                shard.w_down.assign(m_w_down.begin() + begin, m_w_down.begin() + begin + inter);
+            }
+        }
+        m_wq.clear();
+        m_wk.clear();
+        m_wv.clear();
+        m_wo.clear();
+        m_w_gate_up.clear();
+        m_w_down.clear();
+    }
+
+    // Every shard projects its heads, attends over its part of the KV cache and writes
+    // its partial output projection; the group's all-reduce then sums the partials.
+    // Shards record attention mass separately and it is summed afterwards, in shard order.
+    // With the MLP on, shard 0's partials start from the residual, and a second round of
+    // partial down projections and an all-reduce follows the first.
+    Tensor2 forward_sharded(
+        const Tensor2& x,
+        const BatchMetadata& meta,
+        const std::vector<int>* q_lens,
+        AttentionMass* mass) {
+        int rows = static_cast<int>(x.size());
+        m_tp->prepare(rows, m_hidden_size);
+        auto norm = row_norm(x, m_attn_norm);
+        Tensor2 h(m_mlp ? rows : 0, std::vector<float>(m_hidden_size));
+        std::vector<AttentionMass> shard_mass(mass ? m_shards.size() : 0);
+        for (size_t s = 1; s < shard_mass.size(); ++s) {
+            shard_mass[s].mass.assign(mass->mass.size(), 0.0f);
+            shard_mass[s].begins = mass->begins;
+        }
+        Tensor2 out(rows, std::vector<float>(m_hidden_size));
+        m_tp->run([&](int s) {
+            Shard& shard = m_shards[s];
+            AttentionMass* shard_out = !mass ? nullptr : s == 0 ? mass : &shard_mass[s];
+            auto qkv = project_qkv(x, shard.wq, shard.wk, shard.wv, shard.num_heads, norm);
+            auto attn_out = q_lens ? shard.pa.prefill(meta, *q_lens, qkv.q, qkv.k, qkv.v, shard_out)
+                                   : shard.pa.decode(meta, qkv.q, qkv.k, qkv.v, shard_out);
+            auto merged = merge_heads(attn_out);
+            float* partial = m_tp->partial(s);
+            if (!m_mlp) {
+                for (int r = 0; r < rows; ++r) {
+                    linear_row(merged[r], shard.wo, partial + static_cast<size_t>(r) * m_hidden_size);
+                }
+                m_tp->all_reduce(s, out);
+                return;
+            }
+            for (int r = 0; r < rows; ++r) {
+                float* y = partial + static_cast<size_t>(r) * m_hidden_size;
+                start_partial_row(x[r], s, y);
+                accumulate_row(merged[r], shard.wo, y);
+            }
+            m_tp->all_reduce(s, h);
+            // Every shard needs the norm of every row of h; recomputing it is cheaper than
+            // a third synchronization.
+            auto mlp_norm = row_norm(h, m_mlp_norm);
+            std::vector<float> act;
+            for (int r = 0; r < rows; ++r) {
+                float* y = partial + static_cast<size_t>(r) * m_hidden_size;
+                start_partial_row(h[r], s, y);
+                mlp_row(h[r], mlp_norm.inv_rms[r], shard.w_gate_up, shard.w_down, act, y);
+            }
+            m_tp->all_reduce(s, out);
+        });
+        for (size_t s = 1; s < shard_mass.size(); ++s) {
+            for (size_t i = 0; i < mass->mass.size(); ++i) {
+                mass->mass[i] += shard_mass[s].mass[i];
+            }
+        }
+        return out;
+    }
+
+    // The residual enters the sum once, through shard 0.
+    void start_partial_row(const std::vector<float>& residual, int shard, float* y) const {
+        if (shard == 0) {
+            std::copy(residual.begin(), residual.end(), y);
+        } else {
+            std::fill(y, y + m_hidden_size, 0.0f);
+        }
+    }
+
+    // Attention output projection, then the MLP block when it is on.
+    Tensor2 finish(const Tensor2& x, const Tensor2& merged) const {
+        if (!m_mlp) {
+            return linear(merged, m_wo);
+        }
+        // Both residual adds are fused: the projections accumulate into a copy of x.
+        Tensor2 h = x;
+        for (size_t r = 0; r < h.size(); ++r) {
+            accumulate_row(merged[r], m_wo, h[r].data());
+        }
+        auto norm = row_norm(h, m_mlp_norm);
+        std::vector<float> act;
+        for (size_t r = 0; r < h.size(); ++r) {
+            mlp_row(h[r], norm.inv_rms[r], m_w_gate_up, m_w_down, act, h[r].data());
+        }
+        return h;
+    }
+
+    // out += Down(silu(Gate n) * Up n) for one row, n = RMSNorm(h). The gate/up pass
+    // leaves both halves in `act` (scratch), and the SiLU * up epilogue runs on them
+    // while they are in cache. out may point into h, which is read in full first.
+    void mlp_row(
+        const std::vector<float>& h,
+        float inv_rms,
+        const std::vector<std::vector<float>>& w_gate_up,
+        const std::vector<std::vector<float>>& w_down,
+        std::vector<float>& act,
+        float* out) const {
+        int inter = static_cast<int>(w_down.size());
+        act.resize(2 * static_cast<size_t>(inter));
+        linear_row(h, w_gate_up, act.data(), m_mlp_norm.data(), inv_rms);
+        m_silu_mul(act.data(), act.data() + inter, act.data(), inter);
+        accumulate_row(act, w_down, out);
+    }
+
+    // No norm when the weight is empty, i.e. with the MLP off.
+    RowNorm row_norm(const Tensor2& x, const std::vector<float>& weight) const {
+        RowNorm norm;
+        if (weight.empty()) {
+            return norm;
+        }
+        norm.weight = weight.data();
+        norm.inv_rms.reserve(x.size());
+        for (const auto& row : x) {
+            norm.inv_rms.push_back(rms_norm_inv(row.data(), m_hidden_size, m_rms_eps));
+        }
+        return norm;
+    }
+
+    // y += x * w for one row, reading input i as x[i] * inv_rms * norm_weight[i] when a
+    // norm weight is given.
+    static void accumulate_row(
+        const std::vector<float>& x,
+        const std::vector<std::vector<float>>& w,
+        float* y,
+        const float* norm_weight = nullptr,
+        float inv_rms = 1.0f) {
+        int in_dim = static_cast<int>(w.size());
+        int out_dim = static_cast<int>(w[0].size());
+        for (int i = 0; i < in_dim; ++i) {
+            float xv = norm_weight ? x[i] * inv_rms * norm_weight[i] : x[i];
+            eltwise_axpy(xv, w[i].data(), y, out_dim);
+        }
+    }
+
+    // y = x * w for one row; y is overwritten.
+    static void linear_row(
+        const std::vector<float>& x,
+        const std::vector<std::vector<float>>& w,
+        float* y,
+        const float* norm_weight = nullptr,
+        float inv_rms = 1.0f) {
+        std::fill(y, y + w[0].size(), 0.0f);
+        accumulate_row(x, w, y, norm_weight, inv_rms);
+    }
+
+    static Tensor2 linear(const Tensor2& x, const std::vector<std::vector<float>>& w, const RowNorm* norm = nullptr) {
+        const float* weight = norm ? norm->weight : nullptr;
+        Tensor2 y(x.size(), std::vector<float>(w[0].size()));
+        for (size_t r = 0; r < x.size(); ++r) {
+            linear_row(x[r], w, y[r].data(), weight, weight ? norm->inv_rms[r] : 1.0f);
+        }
+        return y;
+    }
+
+    QKV project_qkv(
+        const Tensor2& x,
+        const std::vector<std::vector<float>>& wq,
+        const std::vector<std::vector<float>>& wk,
+        const std::vector<std::vector<float>>& wv,
+        int num_heads,
+        const RowNorm& norm) const {
+        auto q2 = linear(x, wq, &norm);
+        auto k2 = linear(x, wk, &norm);
+        auto v2 = linear(x, wv, &norm);
+
+        QKV out;
+        out.q = split_heads(q2, num_heads);
+        out.k = split_heads(k2, num_heads);
+        out.v = split_heads(v2, num_heads);
+        return out;
+    }
+
+    Tensor3 split_heads(const Tensor2& x, int num_heads) const {
+        Tensor3 y(
+            x.size(),
+            std::vector<std::vector<float>>(num_heads, std::vector<float>(m_head_size, 0.0f)));
+
+        for (size_t t = 0; t < x.size(); ++t) {
+            for (int h = 0; h < num_heads; ++h) {
+                for (int d = 0; d < m_head_size; ++d) {
+                    y[t][h][d] = x[t][h * m_head_size + d];
+                }
+            }
+        }
+        return y;
+    }
+
+    Tensor2 merge_heads(const Tensor3& x) const {
+        int num_heads = x.empty() ? 0 : static_cast<int>(x[0].size());
+        Tensor2 y(x.size(), std::vector<float>(num_heads * m_head_size, 0.0f));
+        for (size_t t = 0; t < x.size(); ++t) {
+            for (int h = 0; h < num_heads; ++h) {
+                for (int d = 0; d < m_head_size; ++d) {
+                    y[t][h * m_head_size + d] = x[t][h][d];
+                }
+            }
+        }
+        return y;
+    }
+};
+
+// Everything a ToyLLMRuntime can be configured with beyond the model and KV cache
+// geometry, one member per feature; each defaults to off.
+struct RuntimeOptions {
+    KVPoolOptions pool;
+    NumaOptions numa;
+    RopeOptions rope;
+    SparseAttentionOptions sparse;
+    KVSharedPoolOptions shared;
+    TensorParallelOptions tp;
+    PipelineOptions pipeline;
+    MlpOptions mlp;
+    AttentionScheduleOptions schedule;
+};
+
+class ToyLLMRuntime {
+public:
+    using Tensor2 = std::vector<std::vector<float>>;
+    using LayerDoneCallback = std::function<void(int layer)>;
+
+    ToyLLMRuntime(
+        int num_layers,
+        int hidden_size,
+        int num_heads,
+        int head_size,
+        int num_blocks,
+        int block_size,
+        bool use_int8_cache,
+        const RuntimeOptions& options = {})
+        : m_num_layers(num_layers),
+          m_hidden_size(hidden_size),
+          m_num_heads(num_heads),
+          m_head_size(head_size),
+          m_block_size(block_size),
+          m_use_int8_cache(use_int8_cache),
+          m_placement(options.numa.enabled ? new NumaPlacement(options.numa) : nullptr),
+          m_shared(
+              options.shared.name.empty()
+                  ? nullptr
+                  : new KVSharedPool(
+                        options.shared,
+                        shared_pool_geometry(
+                            num_layers, num_blocks, num_heads, head_size, block_size, use_int8_cache, options.pool,
+                            options.sparse, options.shared))),
+          m_manager(num_blocks, block_size, m_placement ? m_placement->num_nodes() : 1, m_shared.get()),
+          m_arena(
+              num_layers,
+              num_blocks,
+              num_heads,
+              head_size,
+              block_size,
+              use_int8_cache,
+              m_shared ? m_shared->kv_pool_options(options.pool) : options.pool,
+              m_placement.get(),
+              options.sparse.enabled),
+          m_rope(options.rope.enabled ? new RopeTable(head_size, options.rope) : nullptr),
+          m_tp(options.tp.shards > 1 ? new TensorParallelGroup(options.tp) : nullptr),
+          m_pipeline(options.pipeline.stages > 1 ? new LayerPipeline(options.pipeline) : nullptr),
+          m_attention_pool(
+              options.schedule.threads > 1 ? new ThreadPool(options.schedule.threads, options.schedule.cpus) : nullptr) {
+        if (options.sparse.enabled && (options.sparse.top_k_blocks < 0 || options.sparse.recent_blocks < 1)) {
+            throw std::runtime_error("sparse decode needs top_k_blocks >= 0 and recent_blocks >= 1");
+        }
+        // Both would pick the threads a sequence's attention runs on.
+        if (m_tp && m_placement) {
+            throw std::runtime_error("tensor parallelism and NUMA placement cannot be combined");
+        }
+        // Concurrent stages would share the tensor-parallel group or the node pools.
+        if (m_pipeline && (m_tp || m_placement)) {
+            throw std::runtime_error("pipelining cannot be combined with tensor parallelism or NUMA placement");
+        }
+        if (m_pipeline && options.pipeline.stages > num_layers) {
+            throw std::runtime_error("pipelining needs at least one layer per stage");
+        }
+        // The pool serves one executor at a time; shards and stages run concurrently, and
+        // NUMA placement schedules on its node pools.
+        if (m_attention_pool && (m_tp || m_pipeline || m_placement)) {
+            throw std::runtime_error(
+                "attention threads cannot be combined with tensor parallelism, pipelining or NUMA placement");
+        }
+        for (int i = 0; i < num_layers; ++i) {
+            m_layers.emplace_back(
+                i, hidden_size, m_arena, 1234u + static_cast<uint32_t>(i), m_placement.get(), m_rope.get(), options.sparse,
+                m_tp.get(), options.mlp, m_attention_pool.get(), options.schedule.q_tile);
+        }
+    }
+
+    // node < 0 lets the manager pick the NUMA node with the most free blocks.
+    void add_sequence(int seq_id, int node = -1) {
+        m_manager.add_sequence(seq_id, node);
+    }
+
+    void fork_sequence(int parent_seq_id, int child_seq_id) {
+        m_manager.fork_sequence(parent_seq_id, child_seq_id);
+    }
+
+    void beam_merge(int dst_seq_id, int src_seq_id) {
+        m_manager.beam_merge(dst_seq_id, src_seq_id);
+        drop_released_pending_blocks();
+    }
+
+    void enable_streaming(int seq_id, int sink_tokens, int window_tokens) {
+        m_manager.enable_streaming(seq_id, sink_tokens, window_tokens);
+        drop_released_pending_blocks();
+    }
+
+    // Every step then records the attention mass the sequence's tokens receive and
+    // evicts back to the budget after the commit; see KVBlockManager::enable_heavy_hitters.
+    void enable_heavy_hitters(int seq_id, const HeavyHitterOptions& options) {
+        m_manager.enable_heavy_hitters(seq_id, options);
+    }
+
+    void finish_sequence(int seq_id) {
+        m_manager.finish_sequence(seq_id);
+        drop_released_pending_blocks();
+    }
+
+    // Writes the sequence's committed KV (block table plus the arena image of every
+    // block) to `path`. See kv_snapshot.hpp for the file layout.
+    void snapshot_sequence(int seq_id, const std::string& path) {
+        int past_len = m_manager.past_len(seq_id);
+        const auto& all_blocks = m_manager.logical_blocks(seq_id);
+        std::vector<int> blocks(all_blocks.begin(), all_blocks.begin() + (past_len + m_block_size - 1) / m_block_size);
+        materialize_blocks(blocks);
+
+        KVSnapshotHeader header;
+        header.num_layers = static_cast<uint32_t>(m_num_layers);
+        header.num_heads = static_cast<uint32_t>(m_num_heads);
+        header.head_size = static_cast<uint32_t>(m_head_size);
+        header.block_size = static_cast<uint32_t>(m_block_size);
+        header.use_int8_cache = m_use_int8_cache ? 1u : 0u;
+        header.past_len = static_cast<uint32_t>(past_len);
+        header.num_logical_blocks = static_cast<uint32_t>(blocks.size());
+        header.key_layout = static_cast<uint32_t>(m_arena.key_layout());
+        header.evicted_tokens = static_cast<uint32_t>(m_manager.evicted_tokens(seq_id));
+        header.layer_block_bytes = m_arena.layer_block_bytes();
+
+        KVSnapshotWriter writer(path, header);
+        std::vector<int32_t> block_table(blocks.begin(), blocks.end());
+        writer.write_block_table(block_table.data());
+        std::vector<char> buffer;
+        for (int block : blocks) {
+            const char* image = m_arena.contiguous_block(block);
+            if (!image) {
+                buffer.resize(m_arena.block_bytes());
+                m_arena.export_block(block, buffer.data());
+                image = buffer.data();
+            }
+            writer.write_block(image);
+        }
+        writer.close();
+    }
+
+    // Re-creates `seq_id` from a snapshot without touching its KV payload: fresh blocks
+    // are reserved now and filled from the mapping the first time a step or a block copy
+    // reads them. Returns the restored past length.
+    int restore_sequence(int seq_id, const std::string& path, int node = -1) {
+        auto mapping = std::make_shared<const KVSnapshotMapping>(path);
+        const auto& header = mapping->header();
+        if (header.num_layers != static_cast<uint32_t>(m_num_layers) ||
+            header.num_heads != static_cast<uint32_t>(m_num_heads) ||
+            header.head_size != static_cast<uint32_t>(m_head_size) ||
+            header.block_size != static_cast<uint32_t>(m_block_size) ||
+            header.use_int8_cache != (m_use_int8_cache ? 1u : 0u) ||
+            header.key_layout != static_cast<uint32_t>(m_arena.key_layout()) ||
+            header.layer_block_bytes != m_arena.layer_block_bytes()) {
+            throw std::runtime_error("snapshot does not match runtime config: " + path);
+        }
+
+        auto blocks = m_manager.adopt_sequence(
+            seq_id, static_cast<int>(header.past_len), node, static_cast<int>(header.evicted_tokens));
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            m_pending_blocks[blocks[i]] = PendingSnapshotBlock{mapping, static_cast<uint32_t>(i)};
+        }
+        return static_cast<int>(header.past_len);
+    }
+
+    // Cross-process sharing over a shared KV pool, see KVBlockManager::publish_sequence.
+    // Blocks still waiting for snapshot payload are filled first, since other processes
+    // only see the pool.
+    bool publish_sequence(int seq_id, uint64_t key) {
+        if (m_rope && m_manager.evicted_tokens(seq_id) > 0) {
+            throw std::runtime_error("the shared pool does not carry RoPE positions past evicted tokens");
+        }
+        materialize_blocks(m_manager.logical_blocks(seq_id));
+        return m_manager.publish_sequence(seq_id, key);
+    }
+
+    bool attach_published_sequence(int seq_id, uint64_t key, bool take = false, int node = -1) {
+        return m_manager.attach_published_sequence(seq_id, key, take, node);
+    }
+
+    bool unpublish_sequence(uint64_t key) {
+        bool found = m_manager.unpublish_sequence(key);
+        drop_released_pending_blocks();
+        return found;
+    }
+
+    const KVSharedPool* shared_pool() const {
+        return m_shared.get();
+    }
+
+    size_t num_pending_snapshot_blocks() const {
+        return m_pending_blocks.size();
+    }
+
+    // Background compaction, to be called between steps: plans the moves, copies the
+    // blocks and with release_free_tail gives each node's free tail back to the kernel.
+    KVCompactionResult compact_kv(const CompactionOptions& options = {}, bool release_free_tail = false) {
+        KVCompactionResult result;
+        auto moves = m_manager.compact(options);
+        for (const auto& move : moves) {
+            // A block still waiting for its snapshot payload moves without a copy.
+            auto it = m_pending_blocks.find(move.src_block);
+            if (it != m_pending_blocks.end()) {
+                auto pending = it->second;
+                m_pending_blocks.erase(it);
+                m_pending_blocks[move.dst_block] = pending;
+                continue;
+            }
+            m_arena.copy_block(move.src_block, move.dst_block);
+        }
+        result.moves = static_cast<int>(moves.size());
+        if (release_free_tail) {
+            for (int node = 0; node < m_manager.num_nodes(); ++node) {
+                int first = m_manager.node_high_water(node);
+                int end = numa_block_begin(node + 1, m_manager.num_blocks(), m_manager.num_nodes());
+                result.released_bytes += m_arena.release_blocks(first, end - first);
+            }
+        }
+        return result;
+    }
+
+    // Sequence ids are resolved to slot handles once per step; everything after that
+    // indexes the manager's slot table directly.
+    //
+    // on_layer_done(l) runs once layer l has written its KV for the whole batch, e.g. to
+    // start sending that layer (see kv_transfer.hpp) while the next one computes. Layer
+    // l's regions are not written again by this prefill, but retention policies still
+    // run after the last layer. A prefill with a callback is never pipelined.
+    Tensor2 prefill(
+        const std::vector<int>& seq_ids,
+        const Tensor2& x,
+        const std::vector<int>& q_lens,
+        const LayerDoneCallback& on_layer_done = nullptr) {
+        auto handles = m_manager.handles(seq_ids);
+        std::vector<BlockCopyPlan> copy_plans;
+        for (size_t i = 0; i < handles.size(); ++i) {
+            auto seq_copy_plans = m_manager.reserve_for_prefill(handles[i], q_lens[i]);
+            copy_plans.insert(copy_plans.end(), seq_copy_plans.begin(), seq_copy_plans.end());
+        }
+        apply_copy_plans(copy_plans);
+
+        auto meta = m_manager.build_batch_metadata(handles, q_lens);
+        materialize_blocks(meta.block_indices);
+        reserve_rope_positions(meta, q_lens);
+
+        auto hidden = run_layers(handles, meta, q_lens, x, true, on_layer_done);
+        drop_released_pending_blocks();
+
+        return hidden;
+    }
+
+    Tensor2 decode(const std::vector<int>& seq_ids, const Tensor2& x) {
+        auto handles = m_manager.handles(seq_ids);
+        for (auto h : handles) {
+            if (m_manager.past_len(h) == 0) {
+                throw std::runtime_error("decode called before prefill");
+            }
+        }
+
+        std::vector<int> q_lens(handles.size(), 1);
+        std::vector<BlockCopyPlan> copy_plans;
+        for (auto h : handles) {
+            auto seq_copy_plans = m_manager.reserve_for_decode(h);
+            copy_plans.insert(copy_plans.end(), seq_copy_plans.begin(), seq_copy_plans.end());
+        }
+
+        apply_copy_plans(copy_plans);
+
+        auto meta = m_manager.build_batch_metadata(handles, q_lens);
+        materialize_blocks(meta.block_indices);
+        reserve_rope_positions(meta, q_lens);
+
+        auto hidden = run_layers(handles, meta, q_lens, x, false, nullptr);
+        drop_released_pending_blocks();
+
+        return hidden;
+    }
+
+    int hidden_size() const {
+        return m_hidden_size;
+    }
+
+    const KVBlockManager& manager() const {
+        return m_manager;
+    }
+
+    KVBlockManager& manager() {
+        return m_manager;
+    }
+
+    size_t kv_bytes_per_block() const {
+        return m_arena.block_bytes();
+    }
+
+    size_t peak_kv_bytes() const {
+        return static_cast<size_t>(m_manager.peak_used_blocks()) * kv_bytes_per_block();
+    }
+
+    const NumaPlacement* numa_placement() const {
+        return m_placement.get();
+    }
+
+    const char* attention_kernel_name() const {
+        return m_layers.front().attention_kernel_name();
+    }
+
+    // ISA of the int8 quantize-and-scatter kernel, "none" for an fp32 cache.
+    const char* quant_kernel_isa() const {
+        return m_layers.front().quant_kernel_isa();
+    }
+
+    KVPoolStats kv_pool_stats() const {
+        return m_arena.stats();
+    }
+
+    // 0 with the MLP block off.
+    int mlp_intermediate_size() const {
+        return m_layers.front().mlp_intermediate_size();
+    }
+
+    // ISA of the SiLU * up kernel of the MLP block.
+    const char* eltwise_kernel_isa() const {
+        return select_eltwise_kernel().isa;
+    }
+
+    int tensor_parallel_shards() const {
+        return m_tp ? m_tp->shards() : 1;
+    }
+
+    // Time split of the sharded layer forwards since construction or the last reset.
+    TensorParallelStats tensor_parallel_stats() const {
+        return m_tp ? m_tp->stats() : TensorParallelStats{};
+    }
+
+    void reset_tensor_parallel_stats() {
+        if (m_tp) {
+            m_tp->reset_stats();
+        }
+    }
+
+    int pipeline_stages() const {
+        return m_pipeline ? m_pipeline->stages() : 1;
+    }
+
+    // Pipelined steps since construction or the last reset; see PipelineStats::bubble_fraction.
+    PipelineStats pipeline_stats() const {
+        return m_pipeline ? m_pipeline->stats() : PipelineStats{};
+    }
+
+    void reset_pipeline_stats() {
+        if (m_pipeline) {
+            m_pipeline->reset_stats();
+        }
+    }
+
+    const KVCacheArena& kv_arena() const {
+        return m_arena;
+    }
+
+    KVCacheArena& kv_arena() {
+        return m_arena;
+    }
+
+private:
+    int m_num_layers;
+    int m_hidden_size;
+    int m_num_heads;
+    int m_head_size;
+    int m_block_size;
+    bool m_use_int8_cache;
+
+    std::unique_ptr<NumaPlacement> m_placement;
+    std::unique_ptr<KVSharedPool> m_shared;
+    KVBlockManager m_manager;
+    KVCacheArena m_arena;
+    std::unique_ptr<RopeTable> m_rope;
+    std::unique_ptr<TensorParallelGroup> m_tp;
+    std::unique_ptr<LayerPipeline> m_pipeline;
+    std::unique_ptr<ThreadPool> m_attention_pool;
+    std::vector<ToyLayer> m_layers;
+    std::unordered_map<int, PendingSnapshotBlock> m_pending_blocks;
+
+    static KVSharedPoolGeometry shared_pool_geometry(
+        int num_layers,
+        int num_blocks,
+        int num_heads,
+        int head_size,
+        int block_size,
+        bool use_int8_cache,
+        const KVPoolOptions& pool_options,
+        const SparseAttentionOptions& sparse_options,
+        const KVSharedPoolOptions& shared_options) {
+        KVSharedPoolGeometry geometry;
+        geometry.num_blocks = static_cast<uint32_t>(num_blocks);
+        geometry.block_size = static_cast<uint32_t>(block_size);
+        geometry.num_layers = static_cast<uint32_t>(num_layers);
+        geometry.layout = static_cast<uint32_t>(pool_options.layout);
+        geometry.layer_block_bytes = KVCacheArena::layer_block_bytes_for(
+            num_heads, head_size, block_size, use_int8_cache, sparse_options.enabled);
+        geometry.max_published = static_cast<uint32_t>(std::max(0, shared_options.max_published));
+        geometry.max_published_blocks = static_cast<uint32_t>(std::max(0, shared_options.max_published_blocks));
+        geometry.key_layout = static_cast<uint32_t>(
+            resolve_key_layout(pool_options.key_layout, use_int8_cache, head_size, block_size));
+        return geometry;
+    }
+
+    void materialize_blocks(const std::vector<int>& blocks) {
+        if (m_pending_blocks.empty()) {
+            return;
+        }
+        for (int block : blocks) {
+            auto it = m_pending_blocks.find(block);
+            if (it == m_pending_blocks.end()) {
+                continue;
+            }
+            m_arena.import_block(block, it->second.mapping->layer_block(it->second.logical_block, 0));
+            m_pending_blocks.erase(it);
+        }
+    }
+
+    // A pending block freed before it was ever read must not overwrite its next owner.
+    void drop_released_pending_blocks() {
+        if (m_pending_blocks.empty()) {
+            return;
+        }
+        for (auto it = m_pending_blocks.begin(); it != m_pending_blocks.end();) {
+            if (m_manager.block_ref_count(it->first) == 0) {
+                it = m_pending_blocks.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Zeroed mass ranges for the sequences that track attention mass, none if no one does.
+    AttentionMass attention_mass_for(
+        const std::vector<SequenceHandle>& handles,
+        const BatchMetadata& meta,
+        const std::vector<int>& q_lens) const {
+        AttentionMass mass;
+        mass.begins.assign(1, 0);
+        int total = 0;
+        for (size_t i = 0; i < handles.size(); ++i) {
+            total += m_manager.tracks_attention_mass(handles[i]) ? meta.past_lens[i] + q_lens[i] : 0;
+            mass.begins.push_back(total);
+        }
+        mass.mass.assign(total, 0.0f);
+        return mass;
+    }
+
+    // Every layer over the batch, then the commit. With a pipeline and more than one
+    // sequence the work goes through run_layers_pipelined instead.
+    Tensor2 run_layers(
+        const std::vector<SequenceHandle>& handles,
+        const BatchMetadata& meta,
+        const std::vector<int>& q_lens,
+        const Tensor2& x,
+        bool prefill,
+        const LayerDoneCallback& on_layer_done) {
+        if (m_pipeline && !on_layer_done && handles.size() > 1) {
+            return run_layers_pipelined(handles, q_lens, x, prefill);
+        }
+        AttentionMass mass = attention_mass_for(handles, meta, q_lens);
+        AttentionMass* mass_out = mass.mass.empty() ? nullptr : &mass;
+        Tensor2 hidden = x;
+        for (size_t l = 0; l < m_layers.size(); ++l) {
+            hidden = prefill ? m_layers[l].forward_prefill(hidden, meta, q_lens, mass_out)
+                             : m_layers[l].forward_decode(hidden, meta, mass_out);
+            if (on_layer_done) {
+                on_layer_done(static_cast<int>(l));
+            }
+        }
+        commit_step(handles, meta, q_lens, mass_out);
+        return hidden;
+    }
+
+    struct MicroBatch {
+        std::vector<SequenceHandle> handles;
+        std::vector<int> q_lens;
+        BatchMetadata meta;
+        AttentionMass mass;
+        Tensor2 hidden;
+    };
+
+    // Cuts the batch into contiguous micro-batches of about equal token counts and
+    // streams them through the stages, stage s running layers [s L / S, (s + 1) L / S).
+    // Different stages touch different layers' KV regions and different micro-batches
+    // hold different sequences, so stages never write the same memory. The micro-batches
+    // commit in order afterwards, which leaves the same state as one commit of the batch.
+    Tensor2 run_layers_pipelined(
+        const std::vector<SequenceHandle>& handles,
+        const std::vector<int>& q_lens,
+        const Tensor2& x,
+        bool prefill) {
+        const int n = static_cast<int>(handles.size());
+        const int parts = m_pipeline->micro_batches_for(n);
+        int64_t total = 0;
+        for (int q : q_lens) {
+            total += q;
+        }
+        std::vector<MicroBatch> batches(parts);
+        int seq = 0;
+        int token = 0;
+        int64_t taken = 0;
+        for (int m = 0; m < parts; ++m) {
+            auto& mb = batches[m];
+            int64_t target = total * (m + 1) / parts;
+            // Every later micro-batch keeps at least one sequence; the last takes the rest.
+            while (seq < n - (parts - 1 - m) &&
+                   (mb.handles.empty() || m == parts - 1 || taken + q_lens[seq] <= target)) {
+                mb.handles.push_back(handles[seq]);
+                mb.q_lens.push_back(q_lens[seq]);
+                mb.hidden.insert(mb.hidden.end(), x.begin() + token, x.begin() + token + q_lens[seq]);
+                taken += q_lens[seq];
+                token += q_lens[seq];
+                ++seq;
+            }
+            mb.meta = m_manager.build_batch_metadata(mb.handles, mb.q_lens);
+            mb.mass = attention_mass_for(mb.handles, mb.meta, mb.q_lens);
+        }
+
+        const int num_layers = static_cast<int>(m_layers.size());
+        const int stages = m_pipeline->stages();
+        m_pipeline->run(parts, [&](int stage, int m) {
+            auto& mb = batches[m];
+            AttentionMass* mass_out = mb.mass.mass.empty() ? nullptr : &mb.mass;
+            for (int l = stage * num_layers / stages; l < (stage + 1) * num_layers / stages; ++l) {
+                mb.hidden = prefill ? m_layers[l].forward_prefill(mb.hidden, mb.meta, mb.q_lens, mass_out)
+                                    : m_layers[l].forward_decode(mb.hidden, mb.meta, mass_out);
+            }
+        });
+
+        Tensor2 hidden;
+        hidden.reserve(x.size());
+        for (auto& mb : batches) {
+            commit_step(mb.handles, mb.meta, mb.q_lens, mb.mass.mass.empty() ? nullptr : &mb.mass);
+            std::move(mb.hidden.begin(), mb.hidden.end(), std::back_inserter(hidden));
+        }
+        return hidden;
+    }
+
+    // Folds the step's attention mass into the manager, commits the new tokens and
+    // applies the heavy-hitter evictions that follow. Every block of the step was
+    // materialized already, so the eviction copies read real KV.
+    void commit_step(
+        const std::vector<SequenceHandle>& handles,
+        const BatchMetadata& meta,
+        const std::vector<int>& q_lens,
+        AttentionMass* mass) {
+        for (size_t i = 0; i < handles.size(); ++i) {
+            if (mass) {
+                m_manager.add_attention_mass(handles[i], mass->sequence(static_cast<int>(i)), meta.past_lens[i] + q_lens[i]);
+            }
+            m_manager.commit_tokens(handles[i], q_lens[i]);
+        }
+        if (!mass) {
+            return;
+        }
+        for (auto h : handles) {
+            auto plan = m_manager.evict_heavy_hitters(h);
+            apply_copy_plans(plan.block_copies);
+            for (const auto& move : plan.slot_moves) {
+                m_arena.copy_slot(move.src_slot, move.dst_slot);
+            }
+        }
+    }
+
+    // Grows the shared RoPE table (up to its cap) before any layer reads it.
+    void reserve_rope_positions(const BatchMetadata& meta, const std::vector<int>& q_lens) {
+        if (!m_rope) {
+            return;
+        }
+        int end = 0;
+        for (size_t i = 0; i < q_lens.size(); ++i) {
+            end = std::max(end, ExecutorPACommon::position_offset(meta, static_cast<int>(i)) + meta.past_lens[i] + q_lens[i]);
+        }
+        m_rope->reserve(end);
+    }
+
+    void apply_copy_plans(const std::vector<BlockCopyPlan>& copy_plans) {
+        for (const auto& plan : copy_plans) {
+            materialize_blocks({plan.src_block});
+            m_arena.copy_block(plan.src_block, plan.dst_block);
+        }
+    }
+};
+
+inline std::vector<std::vector<float>> make_random_tensor2(int rows, int cols, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    std::vector<std::vector<float>> x(rows, std::vector<float>(cols, 0.0f));
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            x[i][j] = dist(gen);
+        }
+    }
+    return x;
+}